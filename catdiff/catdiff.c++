@@ -0,0 +1,136 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "capnp/message.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/main.h"
+#include "kj/string.h"
+
+#include "catalog.capnp.h"
+#include "catdiff/diff.h"
+#include "luacat/link.h"
+
+namespace mcm {
+
+namespace catdiff {
+
+namespace {
+
+class CatdiffMain {
+public:
+  CatdiffMain(kj::ProcessContext& context, kj::OutputStream& outStream, kj::OutputStream& errStream):
+      context(context), outStream(&outStream), errStream(errStream) {}
+  KJ_DISALLOW_COPY(CatdiffMain);
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "mcm-catdiff",
+          "Writes a patch catalog with the resources in NEW that are not in OLD or "
+          "differ from OLD, plus noop placeholders for the unchanged resources they "
+          "depend on and a list of the IDs removed since OLD.")
+        .addOptionWithArg({'o'}, KJ_BIND_METHOD(*this, setOutputPath),
+            "FILE", "Write the patch to FILE instead of stdout.")
+        .addOption({"packed"}, KJ_BIND_METHOD(*this, setPackedOutput),
+            "Write the patch in the packed encoding.")
+        .addOption({'s', "summary"}, KJ_BIND_METHOD(*this, setSummary),
+            "Print counts of added, changed, and removed resources to stderr.")
+        .expectArg("OLD", KJ_BIND_METHOD(*this, setOldPath))
+        .expectArg("NEW", KJ_BIND_METHOD(*this, setNewPath))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::OutputStream* outStream;
+  kj::Own<kj::OutputStream> ownOutStream;
+  kj::OutputStream& errStream;
+  kj::String oldPath;
+  kj::String newPath;
+  bool packedOutput = false;
+  bool summary = false;
+
+  kj::MainBuilder::Validity setOutputPath(kj::StringPtr path) {
+    int fd = open(path.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      return kj::str("open ", path, ": ", strerror(errno));
+    }
+    ownOutStream = kj::heap<kj::FdOutputStream>(kj::AutoCloseFd(fd));
+    outStream = ownOutStream.get();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPackedOutput() {
+    packedOutput = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setSummary() {
+    summary = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setOldPath(kj::StringPtr path) {
+    oldPath = kj::heapString(path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setNewPath(kj::StringPtr path) {
+    newPath = kj::heapString(path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+      luacat::CatalogFile oldFile(oldPath);
+      luacat::CatalogFile newFile(newPath);
+      capnp::MallocMessageBuilder message;
+      auto stats = diffCatalogs(oldFile.getCatalog(), newFile.getCatalog(),
+                                message.initRoot<Catalog>());
+      if (packedOutput) {
+        capnp::writePackedMessage(*outStream, message);
+      } else {
+        capnp::writeMessage(*outStream, message);
+      }
+      if (summary) {
+        auto text = kj::str(
+            stats.added, " added, ", stats.changed, " changed, ",
+            stats.triggered, " triggered, ", stats.removed, " removed, ",
+            stats.unchanged, " unchanged (", stats.placeholders, " as placeholders)\n");
+        errStream.write(text.begin(), text.size());
+      }
+    })) {
+      context.exitError(kj::str("mcm-catdiff: ", e->getDescription()));
+    }
+    return true;
+  }
+};
+
+}  // namespace
+}  // namespace catdiff
+}  // namespace mcm
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext context(argv[0]);
+  kj::FdOutputStream out(STDOUT_FILENO);
+  kj::FdOutputStream err(STDERR_FILENO);
+  mcm::catdiff::CatdiffMain mainObject(context, out, err);
+  return kj::runMainAndExit(context, mainObject.getMain(), argc, argv);
+}
@@ -0,0 +1,167 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "catdiff/diff.h"
+
+#include "gtest/gtest.h"
+#include "capnp/message.h"
+
+namespace {
+
+void addResource(mcm::Resource::Builder r, uint64_t id, kj::StringPtr comment,
+                 std::initializer_list<uint64_t> deps) {
+  r.setId(id);
+  r.setComment(comment);
+  auto list = r.initDependencies(deps.size());
+  size_t i = 0;
+  for (uint64_t d : deps) {
+    list.set(i++, d);
+  }
+}
+
+void setBash(mcm::Resource::Builder r, kj::StringPtr script) {
+  r.initExec().initCommand().setBash(script);
+}
+
+}  // namespace
+
+TEST(DiffCatalogsTest, PatchesChangedResources) {
+  capnp::MallocMessageBuilder oldMessage;
+  auto oldRes = oldMessage.initRoot<mcm::Catalog>().initResources(4);
+  addResource(oldRes[0], 1, "base", {});
+  addResource(oldRes[1], 2, "changed", {1});
+  setBash(oldRes[1], "echo old");
+  addResource(oldRes[2], 3, "same", {1});
+  addResource(oldRes[3], 4, "removed", {});
+
+  capnp::MallocMessageBuilder newMessage;
+  auto newRes = newMessage.initRoot<mcm::Catalog>().initResources(4);
+  addResource(newRes[0], 5, "added", {3});
+  addResource(newRes[1], 3, "same", {1});
+  addResource(newRes[2], 2, "changed", {1});
+  setBash(newRes[2], "echo new");
+  addResource(newRes[3], 1, "base", {});
+
+  capnp::MallocMessageBuilder patchMessage;
+  auto patch = patchMessage.initRoot<mcm::Catalog>();
+  auto stats = mcm::catdiff::diffCatalogs(oldMessage.getRoot<mcm::Catalog>().asReader(),
+                                          newMessage.getRoot<mcm::Catalog>().asReader(), patch);
+  EXPECT_EQ(1, stats.added);
+  EXPECT_EQ(1, stats.changed);
+  EXPECT_EQ(0, stats.triggered);
+  EXPECT_EQ(2, stats.placeholders);
+  EXPECT_EQ(2, stats.unchanged);
+  EXPECT_EQ(1, stats.removed);
+
+  auto res = patch.asReader().getResources();
+  ASSERT_EQ(4, res.size());
+  EXPECT_EQ(5, res[0].getId());
+  EXPECT_EQ(3, res[1].getId());
+  EXPECT_TRUE(res[1].isNoop());
+  EXPECT_EQ(0, res[1].getDependencies().size());
+  EXPECT_EQ(kj::StringPtr("same"), res[1].getComment());
+  EXPECT_EQ(2, res[2].getId());
+  EXPECT_EQ(kj::StringPtr("echo new"), res[2].getExec().getCommand().getBash());
+  EXPECT_EQ(1, res[3].getId());
+  EXPECT_TRUE(res[3].isNoop());
+  auto removed = patch.asReader().getRemoved();
+  ASSERT_EQ(1, removed.size());
+  EXPECT_EQ(4, removed[0]);
+}
+
+TEST(DiffCatalogsTest, IncludesTriggeredExecs) {
+  capnp::MallocMessageBuilder newMessage;
+  auto newRes = newMessage.initRoot<mcm::Catalog>().initResources(4);
+  addResource(newRes[0], 1, "file", {});
+  newRes[0].initFile().setPath("/etc/foo");
+  addResource(newRes[1], 2, "restart", {1});
+  setBash(newRes[1], "restart");
+  newRes[1].getExec().getCondition().initIfDepsChanged(1).set(0, 1);
+  addResource(newRes[2], 3, "notify", {2});
+  setBash(newRes[2], "notify");
+  newRes[2].getExec().getCondition().initIfDepsChanged(1).set(0, 2);
+  addResource(newRes[3], 4, "always", {1});
+  setBash(newRes[3], "true");
+
+  // Only resource 1 differs in the old catalog.
+  capnp::MallocMessageBuilder oldMessage;
+  auto oldRes = oldMessage.initRoot<mcm::Catalog>().initResources(4);
+  for (unsigned int i = 0; i < 4; i++) {
+    oldRes.setWithCaveats(i, newRes[i].asReader());
+  }
+  oldRes[0].setNoop();
+
+  capnp::MallocMessageBuilder patchMessage;
+  auto patch = patchMessage.initRoot<mcm::Catalog>();
+  auto stats = mcm::catdiff::diffCatalogs(oldMessage.getRoot<mcm::Catalog>().asReader(),
+                                          newMessage.getRoot<mcm::Catalog>().asReader(), patch);
+  EXPECT_EQ(0, stats.added);
+  EXPECT_EQ(1, stats.changed);
+  EXPECT_EQ(2, stats.triggered);
+  EXPECT_EQ(0, stats.placeholders);
+  auto res = patch.asReader().getResources();
+  ASSERT_EQ(3, res.size());
+  EXPECT_EQ(1, res[0].getId());
+  EXPECT_EQ(2, res[1].getId());
+  EXPECT_TRUE(res[1].isExec());
+  EXPECT_EQ(3, res[2].getId());
+  EXPECT_TRUE(res[2].isExec());
+}
+
+TEST(DiffCatalogsTest, UsesIndex) {
+  capnp::MallocMessageBuilder message;
+  auto catalog = message.initRoot<mcm::Catalog>();
+  auto res = catalog.initResources(2);
+  addResource(res[0], 20, "b", {});
+  addResource(res[1], 10, "a", {});
+  auto index = catalog.initIndex();
+  index.initIds(2).set(0, 10);
+  index.getIds().set(1, 20);
+  index.initPositions(2).set(0, 1);
+  index.getPositions().set(1, 0);
+
+  capnp::MallocMessageBuilder patchMessage;
+  auto patch = patchMessage.initRoot<mcm::Catalog>();
+  auto stats = mcm::catdiff::diffCatalogs(catalog.asReader(), catalog.asReader(), patch);
+  EXPECT_EQ(2, stats.unchanged);
+  EXPECT_EQ(0, patch.asReader().getResources().size());
+  EXPECT_EQ(0, patch.asReader().getRemoved().size());
+}
+
+TEST(DiffCatalogsTest, RejectsStaleIndex) {
+  capnp::MallocMessageBuilder message;
+  auto catalog = message.initRoot<mcm::Catalog>();
+  auto res = catalog.initResources(2);
+  addResource(res[0], 20, "b", {});
+  addResource(res[1], 10, "a", {});
+  auto index = catalog.initIndex();
+  index.initIds(2).set(0, 10);
+  index.getIds().set(1, 20);
+  index.initPositions(2).set(0, 0);
+  index.getPositions().set(1, 1);
+
+  capnp::MallocMessageBuilder patchMessage;
+  EXPECT_ANY_THROW(mcm::catdiff::diffCatalogs(catalog.asReader(), catalog.asReader(),
+                                              patchMessage.initRoot<mcm::Catalog>()));
+}
+
+TEST(DiffCatalogsTest, RejectsDuplicateIds) {
+  capnp::MallocMessageBuilder message;
+  auto res = message.initRoot<mcm::Catalog>().initResources(2);
+  addResource(res[0], 1, "a", {});
+  addResource(res[1], 1, "b", {});
+  capnp::MallocMessageBuilder patchMessage;
+  auto catalog = message.getRoot<mcm::Catalog>().asReader();
+  EXPECT_ANY_THROW(mcm::catdiff::diffCatalogs(catalog, catalog, patchMessage.initRoot<mcm::Catalog>()));
+}
@@ -0,0 +1,207 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "catdiff/diff.h"
+
+#include <algorithm>
+#include <utility>
+#include "capnp/any.h"
+#include "kj/array.h"
+#include "kj/debug.h"
+#include "kj/vector.h"
+
+namespace mcm {
+
+namespace catdiff {
+
+namespace {
+  struct Entry {
+    uint64_t id;
+    uint32_t pos;
+
+    inline bool operator<(const Entry& other) const { return id < other.id; }
+  };
+
+  enum State: uint8_t {
+    UNCHANGED,
+    ADDED,
+    CHANGED,
+    TRIGGERED,
+    PLACEHOLDER,
+  };
+
+  inline bool inPatch(State s) {
+    return s == ADDED || s == CHANGED || s == TRIGGERED;
+  }
+
+  kj::Array<Entry> sortedIds(Catalog::Reader catalog) {
+    // Returns the catalog's resource IDs in ascending order, taken from
+    // its index if it has one.
+
+    auto resources = catalog.getResources();
+    auto entries = kj::heapArray<Entry>(resources.size());
+    if (catalog.hasIndex() && catalog.getIndex().getIds().size() == resources.size() &&
+        catalog.getIndex().getPositions().size() == resources.size()) {
+      auto ids = catalog.getIndex().getIds();
+      auto positions = catalog.getIndex().getPositions();
+      for (uint32_t i = 0; i < entries.size(); i++) {
+        KJ_REQUIRE(positions[i] < resources.size(), "catalog index out of range", positions[i]);
+        KJ_REQUIRE(resources[positions[i]].getId() == ids[i],
+                   "catalog index doesn't match its resources", kj::hex(ids[i]));
+        entries[i] = Entry{ids[i], positions[i]};
+      }
+    } else {
+      for (uint32_t i = 0; i < entries.size(); i++) {
+        entries[i] = Entry{resources[i].getId(), i};
+      }
+      std::sort(entries.begin(), entries.end());
+    }
+    for (size_t i = 1; i < entries.size(); i++) {
+      KJ_REQUIRE(entries[i-1].id < entries[i].id, "duplicate or unsorted resource ID",
+                 kj::hex(entries[i].id));
+    }
+    return entries;
+  }
+
+  kj::Maybe<uint32_t> find(kj::ArrayPtr<const Entry> entries, uint64_t id) {
+    auto iter = std::lower_bound(entries.begin(), entries.end(), Entry{id, 0});
+    if (iter == entries.end() || iter->id != id) {
+      return nullptr;
+    }
+    return iter->pos;
+  }
+}  // namespace
+
+DiffStats diffCatalogs(Catalog::Reader oldCatalog, Catalog::Reader newCatalog,
+                       Catalog::Builder patch) {
+  auto oldResources = oldCatalog.getResources();
+  auto newResources = newCatalog.getResources();
+  auto oldIds = sortedIds(oldCatalog);
+  auto newIds = sortedIds(newCatalog);
+  DiffStats stats;
+
+  // Match resources by ID.
+  auto states = kj::heapArray<State>(newResources.size());
+  kj::Vector<uint64_t> removed;
+  {
+    size_t i = 0, j = 0;
+    while (i < oldIds.size() || j < newIds.size()) {
+      if (j == newIds.size() || (i < oldIds.size() && oldIds[i].id < newIds[j].id)) {
+        removed.add(oldIds[i].id);
+        i++;
+      } else if (i == oldIds.size() || newIds[j].id < oldIds[i].id) {
+        states[newIds[j].pos] = ADDED;
+        stats.added++;
+        j++;
+      } else {
+        capnp::AnyStruct::Reader a(oldResources[oldIds[i].pos]);
+        capnp::AnyStruct::Reader b(newResources[newIds[j].pos]);
+        if (a.equals(b) == capnp::Equality::EQUAL) {
+          states[newIds[j].pos] = UNCHANGED;
+        } else {
+          states[newIds[j].pos] = CHANGED;
+          stats.changed++;
+        }
+        i++;
+        j++;
+      }
+    }
+  }
+
+  // Pull in unchanged resources whose ifDepsChanged names a patched
+  // resource, transitively.
+  {
+    kj::Vector<std::pair<uint32_t, uint32_t>> triggers;  // (dependency, dependent)
+    for (uint32_t i = 0; i < newResources.size(); i++) {
+      auto r = newResources[i];
+      if (states[i] != UNCHANGED || !r.isExec()) {
+        continue;
+      }
+      auto cond = r.getExec().getCondition();
+      if (!cond.isIfDepsChanged()) {
+        continue;
+      }
+      for (uint64_t id : cond.getIfDepsChanged()) {
+        KJ_IF_MAYBE(pos, find(newIds, id)) {
+          triggers.add(std::make_pair(*pos, i));
+        }
+      }
+    }
+    std::sort(triggers.begin(), triggers.end());
+    kj::Vector<uint32_t> queue;
+    for (uint32_t i = 0; i < newResources.size(); i++) {
+      if (inPatch(states[i])) {
+        queue.add(i);
+      }
+    }
+    while (queue.size() > 0) {
+      uint32_t pos = queue.back();
+      queue.removeLast();
+      auto range = std::equal_range(triggers.begin(), triggers.end(),
+                                    std::make_pair(pos, uint32_t(0)),
+                                    [](const std::pair<uint32_t, uint32_t>& a,
+                                       const std::pair<uint32_t, uint32_t>& b) {
+                                      return a.first < b.first;
+                                    });
+      for (auto iter = range.first; iter != range.second; ++iter) {
+        if (states[iter->second] == UNCHANGED) {
+          states[iter->second] = TRIGGERED;
+          stats.triggered++;
+          queue.add(iter->second);
+        }
+      }
+    }
+  }
+
+  // Stand in for unchanged dependencies with noops.
+  size_t n = 0;
+  for (uint32_t i = 0; i < newResources.size(); i++) {
+    if (!inPatch(states[i])) {
+      continue;
+    }
+    n++;
+    for (uint64_t id : newResources[i].getDependencies()) {
+      KJ_IF_MAYBE(pos, find(newIds, id)) {
+        if (states[*pos] == UNCHANGED) {
+          states[*pos] = PLACEHOLDER;
+          stats.placeholders++;
+          n++;
+        }
+      }
+    }
+  }
+  stats.unchanged = newResources.size() - stats.added - stats.changed - stats.triggered;
+  stats.removed = removed.size();
+
+  auto out = patch.initResources(n);
+  size_t k = 0;
+  for (uint32_t i = 0; i < newResources.size(); i++) {
+    if (inPatch(states[i])) {
+      out.setWithCaveats(k++, newResources[i]);
+    } else if (states[i] == PLACEHOLDER) {
+      auto placeholder = out[k++];
+      placeholder.setId(newResources[i].getId());
+      placeholder.setComment(newResources[i].getComment());
+      placeholder.setNoop();
+    }
+  }
+  auto outRemoved = patch.initRemoved(removed.size());
+  for (size_t i = 0; i < removed.size(); i++) {
+    outRemoved.set(i, removed[i]);
+  }
+  return stats;
+}
+
+}  // namespace catdiff
+}  // namespace mcm
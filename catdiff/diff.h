@@ -0,0 +1,52 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_CATDIFF_DIFF_H_
+#define MCM_CATDIFF_DIFF_H_
+// Computing patch catalogs from two versions of a catalog.
+
+#include <stdint.h>
+
+#include "catalog.capnp.h"
+
+namespace mcm {
+
+namespace catdiff {
+
+struct DiffStats {
+  uint64_t added = 0;        // resources only in the new catalog
+  uint64_t changed = 0;      // resources whose contents differ
+  uint64_t triggered = 0;    // unchanged resources with ifDepsChanged on a patched resource
+  uint64_t placeholders = 0; // unchanged dependencies written as noops
+  uint64_t unchanged = 0;    // resources left out of the patch (including placeholders)
+  uint64_t removed = 0;      // resources only in the old catalog
+};
+
+DiffStats diffCatalogs(Catalog::Reader oldCatalog, Catalog::Reader newCatalog,
+                       Catalog::Builder patch);
+// Fill patch with the resources of newCatalog that are new or differ
+// from the resource with the same ID in oldCatalog, and set
+// patch.removed to the IDs that are only in oldCatalog.
+//
+// An unchanged exec resource whose ifDepsChanged condition names a
+// resource in the patch is included too, since applying the patch may
+// trigger it.  Any other unchanged resource that a patched resource
+// depends on is written as a noop with the same ID and comment, so that
+// the patch is a complete catalog on its own.  Resources keep the order
+// they have in newCatalog.  Throws if either catalog has duplicate IDs.
+
+}  // namespace catdiff
+}  // namespace mcm
+
+#endif  // MCM_CATDIFF_DIFF_H_
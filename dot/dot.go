@@ -17,12 +17,11 @@ package main
 import (
 	"flag"
 	"fmt"
-	"io"
 	"os"
 
 	"github.com/zombiezen/mcm/catalog"
+	"github.com/zombiezen/mcm/internal/catio"
 	"github.com/zombiezen/mcm/internal/version"
-	"github.com/zombiezen/mcm/third_party/golang/capnproto"
 )
 
 func main() {
@@ -37,7 +36,7 @@ func main() {
 	switch flag.NArg() {
 	case 0:
 		var err error
-		cat, err = readCatalog(os.Stdin)
+		cat, err = catio.ReadCatalog(os.Stdin)
 		if err != nil {
 			die(err)
 		}
@@ -47,7 +46,7 @@ func main() {
 		if err != nil {
 			die(err)
 		}
-		cat, err = readCatalog(f)
+		cat, err = catio.ReadCatalog(f)
 		if err != nil {
 			die(err)
 		}
@@ -80,15 +79,3 @@ func die(err error) {
 	fmt.Fprintln(os.Stderr, "mcm-dot:", err)
 	os.Exit(1)
 }
-
-func readCatalog(r io.Reader) (catalog.Catalog, error) {
-	msg, err := capnp.NewDecoder(r).Decode()
-	if err != nil {
-		return catalog.Catalog{}, fmt.Errorf("read catalog: %v", err)
-	}
-	c, err := catalog.ReadRootCatalog(msg)
-	if err != nil {
-		return catalog.Catalog{}, fmt.Errorf("read catalog: %v", err)
-	}
-	return c, nil
-}
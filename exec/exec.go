@@ -15,6 +15,7 @@
 package main
 
 import (
+	"bufio"
 	"bytes"
 	"context"
 	"errors"
@@ -29,6 +30,7 @@ import (
 
 	"github.com/zombiezen/mcm/catalog"
 	"github.com/zombiezen/mcm/exec/execlib"
+	"github.com/zombiezen/mcm/internal/catio"
 	"github.com/zombiezen/mcm/internal/system"
 	"github.com/zombiezen/mcm/internal/version"
 	"github.com/zombiezen/mcm/third_party/golang/capnproto"
@@ -71,32 +73,39 @@ func main() {
 	}
 
 	ctx := context.Background()
-	var cat catalog.Catalog
+	var in io.Reader
 	switch flag.NArg() {
 	case 0:
-		var err error
-		cat, err = readCatalog(os.Stdin)
-		if err != nil {
-			log.Fatal(ctx, err)
-		}
+		in = os.Stdin
 	case 1:
 		// TODO(someday): read segments lazily
 		f, err := os.Open(flag.Arg(0))
 		if err != nil {
 			log.Fatal(ctx, err)
 		}
-		cat, err = readCatalog(f)
-		if err != nil {
-			log.Fatal(ctx, err)
-		}
-		if err = f.Close(); err != nil {
-			log.Error(ctx, err)
-		}
+		defer func() {
+			if err := f.Close(); err != nil {
+				log.Error(ctx, err)
+			}
+		}()
+		in = f
 	default:
 		usage()
 		os.Exit(2)
 	}
 
+	br := bufio.NewReader(in)
+	if isStream(br) {
+		sr := newStreamReader(br)
+		if err := execlib.ApplyStream(ctx, sys, sr.next, opts); err != nil {
+			log.Fatal(ctx, err)
+		}
+		return
+	}
+	cat, err := catio.ReadCatalog(br)
+	if err != nil {
+		log.Fatal(ctx, err)
+	}
 	if err := execlib.Apply(ctx, sys, cat, opts); err != nil {
 		log.Fatal(ctx, err)
 	}
@@ -325,14 +334,56 @@ func (l *logger) Fatal(ctx context.Context, err error) {
 	os.Exit(1)
 }
 
-func readCatalog(r io.Reader) (catalog.Catalog, error) {
-	msg, err := capnp.NewDecoder(r).Decode()
+// isStream reports whether r starts with catalog.StreamMagic.  If so,
+// the magic is consumed.
+func isStream(r *bufio.Reader) bool {
+	magic, err := r.Peek(len(catalog.StreamMagic))
+	if err != nil || !bytes.Equal(magic, catalog.StreamMagic) {
+		return false
+	}
+	r.Discard(len(catalog.StreamMagic))
+	return true
+}
+
+// A streamReader reads resources from a streamed catalog, as written
+// by mcm-luacat --stream.
+type streamReader struct {
+	dec   *capnp.Decoder
+	count uint64
+}
+
+func newStreamReader(r *bufio.Reader) *streamReader {
+	return &streamReader{dec: catio.NewDecoder(r)}
+}
+
+// next returns the next resource in the stream or io.EOF after the
+// last resource.
+func (sr *streamReader) next() (catalog.Resource, error) {
+	msg, err := sr.dec.Decode()
+	if err == io.EOF {
+		return catalog.Resource{}, errors.New("read catalog: stream truncated")
+	}
 	if err != nil {
-		return catalog.Catalog{}, fmt.Errorf("read catalog: %v", err)
+		return catalog.Resource{}, fmt.Errorf("read catalog: %v", err)
 	}
-	c, err := catalog.ReadRootCatalog(msg)
+	e, err := catalog.ReadRootStreamEntry(msg)
 	if err != nil {
-		return catalog.Catalog{}, fmt.Errorf("read catalog: %v", err)
+		return catalog.Resource{}, fmt.Errorf("read catalog: %v", err)
+	}
+	switch e.Which() {
+	case catalog.StreamEntry_Which_resource:
+		sr.count++
+		r, err := e.Resource()
+		if err != nil {
+			return catalog.Resource{}, fmt.Errorf("read catalog: %v", err)
+		}
+		return r, nil
+	case catalog.StreamEntry_Which_end:
+		if n := e.End(); n != sr.count {
+			return catalog.Resource{}, fmt.Errorf("read catalog: stream has %d resources, but trailer says %d", sr.count, n)
+		}
+		return catalog.Resource{}, io.EOF
+	default:
+		return catalog.Resource{}, fmt.Errorf("read catalog: unknown stream entry %v", e.Which())
 	}
-	return c, nil
 }
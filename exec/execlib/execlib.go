@@ -18,6 +18,7 @@ import (
 	"context"
 	"errors"
 	"fmt"
+	"io"
 	"strings"
 	"sync"
 
@@ -29,17 +30,53 @@ import (
 // Apply changes a system match the resources in a catalog.
 // Passing nil options is the same as passing the zero value.
 func Apply(ctx context.Context, sys system.System, c catalog.Catalog, opts *Options) error {
-	res, _ := c.Resources()
-	g, err := depgraph.New(res)
+	g, err := depgraph.NewFromCatalog(c)
 	if err != nil {
 		return toError(err)
 	}
-	if err = apply(ctx, cacheUserLookups(sys), g, opts.normalize()); err != nil {
+	if err = apply(ctx, cacheUserLookups(sys), g, nil, opts.normalize()); err != nil {
 		return toError(err)
 	}
 	return nil
 }
 
+// ApplyStream is like Apply, but reads resources one at a time from
+// next, so that resources can be applied before the whole catalog is
+// available.  next should return io.EOF after the last resource.  If
+// next returns any other error, ApplyStream waits for in-progress
+// resources to finish, then returns the error without applying any
+// more resources.
+func ApplyStream(ctx context.Context, sys system.System, next func() (catalog.Resource, error), opts *Options) error {
+	ctx, cancel := context.WithCancel(ctx)
+	defer cancel()
+	src := make(chan streamItem, streamBuffer)
+	go func() {
+		for {
+			r, err := next()
+			select {
+			case src <- streamItem{r, err}:
+			case <-ctx.Done():
+				return
+			}
+			if err != nil {
+				return
+			}
+		}
+	}()
+	if err := apply(ctx, cacheUserLookups(sys), depgraph.NewIncremental(), src, opts.normalize()); err != nil {
+		return toError(err)
+	}
+	return nil
+}
+
+// streamBuffer is the number of resources that ApplyStream reads ahead.
+const streamBuffer = 64
+
+type streamItem struct {
+	res catalog.Resource
+	err error
+}
+
 // Options is the set of optional parameters for Apply.  The zero value
 // is the default set of options.
 type Options struct {
@@ -99,7 +136,7 @@ type applyState struct {
 	changedResources map[uint64]bool
 }
 
-func apply(ctx context.Context, sys system.System, g *depgraph.Graph, opts *Options) error {
+func apply(ctx context.Context, sys system.System, g *depgraph.Graph, src <-chan streamItem, opts *Options) error {
 	ch, results, done := startWorkers(ctx, opts.Log, opts.ConcurrentJobs)
 	defer done()
 
@@ -109,11 +146,18 @@ func apply(ctx context.Context, sys system.System, g *depgraph.Graph, opts *Opti
 	}
 	working := make(workingSet, opts.ConcurrentJobs)
 	var nextJob *job
+	var srcErr error
 	for !g.Done() {
-		if working.hasIdle() && nextJob == nil {
+		if srcErr != nil {
+			// Stop scheduling, but let running jobs finish.
+			if working.idle() {
+				return srcErr
+			}
+			nextJob = nil
+		} else if working.hasIdle() && nextJob == nil {
 			// Find next work, if any.
 			ready := g.Ready()
-			if len(ready) == 0 {
+			if len(ready) == 0 && src == nil {
 				return errors.New("graph not done, but has nothing to do")
 			}
 			if id := working.next(ready); id != 0 {
@@ -127,23 +171,38 @@ func apply(ctx context.Context, sys system.System, g *depgraph.Graph, opts *Opti
 				}
 			}
 		}
-		if nextJob == nil {
-			select {
-			case r := <-results:
-				working.remove(r.id)
-				update(ctx, opts.Log, state, r)
-			case <-ctx.Done():
-				return ctx.Err()
-			}
-			continue
+		var jobCh chan<- *job
+		if nextJob != nil {
+			jobCh = ch
 		}
 		select {
-		case ch <- nextJob:
+		case jobCh <- nextJob:
 			working.add(nextJob.resource.ID())
 			nextJob = nil
 		case r := <-results:
 			working.remove(r.id)
 			update(ctx, opts.Log, state, r)
+		case item := <-src:
+			if item.err == io.EOF {
+				src = nil
+				srcErr = g.Close()
+				continue
+			}
+			if item.err != nil {
+				src = nil
+				srcErr = item.err
+				continue
+			}
+			if skipped, err := g.Add(item.res); err != nil {
+				src = nil
+				srcErr = err
+			} else if len(skipped) > 0 {
+				skipnames := make([]string, len(skipped))
+				for i := range skipnames {
+					skipnames[i] = formatResource(g.Resource(skipped[i]))
+				}
+				opts.Log.Infof(ctx, "skipping due to earlier failure: %s", strings.Join(skipnames, ", "))
+			}
 		case <-ctx.Done():
 			return ctx.Err()
 		}
@@ -194,6 +253,16 @@ func (ws workingSet) hasIdle() bool {
 	return ws.find(0) != -1
 }
 
+// idle reports whether all workers are idle.
+func (ws workingSet) idle() bool {
+	for _, id := range ws {
+		if id != 0 {
+			return false
+		}
+	}
+	return true
+}
+
 func (ws workingSet) add(id uint64) {
 	i := ws.find(0)
 	if i == -1 {
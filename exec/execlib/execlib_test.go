@@ -38,6 +38,10 @@ func TestApplier2Jobs(t *testing.T) {
 	applytests.Run(t, (&fixtureFactory{concurrentJobs: 2}).newFixture)
 }
 
+func TestApplierStream(t *testing.T) {
+	applytests.Run(t, (&fixtureFactory{concurrentJobs: 2, stream: true}).newFixture)
+}
+
 func TestExecBash(t *testing.T) {
 	ctx, cancel := context.WithCancel(context.Background())
 	defer cancel()
@@ -103,6 +107,7 @@ func TestExecBash(t *testing.T) {
 
 type fixtureFactory struct {
 	concurrentJobs int
+	stream         bool
 }
 
 type fixture struct {
@@ -110,6 +115,7 @@ type fixture struct {
 	log            applytests.Logger
 	info           *applytests.SystemInfo
 	concurrentJobs int
+	stream         bool
 }
 
 func (ff *fixtureFactory) newFixture(ctx context.Context, log applytests.Logger, name string) (applytests.Fixture, error) {
@@ -163,14 +169,32 @@ func (ff *fixtureFactory) newFixture(ctx context.Context, log applytests.Logger,
 		log:            log,
 		info:           info,
 		concurrentJobs: ff.concurrentJobs,
+		stream:         ff.stream,
 	}, nil
 }
 
 func (f *fixture) Apply(ctx context.Context, c catalog.Catalog) error {
-	return Apply(ctx, f.sys, c, &Options{
+	opts := &Options{
 		Log:            testLogger{t: f.log},
 		ConcurrentJobs: f.concurrentJobs,
-	})
+	}
+	if !f.stream {
+		return Apply(ctx, f.sys, c, opts)
+	}
+	res, err := c.Resources()
+	if err != nil {
+		return err
+	}
+	i := 0
+	next := func() (catalog.Resource, error) {
+		if i >= res.Len() {
+			return catalog.Resource{}, io.EOF
+		}
+		r := res.At(i)
+		i++
+		return r, nil
+	}
+	return ApplyStream(ctx, f.sys, next, opts)
 }
 
 func (f *fixture) System() system.System {
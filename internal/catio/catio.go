@@ -0,0 +1,68 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package catio reads catalogs written by mcm-luacat, with or without
+// --packed.
+package catio
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+
+	"github.com/zombiezen/mcm/catalog"
+	"github.com/zombiezen/mcm/third_party/golang/capnproto"
+)
+
+// IsPacked reports whether the Cap'n Proto message at the start of r
+// uses the packed encoding.  It does not consume any input.
+//
+// An unpacked message starts with a little-endian segment count minus
+// one, whose first byte is below 0x10 in any catalog mcm-luacat writes.
+// A packed message starts with a tag byte for that same header word.
+// Because the first segment is never empty, the tag has one of its high
+// four bits set, and the byte after it is a non-zero data byte.
+func IsPacked(r *bufio.Reader) bool {
+	b, err := r.Peek(2)
+	if err != nil {
+		return false
+	}
+	return b[0] >= 0x10 && b[1] != 0
+}
+
+// NewDecoder returns a decoder for the message stream in r, packed or
+// not.
+func NewDecoder(r *bufio.Reader) *capnp.Decoder {
+	if IsPacked(r) {
+		return capnp.NewPackedDecoder(r)
+	}
+	return capnp.NewDecoder(r)
+}
+
+// ReadCatalog reads a single catalog message from r.
+func ReadCatalog(r io.Reader) (catalog.Catalog, error) {
+	br, ok := r.(*bufio.Reader)
+	if !ok {
+		br = bufio.NewReader(r)
+	}
+	msg, err := NewDecoder(br).Decode()
+	if err != nil {
+		return catalog.Catalog{}, fmt.Errorf("read catalog: %v", err)
+	}
+	c, err := catalog.ReadRootCatalog(msg)
+	if err != nil {
+		return catalog.Catalog{}, fmt.Errorf("read catalog: %v", err)
+	}
+	return c, nil
+}
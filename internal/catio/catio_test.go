@@ -0,0 +1,110 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package catio
+
+import (
+	"bufio"
+	"bytes"
+	"testing"
+
+	"github.com/zombiezen/mcm/catalog"
+	"github.com/zombiezen/mcm/third_party/golang/capnproto"
+)
+
+func TestIsPacked(t *testing.T) {
+	tests := []struct {
+		name   string
+		data   []byte
+		packed bool
+	}{
+		{"empty", []byte{}, false},
+		{"one segment", []byte{0, 0, 0, 0, 0x10, 0, 0, 0}, false},
+		{"three segments", []byte{2, 0, 0, 0, 0x10, 0, 0, 0, 0x20, 0, 0, 0, 0x30, 0, 0, 0}, false},
+		{"one segment/packed", []byte{0x10, 0x10, 0x01}, true},
+		{"three segments/packed", []byte{0x11, 0x02, 0x10, 0x01, 0x20}, true},
+		{"large segment/packed", []byte{0x30, 0x01, 0x02}, true},
+	}
+	for _, test := range tests {
+		if got := IsPacked(bufio.NewReader(bytes.NewReader(test.data))); got != test.packed {
+			t.Errorf("IsPacked(%s) = %t; want %t", test.name, got, test.packed)
+		}
+	}
+}
+
+func TestReadCatalog(t *testing.T) {
+	tests := []struct {
+		name   string
+		n      int
+		arena  func() capnp.Arena
+		packed bool
+	}{
+		{"empty", 0, func() capnp.Arena { return capnp.SingleSegment(nil) }, false},
+		{"empty/packed", 0, func() capnp.Arena { return capnp.SingleSegment(nil) }, true},
+		{"single", 10, func() capnp.Arena { return capnp.SingleSegment(nil) }, false},
+		{"single/packed", 10, func() capnp.Arena { return capnp.SingleSegment(nil) }, true},
+		{"large", 5000, func() capnp.Arena { return capnp.SingleSegment(nil) }, false},
+		{"large/packed", 5000, func() capnp.Arena { return capnp.SingleSegment(nil) }, true},
+	}
+	for _, test := range tests {
+		msg, seg, err := capnp.NewMessage(test.arena())
+		if err != nil {
+			t.Fatalf("%s: NewMessage: %v", test.name, err)
+		}
+		c, err := catalog.NewRootCatalog(seg)
+		if err != nil {
+			t.Fatalf("%s: NewRootCatalog: %v", test.name, err)
+		}
+		res, err := c.NewResources(int32(test.n))
+		if err != nil {
+			t.Fatalf("%s: NewResources: %v", test.name, err)
+		}
+		for i := 0; i < test.n; i++ {
+			r := res.At(i)
+			r.SetID(uint64(i)*2 + 1)
+			r.SetComment("resource")
+		}
+		buf := new(bytes.Buffer)
+		enc := capnp.NewEncoder(buf)
+		if test.packed {
+			enc = capnp.NewPackedEncoder(buf)
+		}
+		if err := enc.Encode(msg); err != nil {
+			t.Fatalf("%s: Encode: %v", test.name, err)
+		}
+
+		if got := IsPacked(bufio.NewReader(bytes.NewReader(buf.Bytes()))); got != test.packed {
+			t.Errorf("%s: IsPacked = %t; want %t", test.name, got, test.packed)
+		}
+		c2, err := ReadCatalog(bytes.NewReader(buf.Bytes()))
+		if err != nil {
+			t.Errorf("%s: ReadCatalog: %v", test.name, err)
+			continue
+		}
+		res2, err := c2.Resources()
+		if err != nil {
+			t.Errorf("%s: Resources: %v", test.name, err)
+			continue
+		}
+		if res2.Len() != test.n {
+			t.Errorf("%s: len(resources) = %d; want %d", test.name, res2.Len(), test.n)
+			continue
+		}
+		if test.n > 0 {
+			if id := res2.At(test.n - 1).ID(); id != uint64(test.n-1)*2+1 {
+				t.Errorf("%s: last resource ID = %d; want %d", test.name, id, uint64(test.n-1)*2+1)
+			}
+		}
+	}
+}
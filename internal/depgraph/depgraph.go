@@ -18,61 +18,247 @@ package depgraph
 import (
 	"errors"
 	"fmt"
+	"sort"
 
 	"github.com/zombiezen/mcm/catalog"
+	"github.com/zombiezen/mcm/third_party/golang/capnproto"
 )
 
 // A Graph schedules work for a DAG of resources.
 type Graph struct {
-	res   catalog.Resource_List
-	deps  map[uint64][]uint64
-	index map[uint64]int
+	res  map[uint64]catalog.Resource
+	deps map[uint64][]uint64 // resource ID -> IDs of resources that depend on it
+	ix   *index              // if not nil, used instead of res and deps
 
 	// Mutable state
 	ready  []uint64
-	queued map[uint64]int
+	queued map[uint64]int  // resource ID -> number of unmarked dependencies
+	marked map[uint64]bool // resource ID -> whether it succeeded
+	open   bool
+}
+
+// index is a graph read from a catalog's precomputed index.  Resources
+// are referred to by their position in the catalog.
+type index struct {
+	res        catalog.Resource_List
+	ids        capnp.UInt64List
+	positions  capnp.UInt32List
+	depOffsets capnp.UInt32List
+	revOffsets capnp.UInt32List
+	revTargets capnp.UInt32List
+
+	pending []int32 // position -> number of unmarked dependencies; -1 once marked or skipped
+	nqueued int     // number of positions with pending > 0
 }
 
 // New builds a graph from a list of dependencies or returns an error
 // if the dependency information contains inconsistencies.
 func New(res catalog.Resource_List) (*Graph, error) {
 	n := res.Len()
-	g := &Graph{
-		res:    res,
-		deps:   make(map[uint64][]uint64, n),
-		index:  make(map[uint64]int, n),
-		queued: make(map[uint64]int, n),
+	g := newGraph(n)
+	for i := 0; i < n; i++ {
+		if _, err := g.Add(res.At(i)); err != nil {
+			return nil, err
+		}
+	}
+	if err := g.Close(); err != nil {
+		return nil, err
+	}
+	return g, nil
+}
+
+// NewFromCatalog builds a graph from a catalog's resources, using the
+// catalog's precomputed index if it has one.  The index is checked for
+// consistency with the resource IDs, but the dependency lists are
+// trusted, since reading them is what the index avoids.
+func NewFromCatalog(c catalog.Catalog) (*Graph, error) {
+	res, err := c.Resources()
+	if err != nil {
+		return nil, fmt.Errorf("build dependency graph: reading resources: %v", err)
+	}
+	if !c.HasIndex() {
+		return New(res)
+	}
+	cix, err := c.Index()
+	if err != nil {
+		return nil, fmt.Errorf("build dependency graph: reading index: %v", err)
+	}
+	ix, err := readIndex(res, cix)
+	if err != nil {
+		return nil, fmt.Errorf("build dependency graph: %v", err)
+	}
+	g := &Graph{ix: ix}
+	n := res.Len()
+	ix.pending = make([]int32, n)
+	for i := 0; i < n; i++ {
+		p := int32(ix.depOffsets.At(i+1) - ix.depOffsets.At(i))
+		ix.pending[i] = p
+		if p == 0 {
+			g.ready = append(g.ready, res.At(i).ID())
+		} else {
+			ix.nqueued++
+		}
+	}
+	return g, nil
+}
+
+func readIndex(res catalog.Resource_List, cix catalog.Catalog_Index) (*index, error) {
+	ix := &index{res: res}
+	var err error
+	if ix.ids, err = cix.Ids(); err != nil {
+		return nil, fmt.Errorf("reading index IDs: %v", err)
+	}
+	if ix.positions, err = cix.Positions(); err != nil {
+		return nil, fmt.Errorf("reading index positions: %v", err)
+	}
+	if ix.depOffsets, err = cix.DependencyOffsets(); err != nil {
+		return nil, fmt.Errorf("reading index dependency offsets: %v", err)
+	}
+	if ix.revOffsets, err = cix.DependentOffsets(); err != nil {
+		return nil, fmt.Errorf("reading index dependent offsets: %v", err)
+	}
+	if ix.revTargets, err = cix.DependentTargets(); err != nil {
+		return nil, fmt.Errorf("reading index dependent targets: %v", err)
+	}
+	n := res.Len()
+	if ix.ids.Len() != n || ix.positions.Len() != n || ix.depOffsets.Len() != n+1 || ix.revOffsets.Len() != n+1 {
+		return nil, fmt.Errorf("index lists do not match %d resources", n)
 	}
+	var prev uint64
 	for i := 0; i < n; i++ {
-		id := res.At(i).ID()
+		id := ix.ids.At(i)
 		if id == 0 {
-			return nil, errors.New("build dependency graph: encountered resource with ID=0")
+			return nil, errors.New("encountered resource with ID=0")
 		}
-		g.index[id] = i
-		if _, ok := g.deps[id]; !ok {
-			g.deps[id] = nil
+		if i > 0 && id <= prev {
+			return nil, fmt.Errorf("index IDs not sorted or duplicate resource ID=%d", id)
 		}
-		deps, err := res.At(i).Dependencies()
-		if err != nil {
-			return nil, fmt.Errorf("build dependency graph: reading dependency list of resource ID=%d: %v", id, err)
+		prev = id
+		p := ix.positions.At(i)
+		if int64(p) >= int64(n) || res.At(int(p)).ID() != id {
+			return nil, fmt.Errorf("index position of resource ID=%d does not match resources", id)
 		}
-		if ndeps := deps.Len(); ndeps == 0 {
-			g.ready = append(g.ready, id)
-		} else {
-			g.queued[id] = deps.Len()
-			for j := 0; j < ndeps; j++ {
-				d := deps.At(j)
-				g.deps[d] = append(g.deps[d], id)
+	}
+	for _, offsets := range []capnp.UInt32List{ix.depOffsets, ix.revOffsets} {
+		for i := 0; i < n; i++ {
+			if offsets.At(i) > offsets.At(i+1) {
+				return nil, errors.New("index offsets not sorted")
+			}
+		}
+	}
+	if int64(ix.revOffsets.At(n)) != int64(ix.revTargets.Len()) {
+		return nil, errors.New("index dependent offsets do not match targets")
+	}
+	for i, m := 0, ix.revTargets.Len(); i < m; i++ {
+		if int64(ix.revTargets.At(i)) >= int64(n) {
+			return nil, errors.New("index dependent target out of range")
+		}
+	}
+	return ix, nil
+}
+
+// position returns the index into the catalog's resources of the
+// resource with the given ID.
+func (ix *index) position(id uint64) (int, bool) {
+	n := ix.ids.Len()
+	i := sort.Search(n, func(i int) bool { return ix.ids.At(i) >= id })
+	if i == n || ix.ids.At(i) != id {
+		return 0, false
+	}
+	return int(ix.positions.At(i)), true
+}
+
+// dependents calls f with the position of each resource that depends
+// on the resource at position p.
+func (ix *index) dependents(p int, f func(q int)) {
+	for i, end := int(ix.revOffsets.At(p)), int(ix.revOffsets.At(p+1)); i < end; i++ {
+		f(int(ix.revTargets.At(i)))
+	}
+}
+
+// NewIncremental returns an empty graph that resources can be added to
+// with Add while others are being marked.  Close must be called after
+// the last resource is added.
+func NewIncremental() *Graph {
+	return newGraph(0)
+}
+
+func newGraph(n int) *Graph {
+	return &Graph{
+		res:    make(map[uint64]catalog.Resource, n),
+		deps:   make(map[uint64][]uint64, n),
+		queued: make(map[uint64]int, n),
+		marked: make(map[uint64]bool),
+		open:   true,
+	}
+}
+
+// Add adds a resource to a graph that has not been closed.  Its
+// dependencies do not have to have been added yet.  If it depends on a
+// resource that has already failed, then it is skipped, along with any
+// resources added earlier that depend on it, directly or indirectly.
+// Skipped resources never appear in the ready list.  Add returns the
+// IDs of the skipped resources, starting with r's, or nil if r was not
+// skipped.
+func (g *Graph) Add(r catalog.Resource) (skipped []uint64, err error) {
+	if !g.open || g.ix != nil {
+		return nil, errors.New("build dependency graph: add to closed graph")
+	}
+	id := r.ID()
+	if id == 0 {
+		return nil, errors.New("build dependency graph: encountered resource with ID=0")
+	}
+	if _, dup := g.res[id]; dup {
+		return nil, fmt.Errorf("build dependency graph: duplicate resource ID=%d", id)
+	}
+	deps, err := r.Dependencies()
+	if err != nil {
+		return nil, fmt.Errorf("build dependency graph: reading dependency list of resource ID=%d: %v", id, err)
+	}
+	g.res[id] = r
+	if _, ok := g.deps[id]; !ok {
+		g.deps[id] = nil
+	}
+	ndeps := deps.Len()
+	unmarked := 0
+	aborted := false
+	for j := 0; j < ndeps; j++ {
+		d := deps.At(j)
+		if ok, isMarked := g.marked[d]; isMarked {
+			if !ok {
+				aborted = true
 			}
+			continue
 		}
+		g.deps[d] = append(g.deps[d], id)
+		unmarked++
 	}
+	if aborted {
+		g.marked[id] = false
+		return append([]uint64{id}, g.abortDependents(id)...), nil
+	}
+	if unmarked == 0 {
+		g.ready = append(g.ready, id)
+	} else {
+		g.queued[id] = unmarked
+	}
+	return nil, nil
+}
+
+// Close marks the end of the graph's resources and returns an error if
+// any resource depends on a resource that was never added.
+func (g *Graph) Close() error {
+	if !g.open {
+		return nil
+	}
+	g.open = false
 	for id, out := range g.deps {
-		if _, ok := g.index[id]; !ok {
-			return nil, fmt.Errorf("build dependency graph: unknown dependency ID %d requested by resource %d", id, out[0])
+		if _, ok := g.res[id]; !ok && len(out) > 0 {
+			return fmt.Errorf("build dependency graph: unknown dependency ID %d requested by resource %d", id, out[0])
 		}
 	}
 	// TODO(soon): loop detection
-	return g, nil
+	return nil
 }
 
 // Ready returns a list of resources that have not been marked and have
@@ -82,18 +268,25 @@ func (g *Graph) Ready() []uint64 {
 	return g.ready
 }
 
-// Done returns true if all of the resources in the graph have been marked.
+// Done returns true if the graph has been closed and all of the
+// resources in the graph have been marked.
 func (g *Graph) Done() bool {
-	return len(g.ready)+len(g.queued) == 0
+	if g.ix != nil {
+		return len(g.ready)+g.ix.nqueued == 0
+	}
+	return !g.open && len(g.ready)+len(g.queued) == 0
 }
 
 // Resource returns the resource with the given ID.
 func (g *Graph) Resource(id uint64) catalog.Resource {
-	i, ok := g.index[id]
-	if !ok {
-		return catalog.Resource{}
+	if g.ix != nil {
+		p, ok := g.ix.position(id)
+		if !ok {
+			return catalog.Resource{}
+		}
+		return g.ix.res.At(p)
 	}
-	return g.res.At(i)
+	return g.res[id]
 }
 
 // Mark marks a resource as "completed".
@@ -101,6 +294,11 @@ func (g *Graph) Mark(id uint64) {
 	if !g.pop(id) {
 		return
 	}
+	if g.ix != nil {
+		g.ix.mark(g, id)
+		return
+	}
+	g.marked[id] = true
 	for _, dep := range g.deps[id] {
 		n := g.queued[dep]
 		n--
@@ -121,29 +319,30 @@ func (g *Graph) MarkFailure(id uint64) []uint64 {
 	if !g.pop(id) {
 		return nil
 	}
-	var aborted []uint64
-	visited := func(id uint64) bool {
-		for _, x := range aborted {
-			if x == id {
-				return true
-			}
-		}
-		return false
+	if g.ix != nil {
+		return g.ix.markFailure(id)
 	}
-	var stk []uint64
-	for {
+	g.marked[id] = false
+	return g.abortDependents(id)
+}
+
+// abortDependents marks every queued resource that depends on id,
+// directly or indirectly, as failed and returns their IDs.
+func (g *Graph) abortDependents(id uint64) []uint64 {
+	var aborted []uint64
+	stk := []uint64{id}
+	for len(stk) > 0 {
+		end := len(stk) - 1
+		id, stk = stk[end], stk[:end]
 		for _, dep := range g.deps[id] {
-			if g.queued[dep] != 0 && !visited(dep) {
-				stk = append(stk, dep)
+			if _, ok := g.queued[dep]; !ok {
+				continue
 			}
+			delete(g.queued, dep)
+			g.marked[dep] = false
+			aborted = append(aborted, dep)
+			stk = append(stk, dep)
 		}
-		if len(stk) == 0 {
-			break
-		}
-		end := len(stk) - 1
-		stk, id = stk[:end], stk[end]
-		aborted = append(aborted, id)
-		delete(g.queued, id)
 	}
 	return aborted
 }
@@ -162,3 +361,39 @@ func (g *Graph) pop(id uint64) bool {
 	g.ready = append(g.ready[:i], g.ready[i+1:]...)
 	return true
 }
+
+func (ix *index) mark(g *Graph, id uint64) {
+	p, _ := ix.position(id)
+	ix.pending[p] = -1
+	ix.dependents(p, func(q int) {
+		if ix.pending[q] <= 0 {
+			return
+		}
+		ix.pending[q]--
+		if ix.pending[q] == 0 {
+			ix.nqueued--
+			g.ready = append(g.ready, ix.res.At(q).ID())
+		}
+	})
+}
+
+func (ix *index) markFailure(id uint64) []uint64 {
+	p, _ := ix.position(id)
+	ix.pending[p] = -1
+	var aborted []uint64
+	stk := []int{p}
+	for len(stk) > 0 {
+		end := len(stk) - 1
+		p, stk = stk[end], stk[:end]
+		ix.dependents(p, func(q int) {
+			if ix.pending[q] <= 0 {
+				return
+			}
+			ix.pending[q] = -1
+			ix.nqueued--
+			aborted = append(aborted, ix.res.At(q).ID())
+			stk = append(stk, q)
+		})
+	}
+	return aborted
+}
@@ -24,11 +24,6 @@ import (
 )
 
 func TestDepgraph(t *testing.T) {
-	type Mark struct {
-		id      uint64
-		fail    bool
-		skipped []uint64
-	}
 	type DummyResource struct {
 		ID   uint64   `capnp:"id"`
 		Deps []uint64 `capnp:"dependencies"`
@@ -41,7 +36,7 @@ func TestDepgraph(t *testing.T) {
 		failNew   bool
 
 		// Marks to apply (in order)
-		marks []Mark
+		marks []mark
 
 		// Conditions to check after applying marks
 		ready []uint64
@@ -63,7 +58,7 @@ func TestDepgraph(t *testing.T) {
 			resources: []DummyResource{
 				{ID: 42},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 42},
 			},
 			done: true,
@@ -73,7 +68,7 @@ func TestDepgraph(t *testing.T) {
 			resources: []DummyResource{
 				{ID: 42},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 42, fail: true},
 			},
 			done: true,
@@ -92,7 +87,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 42},
 				{ID: 43},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 42},
 			},
 			ready: []uint64{43},
@@ -103,7 +98,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 42},
 				{ID: 43},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 42, fail: true},
 			},
 			ready: []uint64{43},
@@ -114,7 +109,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 42},
 				{ID: 43},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 42},
 				{id: 43},
 			},
@@ -136,7 +131,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 20},
 				{ID: 30, Deps: []uint64{10, 20}},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 10},
 			},
 			ready: []uint64{20},
@@ -148,7 +143,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 20},
 				{ID: 30, Deps: []uint64{10, 20}},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 10},
 				{id: 20},
 			},
@@ -161,7 +156,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 20},
 				{ID: 30, Deps: []uint64{10, 20}},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 10},
 				{id: 20},
 				{id: 30},
@@ -175,7 +170,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 20},
 				{ID: 30, Deps: []uint64{10, 20}},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 10, fail: true, skipped: []uint64{30}},
 			},
 			ready: []uint64{20},
@@ -187,7 +182,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 20},
 				{ID: 30, Deps: []uint64{10, 20}},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 10, fail: true, skipped: []uint64{30}},
 				{id: 20},
 			},
@@ -200,7 +195,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 20},
 				{ID: 30, Deps: []uint64{10, 20}},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 10, fail: true, skipped: []uint64{30}},
 				{id: 20, fail: true},
 			},
@@ -213,7 +208,7 @@ func TestDepgraph(t *testing.T) {
 				{ID: 20, Deps: []uint64{10}},
 				{ID: 30, Deps: []uint64{20}},
 			},
-			marks: []Mark{
+			marks: []mark{
 				{id: 10, fail: true, skipped: []uint64{20, 30}},
 			},
 			done: true,
@@ -269,9 +264,13 @@ func TestDepgraph(t *testing.T) {
 			if err != nil {
 				t.Fatal("NewMessage:", err)
 			}
-			res, err := catalog.NewResource_List(seg, int32(len(test.resources)))
+			c, err := catalog.NewRootCatalog(seg)
+			if err != nil {
+				t.Fatal("NewRootCatalog:", err)
+			}
+			res, err := c.NewResources(int32(len(test.resources)))
 			if err != nil {
-				t.Fatal("NewResource_List:", err)
+				t.Fatal("NewResources:", err)
 			}
 			for i := 0; i < len(test.resources); i++ {
 				if err := pogs.Insert(catalog.Resource_TypeID, res.At(i).Struct, &test.resources[i]); err != nil {
@@ -287,39 +286,132 @@ func TestDepgraph(t *testing.T) {
 				return
 			}
 			if err != nil {
-				t.Error("New:", err)
+				t.Fatal("New:", err)
 			}
+			checkMarks(t, g, test.marks, test.ready, test.done)
 
-			for _, m := range test.marks {
-				if !m.fail {
-					t.Logf("g.Mark(%d)", m.id)
-					g.Mark(m.id)
-					continue
-				}
-				t.Logf("g.MarkFailure(%d)", m.id)
-				skipped := g.MarkFailure(m.id)
-				if _, ok := sortSet(skipped); !ok {
-					t.Errorf("g.MarkFailure(%d) = %v; do not want duplicates", m.id, skipped)
-				}
-				if !idSetsEqual(skipped, m.skipped) {
-					t.Errorf("g.MarkFailure(%d) = %v; want %v", m.id, skipped, m.skipped)
-				}
-			}
-
-			if done := g.Done(); done != test.done {
-				t.Errorf("g.Done() = %t; want %t", done, test.done)
-			}
-			ready := g.Ready()
-			if _, ok := sortSet(ready); !ok {
-				t.Errorf("g.Ready() = %v; do not want duplicates", ready)
+			if err := addIndex(c); err != nil {
+				t.Fatal("addIndex:", err)
 			}
-			if !idSetsEqual(ready, test.ready) {
-				t.Errorf("g.Ready() = %v; want %v", ready, test.ready)
+			g, err = NewFromCatalog(c)
+			if err != nil {
+				t.Fatal("NewFromCatalog:", err)
 			}
+			t.Log("with index")
+			checkMarks(t, g, test.marks, test.ready, test.done)
 		})
 	}
 }
 
+type mark struct {
+	id      uint64
+	fail    bool
+	skipped []uint64
+}
+
+func checkMarks(t *testing.T, g *Graph, marks []mark, wantReady []uint64, wantDone bool) {
+	for _, m := range marks {
+		if !m.fail {
+			t.Logf("g.Mark(%d)", m.id)
+			g.Mark(m.id)
+			continue
+		}
+		t.Logf("g.MarkFailure(%d)", m.id)
+		skipped := g.MarkFailure(m.id)
+		if _, ok := sortSet(skipped); !ok {
+			t.Errorf("g.MarkFailure(%d) = %v; do not want duplicates", m.id, skipped)
+		}
+		if !idSetsEqual(skipped, m.skipped) {
+			t.Errorf("g.MarkFailure(%d) = %v; want %v", m.id, skipped, m.skipped)
+		}
+	}
+
+	if done := g.Done(); done != wantDone {
+		t.Errorf("g.Done() = %t; want %t", done, wantDone)
+	}
+	ready := g.Ready()
+	if _, ok := sortSet(ready); !ok {
+		t.Errorf("g.Ready() = %v; do not want duplicates", ready)
+	}
+	if !idSetsEqual(ready, wantReady) {
+		t.Errorf("g.Ready() = %v; want %v", ready, wantReady)
+	}
+}
+
+// addIndex fills in c's index the way mcm-luacat --index does.
+func addIndex(c catalog.Catalog) error {
+	res, err := c.Resources()
+	if err != nil {
+		return err
+	}
+	n := res.Len()
+	pos := make(map[uint64]uint32, n)
+	byID := make([]uint32, n)
+	for i := 0; i < n; i++ {
+		pos[res.At(i).ID()] = uint32(i)
+		byID[i] = uint32(i)
+	}
+	for i := 1; i < n; i++ {
+		for j := i; j > 0 && res.At(int(byID[j-1])).ID() > res.At(int(byID[j])).ID(); j-- {
+			byID[j-1], byID[j] = byID[j], byID[j-1]
+		}
+	}
+	var depOffsets, depTargets []uint32
+	rev := make([][]uint32, n)
+	for i := 0; i < n; i++ {
+		depOffsets = append(depOffsets, uint32(len(depTargets)))
+		deps, _ := res.At(i).Dependencies()
+		for j := 0; j < deps.Len(); j++ {
+			p := pos[deps.At(j)]
+			depTargets = append(depTargets, p)
+			rev[p] = append(rev[p], uint32(i))
+		}
+	}
+	depOffsets = append(depOffsets, uint32(len(depTargets)))
+	var revOffsets, revTargets []uint32
+	for i := 0; i < n; i++ {
+		revOffsets = append(revOffsets, uint32(len(revTargets)))
+		revTargets = append(revTargets, rev[i]...)
+	}
+	revOffsets = append(revOffsets, uint32(len(revTargets)))
+
+	ix, err := c.NewIndex()
+	if err != nil {
+		return err
+	}
+	ids, err := ix.NewIds(int32(n))
+	if err != nil {
+		return err
+	}
+	positions, err := ix.NewPositions(int32(n))
+	if err != nil {
+		return err
+	}
+	for i, p := range byID {
+		ids.Set(i, res.At(int(p)).ID())
+		positions.Set(i, p)
+	}
+	lists := []struct {
+		vals []uint32
+		init func(int32) (capnp.UInt32List, error)
+	}{
+		{depOffsets, ix.NewDependencyOffsets},
+		{depTargets, ix.NewDependencyTargets},
+		{revOffsets, ix.NewDependentOffsets},
+		{revTargets, ix.NewDependentTargets},
+	}
+	for _, l := range lists {
+		list, err := l.init(int32(len(l.vals)))
+		if err != nil {
+			return err
+		}
+		for i, v := range l.vals {
+			list.Set(i, v)
+		}
+	}
+	return nil
+}
+
 func idSetsEqual(a, b []uint64) bool {
 	a, _ = sortSet(a)
 	b, _ = sortSet(b)
@@ -349,3 +441,120 @@ func sortSet(list []uint64) (set []uint64, ok bool) {
 	}
 	return
 }
+
+func TestIncremental(t *testing.T) {
+	type DummyResource struct {
+		ID   uint64   `capnp:"id"`
+		Deps []uint64 `capnp:"dependencies"`
+	}
+	newResource := func(id uint64, deps ...uint64) catalog.Resource {
+		_, seg, err := capnp.NewMessage(capnp.SingleSegment(nil))
+		if err != nil {
+			t.Fatal(err)
+		}
+		r, err := catalog.NewRootResource(seg)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if err := pogs.Insert(catalog.Resource_TypeID, r.Struct, &DummyResource{ID: id, Deps: deps}); err != nil {
+			t.Fatal(err)
+		}
+		return r
+	}
+	mustAdd := func(g *Graph, r catalog.Resource, wantSkipped ...uint64) {
+		skipped, err := g.Add(r)
+		if err != nil {
+			t.Fatalf("g.Add(%d): %v", r.ID(), err)
+		}
+		if len(wantSkipped) > 0 && (len(skipped) == 0 || skipped[0] != r.ID()) {
+			t.Errorf("g.Add(%d) = %v; want list starting with %d", r.ID(), skipped, r.ID())
+		}
+		if !idSetsEqual(skipped, wantSkipped) {
+			t.Errorf("g.Add(%d) = %v; want %v", r.ID(), skipped, wantSkipped)
+		}
+	}
+
+	t.Run("forward reference", func(t *testing.T) {
+		g := NewIncremental()
+		mustAdd(g, newResource(2, 1))
+		if ready := g.Ready(); len(ready) != 0 {
+			t.Errorf("g.Ready() = %v; want []", ready)
+		}
+		mustAdd(g, newResource(1))
+		if ready := g.Ready(); !idSetsEqual(ready, []uint64{1}) {
+			t.Errorf("g.Ready() = %v; want [1]", ready)
+		}
+		g.Mark(1)
+		if ready := g.Ready(); !idSetsEqual(ready, []uint64{2}) {
+			t.Errorf("g.Ready() = %v; want [2]", ready)
+		}
+		g.Mark(2)
+		if g.Done() {
+			t.Error("g.Done() = true before Close")
+		}
+		if err := g.Close(); err != nil {
+			t.Error("g.Close():", err)
+		}
+		if !g.Done() {
+			t.Error("g.Done() = false after Close")
+		}
+	})
+	t.Run("dependency already marked", func(t *testing.T) {
+		g := NewIncremental()
+		mustAdd(g, newResource(1))
+		g.Mark(1)
+		mustAdd(g, newResource(2, 1))
+		if ready := g.Ready(); !idSetsEqual(ready, []uint64{2}) {
+			t.Errorf("g.Ready() = %v; want [2]", ready)
+		}
+	})
+	t.Run("dependency already failed", func(t *testing.T) {
+		g := NewIncremental()
+		mustAdd(g, newResource(1))
+		mustAdd(g, newResource(2, 1))
+		if skipped := g.MarkFailure(1); !idSetsEqual(skipped, []uint64{2}) {
+			t.Errorf("g.MarkFailure(1) = %v; want [2]", skipped)
+		}
+		mustAdd(g, newResource(3, 2), 3)
+		mustAdd(g, newResource(4))
+		if ready := g.Ready(); !idSetsEqual(ready, []uint64{4}) {
+			t.Errorf("g.Ready() = %v; want [4]", ready)
+		}
+	})
+	t.Run("forward reference to skipped resource", func(t *testing.T) {
+		g := NewIncremental()
+		mustAdd(g, newResource(1))
+		mustAdd(g, newResource(4, 3))
+		mustAdd(g, newResource(5, 4))
+		mustAdd(g, newResource(6))
+		if skipped := g.MarkFailure(1); len(skipped) != 0 {
+			t.Errorf("g.MarkFailure(1) = %v; want []", skipped)
+		}
+		mustAdd(g, newResource(2, 1), 2)
+		mustAdd(g, newResource(3, 2), 3, 4, 5)
+		if err := g.Close(); err != nil {
+			t.Fatal("g.Close():", err)
+		}
+		if ready := g.Ready(); !idSetsEqual(ready, []uint64{6}) {
+			t.Errorf("g.Ready() = %v; want [6]", ready)
+		}
+		g.Mark(6)
+		if !g.Done() {
+			t.Error("g.Done() = false after marking the only resource not skipped")
+		}
+	})
+	t.Run("unknown dependency", func(t *testing.T) {
+		g := NewIncremental()
+		mustAdd(g, newResource(2, 1))
+		if err := g.Close(); err == nil {
+			t.Error("g.Close() did not return error")
+		}
+	})
+	t.Run("duplicate", func(t *testing.T) {
+		g := NewIncremental()
+		mustAdd(g, newResource(1))
+		if _, err := g.Add(newResource(1)); err == nil {
+			t.Error("g.Add did not return error for duplicate ID")
+		}
+	})
+}
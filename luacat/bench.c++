@@ -0,0 +1,434 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for the stages of compiling a catalog.
+//
+// Each benchmark runs against a synthetic script whose shape is set by
+// flags, so that a regression can be narrowed down to a stage and to
+// the kind of input that triggers it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/main.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+#include "capnp/message.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "catalog.capnp.h"
+#include "catalog.luaconv.h"
+#include "luacat/convert.h"
+#include "luacat/idhash.h"
+#include "luacat/main.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+
+struct ScriptShape {
+  uint64_t resources = 10000;
+  uint64_t fanOut = 4;  // dependencies per resource
+  uint64_t contentSize = 256;  // bytes of content per file
+  uint64_t envLength = 8;  // environment variables per exec
+};
+
+kj::String generatePrelude(const ScriptShape& shape) {
+  // Lua that builds the arguments for each mcm.resource call in the
+  // globals names, deps, and res.  Even resources are files and odd
+  // ones are execs.
+
+  return kj::str(
+      "names, deps, res = {}, {}, {}\n"
+      "local content = string.rep('x', ", shape.contentSize, ")\n"
+      "for i = 1, ", shape.resources, " do\n"
+      "  names[i] = 'resource-' .. i\n"
+      "  local d = {}\n"
+      "  for j = 1, math.min(", shape.fanOut, ", i - 1) do d[j] = 'resource-' .. (i - j) end\n"
+      "  deps[i] = d\n"
+      "  if i % 2 == 0 then\n"
+      "    res[i] = mcm.file{path = '/srv/data/file' .. i, plain = {content = content}}\n"
+      "  else\n"
+      "    local env = {}\n"
+      "    for j = 1, ", shape.envLength, " do env[j] = {name = 'VAR' .. j, value = 'value-' .. i} end\n"
+      "    res[i] = mcm.exec{command = {argv = {'/usr/bin/env', 'build', tostring(i)}, environment = env}}\n"
+      "  end\n"
+      "end\n");
+}
+
+const char declareAll[] =
+    "for i = 1, #names do mcm.resource(names[i], deps[i], res[i]) end\n";
+
+const char buildEntries[] =
+    "entries = {}\n"
+    "for i = 1, #names do entries[i] = {names[i], deps[i], res[i]} end\n";
+
+const char declareEntries[] = "mcm.resources(entries)\n";
+
+kj::String generateStrings(const ScriptShape& shape) {
+  // Lua that fills the global strs with one string per resource, each
+  // contentSize bytes with a shell quote and regex specials mixed in,
+  // and defines the Lua versions of shlib.quote and
+  // configs.escapeRegex that the native helpers replaced.
+
+  return kj::str(
+      "strs = {}\n"
+      "local unit = \"ab'c d/.$\"\n"
+      "local s = string.rep(unit, ", shape.contentSize, " // #unit + 1):sub(1, ", shape.contentSize, ")\n"
+      "for i = 1, ", shape.resources, " do strs[i] = s .. i end\n"
+      "function luaQuote(s)\n"
+      "  if s == '' then return \"''\" end\n"
+      "  if not s:find('[^-_/.A-Za-z0-9]') then return s end\n"
+      "  local parts = {\"'\"}\n"
+      "  local i = 1\n"
+      "  while i <= #s do\n"
+      "    local j = s:find(\"'\", i)\n"
+      "    if not j then parts[#parts+1] = s:sub(i) break end\n"
+      "    parts[#parts+1] = s:sub(i, j-1)\n"
+      "    parts[#parts+1] = \"'\\\\''\"\n"
+      "    i = j + 1\n"
+      "  end\n"
+      "  parts[#parts+1] = \"'\"\n"
+      "  return table.concat(parts)\n"
+      "end\n"
+      "function luaEscapeRegex(s)\n"
+      "  local parts = {}\n"
+      "  local i = 1\n"
+      "  while i <= #s do\n"
+      "    local j = s:find('[/.[\\\\*^$]', i)\n"
+      "    if not j then parts[#parts+1] = s:sub(i) break end\n"
+      "    parts[#parts+1] = s:sub(i, j-1)\n"
+      "    parts[#parts+1] = '\\\\'\n"
+      "    parts[#parts+1] = s:sub(j, j)\n"
+      "    i = j + 1\n"
+      "  end\n"
+      "  return table.concat(parts)\n"
+      "end\n");
+}
+
+const char* const stringBenchmarks[][2] = {
+  {"shquote", "local q = mcm.shquote for i = 1, #strs do q(strs[i]) end\n"},
+  {"shquoteLua", "for i = 1, #strs do luaQuote(strs[i]) end\n"},
+  {"escapeRegex", "local e = mcm.escapeRegex for i = 1, #strs do e(strs[i]) end\n"},
+  {"escapeRegexLua", "for i = 1, #strs do luaEscapeRegex(strs[i]) end\n"},
+  {"buffer", "local b = mcm.buffer() for i = 1, #strs do b:add(strs[i], '\\n') end b:tostring()\n"},
+  {"tableConcat",
+   "local t = {} for i = 1, #strs do t[#t+1] = strs[i] t[#t+1] = '\\n' end table.concat(t)\n"},
+};
+
+uint64_t nowNanos() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+void run(lua_State* state, kj::StringPtr script) {
+  if (luaL_loadbuffer(state, script.begin(), script.size(), "=bench") != LUA_OK ||
+      lua_pcall(state, 0, 0, 0) != LUA_OK) {
+    KJ_FAIL_ASSERT("benchmark script failed", luaStringPtr(state, -1));
+  }
+}
+
+class NullOutputStream: public kj::OutputStream {
+public:
+  void write(const void* buffer, size_t size) override {
+    count += size;
+  }
+
+  uint64_t count = 0;
+};
+
+class Bench {
+public:
+  explicit Bench(kj::ProcessContext& context)
+      : context(context), mainObject(context, kj::str(), discard, discard) {}
+  KJ_DISALLOW_COPY(Bench);
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "mcm-luacat benchmarks",
+            "Times each stage of compiling a synthetic catalog script and "
+            "prints resources (or hashes) per second and bytes per second.  "
+            "Runs every benchmark unless some are named.  Benchmarks: "
+            "idHash, idHashes, copyStruct, resource, writeMessage, "
+            "writePackedMessage, process, shquote, shquoteLua, escapeRegex, "
+            "escapeRegexLua, buffer, tableConcat.")
+        .addOptionWithArg({'n', "resources"}, KJ_BIND_METHOD(*this, setResources),
+            "N", "Declare N resources in the script.")
+        .addOptionWithArg({"fan-out"}, KJ_BIND_METHOD(*this, setFanOut),
+            "N", "Give each resource N dependencies.")
+        .addOptionWithArg({"content-size"}, KJ_BIND_METHOD(*this, setContentSize),
+            "BYTES", "Give each file BYTES of content.")
+        .addOptionWithArg({"env"}, KJ_BIND_METHOD(*this, setEnvLength),
+            "N", "Give each exec N environment variables.")
+        .addOptionWithArg({'t', "min-time"}, KJ_BIND_METHOD(*this, setMinTime),
+            "MS", "Repeat each benchmark for at least MS milliseconds.")
+        .expectZeroOrMoreArgs("<benchmark>", KJ_BIND_METHOD(*this, addFilter))
+        .callAfterParsing(KJ_BIND_METHOD(*this, runAll))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  NullOutputStream discard;
+  Main mainObject;
+  ScriptShape shape;
+  uint64_t minNanos = 1000000000;
+  kj::Vector<kj::String> filters;
+  uint64_t catalogBytes = 0;  // encoded size of the script's catalog
+
+  kj::MainBuilder::Validity parseCount(kj::StringPtr arg, uint64_t& out) {
+    char* end;
+    unsigned long long n = strtoull(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0') {
+      return kj::str("invalid count '", arg, "'");
+    }
+    out = n;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setResources(kj::StringPtr arg) {
+    return parseCount(arg, shape.resources);
+  }
+
+  kj::MainBuilder::Validity setFanOut(kj::StringPtr arg) {
+    return parseCount(arg, shape.fanOut);
+  }
+
+  kj::MainBuilder::Validity setContentSize(kj::StringPtr arg) {
+    return parseCount(arg, shape.contentSize);
+  }
+
+  kj::MainBuilder::Validity setEnvLength(kj::StringPtr arg) {
+    return parseCount(arg, shape.envLength);
+  }
+
+  kj::MainBuilder::Validity setMinTime(kj::StringPtr arg) {
+    uint64_t ms = 0;
+    auto result = parseCount(arg, ms);
+    minNanos = ms * 1000000;
+    return result;
+  }
+
+  kj::MainBuilder::Validity addFilter(kj::StringPtr name) {
+    filters.add(kj::heapString(name));
+    return true;
+  }
+
+  bool selected(kj::StringPtr name) {
+    if (filters.size() == 0) {
+      return true;
+    }
+    for (auto& f : filters) {
+      if (f == name) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <typename Setup, typename Body>
+  void measure(kj::StringPtr name, kj::StringPtr unit, uint64_t items, uint64_t bytes,
+               Setup&& setup, Body&& body) {
+    // Run body on a fresh result of setup until minNanos have been
+    // spent in body, after one untimed warm-up run.
+
+    if (!selected(name)) {
+      return;
+    }
+    {
+      auto fixture = setup();
+      body(fixture);
+    }
+    uint64_t iters = 0;
+    uint64_t total = 0;
+    do {
+      auto fixture = setup();
+      uint64_t start = nowNanos();
+      body(fixture);
+      total += nowNanos() - start;
+      iters++;
+    } while (total < minNanos);
+    double secs = double(total) / 1e9 / iters;
+    printf("%-20s %8llu iters %10.3f ms/iter %12.0f %s/s %10.1f MB/s\n",
+           name.cStr(), (unsigned long long)iters, secs * 1e3,
+           double(items) / secs, unit.cStr(), double(bytes) / secs / 1e6);
+    fflush(stdout);
+  }
+
+  struct LuaFixture {
+    // An interpreter that has run the prelude.
+
+    kj::Own<capnp::MallocMessageBuilder> message;
+    kj::Own<Interpreter> interp;
+  };
+
+  LuaFixture newLuaFixture(kj::StringPtr prelude) {
+    LuaFixture f;
+    f.message = kj::heap<capnp::MallocMessageBuilder>();
+    f.interp = kj::heap<Interpreter>();
+    f.interp->getLibState().setMessage(*f.message);
+    run(f.interp->getState(), prelude);
+    return f;
+  }
+
+  void benchIdHash() {
+    kj::Vector<kj::String> strings(shape.resources);
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < shape.resources; i++) {
+      strings.add(kj::str("resource-", i));
+      bytes += strings[i].size();
+    }
+    auto ptrs = KJ_MAP(s, strings) { return kj::StringPtr(s); };
+    auto ids = kj::heapArray<uint64_t>(ptrs.size());
+    auto noSetup = []() { return 0; };
+    measure("idHash", "hashes", ptrs.size(), bytes, noSetup, [&](int) {
+      for (size_t i = 0; i < ptrs.size(); i++) {
+        ids[i] = idHash(ptrs[i]);
+      }
+    });
+    measure("idHashes", "hashes", ptrs.size(), bytes, noSetup, [&](int) {
+      idHashes(ptrs, ids);
+    });
+  }
+
+  void benchCopyStruct(kj::StringPtr prelude) {
+    measure("copyStruct", "resources", shape.resources, catalogBytes,
+        [&]() { return newLuaFixture(prelude); },
+        [&](LuaFixture& f) {
+          lua_State* state = f.interp->getState();
+          auto orphanage = f.message->getOrphanage();
+          lua_getglobal(state, "res");
+          for (uint64_t i = 1; i <= shape.resources; i++) {
+            lua_geti(state, -1, i);
+            auto r = orphanage.newOrphan<Resource>();
+            if (i % 2 == 0) {
+              copyStruct(state, r.get().initFile());
+            } else {
+              copyStruct(state, r.get().initExec());
+            }
+            lua_pop(state, 1);
+          }
+          lua_pop(state, 1);
+        });
+  }
+
+  void benchResource(kj::StringPtr prelude) {
+    measure("resource", "resources", shape.resources, catalogBytes,
+        [&]() { return newLuaFixture(prelude); },
+        [&](LuaFixture& f) {
+          run(f.interp->getState(), declareAll);
+          KJ_ASSERT(f.interp->getLibState().releaseResources().size() == shape.resources);
+        });
+    measure("resources", "resources", shape.resources, catalogBytes,
+        [&]() {
+          auto f = newLuaFixture(prelude);
+          run(f.interp->getState(), buildEntries);
+          return f;
+        },
+        [&](LuaFixture& f) {
+          run(f.interp->getState(), declareEntries);
+          KJ_ASSERT(f.interp->getLibState().releaseResources().size() == shape.resources);
+        });
+  }
+
+  void benchStrings() {
+    // The native string helpers against the Lua code they replaced.
+
+    auto prelude = generateStrings(shape);
+    uint64_t bytes = shape.resources * shape.contentSize;
+    for (auto& b : stringBenchmarks) {
+      kj::StringPtr body = b[1];
+      measure(b[0], "strings", shape.resources, bytes,
+          [&]() { return newLuaFixture(prelude); },
+          [&](LuaFixture& f) { run(f.interp->getState(), body); });
+    }
+  }
+
+  void benchWrite(kj::StringPtr script) {
+    capnp::MallocMessageBuilder message;
+    kj::ArrayInputStream stream(script.asBytes());
+    mainObject.process(message, "=bench", stream);
+    NullOutputStream packedSize;
+    capnp::writePackedMessage(packedSize, message);
+
+    // Write into memory, so that the segments are really copied.
+    auto buf = kj::heapArray<kj::byte>(catalogBytes);
+    auto noSetup = []() { return 0; };
+    measure("writeMessage", "resources", shape.resources, catalogBytes, noSetup, [&](int) {
+      kj::ArrayOutputStream out(buf);
+      capnp::writeMessage(out, message);
+    });
+    measure("writePackedMessage", "resources", shape.resources, packedSize.count, noSetup, [&](int) {
+      kj::ArrayOutputStream out(buf);
+      capnp::writePackedMessage(out, message);
+    });
+  }
+
+  void benchProcess(kj::StringPtr script) {
+    // The segment table may differ from the first run's, so leave room.
+    auto buf = kj::heapArray<kj::byte>(catalogBytes + 4096);
+    measure("process", "resources", shape.resources, catalogBytes,
+        []() { return 0; },
+        [&](int) {
+          capnp::MallocMessageBuilder message(mainObject.firstSegmentWords());
+          kj::ArrayInputStream stream(script.asBytes());
+          mainObject.process(message, "=bench", stream);
+          kj::ArrayOutputStream out(buf);
+          capnp::writeMessage(out, message);
+        });
+  }
+
+  kj::MainBuilder::Validity runAll() {
+    auto prelude = generatePrelude(shape);
+    auto script = kj::str(prelude, declareAll);
+    {
+      capnp::MallocMessageBuilder message;
+      kj::ArrayInputStream stream(script.asBytes());
+      mainObject.process(message, "=bench", stream);
+      catalogBytes = capnp::computeSerializedSizeInWords(message) * sizeof(capnp::word);
+    }
+    printf("%llu resources, fan-out %llu, %llu-byte contents, %llu env vars: %llu-byte catalog\n",
+           (unsigned long long)shape.resources, (unsigned long long)shape.fanOut,
+           (unsigned long long)shape.contentSize, (unsigned long long)shape.envLength,
+           (unsigned long long)catalogBytes);
+
+    benchIdHash();
+    benchCopyStruct(prelude);
+    benchResource(prelude);
+    benchWrite(script);
+    benchProcess(script);
+    benchStrings();
+    return true;
+  }
+};
+
+}  // namespace
+}  // namespace luacat
+}  // namespace mcm
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext context(argv[0]);
+  mcm::luacat::Bench bench(context);
+  return kj::runMainAndExit(context, bench.getMain(), argc, argv);
+}
@@ -0,0 +1,513 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// capnpc-luaconv is a Cap'n Proto compiler plugin that generates
+// Lua-to-Cap'n Proto converters for every struct in a schema file.
+// For foo.capnp it writes foo.luaconv.h and foo.luaconv.c++, which
+// declare a copyStruct overload in mcm::luacat for each struct and
+// group.  The generated functions accept the same Lua values as the
+// reflective copyStruct in convert.h, but dispatch on field names and
+// call typed setters directly.  Fields whose struct has no generated
+// overload fall back to the reflective copyStruct.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <map>
+#include <set>
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/main.h"
+#include "kj/string.h"
+#include "kj/string-tree.h"
+#include "kj/vector.h"
+#include "capnp/schema.capnp.h"
+#include "capnp/schema-loader.h"
+#include "capnp/serialize.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+
+const uint64_t namespaceAnnotationId = 0xb9c6f99ebf805f2cull;
+const uint64_t nameAnnotationId = 0xf264a779fef191ceull;
+
+template <typename P>
+kj::Maybe<capnp::schema::Value::Reader> annotationValue(P proto, uint64_t id) {
+  for (auto annotation : proto.getAnnotations()) {
+    if (annotation.getId() == id) {
+      return annotation.getValue();
+    }
+  }
+  return nullptr;
+}
+
+template <typename P>
+kj::StringPtr cppName(P proto) {
+  // The name capnpc-c++ uses for a node, field, or enumerant.
+
+  KJ_IF_MAYBE(name, annotationValue(proto, nameAnnotationId)) {
+    return name->getText();
+  }
+  return proto.getName();
+}
+
+kj::String toTitleCase(kj::StringPtr name) {
+  kj::String result = kj::heapString(name);
+  if ('a' <= result[0] && result[0] <= 'z') {
+    result[0] = result[0] - 'a' + 'A';
+  }
+  return result;
+}
+
+kj::String toUpperCase(kj::StringPtr name) {
+  kj::Vector<char> result(name.size() + 4);
+  for (char c : name) {
+    if ('a' <= c && c <= 'z') {
+      result.add(c - 'a' + 'A');
+    } else if (result.size() > 0 && 'A' <= c && c <= 'Z') {
+      result.add('_');
+      result.add(c);
+    } else {
+      result.add(c);
+    }
+  }
+  if (result.size() == 4 && memcmp(result.begin(), "NULL", 4) == 0) {
+    result.add('_');
+  }
+  result.add('\0');
+  return kj::String(result.releaseAsArray());
+}
+
+kj::StringPtr shortName(capnp::Schema schema) {
+  auto proto = schema.getProto();
+  return proto.getDisplayName().slice(proto.getDisplayNamePrefixLength());
+}
+
+class LuaconvMain {
+public:
+  explicit LuaconvMain(kj::ProcessContext& context): context(context) {}
+  KJ_DISALLOW_COPY(LuaconvMain);
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "mcm Lua converter plugin",
+          "Generates Lua-to-Cap'n Proto converters for mcm-luacat.  "
+          "It is meant to be run using the Cap'n Proto compiler, e.g.:\n"
+          "    capnp compile -oluaconv foo.capnp")
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  capnp::SchemaLoader loader;
+
+  // Per-file output.
+  kj::Vector<kj::StringTree> decls;
+  kj::Vector<kj::StringTree> defs;
+  std::map<uint64_t, kj::String> enumFuncs;  // enum ID -> generated function name
+  kj::Vector<kj::StringTree> enumDefs;
+  std::set<uint64_t> visited;
+  uint64_t fileId = 0;
+
+  uint64_t fileOf(capnp::Schema schema) {
+    auto proto = schema.getProto();
+    while (proto.getScopeId() != 0) {
+      proto = loader.get(proto.getScopeId()).getProto();
+    }
+    return proto.getId();
+  }
+
+  kj::String qualifiedName(capnp::Schema schema) {
+    // Returns the fully qualified C++ type name of a non-generic node.
+
+    auto proto = schema.getProto();
+    if (proto.getScopeId() == 0) {
+      KJ_IF_MAYBE(ns, annotationValue(proto, namespaceAnnotationId)) {
+        return kj::str(" ::", ns->getText());
+      }
+      return kj::str(" ");
+    }
+    auto parent = loader.get(proto.getScopeId());
+    kj::StringPtr name;
+    kj::String ownName;
+    for (auto nested : parent.getProto().getNestedNodes()) {
+      if (nested.getId() == proto.getId()) {
+        KJ_IF_MAYBE(annotated, annotationValue(proto, nameAnnotationId)) {
+          name = annotated->getText();
+        } else {
+          name = nested.getName();
+        }
+        break;
+      }
+    }
+    if (name == nullptr && parent.getProto().isStruct()) {
+      for (auto field : parent.getProto().getStruct().getFields()) {
+        if (field.isGroup() && field.getGroup().getTypeId() == proto.getId()) {
+          ownName = toTitleCase(cppName(field));
+          name = ownName;
+          break;
+        }
+      }
+    }
+    KJ_REQUIRE(name != nullptr, "node not found in its scope", proto.getDisplayName());
+    auto prefix = qualifiedName(parent);
+    if (prefix == " ") {
+      return kj::str(" ::", name);
+    }
+    return kj::str(prefix, "::", name);
+  }
+
+  kj::StringPtr enumFunc(capnp::EnumSchema schema) {
+    auto id = schema.getProto().getId();
+    auto iter = enumFuncs.find(id);
+    if (iter != enumFuncs.end()) {
+      return iter->second;
+    }
+    kj::StringPtr path = schema.getProto().getDisplayName();
+    KJ_IF_MAYBE(colon, path.findFirst(':')) {
+      path = path.slice(*colon + 1);
+    }
+    kj::Vector<char> chars(path.size() + 3);
+    chars.addAll(kj::StringPtr("to"));
+    for (char c : path) {
+      if (c != '.') {
+        chars.add(c);
+      }
+    }
+    chars.add('\0');
+    kj::String name(chars.releaseAsArray());
+    auto typeName = qualifiedName(schema);
+    kj::Vector<kj::StringTree> cases;
+    for (auto e : schema.getEnumerants()) {
+      cases.add(kj::strTree(
+          "  if (sval == \"", e.getProto().getName(), "\") {\n"
+          "    return", typeName, "::", toUpperCase(cppName(e.getProto())), ";\n"
+          "  }\n"));
+    }
+    enumDefs.add(kj::strTree(
+        typeName, " ", name, "(lua_State* state, bool element) {\n"
+        "  auto sval = luaconv::toText(state, element);\n",
+        kj::StringTree(cases.releaseAsArray(), ""),
+        "  KJ_FAIL_REQUIRE(\"could not find enum value\", sval);\n"
+        "}\n\n"));
+    kj::StringPtr result = name;
+    enumFuncs.insert(std::make_pair(id, kj::mv(name)));
+    return result;
+  }
+
+  kj::StringTree scalar(capnp::Type type, kj::StringPtr element) {
+    // Returns an expression that converts the value at the top of the
+    // stack, or an empty tree if the type is not a scalar.
+
+    switch (type.which()) {
+    case capnp::schema::Type::BOOL:
+      return kj::strTree("luaconv::toBool(state, ", element, ")");
+    case capnp::schema::Type::INT8:
+      return kj::strTree("luaconv::toSigned<int8_t>(state, ", element, ")");
+    case capnp::schema::Type::INT16:
+      return kj::strTree("luaconv::toSigned<int16_t>(state, ", element, ")");
+    case capnp::schema::Type::INT32:
+      return kj::strTree("luaconv::toSigned<int32_t>(state, ", element, ")");
+    case capnp::schema::Type::INT64:
+      return kj::strTree("luaconv::toSigned<int64_t>(state, ", element, ")");
+    case capnp::schema::Type::UINT8:
+      return kj::strTree("luaconv::toUnsigned<uint8_t>(state, ", element, ")");
+    case capnp::schema::Type::UINT16:
+      return kj::strTree("luaconv::toUnsigned<uint16_t>(state, ", element, ")");
+    case capnp::schema::Type::UINT32:
+      return kj::strTree("luaconv::toUnsigned<uint32_t>(state, ", element, ")");
+    case capnp::schema::Type::UINT64:
+      return kj::strTree("luaconv::toUInt64(state, ", element, ")");
+    case capnp::schema::Type::FLOAT32:
+      return kj::strTree("static_cast<float>(luaconv::toFloat(state, ", element, "))");
+    case capnp::schema::Type::FLOAT64:
+      return kj::strTree("luaconv::toFloat(state, ", element, ")");
+    case capnp::schema::Type::TEXT:
+      return kj::strTree("luaconv::toText(state, ", element, ")");
+    case capnp::schema::Type::DATA:
+      return kj::strTree("luaconv::toData(state, ", element, ")");
+    case capnp::schema::Type::ENUM:
+      return kj::strTree(enumFunc(type.asEnum()), "(state, ", element, ")");
+    default:
+      return kj::strTree();
+    }
+  }
+
+  static kj::StringPtr listContext(capnp::Type type) {
+    // Mirrors the KJ_CONTEXT descriptions in copyList.
+
+    switch (type.which()) {
+    case capnp::schema::Type::BOOL:
+      return "List(Bool)";
+    case capnp::schema::Type::INT8:
+    case capnp::schema::Type::INT16:
+    case capnp::schema::Type::INT32:
+    case capnp::schema::Type::INT64:
+      return "List(Int)";
+    case capnp::schema::Type::UINT8:
+    case capnp::schema::Type::UINT16:
+    case capnp::schema::Type::UINT32:
+      return "List(UInt)";
+    case capnp::schema::Type::UINT64:
+      return "List(UInt64)";
+    case capnp::schema::Type::FLOAT32:
+    case capnp::schema::Type::FLOAT64:
+      return "List(Float)";
+    case capnp::schema::Type::TEXT:
+      return "List(Text)";
+    case capnp::schema::Type::DATA:
+      return "List(Data)";
+    case capnp::schema::Type::LIST:
+      return "List(List(...))";
+    case capnp::schema::Type::ENUM:
+      return "List(enum)";
+    case capnp::schema::Type::STRUCT:
+      return "List(struct)";
+    default:
+      return nullptr;
+    }
+  }
+
+  kj::StringTree listLoop(capnp::ListSchema schema, uint depth, kj::StringPtr indent) {
+    // Returns statements that fill list l<depth> from the table at the
+    // top of the stack.
+
+    auto type = schema.getElementType();
+    auto ctx = listContext(type);
+    if (type.which() == capnp::schema::Type::VOID) {
+      return kj::strTree();
+    }
+    auto list = kj::str('l', depth);
+    auto index = kj::str('i', depth);
+    if (ctx == nullptr) {
+      return kj::strTree(
+          indent, "KJ_REQUIRE(", list, ".size() == 0, \"can't map type to Lua\", ",
+          static_cast<int>(type.which()), ");\n");
+    }
+    kj::StringTree contextArgs = kj::strTree("\"", ctx, "\", ", index);
+    if (type.which() == capnp::schema::Type::ENUM) {
+      contextArgs = kj::strTree(kj::mv(contextArgs), ", \"", shortName(type.asEnum()), "\"");
+    } else if (type.which() == capnp::schema::Type::STRUCT) {
+      contextArgs = kj::strTree(kj::mv(contextArgs), ", \"", shortName(type.asStruct()), "\"");
+    }
+    auto inner = kj::str(indent, "  ");
+    kj::StringTree body;
+    switch (type.which()) {
+    case capnp::schema::Type::LIST:
+      body = kj::strTree(
+          inner, "auto l", depth + 1, " = ", list, ".init(", index,
+              ", luaconv::tableLen(state, true));\n",
+          listLoop(type.asList(), depth + 1, inner));
+      break;
+    case capnp::schema::Type::STRUCT:
+      body = kj::strTree(
+          inner, "luaconv::requireTable(state, true);\n",
+          inner, "copyStruct(state, ", list, "[", index, "]);\n");
+      break;
+    default:
+      body = kj::strTree(inner, list, ".set(", index, ", ", scalar(type, "true"), ");\n");
+      break;
+    }
+    return kj::strTree(
+        indent, "for (capnp::uint ", index, " = 0; ", index, " < ", list, ".size(); ",
+            index, "++) {\n",
+        inner, "KJ_CONTEXT(", kj::mv(contextArgs), ");\n",
+        inner, "luaconv::pushElement(state, ", index, ");\n",
+        kj::mv(body),
+        inner, "lua_pop(state, 1);\n",
+        indent, "}\n");
+  }
+
+  kj::StringTree fieldBody(capnp::StructSchema::Field field, kj::StringPtr indent) {
+    auto type = field.getType();
+    auto title = toTitleCase(cppName(field.getProto()));
+    switch (type.which()) {
+    case capnp::schema::Type::VOID:
+      return kj::strTree(indent, "builder.set", title, "();\n");
+    case capnp::schema::Type::LIST:
+      return kj::strTree(
+          indent, "auto l0 = builder.init", title, "(luaconv::tableLen(state, false));\n",
+          listLoop(type.asList(), 0, indent));
+    case capnp::schema::Type::STRUCT:
+      if (fileOf(type.asStruct()) == fileId) {
+        addStruct(type.asStruct());
+      }
+      return kj::strTree(
+          indent, "luaconv::requireTable(state, false);\n",
+          indent, "copyStruct(state, builder.init", title, "());\n");
+    default:
+      {
+        auto value = scalar(type, "false");
+        if (value.size() == 0) {
+          return kj::strTree(
+              indent, "KJ_FAIL_REQUIRE(\"can't map field type to Lua\", ",
+              static_cast<int>(type.which()), ");\n");
+        }
+        return kj::strTree(indent, "builder.set", title, "(", kj::mv(value), ");\n");
+      }
+    }
+  }
+
+  void addStruct(capnp::StructSchema schema) {
+    auto proto = schema.getProto();
+    if (proto.getIsGeneric() || !visited.insert(proto.getId()).second) {
+      return;
+    }
+    auto typeName = qualifiedName(schema);
+    decls.add(kj::strTree("void copyStruct(lua_State* state,", typeName, "::Builder builder);\n"));
+
+    kj::Vector<kj::StringTree> cases;
+    for (auto field : schema.getFields()) {
+      cases.add(kj::strTree(
+          cases.size() == 0 ? "    if" : " else if",
+          " (key == \"", field.getProto().getName(), "\") {\n",
+          fieldBody(field, "      "),
+          "    }"));
+    }
+    kj::StringTree dispatch;
+    if (cases.size() == 0) {
+      dispatch = kj::strTree("    KJ_FAIL_REQUIRE(\"could not find field\");\n");
+    } else {
+      dispatch = kj::strTree(
+          kj::StringTree(cases.releaseAsArray(), ""), " else {\n"
+          "      KJ_FAIL_REQUIRE(\"could not find field\");\n"
+          "    }\n");
+    }
+    defs.add(kj::strTree(
+        "void copyStruct(lua_State* state,", typeName, "::Builder builder) {\n"
+        "  KJ_ASSERT(lua_checkstack(state, 2), \"recursion depth exceeded\");\n"
+        "  KJ_CONTEXT(\"", shortName(schema), "\");\n"
+        "  KJ_REQUIRE(lua_istable(state, -1), \"value must be a table\");\n"
+        "  lua_pushnil(state);\n"
+        "  while (lua_next(state, -2)) {\n"
+        "    KJ_REQUIRE(lua_isstring(state, -2), \"non-string key in table\");\n"
+        "    auto key = luaStringPtr(state, -2);\n"
+        "    KJ_CONTEXT(key);\n",
+        kj::mv(dispatch),
+        "    lua_pop(state, 1);\n"
+        "  }\n"
+        "}\n\n"));
+  }
+
+  void addScope(capnp::Schema schema) {
+    // Generates converters for every struct declared in schema.
+
+    for (auto nested : schema.getProto().getNestedNodes()) {
+      auto child = loader.get(nested.getId());
+      if (child.getProto().isStruct()) {
+        addStruct(child.asStruct());
+      }
+      if (!child.getProto().getIsGeneric()) {
+        addScope(child);
+      }
+    }
+  }
+
+  void makeDirectory(kj::StringPtr path) {
+    KJ_IF_MAYBE(slash, path.findLast('/')) {
+      makeDirectory(kj::str(path.slice(0, *slash)));
+    }
+    if (mkdir(path.cStr(), 0777) < 0) {
+      int error = errno;
+      if (error != EEXIST) {
+        KJ_FAIL_SYSCALL("mkdir(path)", error, path);
+      }
+    }
+  }
+
+  void writeFile(kj::StringPtr filename, const kj::StringTree& text) {
+    KJ_IF_MAYBE(slash, filename.findLast('/')) {
+      makeDirectory(kj::str(filename.slice(0, *slash)));
+    }
+    int fd;
+    KJ_SYSCALL(fd = open(filename.cStr(), O_CREAT | O_WRONLY | O_TRUNC, 0666), filename);
+    kj::FdOutputStream out((kj::AutoCloseFd(fd)));
+    text.visit([&](kj::ArrayPtr<const char> text) {
+      out.write(text.begin(), text.size());
+    });
+  }
+
+  kj::MainBuilder::Validity run() {
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = 1 << 30;
+    capnp::StreamFdMessageReader reader(STDIN_FILENO, options);
+    auto request = reader.getRoot<capnp::schema::CodeGeneratorRequest>();
+    for (auto node : request.getNodes()) {
+      loader.load(node);
+    }
+
+    for (auto requestedFile : request.getRequestedFiles()) {
+      decls = kj::Vector<kj::StringTree>();
+      defs = kj::Vector<kj::StringTree>();
+      enumFuncs.clear();
+      enumDefs = kj::Vector<kj::StringTree>();
+      visited.clear();
+      fileId = requestedFile.getId();
+      addScope(loader.get(requestedFile.getId()));
+
+      kj::StringPtr filename = requestedFile.getFilename();
+      auto base = kj::heapString(filename.endsWith(".capnp") ?
+          filename.slice(0, filename.size() - 6) : filename.asArray());
+      auto guard = kj::str("LUACONV_", KJ_MAP(c, base) -> char {
+        if ('a' <= c && c <= 'z') {
+          return c - 'a' + 'A';
+        } else if (('A' <= c && c <= 'Z') || ('0' <= c && c <= '9')) {
+          return c;
+        }
+        return '_';
+      }, "_H_");
+      writeFile(kj::str(base, ".luaconv.h"), kj::strTree(
+          "// Generated by capnpc-luaconv from ", requestedFile.getFilename(), ".  DO NOT EDIT.\n\n"
+          "#ifndef ", guard, "\n"
+          "#define ", guard, "\n\n"
+          "#include \"", requestedFile.getFilename(), ".h\"\n\n"
+          "struct lua_State;\n\n"
+          "namespace mcm {\n"
+          "namespace luacat {\n\n",
+          kj::StringTree(decls.releaseAsArray(), ""),
+          "\n"
+          "}  // namespace luacat\n"
+          "}  // namespace mcm\n\n"
+          "#endif  // ", guard, "\n"));
+      writeFile(kj::str(base, ".luaconv.c++"), kj::strTree(
+          "// Generated by capnpc-luaconv from ", requestedFile.getFilename(), ".  DO NOT EDIT.\n\n"
+          "#include \"", base, ".luaconv.h\"\n\n"
+          "#include \"kj/debug.h\"\n"
+          "#include \"lua.hpp\"\n\n"
+          "#include \"luacat/convert.h\"\n"
+          "#include \"luacat/luaconv.h\"\n\n"
+          "namespace mcm {\n"
+          "namespace luacat {\n\n",
+          enumDefs.size() == 0 ? kj::strTree() : kj::strTree(
+              "namespace {\n\n",
+              kj::StringTree(enumDefs.releaseAsArray(), ""),
+              "}  // namespace\n\n"),
+          kj::StringTree(defs.releaseAsArray(), ""),
+          "}  // namespace luacat\n"
+          "}  // namespace mcm\n"));
+    }
+    return true;
+  }
+};
+
+}  // namespace
+}  // namespace luacat
+}  // namespace mcm
+
+KJ_MAIN(mcm::luacat::LuaconvMain);
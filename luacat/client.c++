@@ -0,0 +1,165 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// mcm-luacat-client sends a script to a running mcm-luacat --serve and
+// writes the resulting catalog, just like mcm-luacat would.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/main.h"
+#include "kj/miniposix.h"
+#include "kj/vector.h"
+#include "capnp/ez-rpc.h"
+#include "capnp/message.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+
+#include "luacat/compiler.capnp.h"
+#include "luacat/io.h"
+#include "luacat/main.h"
+#include "luacat/path.h"
+#include "luacat/version.h"
+
+namespace {
+
+class ClientMain {
+public:
+  ClientMain(kj::ProcessContext& context, kj::String versionInfo):
+      context(context), versionInfo(kj::mv(versionInfo)),
+      out(kj::heap<kj::FdOutputStream>(STDOUT_FILENO)), err(STDERR_FILENO) {
+    const char* addr = getenv("MCM_LUACAT_SERVER");
+    if (addr != nullptr) {
+      serverAddress = kj::heapString(addr);
+    }
+  }
+  KJ_DISALLOW_COPY(ClientMain);
+
+  kj::MainBuilder::Validity setServerAddress(kj::StringPtr path) {
+    serverAddress = kj::heapString(path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity addIncludePath(kj::StringPtr include) {
+    includes.add(kj::heapString(include));
+    return true;
+  }
+
+  kj::MainBuilder::Validity setOutputPath(kj::StringPtr outPath) {
+    int fd;
+    KJ_SYSCALL(fd = open(outPath.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666), outPath);
+    out = kj::heap<kj::FdOutputStream>(kj::AutoCloseFd(fd));
+    return true;
+  }
+
+  kj::MainBuilder::Validity setParams(kj::StringPtr path) {
+    auto maybeExc = kj::runCatchingExceptions([&]() {
+      mcm::luacat::loadParams(path, params.initRoot<mcm::luacat::LuaValue>());
+    });
+    KJ_IF_MAYBE(e, maybeExc) {
+      return kj::str(path, ": ", e->getDescription());
+    }
+    hasParams = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPackedOutput() {
+    packed = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity compile(kj::StringPtr src) {
+    if (serverAddress.size() == 0) {
+      return kj::str("no server given; use --connect or set MCM_LUACAT_SERVER");
+    }
+    if (isatty(out->getFd())) {
+      context.exitError("mcm-luacat-client: output file is a tty\n\nWriting a binary catalog will likely mess up your terminal. Either\nredirect stdout or use -o.");
+    }
+    auto script = mcm::luacat::readFile(src);
+    capnp::EzRpcClient client(kj::str("unix:", serverAddress));
+    auto req = client.getMain<mcm::luacat::Compiler>().compileRequest();
+    req.setScript(script);
+    // The server resolves paths against its own working directory.
+    req.setPath(mcm::luacat::absolutePath(src));
+    auto incList = req.initIncludePaths(includes.size());
+    for (size_t i = 0; i < includes.size(); i++) {
+      incList.set(i, mcm::luacat::absoluteSearchPath(includes[i]));
+    }
+    if (hasParams) {
+      req.setParams(params.getRoot<mcm::luacat::LuaValue>().asReader());
+    }
+    auto maybeExc = kj::runCatchingExceptions([&]() {
+      auto resp = req.send().wait(client.getWaitScope());
+      auto output = resp.getOutput();
+      err.write(output.begin(), output.size());
+      capnp::MallocMessageBuilder message;
+      message.setRoot(resp.getCatalog());
+      if (packed) {
+        capnp::writePackedMessage(*out, message);
+      } else {
+        capnp::writeMessage(*out, message);
+      }
+    });
+    KJ_IF_MAYBE(e, maybeExc) {
+      context.error(e->getDescription());
+    }
+    return true;
+  }
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, versionInfo, "Compiles a catalog using a running mcm-luacat --serve.")
+        .addOptionWithArg({'c', "connect"}, KJ_BIND_METHOD(*this, setServerAddress),
+            "SOCKET", "Connect to the server listening on the Unix socket SOCKET. "
+            "Defaults to $MCM_LUACAT_SERVER.")
+        .addOptionWithArg({'I'}, KJ_BIND_METHOD(*this, addIncludePath),
+            "<templates>", "Add a package path template in package.searchpath format.")
+        .addOptionWithArg({'o'}, KJ_BIND_METHOD(*this, setOutputPath),
+            "FILE", "Write output to FILE instead of stdout.")
+        .addOptionWithArg({"params"}, KJ_BIND_METHOD(*this, setParams),
+            "FILE", "Pass the value returned by the Lua file FILE as the global \"params\".")
+        .addOption({"packed"}, KJ_BIND_METHOD(*this, setPackedOutput),
+            "Write the catalog in the packed Cap'n Proto encoding.")
+        .expectArg("FILE", KJ_BIND_METHOD(*this, compile))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::String versionInfo;
+  kj::Own<kj::FdOutputStream> out;
+  kj::FdOutputStream err;
+  kj::String serverAddress;
+  kj::Vector<kj::String> includes;
+  capnp::MallocMessageBuilder params;
+  bool hasParams = false;
+  bool packed = false;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext context(argv[0]);
+  kj::String versionInfo;
+  if (BUILD_EMBED_LABEL[0] != 0) {
+    versionInfo = kj::str("version ", BUILD_EMBED_LABEL);
+  } else if (strcmp(BUILD_SCM_STATUS, "Modified") == 0) {
+    versionInfo = kj::str("built from ", BUILD_SCM_REVISION, " with local modifications");
+  } else {
+    versionInfo = kj::str("built from ", BUILD_SCM_REVISION);
+  }
+  ClientMain mainObject(context, kj::mv(versionInfo));
+  return kj::runMainAndExit(context, mainObject.getMain(), argc, argv);
+}
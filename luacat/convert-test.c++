@@ -127,7 +127,7 @@ TEST(CopyStructTest, UInt64Field) {
 TEST(CopyStructTest, UInt64FieldWithId) {
   auto state = mcm::luacat::newLuaState();
   lua_createtable(state, 0, 1);
-  mcm::luacat::pushId(state, kj::heap<const mcm::luacat::Id>(42, nullptr));
+  mcm::luacat::pushId(state, 42, nullptr);
   lua_setfield(state, -2, "uint64");
   capnp::MallocMessageBuilder message;
   auto root = message.initRoot<mcm::luacat::GenericValue>();
@@ -248,7 +248,7 @@ TEST(CopyListTest, UInt64ListWithId) {
   auto state = mcm::luacat::newLuaState();
   lua_createtable(state, 0, 1);
   lua_createtable(state, 1, 0);
-  mcm::luacat::pushId(state, kj::heap<const mcm::luacat::Id>(42, nullptr));
+  mcm::luacat::pushId(state, 42, nullptr);
   lua_seti(state, -2, 1);
   lua_setfield(state, -2, "uint64List");
   capnp::MallocMessageBuilder message;
@@ -261,3 +261,32 @@ TEST(CopyListTest, UInt64ListWithId) {
   ASSERT_EQ(1, list.size());
   EXPECT_EQ(42, list[0]);
 }
+
+TEST(CopyValueTest, RoundTrip) {
+  auto state = mcm::luacat::newLuaState();
+  luaL_openlibs(state);
+  ASSERT_NO_FATAL_FAILURE(evalString(state, "{name = 'web1', port = 8080, weight = 0.5, tags = {'a', 'b'}, enabled = true}"));
+  capnp::MallocMessageBuilder message;
+  auto root = message.initRoot<mcm::luacat::LuaValue>();
+
+  copyValue(state, root);
+  lua_pop(state, 1);
+  pushLua(state, root.asReader());
+  lua_setglobal(state, "t");
+  ASSERT_NO_FATAL_FAILURE(evalString(state,
+      "t.name == 'web1' and t.port == 8080 and math.type(t.port) == 'integer' and "
+      "t.weight == 0.5 and #t.tags == 2 and t.tags[2] == 'b' and t.enabled == true"));
+
+  ASSERT_EQ(mcm::luacat::LuaValue::TABLE, root.which());
+  EXPECT_EQ(5, root.getTable().size());
+  EXPECT_TRUE(lua_toboolean(state, -1));
+}
+
+TEST(CopyValueTest, FunctionFails) {
+  auto state = mcm::luacat::newLuaState();
+  ASSERT_NO_FATAL_FAILURE(evalString(state, "{f = function() end}"));
+  capnp::MallocMessageBuilder message;
+  auto root = message.initRoot<mcm::luacat::LuaValue>();
+
+  EXPECT_ANY_THROW(copyValue(state, root));
+}
@@ -38,6 +38,100 @@ namespace {
     *size = reader.stream.tryRead(reader.buf, 1, Reader::bufSize);
     return reinterpret_cast<char*>(reader.buf);
   }
+
+  const int maxValueDepth = 64;
+
+  int readOnlyNewIndex(lua_State* state) {
+    return luaL_error(state, "attempt to modify a read-only table");
+  }
+
+  int readOnlyLen(lua_State* state) {
+    lua_pushinteger(state, luaL_len(state, lua_upvalueindex(1)));
+    return 1;
+  }
+
+  int readOnlyNext(lua_State* state) {
+    lua_settop(state, 2);
+    if (lua_next(state, 1)) {
+      return 2;
+    }
+    lua_pushnil(state);
+    return 1;
+  }
+
+  int readOnlyPairs(lua_State* state) {
+    lua_pushcfunction(state, readOnlyNext);
+    lua_pushvalue(state, lua_upvalueindex(1));
+    lua_pushnil(state);
+    return 3;
+  }
+
+  void wrapReadOnly(lua_State* state) {
+    // Replaces the table at the top of the stack with a read-only proxy.
+
+    lua_createtable(state, 0, 0);  // proxy
+    lua_createtable(state, 0, 5);  // metatable
+    lua_pushvalue(state, -3);
+    lua_setfield(state, -2, "__index");
+    lua_pushcfunction(state, readOnlyNewIndex);
+    lua_setfield(state, -2, "__newindex");
+    lua_pushvalue(state, -3);
+    lua_pushcclosure(state, readOnlyLen, 1);
+    lua_setfield(state, -2, "__len");
+    lua_pushvalue(state, -3);
+    lua_pushcclosure(state, readOnlyPairs, 1);
+    lua_setfield(state, -2, "__pairs");
+    lua_pushliteral(state, "read-only table");
+    lua_setfield(state, -2, "__metatable");
+    lua_setmetatable(state, -2);
+    lua_replace(state, -2);
+  }
+
+  void copyValue(lua_State* state, LuaValue::Builder builder, int depth) {
+    KJ_REQUIRE(depth < maxValueDepth, "tables nested too deeply (reference cycle?)");
+    KJ_ASSERT(lua_checkstack(state, 3), "recursion depth exceeded");
+    switch (lua_type(state, -1)) {
+    case LUA_TNIL:
+      builder.setNil();
+      break;
+    case LUA_TBOOLEAN:
+      builder.setBoolean(lua_toboolean(state, -1));
+      break;
+    case LUA_TNUMBER:
+      if (lua_isinteger(state, -1)) {
+        builder.setInteger(lua_tointeger(state, -1));
+      } else {
+        builder.setNumber(lua_tonumber(state, -1));
+      }
+      break;
+    case LUA_TSTRING:
+      builder.setString(luaBytePtr(state, -1));
+      break;
+    case LUA_TTABLE:
+      {
+        unsigned int n = 0;
+        lua_pushnil(state);
+        while (lua_next(state, -2)) {
+          n++;
+          lua_pop(state, 1);
+        }
+        auto entries = builder.initTable(n);
+        unsigned int i = 0;
+        lua_pushnil(state);
+        while (lua_next(state, -2)) {
+          lua_pushvalue(state, -2);
+          copyValue(state, entries[i].initKey(), depth + 1);
+          lua_pop(state, 1);
+          copyValue(state, entries[i].initValue(), depth + 1);
+          lua_pop(state, 1);
+          i++;
+        }
+      }
+      break;
+    default:
+      KJ_FAIL_REQUIRE("can't convert value to a parameter", luaL_typename(state, -1));
+    }
+  }
 }  // namespace
 
 const kj::ArrayPtr<const kj::byte> luaBytePtr(lua_State* state, int index) {
@@ -52,9 +146,17 @@ const kj::StringPtr luaStringPtr(lua_State* state, int index) {
   return kj::StringPtr(s, len);
 }
 
-int luaLoad(lua_State* state, kj::StringPtr name, kj::InputStream& stream) {
+int luaLoad(lua_State* state, kj::StringPtr name, kj::InputStream& stream, const char* mode) {
+  KJ_IF_MAYBE(a, kj::dynamicDowncastIfAvailable<kj::ArrayInputStream>(stream)) {
+    // The chunk is already in memory, so hand it to Lua without copying.
+    auto buf = a->tryGetReadBuffer();
+    int status = luaL_loadbufferx(state, reinterpret_cast<const char*>(buf.begin()), buf.size(),
+                                  name.cStr(), mode);
+    a->skip(buf.size());
+    return status;
+  }
   Reader reader(stream);
-  return lua_load(state, readStream, &reader, name.cStr(), NULL);
+  return lua_load(state, readStream, &reader, name.cStr(), mode);
 }
 
 void pushLua(lua_State* state, kj::Exception& e) {
@@ -185,6 +287,51 @@ void copyStruct(lua_State* state, capnp::DynamicStruct::Builder builder) {
   }
 }
 
+void copyValue(lua_State* state, LuaValue::Builder builder) {
+  copyValue(state, builder, 0);
+}
+
+void pushLua(lua_State* state, LuaValue::Reader value) {
+  KJ_ASSERT(lua_checkstack(state, 3), "recursion depth exceeded");
+  switch (value.which()) {
+  case LuaValue::NIL:
+    lua_pushnil(state);
+    break;
+  case LuaValue::BOOLEAN:
+    lua_pushboolean(state, value.getBoolean());
+    break;
+  case LuaValue::INTEGER:
+    lua_pushinteger(state, value.getInteger());
+    break;
+  case LuaValue::NUMBER:
+    lua_pushnumber(state, value.getNumber());
+    break;
+  case LuaValue::STRING:
+    {
+      auto s = value.getString();
+      lua_pushlstring(state, reinterpret_cast<const char*>(s.begin()), s.size());
+    }
+    break;
+  case LuaValue::TABLE:
+    {
+      auto entries = value.getTable();
+      lua_createtable(state, 0, entries.size());
+      for (auto entry : entries) {
+        auto key = entry.getKey();
+        KJ_REQUIRE(!key.isNil() && !(key.isNumber() && key.getNumber() != key.getNumber()),
+            "table key is nil or NaN");
+        pushLua(state, key);
+        pushLua(state, entry.getValue());
+        lua_rawset(state, -3);
+      }
+      wrapReadOnly(state);
+    }
+    break;
+  default:
+    KJ_FAIL_REQUIRE("unknown parameter type", static_cast<int>(value.which()));
+  }
+}
+
 void copyList(lua_State* state, capnp::DynamicList::Builder builder) {
   if (builder.size() == 0) {
     return;
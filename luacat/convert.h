@@ -28,6 +28,8 @@ extern "C" {
 #include "lua.h"
 }
 
+#include "luacat/params.capnp.h"
+
 namespace mcm {
 
 namespace luacat {
@@ -42,7 +44,9 @@ const kj::StringPtr luaStringPtr(lua_State* state, int index);
 // The memory is owned by Lua, so the caller must keep the Lua value on
 // the stack while the return value is live.
 
-int luaLoad(lua_State* state, kj::StringPtr name, kj::InputStream& stream);
+int luaLoad(lua_State* state, kj::StringPtr name, kj::InputStream& stream, const char* mode = NULL);
+// Load a Lua chunk from stream, as lua_load.  mode is "b", "t", or
+// NULL (either).
 
 inline void pushLua(lua_State* state, const kj::StringPtr s) {
   // Push a string onto the Lua stack.
@@ -60,6 +64,15 @@ void copyList(lua_State* state, capnp::DynamicList::Builder builder);
 // Converts the Lua value at the top of the stack into a Cap'n Proto list.
 // Throws kj::Exception on input validation error.
 
+void copyValue(lua_State* state, LuaValue::Builder builder);
+// Converts the Lua value at the top of the stack into a LuaValue.
+// Throws kj::Exception if the value is (or contains) a function,
+// userdata, or thread.
+
+void pushLua(lua_State* state, LuaValue::Reader value);
+// Push a copy of value onto the Lua stack.  Tables are wrapped in
+// read-only proxies, so the script can't modify its parameters.
+
 }  // namespace luacat
 }  // namespace mcm
 
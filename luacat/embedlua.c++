@@ -0,0 +1,153 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// embedlua compiles Lua modules to bytecode and writes a C++ source
+// file that defines them as the stdlibModules array declared in
+// luacat/stdlib.h.  Each FILE is registered under its base name without
+// the .lua extension.  Debug information is kept, so errors in embedded
+// modules still name the source file and line.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/main.h"
+#include "kj/string.h"
+#include "kj/string-tree.h"
+#include "kj/vector.h"
+
+extern "C" {
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+
+const char hexDigits[] = "0123456789abcdef";
+
+int dumpWriter(lua_State* state, const void* p, size_t sz, void* ud) {
+  auto& buf = *reinterpret_cast<kj::Vector<kj::byte>*>(ud);
+  auto bytes = reinterpret_cast<const kj::byte*>(p);
+  buf.addAll(bytes, bytes + sz);
+  return 0;
+}
+
+kj::String byteList(kj::ArrayPtr<const kj::byte> data) {
+  // Format data as the body of a C array initializer, 16 bytes per line.
+
+  kj::Vector<char> out(data.size() * 6 + data.size() / 16 * 3 + 1);
+  for (size_t i = 0; i < data.size(); i++) {
+    if (i % 16 == 0) {
+      out.addAll(kj::StringPtr("\n   "));
+    }
+    out.addAll(kj::StringPtr(" 0x"));
+    out.add(hexDigits[data[i] >> 4]);
+    out.add(hexDigits[data[i] & 0xf]);
+    out.add(',');
+  }
+  out.add('\0');
+  return kj::String(out.releaseAsArray());
+}
+
+class EmbedMain {
+public:
+  explicit EmbedMain(kj::ProcessContext& context): context(context) {}
+  KJ_DISALLOW_COPY(EmbedMain);
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "mcm Lua embedder",
+          "Compiles Lua modules and writes them to a C++ source file as the "
+          "standard library built into mcm-luacat.")
+        .addOptionWithArg({'o'}, KJ_BIND_METHOD(*this, setOutputPath),
+            "FILE", "Write the C++ source to FILE.")
+        .expectOneOrMoreArgs("FILE", KJ_BIND_METHOD(*this, addModule))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::String outPath;
+  kj::Vector<kj::StringTree> arrays;
+  kj::Vector<kj::StringTree> entries;
+
+  kj::MainBuilder::Validity setOutputPath(kj::StringPtr path) {
+    outPath = kj::heapString(path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity addModule(kj::StringPtr path) {
+    // Not path.h's baseName, since this tool can't depend on the luacat
+    // library that embeds its output.
+    kj::StringPtr base = path;
+    KJ_IF_MAYBE(i, path.findLast('/')) {
+      base = path.slice(*i + 1);
+    }
+    if (!base.endsWith(".lua")) {
+      return kj::str(path, ": not a .lua file");
+    }
+    auto name = kj::heapString(base.slice(0, base.size() - 4));
+
+    lua_State* state = luaL_newstate();
+    KJ_DEFER(lua_close(state));
+    if (luaL_loadfilex(state, path.cStr(), "t") != LUA_OK) {
+      return kj::str(lua_tostring(state, -1));
+    }
+    kj::Vector<kj::byte> bytecode;
+    lua_dump(state, dumpWriter, &bytecode, 0);
+
+    auto ident = kj::str("module", entries.size());
+    arrays.add(kj::strTree(
+        "const kj::byte ", ident, "[] = {", byteList(bytecode), "\n};\n\n"));
+    entries.add(kj::strTree(
+        "  {\"", name, "\", ", ident, ", sizeof(", ident, ")},\n"));
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (outPath.size() == 0) {
+      return kj::str("missing -o");
+    }
+    size_t count = entries.size();
+    auto text = kj::strTree(
+        "// Generated by embedlua.  DO NOT EDIT.\n\n"
+        "#include \"luacat/stdlib.h\"\n\n"
+        "namespace mcm {\n"
+        "namespace luacat {\n\n"
+        "namespace {\n\n",
+        kj::StringTree(arrays.releaseAsArray(), ""),
+        "}  // namespace\n\n"
+        "const EmbeddedModule stdlibModules[] = {\n",
+        kj::StringTree(entries.releaseAsArray(), ""),
+        "};\n\n"
+        "const size_t stdlibModuleCount = ", count, ";\n\n"
+        "}  // namespace luacat\n"
+        "}  // namespace mcm\n").flatten();
+    int fd;
+    KJ_SYSCALL(fd = open(outPath.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666), outPath);
+    kj::FdOutputStream out{kj::AutoCloseFd(fd)};
+    out.write(text.begin(), text.size());
+    return true;
+  }
+};
+
+}  // namespace
+}  // namespace luacat
+}  // namespace mcm
+
+KJ_MAIN(mcm::luacat::EmbedMain);
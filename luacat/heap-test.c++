@@ -0,0 +1,136 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/heap.h"
+
+#include "gtest/gtest.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/main.h"
+
+namespace {
+
+mcm::luacat::HeapLimits limits(uint64_t maxBytes, uint64_t maxInstructions) {
+  mcm::luacat::HeapLimits l;
+  l.maxBytes = maxBytes;
+  l.maxInstructions = maxInstructions;
+  return l;
+}
+
+int run(lua_State* state, const char* script) {
+  // Like luaL_dostring, but returns the status.
+  int status = luaL_loadstring(state, script);
+  if (status != LUA_OK) {
+    return status;
+  }
+  return lua_pcall(state, 0, LUA_MULTRET, 0);
+}
+
+}  // namespace
+
+TEST(LuaHeapTest, TracksUsage) {
+  mcm::luacat::Interpreter interp;
+  lua_State* state = interp.getState();
+  auto& heap = mcm::luacat::LuaHeap::from(state);
+  uint64_t before = heap.getBytesInUse();
+  ASSERT_EQ(LUA_OK, luaL_dostring(state,
+      "t = {}\n"
+      "for i = 1, 10000 do t[i] = {i, tostring(i)} end\n"
+      "assert(t[9999][2] == '9999')\n"));
+  EXPECT_GT(heap.getBytesInUse(), before + 10000 * 32);
+  ASSERT_EQ(LUA_OK, luaL_dostring(state, "t = nil; collectgarbage()"));
+  EXPECT_GT(heap.getPeakBytes(), before + 10000 * 32);
+  EXPECT_LT(heap.getBytesInUse(), heap.getPeakBytes() / 4);
+  EXPECT_FALSE(heap.refusedAllocation());
+}
+
+TEST(LuaHeapTest, AttributesRequiredModules) {
+  mcm::luacat::Interpreter interp;
+  lua_State* state = interp.getState();
+  ASSERT_EQ(LUA_OK, luaL_dostring(state,
+      "package.preload.big = function()\n"
+      "  local t = {}\n"
+      "  for i = 1, 1000 do t[i] = {} end\n"
+      "  return t\n"
+      "end\n"
+      "package.preload.small = function() return {} end\n"
+      "assert(#require('big') == 1000)\n"
+      "require('small')\n"
+      "assert(not pcall(require, 'missing'))\n")) << lua_tostring(state, -1);
+  auto modules = mcm::luacat::LuaHeap::from(state).getModules();
+  ASSERT_EQ(4, modules.size());
+  EXPECT_STREQ("", modules[0].name.cStr());
+  EXPECT_STREQ("big", modules[1].name.cStr());
+  EXPECT_GE(modules[1].allocs, 1000);
+  EXPECT_STREQ("small", modules[2].name.cStr());
+  EXPECT_LT(modules[2].allocs, 10);
+  EXPECT_STREQ("missing", modules[3].name.cStr());
+}
+
+TEST(LuaHeapTest, MemoryBudget) {
+  mcm::luacat::Interpreter interp(limits(4 << 20, 0));
+  lua_State* state = interp.getState();
+  ASSERT_EQ(LUA_OK, luaL_dostring(state, "local s = string.rep('x', 1 << 20)"));
+  EXPECT_EQ(LUA_ERRMEM, run(state, "local t = {} for i = 1, 1e7 do t[i] = {} end"));
+  EXPECT_TRUE(mcm::luacat::LuaHeap::from(state).refusedAllocation());
+  EXPECT_LE(mcm::luacat::LuaHeap::from(state).getPeakBytes(), 4 << 20);
+
+  // The interpreter is still usable after the garbage is collected.
+  ASSERT_EQ(LUA_OK, luaL_dostring(state, "collectgarbage(); x = {1, 2, 3}"));
+}
+
+TEST(LuaHeapTest, MemoryBudgetStopsBuffer) {
+  mcm::luacat::Interpreter interp(limits(4 << 20, 0));
+  lua_State* state = interp.getState();
+  ASSERT_EQ(LUA_ERRRUN, run(state,
+      "local b = mcm.buffer()\n"
+      "local s = string.rep('x', 1 << 16)\n"
+      "for i = 1, 1000 do b:add(s) end\n"));
+  EXPECT_STREQ("[string \"local b = mcm.buffer()...\"]:3: not enough memory for buffer allocation",
+               lua_tostring(state, -1));
+  EXPECT_TRUE(mcm::luacat::LuaHeap::from(state).refusedAllocation());
+  EXPECT_LE(mcm::luacat::LuaHeap::from(state).getPeakBytes(), 4 << 20);
+  ASSERT_EQ(LUA_OK, luaL_dostring(state, "collectgarbage(); x = mcm.buffer('a', 'b')"));
+}
+
+TEST(LuaHeapTest, InstructionBudget) {
+  struct {
+    const char* script;
+    const char* error;
+  } cases[] = {
+    {"while true do end",
+     "[string \"while true do end\"]:1: instruction budget of 100000 exceeded"},
+    {"while true do pcall(function() while true do end end) end",
+     "[string \"while true do pcall(function() while true do ...\"]:1: "
+     "instruction budget of 100000 exceeded"},
+    // coroutine.wrap adds the position of the call to any error.
+    {"local co = coroutine.wrap(function() while true do end end) co()",
+     "[string \"local co = coroutine.wrap(function() while tr...\"]:1: "
+     "[string \"local co = coroutine.wrap(function() while tr...\"]:1: "
+     "instruction budget of 100000 exceeded"},
+  };
+  for (auto& c : cases) {
+    SCOPED_TRACE(c.script);
+    mcm::luacat::Interpreter interp(limits(0, 100000));
+    lua_State* state = interp.getState();
+    ASSERT_EQ(LUA_ERRRUN, run(state, c.script));
+    EXPECT_STREQ(c.error, lua_tostring(state, -1));
+  }
+
+  mcm::luacat::Interpreter interp(limits(0, 100000));
+  EXPECT_EQ(LUA_OK, run(interp.getState(), "for i = 1, 1000 do end"));
+}
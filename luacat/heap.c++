@@ -0,0 +1,225 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/heap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "kj/debug.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/convert.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  const int hookPeriod = 1000;  // instructions between budget checks
+
+  inline size_t sizeClass(size_t size) {
+    return (size - 1) / 16;
+  }
+}  // namespace
+
+LuaHeap::LuaHeap(const HeapLimits& limits): limits(limits) {
+  modules.add(ModuleUsage{kj::heapString(""), 0, 0});
+}
+
+LuaHeap::~LuaHeap() noexcept {
+  for (void* chunk : chunks) {
+    free(chunk);
+  }
+}
+
+void* LuaHeap::alloc(void* ud, void* ptr, size_t osize, size_t nsize) noexcept {
+  auto& heap = *reinterpret_cast<LuaHeap*>(ud);
+  if (ptr == nullptr) {
+    osize = 0;  // Lua passes the object type here
+  }
+  if (nsize > osize) {
+    uint64_t grow = nsize - osize;
+    if (heap.limits.maxBytes != 0 && heap.inUse + grow > heap.limits.maxBytes) {
+      heap.refused = true;
+      return nullptr;
+    }
+    void* p = heap.reallocate(ptr, osize, nsize);
+    if (p == nullptr) {
+      return nullptr;
+    }
+    heap.inUse += grow;
+    heap.peak = kj::max(heap.peak, heap.inUse);
+    auto& m = heap.modules[heap.currentModule];
+    m.bytes += grow;
+    if (ptr == nullptr) {
+      m.allocs++;
+    }
+    return p;
+  }
+  void* p = heap.reallocate(ptr, osize, nsize);
+  if (p == nullptr && nsize > 0) {
+    return nullptr;
+  }
+  heap.inUse -= osize - nsize;
+  return p;
+}
+
+void* LuaHeap::reallocate(void* ptr, size_t osize, size_t nsize) {
+  // Shrinking must not fail, so nothing is allocated when the block
+  // stays in the same place, and a large block moving into a size class
+  // may use the spare chunk.
+
+  bool oldSmall = ptr != nullptr && osize <= classSize * numClasses;
+  bool newSmall = nsize > 0 && nsize <= classSize * numClasses;
+  if (nsize == 0) {
+    if (oldSmall) {
+      freeSmall(ptr, sizeClass(osize));
+    } else {
+      free(ptr);
+    }
+    return nullptr;
+  }
+  if (!oldSmall && !newSmall) {
+    return realloc(ptr, nsize);
+  }
+  if (oldSmall && newSmall && sizeClass(osize) == sizeClass(nsize)) {
+    return ptr;
+  }
+  void* p = newSmall ? allocSmall(sizeClass(nsize), nsize < osize) : malloc(nsize);
+  if (p == nullptr) {
+    // Only possible when growing; Lua keeps the old block.
+    return nullptr;
+  }
+  if (ptr != nullptr) {
+    memcpy(p, ptr, kj::min(osize, nsize));
+    if (oldSmall) {
+      freeSmall(ptr, sizeClass(osize));
+    } else {
+      free(ptr);
+    }
+  }
+  return p;
+}
+
+void* LuaHeap::allocSmall(size_t cls, bool shrinking) {
+  FreeBlock* block = freeLists[cls];
+  if (block != nullptr) {
+    freeLists[cls] = block->next;
+    return block;
+  }
+  size_t size = (cls + 1) * classSize;
+  if (chunkPos == nullptr || size_t(chunkEnd - chunkPos) < size) {
+    void* chunk = malloc(chunkSize);
+    if (chunk != nullptr) {
+      chunks.add(chunk);
+    } else if (shrinking && spareChunk != nullptr) {
+      chunk = spareChunk;
+      spareChunk = nullptr;
+    } else {
+      return nullptr;
+    }
+    if (spareChunk == nullptr) {
+      spareChunk = malloc(chunkSize);
+      if (spareChunk != nullptr) {
+        chunks.add(spareChunk);
+      }
+    }
+    chunkPos = reinterpret_cast<char*>(chunk);
+    chunkEnd = chunkPos + chunkSize;
+  }
+  void* p = chunkPos;
+  chunkPos += size;
+  return p;
+}
+
+void LuaHeap::freeSmall(void* ptr, size_t cls) {
+  auto block = reinterpret_cast<FreeBlock*>(ptr);
+  block->next = freeLists[cls];
+  freeLists[cls] = block;
+}
+
+LuaHeap& LuaHeap::from(lua_State* state) {
+  void* ud;
+  lua_Alloc f = lua_getallocf(state, &ud);
+  KJ_REQUIRE(f == &LuaHeap::alloc, "Lua state was not created by newLuaState");
+  return *reinterpret_cast<LuaHeap*>(ud);
+}
+
+void LuaHeap::install(lua_State* state) {
+  lua_getglobal(state, "require");
+  lua_pushcclosure(state, requirefunc, 1);
+  lua_setglobal(state, "require");
+  if (limits.maxInstructions != 0) {
+    lua_sethook(state, hookfunc, LUA_MASKCOUNT, hookPeriod);
+  }
+}
+
+void LuaHeap::setSampler(lua_State* state, Sampler& s) {
+  sampler = &s;
+  lua_sethook(state, hookfunc, LUA_MASKCOUNT, hookPeriod);
+}
+
+size_t LuaHeap::enterModule(kj::StringPtr name) {
+  size_t prev = currentModule;
+  for (size_t i = 1; i < modules.size(); i++) {
+    if (modules[i].name == name) {
+      currentModule = i;
+      return prev;
+    }
+  }
+  modules.add(ModuleUsage{kj::heapString(name), 0, 0});
+  currentModule = modules.size() - 1;
+  return prev;
+}
+
+int LuaHeap::requirefunc(lua_State* state) {
+  auto& heap = from(state);
+  luaL_checkstring(state, 1);
+  lua_settop(state, 1);
+  size_t prev = heap.enterModule(luaStringPtr(state, 1));
+  lua_pushvalue(state, lua_upvalueindex(1));
+  lua_insert(state, 1);
+  int status = lua_pcall(state, 1, LUA_MULTRET, 0);
+  heap.currentModule = prev;
+  if (status != LUA_OK) {
+    return lua_error(state);
+  }
+  return lua_gettop(state);
+}
+
+void LuaHeap::hookfunc(lua_State* state, lua_Debug* ar) {
+  auto& heap = from(state);
+  if (heap.sampler != nullptr) {
+    heap.sampler->sample(state);
+  }
+  if (heap.limits.maxInstructions == 0) {
+    return;
+  }
+  heap.instructions += hookPeriod;
+  if (heap.instructions > heap.limits.maxInstructions) {
+    // Check every instruction from now on, so that a script can't keep
+    // going by catching the error with pcall.
+    lua_sethook(state, hookfunc, LUA_MASKCOUNT, 1);
+    lua_getinfo(state, "Sl", ar);
+    lua_pushfstring(state, "%s:%d: instruction budget of %I exceeded",
+                    ar->short_src, ar->currentline, lua_Integer(heap.limits.maxInstructions));
+    lua_error(state);
+  }
+}
+
+}  // namespace luacat
+}  // namespace mcm
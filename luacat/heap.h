@@ -0,0 +1,126 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_HEAP_H_
+#define MCM_LUACAT_HEAP_H_
+// Lua memory allocation and budgets.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kj/common.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace mcm {
+
+namespace luacat {
+
+struct HeapLimits {
+  uint64_t maxBytes = 0;  // live bytes; 0 means no limit
+  uint64_t maxInstructions = 0;  // VM instructions; 0 means no limit
+};
+
+class Sampler {
+  // Called periodically while Lua code runs.  See LuaHeap::setSampler.
+
+public:
+  virtual void sample(lua_State* state) = 0;
+};
+
+class LuaHeap {
+  // The allocator behind a lua_State.  Small blocks come from per-size
+  // free lists carved out of large chunks, which are all released when
+  // the heap is destroyed.  Allocations are attributed to the module
+  // being loaded by require, if any, rather than to the chunk of the
+  // running function: the allocator can't call into the debug API, so
+  // a function from one module called after it loaded is charged to
+  // whichever module (or the main chunk) is loading at the time.
+
+public:
+  struct ModuleUsage {
+    kj::String name;  // empty for the main chunk
+    uint64_t bytes;  // total bytes allocated, including since-freed blocks
+    uint64_t allocs;
+  };
+
+  explicit LuaHeap(const HeapLimits& limits);
+  ~LuaHeap() noexcept;
+  KJ_DISALLOW_COPY(LuaHeap);
+
+  static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize) noexcept;
+  // A lua_Alloc function; ud is the LuaHeap.
+
+  static LuaHeap& from(lua_State* state);
+  // Returns the heap of a state created by newLuaState.
+
+  void install(lua_State* state);
+  // Wrap require so that allocations are attributed to modules and set
+  // the instruction budget hook, if any.  Call after opening the
+  // standard libraries.
+
+  void setSampler(lua_State* state, Sampler& s);
+  // Call s.sample every thousand or so VM instructions.  Must be set
+  // before the script creates any coroutines.  s must outlive the heap.
+
+  inline const HeapLimits& getLimits() const { return limits; }
+  inline uint64_t getBytesInUse() const { return inUse; }
+  inline uint64_t getPeakBytes() const { return peak; }
+  inline uint64_t getInstructions() const { return instructions; }
+  // Instructions run so far, rounded down to the hook period.  Only
+  // counted with an instruction budget.
+  inline bool refusedAllocation() const { return refused; }
+  // Whether an allocation has failed because of the memory budget.
+  inline kj::ArrayPtr<const ModuleUsage> getModules() const { return modules.asPtr(); }
+
+private:
+  static const size_t classSize = 16;
+  static const size_t numClasses = 16;  // blocks up to 256 bytes
+  static const size_t chunkSize = 64 * 1024;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  HeapLimits limits;
+  FreeBlock* freeLists[numClasses] = {};
+  kj::Vector<void*> chunks;
+  char* chunkPos = nullptr;
+  char* chunkEnd = nullptr;
+  void* spareChunk = nullptr;  // in chunks; only used to shrink a block
+
+  uint64_t inUse = 0;
+  uint64_t peak = 0;
+  uint64_t instructions = 0;
+  bool refused = false;
+  Sampler* sampler = nullptr;
+  kj::Vector<ModuleUsage> modules;
+  size_t currentModule = 0;
+
+  void* allocSmall(size_t cls, bool shrinking);
+  void freeSmall(void* ptr, size_t cls);
+  void* reallocate(void* ptr, size_t osize, size_t nsize);
+  size_t enterModule(kj::StringPtr name);
+
+  static int requirefunc(lua_State* state);
+  static void hookfunc(lua_State* state, lua_Debug* ar);
+};
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_HEAP_H_
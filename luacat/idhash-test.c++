@@ -0,0 +1,55 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/idhash.h"
+
+#include "gtest/gtest.h"
+#include "kj/array.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+
+TEST(IdHashTest, KnownValues) {
+  EXPECT_EQ(0xd96f419065c49db1, mcm::luacat::idHash("xyzzy!"));
+  EXPECT_EQ(0xa11bc8c61a92fd91, mcm::luacat::idHash("42"));
+}
+
+TEST(IdHashTest, BatchMatchesScalar) {
+  // Lengths cover the one-to-four block range, including the 55/56
+  // and 119/120 byte boundaries once the prefix is added.
+  kj::Vector<kj::String> strings;
+  for (size_t n = 0; n < 250; n++) {
+    auto s = kj::heapString(n);
+    for (size_t i = 0; i < n; i++) {
+      s[i] = 'a' + (i * 7 + n) % 26;
+    }
+    strings.add(kj::mv(s));
+  }
+  auto ptrs = kj::heapArray<kj::StringPtr>(strings.size());
+  for (size_t i = 0; i < strings.size(); i++) {
+    ptrs[i] = strings[i];
+  }
+
+  // Odd batch sizes leave partly-filled lanes and a lone last string.
+  for (size_t batch : {1, 2, 3, 8, 9, 17, 250}) {
+    SCOPED_TRACE(batch);
+    auto ids = kj::heapArray<uint64_t>(ptrs.size());
+    for (size_t i = 0; i < ptrs.size(); i += batch) {
+      size_t n = kj::min(batch, ptrs.size() - i);
+      mcm::luacat::idHashes(ptrs.slice(i, i + n), ids.slice(i, i + n));
+    }
+    for (size_t i = 0; i < ptrs.size(); i++) {
+      EXPECT_EQ(mcm::luacat::idHash(ptrs[i]), ids[i]) << "length " << ptrs[i].size();
+    }
+  }
+}
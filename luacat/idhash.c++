@@ -0,0 +1,220 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/idhash.h"
+
+#include <string.h>
+#include "kj/debug.h"
+#include "openssl/sha.h"
+
+// The multi-buffer kernel uses GCC vector extensions, which both GCC
+// and Clang lower to whatever SIMD the target has.  On x86-64 Linux an
+// AVX2 clone is selected at load time.
+#if defined(__GNUC__)
+#define MCM_IDHASH_VECTOR 1
+#if defined(__x86_64__) && defined(__linux__) && (!defined(__clang__) || __clang_major__ >= 14)
+#define MCM_IDHASH_CLONES __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+
+#ifndef MCM_IDHASH_CLONES
+#define MCM_IDHASH_CLONES
+#endif
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  const char idHashPrefix[] = "mcm-luacat ID: ";
+  const size_t idHashPrefixLen = sizeof(idHashPrefix) - 1;
+
+  inline uint64_t idFromDigest(const uint8_t* hash) {
+    return 1 | hash[0] |
+        (((uint64_t)hash[1]) << 8) |
+        (((uint64_t)hash[2]) << 16) |
+        (((uint64_t)hash[3]) << 24) |
+        (((uint64_t)hash[4]) << 32) |
+        (((uint64_t)hash[5]) << 40) |
+        (((uint64_t)hash[6]) << 48) |
+        (((uint64_t)hash[7]) << 56);
+  }
+}  // namespace
+
+uint64_t idHash(kj::StringPtr s) {
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  SHA1_Update(&ctx, idHashPrefix, idHashPrefixLen);
+  SHA1_Update(&ctx, s.cStr(), s.size());
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  SHA1_Final(hash, &ctx);
+  return idFromDigest(hash);
+}
+
+#if MCM_IDHASH_VECTOR
+
+namespace {
+  const size_t lanes = 8;
+  typedef uint32_t Vec __attribute__((vector_size(lanes * sizeof(uint32_t))));
+
+#define MCM_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+  inline size_t blockCount(size_t len) {
+    // Message, 0x80 terminator, and 64-bit length, rounded up to 64 bytes.
+    return (idHashPrefixLen + len + 8) / 64 + 1;
+  }
+
+  void fillBlock(kj::StringPtr s, size_t block, uint8_t out[64]) {
+    // Writes block number `block` of the padded SHA-1 message for s.
+
+    memset(out, 0, 64);
+    size_t total = idHashPrefixLen + s.size();
+    size_t start = block * 64;
+    size_t end = kj::min(start + 64, total);
+    if (start < idHashPrefixLen) {
+      size_t n = kj::min(idHashPrefixLen, end) - start;
+      memcpy(out, idHashPrefix + start, n);
+    }
+    size_t from = kj::max(start, idHashPrefixLen);
+    if (from < end) {
+      memcpy(out + (from - start), s.begin() + (from - idHashPrefixLen), end - from);
+    }
+    if (total >= start && total < start + 64) {
+      out[total - start] = 0x80;
+    }
+    if (block == blockCount(s.size()) - 1) {
+      uint64_t bits = uint64_t(total) * 8;
+      for (int i = 0; i < 8; i++) {
+        out[63 - i] = uint8_t(bits >> (i * 8));
+      }
+    }
+  }
+
+#define MCM_SHA1_ROUND(f, k) \
+    do { \
+      if (t >= 16) { \
+        w[t & 15] = MCM_ROTL(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1); \
+      } \
+      Vec tmp = MCM_ROTL(a, 5) + (f) + e + (k) + w[t & 15]; \
+      e = d; \
+      d = c; \
+      c = MCM_ROTL(b, 30); \
+      b = a; \
+      a = tmp; \
+    } while (false)
+
+  inline __attribute__((always_inline)) void compress(Vec h[5], Vec w[16]) {
+    Vec a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    int t = 0;
+    for (; t < 20; t++) {
+      MCM_SHA1_ROUND((b & c) | (~b & d), 0x5a827999u);
+    }
+    for (; t < 40; t++) {
+      MCM_SHA1_ROUND(b ^ c ^ d, 0x6ed9eba1u);
+    }
+    for (; t < 60; t++) {
+      MCM_SHA1_ROUND((b & c) | (b & d) | (c & d), 0x8f1bbcdcu);
+    }
+    for (; t < 80; t++) {
+      MCM_SHA1_ROUND(b ^ c ^ d, 0xca62c1d6u);
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+#undef MCM_SHA1_ROUND
+#undef MCM_ROTL
+
+  MCM_IDHASH_CLONES
+  void hashLanes(const kj::StringPtr* strings, size_t n, uint64_t* ids) {
+    // Hashes up to `lanes` strings at once.  Lanes whose message is
+    // shorter than the longest one keep their state once they run out
+    // of blocks.
+
+    Vec h[5];
+    const uint32_t init[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    for (int i = 0; i < 5; i++) {
+      h[i] = Vec{} + init[i];
+    }
+    Vec nblocks{};
+    size_t maxBlocks = 0;
+    for (size_t i = 0; i < n; i++) {
+      size_t nb = blockCount(strings[i].size());
+      nblocks[i] = nb;
+      maxBlocks = kj::max(maxBlocks, nb);
+    }
+
+    for (size_t block = 0; block < maxBlocks; block++) {
+      uint32_t words[16][lanes] = {};
+      for (size_t i = 0; i < n; i++) {
+        if (block >= nblocks[i]) {
+          continue;
+        }
+        uint8_t buf[64];
+        fillBlock(strings[i], block, buf);
+        for (int t = 0; t < 16; t++) {
+          uint32_t word;
+          memcpy(&word, buf + t * 4, sizeof(word));
+          words[t][i] = __builtin_bswap32(word);
+        }
+      }
+      Vec w[16];
+      memcpy(w, words, sizeof(w));
+      Vec prev[5] = {h[0], h[1], h[2], h[3], h[4]};
+      compress(h, w);
+      Vec active = (Vec)(nblocks > uint32_t(block));
+      for (int i = 0; i < 5; i++) {
+        h[i] = (h[i] & active) | (prev[i] & ~active);
+      }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      uint8_t digest[8];
+      for (int j = 0; j < 4; j++) {
+        digest[j] = uint8_t(h[0][i] >> (24 - j * 8));
+        digest[4 + j] = uint8_t(h[1][i] >> (24 - j * 8));
+      }
+      ids[i] = idFromDigest(digest);
+    }
+  }
+}  // namespace
+
+void idHashes(kj::ArrayPtr<const kj::StringPtr> strings, kj::ArrayPtr<uint64_t> ids) {
+  KJ_REQUIRE(strings.size() == ids.size());
+  size_t i = 0;
+  for (; i + 1 < strings.size(); i += lanes) {
+    hashLanes(strings.begin() + i, kj::min(lanes, strings.size() - i), ids.begin() + i);
+  }
+  if (i < strings.size()) {
+    // A single string is faster with the scalar library code.
+    ids[i] = idHash(strings[i]);
+  }
+}
+
+#else
+
+void idHashes(kj::ArrayPtr<const kj::StringPtr> strings, kj::ArrayPtr<uint64_t> ids) {
+  KJ_REQUIRE(strings.size() == ids.size());
+  for (size_t i = 0; i < strings.size(); i++) {
+    ids[i] = idHash(strings[i]);
+  }
+}
+
+#endif  // MCM_IDHASH_VECTOR
+
+}  // namespace luacat
+}  // namespace mcm
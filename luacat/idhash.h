@@ -0,0 +1,39 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_IDHASH_H_
+#define MCM_LUACAT_IDHASH_H_
+// Resource ID hashing.
+
+#include <stdint.h>
+#include "kj/array.h"
+#include "kj/string.h"
+
+namespace mcm {
+
+namespace luacat {
+
+uint64_t idHash(kj::StringPtr s);
+// Returns the resource ID for s: the first 8 bytes of
+// SHA-1("mcm-luacat ID: " + s) as a little-endian integer, with the
+// low bit set.
+
+void idHashes(kj::ArrayPtr<const kj::StringPtr> strings, kj::ArrayPtr<uint64_t> ids);
+// Sets ids[i] = idHash(strings[i]) for each string.  Hashes several
+// strings at once in SIMD lanes where the compiler supports it.
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_IDHASH_H_
@@ -0,0 +1,106 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/io.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "kj/debug.h"
+#include "kj/exception.h"
+
+#include "luacat/path.h"
+
+namespace mcm {
+
+namespace luacat {
+
+void BufferOutputStream::write(const void* buffer, size_t size) {
+  auto p = reinterpret_cast<const kj::byte*>(buffer);
+  buf.addAll(p, p + size);
+}
+
+namespace {
+  class UnmapDisposer final: public kj::ArrayDisposer {
+  protected:
+    void disposeImpl(void* firstElement, size_t elementSize, size_t elementCount,
+                     size_t capacity, void (*destroyElement)(void*)) const override {
+      munmap(firstElement, elementSize * elementCount);
+    }
+  };
+
+  const UnmapDisposer unmapDisposer;
+
+  kj::Array<kj::byte> readAll(kj::AutoCloseFd fd) {
+    kj::FdInputStream stream{kj::mv(fd)};
+    kj::Vector<kj::byte> data;
+    kj::byte buf[4096];
+    for (;;) {
+      size_t n = stream.tryRead(buf, 1, sizeof(buf));
+      if (n == 0) {
+        return data.releaseAsArray();
+      }
+      data.addAll(buf, buf + n);
+    }
+  }
+}  // namespace
+
+kj::Array<kj::byte> readFile(kj::StringPtr path) {
+  int fd;
+  KJ_SYSCALL(fd = open(path.cStr(), O_RDONLY, 0), path);
+  return readAll(kj::AutoCloseFd(fd));
+}
+
+kj::Array<const kj::byte> mapFile(kj::StringPtr path) {
+  int fd;
+  KJ_SYSCALL(fd = open(path.cStr(), O_RDONLY, 0), path);
+  return mapFile(kj::AutoCloseFd(fd));
+}
+
+kj::Array<const kj::byte> mapFile(kj::AutoCloseFd fd) {
+  struct stat st;
+  KJ_SYSCALL(fstat(fd, &st));
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      return kj::Array<const kj::byte>(reinterpret_cast<const kj::byte*>(p), st.st_size, unmapDisposer);
+    }
+  }
+  return readAll(kj::mv(fd));
+}
+
+void replaceFile(kj::StringPtr path, kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) {
+  auto tmpPath = joinPath(dirName(path), ".tmp-XXXXXX").flatten();
+  int fd;
+  KJ_SYSCALL(fd = mkstemp(tmpPath.begin()), tmpPath);
+  KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+    kj::FdOutputStream stream{kj::AutoCloseFd(fd)};
+    stream.write(pieces);
+  })) {
+    unlink(tmpPath.cStr());
+    kj::throwFatalException(kj::mv(*e));
+  }
+  if (rename(tmpPath.cStr(), path.cStr()) != 0) {
+    int error = errno;
+    unlink(tmpPath.cStr());
+    KJ_FAIL_SYSCALL("rename", error, tmpPath, path);
+  }
+}
+
+}  // namespace luacat
+}  // namespace mcm
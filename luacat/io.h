@@ -0,0 +1,64 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_IO_H_
+#define MCM_LUACAT_IO_H_
+// I/O helpers not provided by KJ.
+
+#include "kj/array.h"
+#include "kj/common.h"
+#include "kj/io.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+
+namespace mcm {
+
+namespace luacat {
+
+class BufferOutputStream: public kj::OutputStream {
+  // An output stream that collects everything written to it in memory.
+
+public:
+  void write(const void* buffer, size_t size) override;
+
+  inline kj::ArrayPtr<const kj::byte> getArray() { return buf.asPtr(); }
+
+private:
+  kj::Vector<kj::byte> buf;
+};
+
+kj::Array<kj::byte> readFile(kj::StringPtr path);
+// Read the entire contents of the file at the given path.
+
+kj::Array<const kj::byte> mapFile(kj::StringPtr path);
+// Like readFile, but maps regular files into memory instead of copying
+// them.  Files that can't be mapped (empty files, pipes) are read.
+// Truncating a file while it is mapped makes later accesses crash, so
+// only use this for files that are not written during the run.
+
+kj::Array<const kj::byte> mapFile(kj::AutoCloseFd fd);
+// Like mapFile(path), but for an already open file.
+
+void replaceFile(kj::StringPtr path, kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces);
+inline void replaceFile(kj::StringPtr path, kj::ArrayPtr<const kj::byte> data) {
+  replaceFile(path, kj::arrayPtr(&data, 1));
+}
+// Write the concatenation of pieces to a temporary file and rename it
+// to path, so that concurrent readers see either the old file or the
+// complete new one.
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_IO_H_
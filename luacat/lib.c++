@@ -15,10 +15,13 @@
 #include "luacat/lib.h"
 
 #include <fcntl.h>
+#include <string.h>
+#include <algorithm>
 #include "kj/debug.h"
 #include "kj/exception.h"
 #include "kj/string.h"
 #include "kj/vector.h"
+#include "capnp/any.h"
 #include "capnp/message.h"
 #include "capnp/orphan.h"
 #include "capnp/schema.h"
@@ -26,19 +29,22 @@
 #include "openssl/sha.h"
 
 #include "catalog.capnp.h"
+#include "catalog.luaconv.h"
 #include "luacat/convert.h"
+#include "luacat/idhash.h"
 #include "luacat/types.h"
+#include "luacat/view.h"
 
 namespace mcm {
 
 namespace luacat {
 
 namespace {
-  const char* idHashPrefix = "mcm-luacat ID: ";
   const char* resourceTypeMetaKey = "mcm_resource";
   const char* stateRefRegistryKey = "mcm::Lua";
   const uint64_t fileResId = 0x8dc4ac52b2962163;
   const uint64_t execResId = 0x984c97311006f1ca;
+  char idCacheKey;  // address is the registry key of the ID cache
 
   LibState& getStateRef(lua_State* state) {
     int ty = lua_getfield(state, LUA_REGISTRYINDEX, stateRefRegistryKey);
@@ -48,21 +54,75 @@ namespace {
     return *ptr;
   }
 
-  uint64_t idHash(kj::StringPtr s) {
-    SHA_CTX ctx;
-    SHA1_Init(&ctx);
-    SHA1_Update(&ctx, idHashPrefix, strlen(idHashPrefix));
-    SHA1_Update(&ctx, s.cStr(), s.size());
-    uint8_t hash[SHA_DIGEST_LENGTH];
-    SHA1_Final(hash, &ctx);
-    return 1 | hash[0] |
-        (((uint64_t)hash[1]) << 8) |
-        (((uint64_t)hash[2]) << 16) |
-        (((uint64_t)hash[3]) << 24) |
-        (((uint64_t)hash[4]) << 32) |
-        (((uint64_t)hash[5]) << 40) |
-        (((uint64_t)hash[6]) << 48) |
-        (((uint64_t)hash[7]) << 56);
+  const Id& pushHashId(lua_State* state, LibState& libState, int index) {
+    // Push the Id for the string at index.  Ids are cached per
+    // interpreter, so each distinct string is hashed once.
+
+    index = lua_absindex(state, index);
+    auto comment = luaStringPtr(state, index);  // converts numbers in place
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &idCacheKey);
+    lua_pushvalue(state, index);
+    if (lua_rawget(state, -2) == LUA_TNIL) {
+      lua_pop(state, 1);
+      uint64_t value = idHash(comment);
+      pushId(state, value, comment);
+      libState.getStats().hashes++;
+      for (auto o : libState.getObservers()) {
+        o->idHashed(state, value, comment);
+      }
+      lua_pushvalue(state, index);
+      lua_pushvalue(state, -2);
+      lua_rawset(state, -4);
+    }
+    lua_remove(state, -2);  // pop cache
+    return KJ_ASSERT_NONNULL(getId(state, -1));
+  }
+
+  uint64_t stringId(lua_State* state, LibState& libState, int index) {
+    // Returns the ID for the string at index, using the cache but not
+    // adding to it.  Used for resource names, which are rarely repeated.
+
+    index = lua_absindex(state, index);
+    auto comment = luaStringPtr(state, index);
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &idCacheKey);
+    lua_pushvalue(state, index);
+    lua_rawget(state, -2);
+    uint64_t value;
+    KJ_IF_MAYBE(id, getId(state, -1)) {
+      value = id->getValue();
+    } else {
+      value = idHash(comment);
+      libState.getStats().hashes++;
+      for (auto o : libState.getObservers()) {
+        o->idHashed(state, value, comment);
+      }
+    }
+    lua_pop(state, 2);
+    return value;
+  }
+
+  template <typename Init>
+  void sortIds(capnp::List<uint64_t>::Reader list, Init&& init) {
+    // Sort the IDs in list and drop duplicates.  init(n) must replace
+    // list with a new list of size n.
+
+    bool sorted = true;
+    for (capnp::uint i = 1; i < list.size(); i++) {
+      if (list[i-1] >= list[i]) {
+        sorted = false;
+        break;
+      }
+    }
+    if (sorted) {
+      return;
+    }
+    auto ids = KJ_MAP(id, list) { return id; };
+    std::sort(ids.begin(), ids.end());
+    size_t n = std::unique(ids.begin(), ids.end()) - ids.begin();
+    capnp::List<uint64_t>::Builder out = init(n);
+    for (size_t i = 0; i < n; i++) {
+      out.set(i, ids[i]);
+    }
   }
 
   int hashfunc(lua_State* state) {
@@ -70,8 +130,7 @@ namespace {
       return luaL_error(state, "'mcm.hash' takes 1 argument, got %d", lua_gettop(state));
     }
     luaL_argcheck(state, lua_isstring(state, 1), 1, "must be a string");
-    auto comment = luaStringPtr(state, 1);
-    pushId(state, kj::heap<Id>(idHash(comment), comment));
+    pushHashId(state, getStateRef(state), 1);
     return 1;
   }
 
@@ -116,56 +175,193 @@ namespace {
     return 1;  // Return original argument
   }
 
-  int resourcefunc(lua_State* state) {
-    if (lua_gettop(state) != 3) {
-      return luaL_error(state, "'mcm.resource' takes 3 arguments, got %d", lua_gettop(state));
+  void digestStruct(SHA_CTX& ctx, capnp::AnyStruct::Reader s);
+
+  void digestPointer(SHA_CTX& ctx, capnp::AnyPointer::Reader p) {
+    auto type = static_cast<uint8_t>(p.getPointerType());
+    SHA1_Update(&ctx, &type, 1);
+    if (!p.isList()) {
+      if (p.isStruct()) {
+        digestStruct(ctx, p.getAs<capnp::AnyStruct>());
+      }
+      return;
+    }
+    auto list = p.getAs<capnp::AnyList>();
+    uint32_t n = list.size();
+    SHA1_Update(&ctx, &n, sizeof(n));
+    auto elementSize = list.getElementSize();
+    if (elementSize == capnp::ElementSize::POINTER || elementSize == capnp::ElementSize::INLINE_COMPOSITE) {
+      auto structs = list.as<capnp::List<capnp::AnyStruct>>();
+      for (uint32_t i = 0; i < n; i++) {
+        digestStruct(ctx, structs[i]);
+      }
+      return;
+    }
+    auto size = static_cast<uint8_t>(elementSize);
+    SHA1_Update(&ctx, &size, 1);
+    auto bytes = list.getRawBytes();
+    SHA1_Update(&ctx, bytes.begin(), bytes.size());
+  }
+
+  void digestStruct(SHA_CTX& ctx, capnp::AnyStruct::Reader s) {
+    // Trailing zero bytes and null pointers are left out, as in
+    // AnyStruct::Reader::equals.
+
+    auto data = s.getDataSection();
+    uint32_t dataSize = data.size();
+    while (dataSize > 0 && data[dataSize - 1] == 0) {
+      dataSize--;
+    }
+    SHA1_Update(&ctx, &dataSize, sizeof(dataSize));
+    SHA1_Update(&ctx, data.begin(), dataSize);
+    auto ptrs = s.getPointerSection();
+    uint32_t nptrs = ptrs.size();
+    while (nptrs > 0 && ptrs[nptrs - 1].isNull()) {
+      nptrs--;
+    }
+    SHA1_Update(&ctx, &nptrs, sizeof(nptrs));
+    for (uint32_t i = 0; i < nptrs; i++) {
+      digestPointer(ctx, ptrs[i]);
     }
-    luaL_argcheck(state, lua_istable(state, 2), 2, "must be a table");
-    luaL_argcheck(state, lua_istable(state, 3), 3, "must be a table");
+  }
+
+  uint64_t resourceDigest(Resource::Reader resource) {
+    // A hash of the resource's content that is the same for resources
+    // that AnyStruct::Reader::equals reports as equal.
+
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    digestStruct(ctx, capnp::AnyStruct::Reader(resource));
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    SHA1_Final(hash, &ctx);
+    uint64_t digest;
+    memcpy(&digest, hash, sizeof(digest));
+    return digest;
+  }
+
+  const int badResourceTable = -1;
+  const char* const declareArgNames[] = {nullptr, "id", "deps", "resource"};
+
+  int declareResource(lua_State* state, LibState& libState, int cache, int base) {
+    // Declare the resource whose ID, dependencies, and resource table
+    // are at stack indices base through base+2.  cache is the stack
+    // index of the ID cache.  Returns 0 on success.  Otherwise, pushes
+    // an error message and returns the offending argument (1 through 3),
+    // or badResourceTable if the resource table could not be converted.
 
-    if (!luaL_getmetafield(state, 3, resourceTypeMetaKey)) {
-      return luaL_argerror(state, 3, "expect resource table");
+    int idIndex = base, depsIndex = base + 1, resIndex = base + 2;
+    if (!lua_istable(state, depsIndex)) {
+      lua_pushstring(state, "must be a table");
+      return 2;
+    }
+    if (!lua_istable(state, resIndex)) {
+      lua_pushstring(state, "must be a table");
+      return 3;
+    }
+    if (!luaL_getmetafield(state, resIndex, resourceTypeMetaKey)) {
+      lua_pushstring(state, "expect resource table");
+      return 3;
     }
     auto maybeTypeId = getResourceType(state, -1);
+    lua_pop(state, 1);
     uint64_t typeId;
     KJ_IF_MAYBE(t, maybeTypeId) {
       typeId = *t;
     } else {
-      return luaL_argerror(state, 3, "expect resource table");
+      lua_pushstring(state, "expect resource table");
+      return 3;
+    }
+    if (typeId != 0 && typeId != fileResId && typeId != execResId) {
+      lua_pushstring(state, "unknown resource type");
+      return 3;
     }
-    lua_pop(state, 1);
 
-    auto& libState = getStateRef(state);
+    auto& stats = libState.getStats();
     auto res = libState.newResource();
-    KJ_IF_MAYBE(id, getId(state, 1)) {
+    size_t commentSize;
+    KJ_IF_MAYBE(id, getId(state, idIndex)) {
       res.setId(id->getValue());
       res.setComment(id->getComment());
-    } else if (lua_isstring(state, 1)) {
-      auto comment = luaStringPtr(state, 1);
-      res.setId(idHash(comment));
+      commentSize = id->getComment().size();
+    } else if (lua_isstring(state, idIndex)) {
+      res.setId(stringId(state, libState, idIndex));
+      auto comment = luaStringPtr(state, idIndex);
       res.setComment(comment);
+      commentSize = comment.size();
     } else {
-      return luaL_argerror(state, 1, "expect mcm.hash or string");
+      lua_pushstring(state, "expect mcm.hash or string");
+      return 1;
     }
-    lua_len(state, 2);
+    lua_len(state, depsIndex);
     lua_Integer ndeps = lua_tointeger(state, -1);
     lua_pop(state, 1);
     if (ndeps > 0) {
       auto depList = res.initDependencies(ndeps);
-      // TODO(soon): sort
+      // Strings that miss the ID cache are left on the stack and hashed
+      // together once a batch fills up.
+      const size_t batchSize = 64;
+      kj::StringPtr pending[batchSize];
+      uint64_t pendingIds[batchSize];
+      capnp::uint pendingIndex[batchSize];
+      size_t npending = 0;
+      auto flush = [&]() {
+        idHashes(kj::arrayPtr(pending, npending), kj::arrayPtr(pendingIds, npending));
+        stats.hashes += npending;
+        int top = lua_gettop(state) - npending;
+        for (size_t j = 0; j < npending; j++) {
+          depList.set(pendingIndex[j], pendingIds[j]);
+          lua_pushvalue(state, top + 1 + j);
+          pushId(state, pendingIds[j], pending[j]);
+          lua_rawset(state, cache);
+          for (auto o : libState.getObservers()) {
+            o->idHashed(state, pendingIds[j], pending[j]);
+          }
+        }
+        lua_settop(state, top);
+        npending = 0;
+      };
+      luaL_checkstack(state, batchSize + 4, nullptr);
       for (lua_Integer i = 1; i <= ndeps; i++) {
-        lua_geti(state, 2, i);
+        lua_geti(state, depsIndex, i);
         KJ_IF_MAYBE(id, getId(state, -1)) {
           depList.set(i-1, id->getValue());
+        } else if (lua_type(state, -1) == LUA_TSTRING) {
+          lua_pushvalue(state, -1);
+          lua_rawget(state, cache);
+          KJ_IF_MAYBE(id, getId(state, -1)) {
+            depList.set(i-1, id->getValue());
+            lua_pop(state, 1);
+          } else {
+            lua_pop(state, 1);
+            pending[npending] = luaStringPtr(state, -1);
+            pendingIndex[npending] = i-1;
+            if (++npending == batchSize) {
+              flush();
+            }
+            continue;  // keep the string on the stack until it is hashed
+          }
         } else if (lua_isstring(state, -1)) {
-          depList.set(i-1, idHash(luaStringPtr(state, -1)));
+          depList.set(i-1, pushHashId(state, libState, -1).getValue());
+          lua_pop(state, 1);
         } else {
-          return luaL_argerror(state, 2, "expect deps to contain only mcm.hash or strings");
+          lua_settop(state, lua_gettop(state) - npending - 1);
+          lua_pushstring(state, "expect deps to contain only mcm.hash or strings");
+          return 2;
         }
         lua_pop(state, 1);
       }
+      if (npending > 0) {
+        flush();
+      }
+      if (libState.isCanonical()) {
+        sortIds(depList, [&](capnp::uint n) { return res.initDependencies(n); });
+      }
     }
 
+    // Counters are only updated once the resource is known to be good.
+    auto convertBefore = stats.convert;
+    lua_pushvalue(state, resIndex);  // copyStruct converts the top of the stack
+    kj::Maybe<kj::Exception> maybeExc;
     switch (typeId) {
     case 0:
       res.setNoop();
@@ -173,42 +369,357 @@ namespace {
     case fileResId:
       {
         auto f = res.initFile();
-        auto maybeExc = kj::runCatchingExceptions([state, &f]() {
+        maybeExc = kj::runCatchingExceptions([state, &f]() {
           copyStruct(state, f);
         });
-        KJ_IF_MAYBE(e, maybeExc) {
-          pushLua(state, *e);
-          return lua_error(state);
-        }
       }
       break;
     case execResId:
       {
         auto e = res.initExec();
-        auto maybeExc = kj::runCatchingExceptions([state, &e]() {
+        maybeExc = kj::runCatchingExceptions([state, &e]() {
           copyStruct(state, e);
         });
-        KJ_IF_MAYBE(e, maybeExc) {
-          pushLua(state, *e);
-          return lua_error(state);
+        if (maybeExc == nullptr) {
+          auto cond = e.getCondition();
+          if (libState.isCanonical() && cond.isIfDepsChanged()) {
+            sortIds(cond.getIfDepsChanged(), [&](capnp::uint n) { return cond.initIfDepsChanged(n); });
+          }
         }
       }
       break;
-    default:
-      return luaL_argerror(state, 3, "unknown resource type");
+    }
+    lua_pop(state, 1);
+    KJ_IF_MAYBE(e, maybeExc) {
+      stats.convert = convertBefore;
+      pushLua(state, e->getDescription());
+      return badResourceTable;
+    }
+    bool isNew = true;
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { isNew = libState.declare(res.asReader()); })) {
+      stats.convert = convertBefore;
+      pushLua(state, e->getDescription());
+      return 1;
+    }
+    if (!isNew) {
+      stats.convert = convertBefore;
+      return 0;  // already included
+    }
+    switch (typeId) {
+    case 0: stats.noops++; break;
+    case fileResId: stats.files++; break;
+    case execResId: stats.execs++; break;
+    }
+    stats.dependencies += res.asReader().getDependencies().size();
+    stats.convert.textBytes += commentSize;
+    for (auto o : libState.getObservers()) {
+      o->resourceDeclared(state, res.asReader());
+    }
+    libState.finishResource();
+    return 0;
+  }
+
+  int resourcefunc(lua_State* state) {
+    if (lua_gettop(state) != 3) {
+      return luaL_error(state, "'mcm.resource' takes 3 arguments, got %d", lua_gettop(state));
+    }
+    auto& libState = getStateRef(state);
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &idCacheKey);
+    int status = declareResource(state, libState, 4, 1);
+    if (status == badResourceTable) {
+      luaL_where(state, 1);
+      lua_insert(state, -2);
+      lua_concat(state, 2);
+      return lua_error(state);
+    } else if (status != 0) {
+      return luaL_argerror(state, status, lua_tostring(state, -1));
     }
     return 0;
   }
 
+  int resourcesfunc(lua_State* state) {
+    // mcm.resources{{id, deps, resource}, ...}: declare many resources
+    // with one call.  Entries before a bad one stay declared.
+
+    if (lua_gettop(state) != 1) {
+      return luaL_error(state, "'mcm.resources' takes 1 argument, got %d", lua_gettop(state));
+    }
+    luaL_argcheck(state, lua_istable(state, 1), 1, "must be a table");
+    auto& libState = getStateRef(state);
+    lua_rawgetp(state, LUA_REGISTRYINDEX, &idCacheKey);
+    const int cache = 2, base = 3;
+    lua_Integer n = luaL_len(state, 1);
+    for (lua_Integer i = 1; i <= n; i++) {
+      if (lua_rawgeti(state, 1, i) != LUA_TTABLE) {
+        return luaL_error(state, "bad entry #%d to 'resources' (table expected, got %s)",
+                          static_cast<int>(i), luaL_typename(state, -1));
+      }
+      lua_rawgeti(state, base, 1);
+      lua_rawgeti(state, base, 2);
+      lua_rawgeti(state, base, 3);
+      int status = declareResource(state, libState, cache, base + 1);
+      if (status == badResourceTable) {
+        return luaL_error(state, "bad entry #%d to 'resources' (%s)",
+                          static_cast<int>(i), lua_tostring(state, -1));
+      } else if (status != 0) {
+        return luaL_error(state, "bad entry #%d to 'resources' (%s: %s)",
+                          static_cast<int>(i), declareArgNames[status], lua_tostring(state, -1));
+      }
+      lua_settop(state, cache);
+    }
+    return 0;
+  }
+
+  int includefunc(lua_State* state) {
+    if (lua_gettop(state) != 1) {
+      return luaL_error(state, "'mcm.include' takes 1 argument, got %d", lua_gettop(state));
+    }
+    luaL_argcheck(state, lua_isstring(state, 1), 1, "must be a string");
+    auto& libState = getStateRef(state);
+    bool failed = false;
+    {
+      auto path = kj::heapString(luaStringPtr(state, 1));
+      KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { libState.include(state, path); })) {
+        luaL_where(state, 1);
+        pushLua(state, e->getDescription());
+        lua_concat(state, 2);
+        failed = true;
+      }
+    }
+    if (failed) {
+      return lua_error(state);  // after the exception's destructor has run
+    }
+    return 0;
+  }
+
+  int loadfunc(lua_State* state) {
+    if (lua_gettop(state) != 1) {
+      return luaL_error(state, "'mcm.load' takes 1 argument, got %d", lua_gettop(state));
+    }
+    luaL_argcheck(state, lua_isstring(state, 1), 1, "must be a string");
+    auto& libState = getStateRef(state);
+    bool failed = false;
+    {
+      auto path = kj::heapString(luaStringPtr(state, 1));
+      KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { libState.load(state, path); })) {
+        pushLua(state, *e);
+        failed = true;
+      }
+    }
+    if (failed) {
+      return lua_error(state);  // after the exception's destructor has run
+    }
+    return 1;
+  }
+
+  inline bool isShellSafe(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '-' || c == '_' || c == '/' || c == '.';
+  }
+
+  int shquotefunc(lua_State* state) {
+    // mcm.shquote(s): s quoted for a POSIX shell, as shlib.quote does.
+
+    if (lua_gettop(state) != 1) {
+      return luaL_error(state, "'mcm.shquote' takes 1 argument, got %d", lua_gettop(state));
+    }
+    luaL_checktype(state, 1, LUA_TSTRING);
+    size_t len;
+    const char* s = lua_tolstring(state, 1, &len);
+    if (len == 0) {
+      lua_pushliteral(state, "''");
+      return 1;
+    }
+    size_t quotes = 0;
+    bool safe = true;
+    for (size_t i = 0; i < len; i++) {
+      if (s[i] == '\'') {
+        quotes++;
+      }
+      safe = safe && isShellSafe(s[i]);
+    }
+    if (safe) {
+      return 1;  // the argument itself
+    }
+    size_t outLen = len + 3 * quotes + 2;
+    luaL_Buffer b;
+    char* out = luaL_buffinitsize(state, &b, outLen);
+    *out++ = '\'';
+    for (size_t i = 0; i < len; i++) {
+      if (s[i] == '\'') {
+        memcpy(out, "'\\''", 4);
+        out += 4;
+      } else {
+        *out++ = s[i];
+      }
+    }
+    *out++ = '\'';
+    luaL_pushresultsize(&b, outLen);
+    return 1;
+  }
+
+  inline bool isRegexSpecial(char c) {
+    // POSIX.2 BRE special characters, plus slash so that the result can
+    // be used as a sed address.
+    return c == '.' || c == '[' || c == '\\' || c == '*' || c == '^' || c == '$' || c == '/';
+  }
+
+  int escaperegexfunc(lua_State* state) {
+    // mcm.escapeRegex(s): s with a backslash before each character that
+    // is special in a basic regular expression, as configs.escapeRegex.
+
+    if (lua_gettop(state) != 1) {
+      return luaL_error(state, "'mcm.escapeRegex' takes 1 argument, got %d", lua_gettop(state));
+    }
+    luaL_checktype(state, 1, LUA_TSTRING);
+    size_t len;
+    const char* s = lua_tolstring(state, 1, &len);
+    size_t specials = 0;
+    for (size_t i = 0; i < len; i++) {
+      specials += isRegexSpecial(s[i]);
+    }
+    if (specials == 0) {
+      return 1;  // the argument itself
+    }
+    luaL_Buffer b;
+    char* out = luaL_buffinitsize(state, &b, len + specials);
+    for (size_t i = 0; i < len; i++) {
+      if (isRegexSpecial(s[i])) {
+        *out++ = '\\';
+      }
+      *out++ = s[i];
+    }
+    luaL_pushresultsize(&b, len + specials);
+    return 1;
+  }
+
+  const char* const bufferMetaName = "mcm buffer";
+
+  class StringBuffer {
+    // The userdata behind mcm.buffer.  Unlike a luaL_Buffer, it can
+    // outlive the C function that created it.  The characters come from
+    // the state's allocator, so they count against the memory budget.
+
+  public:
+    void add(lua_State* state, const char* s, size_t n) {
+      if (size + n > capacity) {
+        size_t newCapacity = kj::max(size + n, capacity * 2 + 64);
+        void* ud;
+        lua_Alloc allocf = lua_getallocf(state, &ud);
+        void* p = allocf(ud, chars, capacity, newCapacity);
+        if (p == nullptr) {
+          // Like luaL_Buffer; the old characters are kept.
+          luaL_error(state, "not enough memory for buffer allocation");
+        }
+        chars = reinterpret_cast<char*>(p);
+        capacity = newCapacity;
+      }
+      memcpy(chars + size, s, n);
+      size += n;
+    }
+
+    void release(lua_State* state) {
+      if (chars != nullptr) {
+        void* ud;
+        lua_Alloc allocf = lua_getallocf(state, &ud);
+        allocf(ud, chars, capacity, 0);
+        chars = nullptr;
+      }
+      size = capacity = 0;
+    }
+
+    inline void clear() { size = 0; }
+    inline kj::ArrayPtr<const char> get() const { return kj::arrayPtr(chars, size); }
+
+  private:
+    char* chars = nullptr;
+    size_t size = 0;
+    size_t capacity = 0;
+  };
+
+  StringBuffer& checkBuffer(lua_State* state, int index) {
+    return *reinterpret_cast<StringBuffer*>(luaL_checkudata(state, index, bufferMetaName));
+  }
+
+  int bufferAdd(lua_State* state) {
+    // buf:add(...) appends each argument (strings or numbers) and
+    // returns buf.
+
+    auto& buf = checkBuffer(state, 1);
+    int n = lua_gettop(state);
+    for (int i = 2; i <= n; i++) {
+      size_t len;
+      const char* s = luaL_checklstring(state, i, &len);
+      buf.add(state, s, len);
+    }
+    lua_settop(state, 1);
+    return 1;
+  }
+
+  int bufferClear(lua_State* state) {
+    checkBuffer(state, 1).clear();
+    lua_settop(state, 1);
+    return 1;
+  }
+
+  int bufferToString(lua_State* state) {
+    auto s = checkBuffer(state, 1).get();
+    lua_pushlstring(state, s.begin(), s.size());
+    return 1;
+  }
+
+  int bufferLen(lua_State* state) {
+    lua_pushinteger(state, checkBuffer(state, 1).get().size());
+    return 1;
+  }
+
+  int bufferGc(lua_State* state) {
+    checkBuffer(state, 1).release(state);
+    return 0;
+  }
+
+  const luaL_Reg bufferMethods[] = {
+    {"add", bufferAdd},
+    {"clear", bufferClear},
+    {"tostring", bufferToString},
+    {NULL, NULL},
+  };
+
+  const luaL_Reg bufferMeta[] = {
+    {"__tostring", bufferToString},
+    {"__len", bufferLen},
+    {"__gc", bufferGc},
+    {NULL, NULL},
+  };
+
+  int bufferfunc(lua_State* state) {
+    // mcm.buffer(...): a new string buffer holding the arguments.
+
+    auto p = reinterpret_cast<StringBuffer*>(lua_newuserdata(state, sizeof(StringBuffer)));
+    kj::ctor(*p);
+    luaL_setmetatable(state, bufferMetaName);
+    lua_insert(state, 1);
+    return bufferAdd(state);
+  }
+
   const luaL_Reg mcmlib[] = {
+    {"buffer", bufferfunc},
+    {"escapeRegex", escaperegexfunc},
     {"exec", execfunc},
     {"file", filefunc},
     {"hash", hashfunc},
+    {"include", includefunc},
+    {"load", loadfunc},
     {"resource", resourcefunc},
+    {"resources", resourcesfunc},
+    {"shquote", shquotefunc},
     {NULL, NULL},
   };
 
   int openmcm(lua_State* state) {
+    lua_newtable(state);
+    lua_rawsetp(state, LUA_REGISTRYINDEX, &idCacheKey);
+
     luaL_newlib(state, mcmlib);
 
     lua_newtable(state);
@@ -217,20 +728,147 @@ namespace {
     lua_setfield(state, -2, resourceTypeMetaKey);  // metatable[resourceTypeMetaKey] = TOP
     lua_setmetatable(state, -2);  // pop metatable
     lua_setfield(state, -2, "noop");  // mcm.noop = TOP
+
+    luaL_newmetatable(state, bufferMetaName);
+    luaL_setfuncs(state, bufferMeta, 0);
+    luaL_newlib(state, bufferMethods);
+    lua_setfield(state, -2, "__index");
+    lua_pop(state, 1);
     return 1;
   }
 }  // namespace
 
 Resource::Builder LibState::newResource() {
-  auto orphan = scratch.getOrphanage().newOrphan<Resource>();
-  auto builder = orphan.get();
-  resources.add(kj::mv(orphan));
-  return builder;
+  if (sink != nullptr) {
+    return sink->newResource();
+  }
+  KJ_REQUIRE(message != nullptr, "no message to build resources in");
+  current = message->getOrphanage().newOrphan<Resource>();  // discards an unfinished resource
+  return current.get();
+}
+
+void LibState::finishResource() {
+  if (sink != nullptr) {
+    sink->finishResource();
+    return;
+  }
+  resources.add(kj::mv(current));
+}
+
+kj::Array<capnp::Orphan<Resource>> LibState::releaseResources() {
+  added.clear();  // may point into the released orphans
+  streamed = kj::Vector<Streamed>();
+  trackingIds = false;
+  current = capnp::Orphan<Resource>();
+  return resources.releaseAsArray();
+}
+
+bool LibState::declare(Resource::Reader resource) {
+  if (!trackingIds) {
+    if (sink != nullptr) {
+      streamed.add(Streamed{resource.getId(), resourceDigest(resource)});
+    }
+    return true;
+  }
+  auto iter = added.find(resource.getId());
+  if (iter == added.end()) {
+    if (sink != nullptr) {
+      added.insert(std::make_pair(resource.getId(), Added{nullptr, nullptr, resourceDigest(resource)}));
+    } else {
+      added.insert(std::make_pair(resource.getId(), Added{resource, nullptr, 0}));
+    }
+    return true;
+  }
+  auto& prev = iter->second;
+  if (prev.source.size() == 0) {
+    return true;  // declared twice; left to --validate
+  }
+  if (sameResource(prev, resource)) {
+    return false;
+  }
+  throw kj::Exception(kj::Exception::Type::FAILED, __FILE__, __LINE__, kj::str(
+      "resource \"", resource.getComment(), "\" (id ", kj::hex(resource.getId()),
+      ") differs from the one included from ", prev.source));
+}
+
+void LibState::startTrackingIds() {
+  // Until now, only declared resources were added.
+  trackingIds = true;
+  for (auto& r : resources) {
+    auto reader = r.getReader();
+    added.insert(std::make_pair(reader.getId(), Added{reader, nullptr, 0}));
+  }
+  for (auto& s : streamed) {
+    added.insert(std::make_pair(s.id, Added{nullptr, nullptr, s.digest}));
+  }
+  streamed = kj::Vector<Streamed>();
+}
+
+bool LibState::sameResource(const Added& prev, Resource::Reader resource) {
+  KJ_IF_MAYBE(r, prev.resource) {
+    return capnp::AnyStruct::Reader(*r).equals(capnp::AnyStruct::Reader(resource)) ==
+        capnp::Equality::EQUAL;
+  }
+  return prev.digest == resourceDigest(resource);
+}
+
+void LibState::include(lua_State* state, kj::StringPtr path) {
+  // Keep the file mapped even if a conflict stops the include partway,
+  // since added refers to its resources.
+  auto& file = *includes.add(kj::heap<CatalogFile>(path));
+  readCatalogs = true;
+  if (!trackingIds) {
+    startTrackingIds();
+  }
+  for (auto r : file.getCatalog().getResources()) {
+    auto inserted = added.insert(std::make_pair(r.getId(), Added{r, file.getPath(), 0}));
+    if (!inserted.second) {
+      if (sameResource(inserted.first->second, r)) {
+        continue;
+      }
+      auto& prev = inserted.first->second;
+      throw kj::Exception(kj::Exception::Type::FAILED, __FILE__, __LINE__, kj::str(
+          file.getPath(), ": resource \"", r.getComment(), "\" (id ", kj::hex(r.getId()),
+          ") differs from the one ", prev.source.size() > 0 ? "in " : "declared by the script",
+          prev.source));
+    }
+    switch (r.which()) {
+    case Resource::NOOP: stats.noops++; break;
+    case Resource::FILE: stats.files++; break;
+    case Resource::EXEC: stats.execs++; break;
+    }
+    stats.dependencies += r.getDependencies().size();
+    for (auto o : observers) {
+      o->resourceDeclared(state, r);
+    }
+    if (sink != nullptr) {
+      sink->addResource(r);
+      continue;
+    }
+    KJ_REQUIRE(message != nullptr, "no message to build resources in");
+    auto orphan = message->getOrphanage().newOrphanCopy(r);
+    if (canonical) {
+      auto res = orphan.get();
+      sortIds(res.getDependencies(), [&](capnp::uint n) { return res.initDependencies(n); });
+      if (res.isExec() && res.getExec().getCondition().isIfDepsChanged()) {
+        auto cond = res.getExec().getCondition();
+        sortIds(cond.getIfDepsChanged(), [&](capnp::uint n) { return cond.initIfDepsChanged(n); });
+      }
+    }
+    resources.add(kj::mv(orphan));
+  }
+}
+
+void LibState::load(lua_State* state, kj::StringPtr path) {
+  auto file = kj::heap<CatalogFile>(path);
+  readCatalogs = true;
+  pushCatalogView(state, kj::mv(file));
 }
 
 void openlib(lua_State *state, LibState& lib) {
   lua_pushlightuserdata(state, &lib);
   lua_setfield(state, LUA_REGISTRYINDEX, stateRefRegistryKey);
+  luaconv::setStats(state, &lib.getStats().convert);
   luaL_requiref(state, "mcm", openmcm, 0);  // pushes module onto the stack
 }
 
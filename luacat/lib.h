@@ -16,20 +16,67 @@
 #define MCM_LUACAT_LIB_H_
 // mcm Lua module.
 
+#include <stdint.h>
+#include <unordered_map>
 #include "kj/common.h"
+#include "kj/memory.h"
+#include "kj/string.h"
 #include "kj/vector.h"
 #include "capnp/message.h"
+#include "capnp/orphan.h"
 
 extern "C" {
 #include "lua.h"
 }
 
 #include "catalog.capnp.h"
+#include "luacat/link.h"
+#include "luacat/luaconv.h"
 
 namespace mcm {
 
 namespace luacat {
 
+class ResourceSink {
+  // Receives resources as soon as a script declares them, instead of
+  // collecting them in LibState.
+
+public:
+  virtual Resource::Builder newResource() = 0;
+  // Start a new resource, discarding any unfinished one.
+
+  virtual void finishResource() = 0;
+  // Emit the resource returned by the last call to newResource.
+
+  virtual void addResource(Resource::Reader resource) = 0;
+  // Emit a copy of a resource built elsewhere, discarding any
+  // unfinished one.
+};
+
+class ResourceObserver {
+  // Sees each resource just before it is finished.
+
+public:
+  virtual void resourceDeclared(lua_State* state, Resource::Reader resource) = 0;
+  // Called from mcm.resource (or mcm.include, for each resource it
+  // adds), so the caller is at stack level 1.
+
+  virtual void idHashed(lua_State* state, uint64_t id, kj::StringPtr s) {}
+  // Called each time a string is hashed into an ID, from the function
+  // that hashed it.  A string may be reported more than once.
+};
+
+struct LibStats {
+  // Counters kept by the mcm module as a script runs.
+
+  uint64_t noops = 0;
+  uint64_t files = 0;
+  uint64_t execs = 0;
+  uint64_t dependencies = 0;  // edges, counting duplicates unless canonical
+  uint64_t hashes = 0;  // strings hashed into IDs; cache hits don't count
+  luaconv::ConvertStats convert;  // Text and Data copied into resources
+};
+
 class LibState {
   // The mutable state of the mcm Lua module.
 public:
@@ -37,10 +84,79 @@ public:
   KJ_DISALLOW_COPY(LibState);
 
   Resource::Builder newResource();
-  inline kj::ArrayPtr<capnp::Orphan<Resource>> getResources() { return resources.asPtr(); }
+  void finishResource();
+  kj::Array<capnp::Orphan<Resource>> releaseResources();
+  // Take the resources finished so far.  The orphans must be dropped
+  // before the message they were built in.
+
+  bool declare(Resource::Reader resource);
+  // Record the resource returned by newResource before finishing it.
+  // Returns false if it is identical to an included resource with the
+  // same ID, in which case it must not be finished.  Throws if it
+  // differs from one.  Resources the script declares twice are not
+  // compared here; --validate reports them.
+
+  void include(lua_State* state, kj::StringPtr path);
+  // Add the resources in the catalog file at path, as mcm.include does.
+  // Resources identical to ones already included or declared are
+  // skipped, and different resources with the same ID are rejected.
+
+  void load(lua_State* state, kj::StringPtr path);
+  // Push a read-only view of the catalog file at path, as mcm.load
+  // does.
+
+  inline bool hasReadCatalogs() const { return readCatalogs; }
+  // Whether the script has included or loaded a catalog file.
+
+  inline void setMessage(capnp::MessageBuilder& m) { message = &m; }
+  // Allocate resources in m, so that they can be adopted into m's
+  // catalog without copying.  Must be called before the script declares
+  // any resources, unless a sink is set.  m must outlive the LibState.
+
+  inline void setSink(ResourceSink& s) { sink = &s; }
+  // Send resources to s instead of releaseResources.  s must outlive the
+  // LibState.
+
+  inline void addObserver(ResourceObserver& o) { observers.add(&o); }
+  inline kj::ArrayPtr<ResourceObserver* const> getObservers() const { return observers; }
+  // o must outlive the LibState.
+
+  inline LibStats& getStats() { return stats; }
+
+  inline void setCanonical(bool c) { canonical = c; }
+  inline bool isCanonical() const { return canonical; }
+  // Whether each resource's dependencies (and its exec condition's
+  // ifDepsChanged) are sorted and de-duplicated.
+
 private:
-  capnp::MallocMessageBuilder scratch;
+  capnp::MessageBuilder* message = nullptr;
+  capnp::Orphan<Resource> current;  // resource being built, if any
   kj::Vector<capnp::Orphan<Resource>> resources;
+  ResourceSink* sink = nullptr;
+  kj::Vector<ResourceObserver*> observers;
+  kj::Vector<kj::Own<CatalogFile>> includes;
+
+  // Resource IDs are only tracked once the script includes a catalog.
+  // Resources already sent to a sink can't be read back, so they are
+  // remembered by digest.
+  struct Added {
+    kj::Maybe<Resource::Reader> resource;  // null if sent to the sink
+    kj::StringPtr source;  // path of the included catalog, or empty if declared
+    uint64_t digest;  // only for resources sent to the sink
+  };
+  struct Streamed {
+    uint64_t id;
+    uint64_t digest;
+  };
+  bool trackingIds = false;
+  std::unordered_map<uint64_t, Added> added;  // first resource added with each ID
+  kj::Vector<Streamed> streamed;  // declared into the sink before the first include
+
+  void startTrackingIds();
+  bool sameResource(const Added& prev, Resource::Reader resource);
+  LibStats stats;
+  bool canonical = false;
+  bool readCatalogs = false;
 };
 
 void openlib(lua_State* state, LibState& lib);
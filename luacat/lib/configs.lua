@@ -41,6 +41,11 @@ function configs.escapeRegex(s)
   return table.concat(parts)
 end
 
+-- mcm-luacat provides a native version that doesn't build a table.
+if mcm and mcm.escapeRegex then
+  configs.escapeRegex = mcm.escapeRegex
+end
+
 function configs.line(id, deps, args)
   if type(args.path) ~= "string" then error("must pass [\"path\"] string to configs.line") end
   if type(args.pattern) ~= "string" then error("must pass [\"pattern\"] string to configs.line") end
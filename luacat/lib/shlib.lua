@@ -41,4 +41,9 @@ function shlib.quote(s)
   return table.concat(parts)
 end
 
+-- mcm-luacat provides a native version that doesn't build a table.
+if mcm and mcm.shquote then
+  shlib.quote = mcm.shquote
+end
+
 return shlib
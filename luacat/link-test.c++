@@ -0,0 +1,285 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/link.h"
+
+#include <string.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "capnp/message.h"
+#include "kj/debug.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/idhash.h"
+#include "luacat/io.h"
+#include "luacat/main.h"
+#include "luacat/stream.h"
+#include "luacat/testutil.h"
+
+namespace {
+
+void initCatalog(capnp::MessageBuilder& message, kj::ArrayPtr<const uint64_t> ids, kj::StringPtr path) {
+  // One file resource per ID, each depending on the one before it.
+  auto resources = message.initRoot<mcm::Catalog>().initResources(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    resources[i].setId(ids[i]);
+    resources[i].setComment(kj::str("r", ids[i]));
+    if (i > 0) {
+      resources[i].initDependencies(1).set(0, ids[i - 1]);
+    }
+    auto f = resources[i].initFile();
+    f.setPath(path);
+    f.initPlain();
+  }
+}
+
+struct ScriptResult {
+  bool ok;
+  kj::String error;
+  kj::Array<uint64_t> ids;
+};
+
+bool runLua(lua_State* state, kj::StringPtr script, ScriptResult& result) {
+  result.ok = luaL_loadbuffer(state, script.begin(), script.size(), "=test") == LUA_OK &&
+      lua_pcall(state, 0, 0, 0) == LUA_OK;
+  if (!result.ok) {
+    result.error = kj::heapString(lua_tostring(state, -1));
+  }
+  return result.ok;
+}
+
+ScriptResult runScript(kj::StringPtr script) {
+  capnp::MallocMessageBuilder message;
+  mcm::luacat::Interpreter interp;
+  auto& lib = interp.getLibState();
+  lib.setMessage(message);
+  ScriptResult result;
+  runLua(interp.getState(), script, result);
+  auto resources = lib.releaseResources();
+  result.ids = kj::heapArray<uint64_t>(resources.size());
+  for (size_t i = 0; i < resources.size(); i++) {
+    result.ids[i] = resources[i].getReader().getId();
+  }
+  return result;
+}
+
+ScriptResult runStreamedScript(kj::StringPtr script) {
+  // Like runScript, but sends resources to a CatalogStreamWriter.
+  // Only the number of resources written is reported, as zero IDs.
+
+  mcm::luacat::BufferOutputStream out;
+  mcm::luacat::CatalogStreamWriter writer(out);
+  mcm::luacat::Interpreter interp;
+  interp.getLibState().setSink(writer);
+  ScriptResult result;
+  if (runLua(interp.getState(), script, result)) {
+    writer.finish();
+  }
+  result.ids = kj::heapArray<uint64_t>(writer.getCount());
+  memset(result.ids.begin(), 0, result.ids.size() * sizeof(uint64_t));
+  return result;
+}
+
+kj::String compileToTempCatalog(kj::StringPtr script) {
+  capnp::MallocMessageBuilder message;
+  mcm::luacat::Interpreter interp;
+  auto& lib = interp.getLibState();
+  lib.setMessage(message);
+  ScriptResult result;
+  KJ_ASSERT(runLua(interp.getState(), script, result), result.error);
+  auto orphans = lib.releaseResources();
+  auto resources = message.initRoot<mcm::Catalog>().initResources(orphans.size());
+  for (size_t i = 0; i < orphans.size(); i++) {
+    resources.setWithCaveats(i, orphans[i].getReader());
+  }
+  return mcm::luacat::writeTempCatalog(message);
+}
+
+kj::String writeResourceA(kj::StringPtr comment) {
+  // A catalog with a noop resource declared as mcm.resource('a', {}, mcm.noop).
+
+  capnp::MallocMessageBuilder message;
+  auto r = message.initRoot<mcm::Catalog>().initResources(1)[0];
+  r.setId(mcm::luacat::idHash("a"));
+  r.setComment(comment);
+  r.setNoop();
+  return mcm::luacat::writeTempCatalog(message);
+}
+
+}  // namespace
+
+TEST(ResourceSetTest, KeepsIdenticalDuplicatesOnce) {
+  capnp::MallocMessageBuilder a, b;
+  const uint64_t ids[] = {1, 2};
+  initCatalog(a, ids, "/a");
+  initCatalog(b, ids, "/a");
+  auto ra = a.getRoot<mcm::Catalog>().asReader().getResources();
+  auto rb = b.getRoot<mcm::Catalog>().asReader().getResources();
+
+  mcm::luacat::ResourceSet set;
+  EXPECT_TRUE(set.add(ra[0], "a"));
+  EXPECT_TRUE(set.add(ra[1], "a"));
+  EXPECT_FALSE(set.add(rb[0], "b"));
+  EXPECT_FALSE(set.add(rb[1], "b"));
+  EXPECT_TRUE(set.contains(1));
+  EXPECT_FALSE(set.contains(3));
+}
+
+TEST(ResourceSetTest, RejectsConflictingDuplicates) {
+  capnp::MallocMessageBuilder a, b;
+  const uint64_t ids[] = {1};
+  initCatalog(a, ids, "/a");
+  initCatalog(b, ids, "/b");
+
+  mcm::luacat::ResourceSet set;
+  EXPECT_TRUE(set.add(a.getRoot<mcm::Catalog>().asReader().getResources()[0], "a.catalog"));
+  KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+    set.add(b.getRoot<mcm::Catalog>().asReader().getResources()[0], "b.catalog");
+  })) {
+    EXPECT_STREQ("b.catalog: resource \"r1\" (id 1) differs from the one in a.catalog",
+                 e->getDescription().cStr());
+  } else {
+    ADD_FAILURE() << "conflicting resource added";
+  }
+}
+
+TEST(CatalogFileTest, ReadsBothEncodings) {
+  for (bool packed : {false, true}) {
+    capnp::MallocMessageBuilder message;
+    const uint64_t ids[] = {5, 6, 7};
+    initCatalog(message, ids, "/x");
+    auto path = mcm::luacat::writeTempCatalog(message, packed);
+    KJ_DEFER(unlink(path.cStr()));
+
+    mcm::luacat::CatalogFile file(path);
+    auto resources = file.getCatalog().getResources();
+    ASSERT_EQ(3, resources.size()) << "packed=" << packed;
+    EXPECT_EQ(7, resources[2].getId());
+    EXPECT_EQ(kj::StringPtr("/x"), resources[2].getFile().getPath());
+  }
+}
+
+TEST(IncludeTest, SplicesCatalogs) {
+  capnp::MallocMessageBuilder base, extra;
+  const uint64_t baseIds[] = {1, 2};
+  const uint64_t extraIds[] = {2, 3};
+  initCatalog(base, baseIds, "/a");
+  initCatalog(extra, extraIds, "/a");
+  extra.getRoot<mcm::Catalog>().getResources()[0].initDependencies(1).set(0, 1);
+  auto basePath = mcm::luacat::writeTempCatalog(base);
+  KJ_DEFER(unlink(basePath.cStr()));
+  auto extraPath = mcm::luacat::writeTempCatalog(extra, true);
+  KJ_DEFER(unlink(extraPath.cStr()));
+
+  auto result = runScript(kj::str(
+      "mcm.include('", basePath, "')\n"
+      "mcm.resource('local', {}, mcm.noop)\n"
+      "mcm.include('", extraPath, "')\n"
+      "mcm.include('", basePath, "')\n"));
+  ASSERT_TRUE(result.ok) << result.error.cStr();
+  ASSERT_EQ(4, result.ids.size());
+  EXPECT_EQ(1, result.ids[0]);
+  EXPECT_EQ(2, result.ids[1]);
+  EXPECT_EQ(3, result.ids[3]);
+}
+
+TEST(IncludeTest, RejectsConflicts) {
+  capnp::MallocMessageBuilder a, b;
+  const uint64_t ids[] = {1};
+  initCatalog(a, ids, "/a");
+  initCatalog(b, ids, "/b");
+  auto pathA = mcm::luacat::writeTempCatalog(a);
+  KJ_DEFER(unlink(pathA.cStr()));
+  auto pathB = mcm::luacat::writeTempCatalog(b);
+  KJ_DEFER(unlink(pathB.cStr()));
+
+  auto result = runScript(kj::str(
+      "mcm.include('", pathA, "')\n"
+      "mcm.include('", pathB, "')\n"));
+  ASSERT_FALSE(result.ok);
+  EXPECT_TRUE(kj::StringPtr(result.error).startsWith("test:2: ")) << result.error.cStr();
+  EXPECT_TRUE(strstr(result.error.cStr(), "differs from the one in") != nullptr) << result.error.cStr();
+}
+
+TEST(IncludeTest, ChecksDeclaredResources) {
+  auto path = writeResourceA("a");
+  KJ_DEFER(unlink(path.cStr()));
+  auto run = [](kj::StringPtr script, bool streamed) {
+    return streamed ? runStreamedScript(script) : runScript(script);
+  };
+
+  for (bool streamed : {false, true}) {
+    SCOPED_TRACE(streamed ? "streamed" : "message");
+    {
+      auto result = run(kj::str(
+          "mcm.include('", path, "')\n"
+          "mcm.resource('a', {}, mcm.noop)\n"
+          "mcm.resource('b', {}, mcm.noop)\n"), streamed);
+      ASSERT_TRUE(result.ok) << result.error.cStr();
+      EXPECT_EQ(2, result.ids.size());
+    }
+    {
+      auto result = run(kj::str(
+          "mcm.resource('a', {}, mcm.noop)\n"
+          "mcm.resource('b', {}, mcm.noop)\n"
+          "mcm.include('", path, "')\n"), streamed);
+      ASSERT_TRUE(result.ok) << result.error.cStr();
+      EXPECT_EQ(2, result.ids.size());
+    }
+    {
+      auto result = run(kj::str(
+          "mcm.include('", path, "')\n"
+          "mcm.resource('a', {}, mcm.file{path='/site'})\n"), streamed);
+      ASSERT_FALSE(result.ok);
+      EXPECT_TRUE(kj::StringPtr(result.error).startsWith("test:2: ")) << result.error.cStr();
+      EXPECT_TRUE(strstr(result.error.cStr(), kj::str("differs from the one included from ", path).cStr()) != nullptr)
+          << result.error.cStr();
+    }
+    {
+      auto result = run(kj::str(
+          "mcm.resource('a', {}, mcm.file{path='/site'})\n"
+          "mcm.include('", path, "')\n"), streamed);
+      ASSERT_FALSE(result.ok);
+      EXPECT_TRUE(kj::StringPtr(result.error).startsWith("test:2: ")) << result.error.cStr();
+      EXPECT_TRUE(strstr(result.error.cStr(), "differs from the one declared by the script") != nullptr)
+          << result.error.cStr();
+    }
+  }
+}
+
+TEST(IncludeTest, ComparesStreamedResourcesByContent) {
+  auto decl = [](kj::StringPtr content) {
+    return kj::str("mcm.resource('a', {'b'}, mcm.file{path='/x', plain={content='", content, "'}})\n");
+  };
+  auto path = compileToTempCatalog(kj::str("mcm.resource('b', {}, mcm.noop)\n", decl("hi")));
+  KJ_DEFER(unlink(path.cStr()));
+
+  auto same = runStreamedScript(kj::str(decl("hi"), "mcm.include('", path, "')\n"));
+  ASSERT_TRUE(same.ok) << same.error.cStr();
+  EXPECT_EQ(2, same.ids.size());
+
+  auto differ = runStreamedScript(kj::str(decl("ho"), "mcm.include('", path, "')\n"));
+  ASSERT_FALSE(differ.ok);
+  EXPECT_TRUE(strstr(differ.error.cStr(), "differs from the one declared by the script") != nullptr)
+      << differ.error.cStr();
+}
+
+TEST(IncludeTest, MissingFile) {
+  auto result = runScript("mcm.include('/nonexistent/base.catalog')\n");
+  ASSERT_FALSE(result.ok);
+  EXPECT_TRUE(kj::StringPtr(result.error).startsWith("test:1: ")) << result.error.cStr();
+}
@@ -0,0 +1,77 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/link.h"
+
+#include <string.h>
+#include "kj/debug.h"
+#include "capnp/any.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+
+#include "luacat/io.h"
+
+namespace mcm {
+
+namespace luacat {
+
+capnp::ReaderOptions catalogReaderOptions() {
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = uint64_t(1) << 62;
+  return options;
+}
+
+bool isPackedCatalog(kj::ArrayPtr<const kj::byte> bytes) {
+  // A standard message starts with the little-endian segment count
+  // minus one, whose first byte is below 0x10 for any catalog
+  // mcm-luacat writes.  A packed message starts with the tag byte for
+  // that header word instead: the first segment is never empty, so one
+  // of the tag's high four bits is set, and the data byte after it is
+  // non-zero.
+
+  return bytes.size() >= 2 && bytes[0] >= 0x10 && bytes[1] != 0;
+}
+
+CatalogFile::CatalogFile(kj::StringPtr path): path(kj::heapString(path)), bytes(mapFile(path)) {
+  auto magic = STREAM_MAGIC.get();
+  KJ_REQUIRE(bytes.size() < magic.size() || memcmp(bytes.begin(), magic.begin(), magic.size()) != 0,
+             "streamed catalogs aren't supported; run mcm-luacat without --stream", path);
+  if (isPackedCatalog(bytes)) {
+    stream = kj::heap<kj::ArrayInputStream>(bytes);
+    reader = kj::heap<capnp::PackedMessageReader>(*stream, catalogReaderOptions());
+  } else {
+    KJ_REQUIRE(bytes.size() % sizeof(capnp::word) == 0, "truncated catalog", path);
+    auto words = kj::arrayPtr(reinterpret_cast<const capnp::word*>(bytes.begin()),
+                              bytes.size() / sizeof(capnp::word));
+    reader = kj::heap<capnp::FlatArrayMessageReader>(words, catalogReaderOptions());
+  }
+}
+
+bool ResourceSet::add(Resource::Reader resource, kj::StringPtr source) {
+  auto result = resources.insert(std::make_pair(resource.getId(), Entry{resource, source}));
+  if (result.second) {
+    return true;
+  }
+  auto& prev = result.first->second;
+  if (capnp::AnyStruct::Reader(prev.resource).equals(capnp::AnyStruct::Reader(resource)) ==
+      capnp::Equality::EQUAL) {
+    return false;
+  }
+  throw kj::Exception(kj::Exception::Type::FAILED, __FILE__, __LINE__, kj::str(
+      source, ": resource \"", resource.getComment(), "\" (id ", kj::hex(resource.getId()),
+      ") differs from the one in ", prev.source));
+}
+
+}  // namespace luacat
+}  // namespace mcm
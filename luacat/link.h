@@ -0,0 +1,90 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_LINK_H_
+#define MCM_LUACAT_LINK_H_
+// Combining precompiled catalogs.
+
+#include <stdint.h>
+#include <unordered_map>
+#include "kj/array.h"
+#include "kj/common.h"
+#include "kj/io.h"
+#include "kj/memory.h"
+#include "kj/string.h"
+#include "capnp/message.h"
+
+#include "catalog.capnp.h"
+
+namespace mcm {
+
+namespace luacat {
+
+capnp::ReaderOptions catalogReaderOptions();
+// Reader options for catalogs, which can be arbitrarily large.
+
+bool isPackedCatalog(kj::ArrayPtr<const kj::byte> bytes);
+// Reports whether bytes starts with a packed message.  Same test as
+// IsPacked in internal/catio.
+
+class CatalogFile {
+  // A catalog read from a file in the standard or packed encoding.
+  // Files in the standard encoding are mapped into memory and read in
+  // place.  Streamed catalogs are rejected.
+
+public:
+  explicit CatalogFile(kj::StringPtr path);
+  KJ_DISALLOW_COPY(CatalogFile);
+
+  inline kj::StringPtr getPath() const { return path; }
+  inline Catalog::Reader getCatalog() { return reader->getRoot<Catalog>(); }
+
+private:
+  kj::String path;
+  kj::Array<const kj::byte> bytes;
+  kj::Own<kj::ArrayInputStream> stream;  // only for packed catalogs
+  kj::Own<capnp::MessageReader> reader;
+};
+
+class ResourceSet {
+  // Resources gathered from several catalogs, keyed by ID.  A resource
+  // that appears in more than one catalog is kept once, but two
+  // different resources with the same ID are rejected.
+
+public:
+  ResourceSet() {}
+  KJ_DISALLOW_COPY(ResourceSet);
+
+  bool add(Resource::Reader resource, kj::StringPtr source);
+  // Returns true if resource was added, or false if an identical
+  // resource already was.  Throws if a different resource with the
+  // same ID was added.  resource and source must outlive the set.
+
+  bool contains(uint64_t id) const { return resources.count(id) > 0; }
+
+  void clear() { resources.clear(); }
+
+private:
+  struct Entry {
+    Resource::Reader resource;
+    kj::StringPtr source;
+  };
+
+  std::unordered_map<uint64_t, Entry> resources;
+};
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_LINK_H_
@@ -0,0 +1,172 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// mcm-link combines precompiled catalogs into one.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "capnp/message.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/main.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+
+#include "catalog.capnp.h"
+#include "luacat/link.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+
+class LinkMain {
+public:
+  LinkMain(kj::ProcessContext& context, kj::OutputStream& outStream):
+      context(context), outStream(&outStream) {}
+  KJ_DISALLOW_COPY(LinkMain);
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "mcm-link",
+          "Combines the resources of the catalogs FILE... into one catalog.  "
+          "A resource that appears in several catalogs is written once; two "
+          "different resources with the same ID are an error, as is a dependency "
+          "that none of the catalogs declares.")
+        .addOptionWithArg({'o'}, KJ_BIND_METHOD(*this, setOutputPath),
+            "FILE", "Write the catalog to FILE instead of stdout.")
+        .addOption({"packed"}, KJ_BIND_METHOD(*this, setPackedOutput),
+            "Write the catalog in the packed encoding.")
+        .addOption({"partial"}, KJ_BIND_METHOD(*this, setPartial),
+            "Allow dependencies that none of the catalogs declares, so that the "
+            "output can be linked again with more catalogs.")
+        .expectOneOrMoreArgs("FILE", KJ_BIND_METHOD(*this, addInput))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::OutputStream* outStream;
+  kj::Own<kj::OutputStream> ownOutStream;
+  kj::Vector<kj::String> inputs;
+  bool packedOutput = false;
+  bool partial = false;
+
+  kj::MainBuilder::Validity setOutputPath(kj::StringPtr path) {
+    int fd = open(path.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      return kj::str("open ", path, ": ", strerror(errno));
+    }
+    ownOutStream = kj::heap<kj::FdOutputStream>(kj::AutoCloseFd(fd));
+    outStream = ownOutStream.get();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPackedOutput() {
+    packedOutput = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPartial() {
+    partial = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity addInput(kj::StringPtr path) {
+    inputs.add(kj::heapString(path));
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { link(); })) {
+      context.exitError(kj::str("mcm-link: ", e->getDescription()));
+    }
+    return true;
+  }
+
+  void link() {
+    auto files = KJ_MAP(path, inputs) { return kj::heap<CatalogFile>(path); };
+    ResourceSet set;
+    kj::Vector<Resource::Reader> resources;
+    uint64_t words = 0;
+    for (auto& f : files) {
+      auto catalog = f->getCatalog();
+      for (auto r : catalog.getResources()) {
+        if (set.add(r, f->getPath())) {
+          resources.add(r);
+        }
+      }
+      words += catalog.totalSize().wordCount;
+    }
+    if (!partial) {
+      checkDependencies(set, resources);
+    }
+
+    // One segment big enough for every input catalog, packed or not,
+    // so that the output is laid out without gaps.
+    capnp::MallocMessageBuilder message(words + 16);
+    auto list = message.initRoot<Catalog>().initResources(resources.size());
+    for (size_t i = 0; i < resources.size(); i++) {
+      list.setWithCaveats(i, resources[i]);
+    }
+    if (packedOutput) {
+      capnp::writePackedMessage(*outStream, message);
+    } else {
+      capnp::writeMessage(*outStream, message);
+    }
+  }
+
+  void checkDependencies(const ResourceSet& set, kj::ArrayPtr<const Resource::Reader> resources) {
+    // Fail if any dependency is missing, listing only the first few.
+
+    const size_t maxProblems = 20;
+    kj::Vector<kj::String> lines;
+    size_t count = 0;
+    for (auto r : resources) {
+      for (uint64_t dep : r.getDependencies()) {
+        if (set.contains(dep)) {
+          continue;
+        }
+        if (count++ < maxProblems) {
+          lines.add(kj::str("  resource \"", r.getComment(), "\" depends on id ", kj::hex(dep),
+                            ", which no catalog declares"));
+        }
+      }
+    }
+    if (count == 0) {
+      return;
+    }
+    if (count > maxProblems) {
+      lines.add(kj::str("  ...and ", count - maxProblems, " more"));
+    }
+    throw kj::Exception(kj::Exception::Type::FAILED, __FILE__, __LINE__, kj::str(
+        "unresolved dependencies (use --partial to allow):\n", kj::strArray(lines, "\n")));
+  }
+};
+
+}  // namespace
+}  // namespace luacat
+}  // namespace mcm
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext context(argv[0]);
+  kj::FdOutputStream out(STDOUT_FILENO);
+  mcm::luacat::LinkMain mainObject(context, out);
+  return kj::runMainAndExit(context, mainObject.getMain(), argc, argv);
+}
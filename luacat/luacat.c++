@@ -38,5 +38,17 @@ int main(int argc, char* argv[]) {
   if (path != nullptr) {
     mainObject.setFallbackIncludePath(path);
   }
+  const char* cache = getenv("MCM_LUACAT_BYTECODE_CACHE");
+  if (cache != nullptr && cache[0] != '\0') {
+    KJ_IF_MAYBE(msg, mainObject.setBytecodeCache(cache).getError()) {
+      context.exitError(kj::str("MCM_LUACAT_BYTECODE_CACHE: ", *msg));
+    }
+  }
+  const char* outputCache = getenv("MCM_LUACAT_OUTPUT_CACHE");
+  if (outputCache != nullptr && outputCache[0] != '\0') {
+    KJ_IF_MAYBE(msg, mainObject.setOutputCache(outputCache).getError()) {
+      context.exitError(kj::str("MCM_LUACAT_OUTPUT_CACHE: ", *msg));
+    }
+  }
   return kj::runMainAndExit(context, mainObject.getMain(), argc, argv);
 }
@@ -0,0 +1,163 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks that the converters generated by capnpc-luaconv agree with the
+// reflective copyStruct.
+
+#include "luacat/luaconv.h"
+
+#include "gtest/gtest.h"
+#include "kj/exception.h"
+#include "kj/string.h"
+#include "capnp/dynamic.h"
+#include "capnp/message.h"
+#include "lua.hpp"
+
+#include "catalog.luaconv.h"
+#include "luacat/convert.h"
+#include "luacat/main.h"
+#include "luacat/testsuite.luaconv.h"
+
+namespace {
+
+struct ConvCase {
+  const char* expr;
+  const char* error;  // substring of the error, or nullptr if the conversion succeeds
+};
+
+template <typename T>
+void checkParity(const ConvCase& c) {
+  SCOPED_TRACE(c.expr);
+  mcm::luacat::Interpreter interp;
+  lua_State* state = interp.getState();
+  auto script = kj::str("return ", c.expr);
+  ASSERT_EQ(LUA_OK, luaL_dostring(state, script.cStr())) << lua_tostring(state, -1);
+
+  capnp::MallocMessageBuilder dynamicMessage;
+  auto dynamicRoot = dynamicMessage.initRoot<T>();
+  auto dynamicExc = kj::runCatchingExceptions([&]() {
+    mcm::luacat::copyStruct(state, capnp::DynamicStruct::Builder(dynamicRoot));
+  });
+  lua_settop(state, 1);
+
+  capnp::MallocMessageBuilder generatedMessage;
+  auto generatedRoot = generatedMessage.initRoot<T>();
+  auto generatedExc = kj::runCatchingExceptions([&]() {
+    mcm::luacat::copyStruct(state, generatedRoot);
+  });
+  lua_settop(state, 1);
+
+  if (c.error == nullptr) {
+    KJ_IF_MAYBE(e, dynamicExc) {
+      FAIL() << "reflective: " << e->getDescription().cStr();
+    }
+    KJ_IF_MAYBE(e, generatedExc) {
+      FAIL() << "generated: " << e->getDescription().cStr();
+    }
+    EXPECT_EQ(kj::str(dynamicRoot.asReader()), kj::str(generatedRoot.asReader()));
+    return;
+  }
+  KJ_IF_MAYBE(e, dynamicExc) {
+    EXPECT_NE(nullptr, strstr(e->getDescription().cStr(), c.error)) << e->getDescription().cStr();
+  } else {
+    ADD_FAILURE() << "reflective conversion succeeded";
+  }
+  KJ_IF_MAYBE(e, generatedExc) {
+    EXPECT_NE(nullptr, strstr(e->getDescription().cStr(), c.error)) << e->getDescription().cStr();
+  } else {
+    ADD_FAILURE() << "generated conversion succeeded";
+  }
+}
+
+}  // namespace
+
+TEST(LuaconvTest, GenericValue) {
+  const ConvCase cases[] = {
+    {"{}", nullptr},
+    {"{void = true}", nullptr},
+    {"{bool = false}", nullptr},
+    {"{bool = 1}", "non-boolean value"},
+    {"{int8 = -128}", nullptr},
+    {"{int8 = 128}", "out-of-range"},
+    {"{int16 = '42'}", nullptr},
+    {"{int32 = 1.5}", "non-integer value"},
+    {"{int64 = -0x7fffffffffffffff}", nullptr},
+    {"{int64 = {}}", "non-number value"},
+    {"{uint8 = 255}", nullptr},
+    {"{uint8 = -1}", "out-of-range"},
+    {"{uint32 = 0xffffffff}", nullptr},
+    {"{uint64 = 0x8000000000000000}", nullptr},
+    {"{uint64 = mcm.hash('foo')}", nullptr},
+    {"{uint64 = true}", "not a number or an Id"},
+    {"{float32 = 1.25}", nullptr},
+    {"{float64 = 'x'}", "non-number value"},
+    {"{text = 'hello'}", nullptr},
+    {"{text = 42}", nullptr},
+    {"{text = {}}", "non-string value"},
+    {"{data = '\\0\\1\\2'}", nullptr},
+    {"{enum = 'other'}", nullptr},
+    {"{enum = 'nope'}", "could not find enum value"},
+    {"{struct = {struct = {int8 = 1}}}", nullptr},
+    {"{struct = 1}", "non-table value"},
+    {"{structList = {{bool = true}, {text = 'x'}}}", nullptr},
+    {"{structList = {1}}", "non-table element"},
+    {"{boolList = {true, false, true}}", nullptr},
+    {"{boolList = {true, 0}}", "non-boolean element"},
+    {"{listList = {{1, 2}, {}, {3}}}", nullptr},
+    {"{listList = {{1, 'x'}}}", "non-number element"},
+    {"{listList = {{70000}}}", "out-of-range"},
+    {"{listList = {1}}", "non-table element"},
+    {"{enumList = {'this', 'that'}}", nullptr},
+    {"{enumList = {'this', 2}}", "non-string element"},
+    {"{uint64List = {1, mcm.hash('x')}}", nullptr},
+    {"{uint64List = {'1'}}", "element is not a number or an Id"},
+    {"{bogus = 1}", "could not find field"},
+    {"{[1] = true}", "could not find field"},
+    {"42", "value must be a table"},
+  };
+  for (auto& c : cases) {
+    checkParity<mcm::luacat::GenericValue>(c);
+  }
+}
+
+TEST(LuaconvTest, File) {
+  const ConvCase cases[] = {
+    {"{path = '/etc/motd', plain = {content = 'hi', mode = {bits = 420, user = {name = 'root'}}}}", nullptr},
+    {"{path = '/tmp', directory = {mode = {group = {id = 0}}}}", nullptr},
+    {"{path = '/bin/sh', symlink = {target = 'bash'}}", nullptr},
+    {"{path = '/x', absent = true}", nullptr},
+    {"{path = {}}", "non-string value"},
+    {"{path = '/x', plain = {mode = {bits = 0x10000}}}", "out-of-range"},
+    {"{path = '/x', plain = {mode = {user = {uid = 0}}}}", "could not find field"},
+  };
+  for (auto& c : cases) {
+    checkParity<mcm::File>(c);
+  }
+}
+
+TEST(LuaconvTest, Exec) {
+  const ConvCase cases[] = {
+    {"{command = {argv = {'/bin/true', '-v'}, environment = {{name = 'A', value = 'b'}}}}", nullptr},
+    {"{command = {bash = 'true', workingDirectory = '/'}, condition = {always = true}}", nullptr},
+    {"{command = {bash = 'true'}, condition = {onlyIf = {argv = {'test'}}}}", nullptr},
+    {"{command = {bash = 'true'}, condition = {fileAbsent = '/x'}}", nullptr},
+    {"{command = {bash = 'true'}, condition = {ifDepsChanged = {mcm.hash('a'), 2}}}", nullptr},
+    {"{command = {argv = {'/bin/true', false}}}", "non-string element"},
+    {"{command = {environment = {'A=b'}}}", "non-table element"},
+    {"{condition = 'always'}", "non-table value"},
+  };
+  for (auto& c : cases) {
+    checkParity<mcm::Exec>(c);
+  }
+}
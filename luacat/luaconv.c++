@@ -0,0 +1,137 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/luaconv.h"
+
+#include "lua.hpp"
+
+#include "luacat/convert.h"
+#include "luacat/types.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace luaconv {
+
+namespace {
+  inline ConvertStats* getStats(lua_State* state) {
+    return *reinterpret_cast<ConvertStats**>(lua_getextraspace(state));
+  }
+}  // namespace
+
+void setStats(lua_State* state, ConvertStats* stats) {
+  *reinterpret_cast<ConvertStats**>(lua_getextraspace(state)) = stats;
+}
+
+void requireTable(lua_State* state, bool element) {
+  if (element) {
+    int ty = lua_type(state, -1);
+    KJ_REQUIRE(ty == LUA_TTABLE, "non-table element");
+  } else {
+    KJ_REQUIRE(lua_istable(state, -1), "non-table value");
+  }
+}
+
+capnp::uint tableLen(lua_State* state, bool element) {
+  requireTable(state, element);
+  lua_len(state, -1);
+  lua_Integer n = lua_tointeger(state, -1);
+  lua_pop(state, 1);
+  return n;
+}
+
+void pushElement(lua_State* state, capnp::uint i) {
+  KJ_ASSERT(lua_checkstack(state, 2), "recursion depth exceeded");
+  lua_geti(state, -1, lua_Integer(i) + 1);
+}
+
+bool toBool(lua_State* state, bool element) {
+  if (element) {
+    int ty = lua_type(state, -1);
+    KJ_REQUIRE(ty == LUA_TBOOLEAN, "non-boolean element");
+  } else {
+    KJ_REQUIRE(lua_isboolean(state, -1), "non-boolean value");
+  }
+  return lua_toboolean(state, -1);
+}
+
+namespace {
+  void requireNumber(lua_State* state, bool element) {
+    if (element) {
+      int ty = lua_type(state, -1);
+      KJ_REQUIRE(ty == LUA_TNUMBER, "non-number element");
+    } else {
+      KJ_REQUIRE(lua_isnumber(state, -1), "non-number value");
+    }
+  }
+
+  void requireString(lua_State* state, bool element) {
+    if (element) {
+      int ty = lua_type(state, -1);
+      KJ_REQUIRE(ty == LUA_TSTRING, "non-string element");
+    } else {
+      KJ_REQUIRE(lua_isstring(state, -1), "non-string value");
+    }
+  }
+}  // namespace
+
+int64_t toInteger(lua_State* state, bool element) {
+  requireNumber(state, element);
+  int isint = 0;
+  int64_t value = lua_tointegerx(state, -1, &isint);
+  KJ_REQUIRE(isint, "non-integer value");
+  return value;
+}
+
+uint64_t toUInt64(lua_State* state, bool element) {
+  KJ_IF_MAYBE(id, getId(state, -1)) {
+    return id->getValue();
+  }
+  if (element) {
+    KJ_REQUIRE(lua_type(state, -1) == LUA_TNUMBER, "element is not a number or an Id");
+  } else {
+    KJ_REQUIRE(lua_isnumber(state, -1), "value is not a number or an Id");
+  }
+  return static_cast<uint64_t>(toInteger(state, element));
+}
+
+double toFloat(lua_State* state, bool element) {
+  requireNumber(state, element);
+  return lua_tonumber(state, -1);
+}
+
+kj::StringPtr toText(lua_State* state, bool element) {
+  requireString(state, element);
+  auto s = luaStringPtr(state, -1);
+  ConvertStats* stats = getStats(state);
+  if (stats != nullptr) {
+    stats->textBytes += s.size();
+  }
+  return s;
+}
+
+kj::ArrayPtr<const kj::byte> toData(lua_State* state, bool element) {
+  requireString(state, element);
+  auto b = luaBytePtr(state, -1);
+  ConvertStats* stats = getStats(state);
+  if (stats != nullptr) {
+    stats->dataBytes += b.size();
+  }
+  return b;
+}
+
+}  // namespace luaconv
+}  // namespace luacat
+}  // namespace mcm
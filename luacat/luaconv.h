@@ -0,0 +1,87 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_LUACONV_H_
+#define MCM_LUACAT_LUACONV_H_
+// Support code for the converters generated by capnpc-luaconv.
+//
+// Each function converts the Lua value at the top of the stack in the
+// same way as copyStruct and copyList in convert.h, so that generated
+// and reflective conversions accept the same input and fail with the
+// same messages.  element is true for list elements, which are checked
+// by their Lua type, and false for struct fields, which accept
+// anything Lua can coerce.
+
+#include <stdint.h>
+#include "kj/array.h"
+#include "kj/common.h"
+#include "kj/debug.h"
+#include "kj/string.h"
+#include "capnp/common.h"
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace mcm {
+
+namespace luacat {
+
+namespace luaconv {
+
+struct ConvertStats {
+  uint64_t textBytes = 0;
+  uint64_t dataBytes = 0;
+};
+
+void setStats(lua_State* state, ConvertStats* stats);
+// Count the bytes returned by toText and toData in state in stats, or
+// stop counting if stats is null.  Stored in the state's extra space,
+// so it must be set before any threads are created.
+
+void requireTable(lua_State* state, bool element);
+
+capnp::uint tableLen(lua_State* state, bool element);
+// Returns the length of the table at the top of the stack.
+
+void pushElement(lua_State* state, capnp::uint i);
+// Pushes element i (zero-based) of the table at the top of the stack.
+
+bool toBool(lua_State* state, bool element);
+int64_t toInteger(lua_State* state, bool element);
+uint64_t toUInt64(lua_State* state, bool element);
+// Accepts an mcm.hash id as well as a number.
+double toFloat(lua_State* state, bool element);
+kj::StringPtr toText(lua_State* state, bool element);
+kj::ArrayPtr<const kj::byte> toData(lua_State* state, bool element);
+
+template <typename T>
+T toSigned(lua_State* state, bool element) {
+  int64_t value = toInteger(state, element);
+  KJ_REQUIRE(T(value) == value, "Value out-of-range for requested type.", value);
+  return value;
+}
+
+template <typename T>
+T toUnsigned(lua_State* state, bool element) {
+  uint64_t value = static_cast<uint64_t>(toInteger(state, element));
+  KJ_REQUIRE(T(value) == value, "Value out-of-range for requested type.", value);
+  return value;
+}
+
+}  // namespace luaconv
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_LUACONV_H_
@@ -14,13 +14,19 @@
 
 #include "luacat/main.h"
 
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <iostream>
 #include "gtest/gtest.h"
 #include "capnp/any.h"
+#include "capnp/serialize.h"
 #include "kj/debug.h"
 #include "kj/io.h"
 #include "kj/string.h"
 
+#include "luacat/io.h"
+#include "luacat/path.h"
 #include "luacat/testsuite.capnp.h"
 
 namespace kj {
@@ -97,6 +103,16 @@ namespace {
   inline bool isValidOption(const kj::MainBuilder::Validity& v) {
     return v.getError() == nullptr;
   }
+
+  kj::String writeTempScript(kj::StringPtr content) {
+    const char* tmp = getenv("TEST_TMPDIR");
+    auto path = mcm::luacat::joinPath(tmp != nullptr ? tmp : "/tmp", "main-test.XXXXXX").flatten();
+    int fd;
+    KJ_SYSCALL(fd = mkstemp(path.begin()));
+    kj::FdOutputStream stream{kj::AutoCloseFd(fd)};
+    stream.write(content.begin(), content.size());
+    return path;
+  }
 }  // namespace
 
 const int logBufMax = 4096;
@@ -210,3 +226,94 @@ TEST(MainTest, FallbackPathIsAtEndOfIncludes) {
   auto outString = kj::heapString(reinterpret_cast<char*>(outArray.begin()), outArray.size());
   ASSERT_EQ("?.lua;foo?.lua;bar?.lua;baz?.lua\n", outString);
 }
+
+TEST(MainTest, ParamsAreReadOnlyGlobal) {
+  FakeProcessContext ctx;
+  DiscardOutputStream discardStdout;
+  DiscardOutputStream discardLog;
+  auto logBuf = kj::heapArray<kj::byte>(logBufMax);
+  kj::ArrayOutputStream logBufStream(logBuf);
+  mcm::luacat::Main main(ctx, kj::str(), discardStdout, discardLog);
+  capnp::MallocMessageBuilder paramsMessage;
+  auto params = paramsMessage.initRoot<mcm::luacat::LuaValue>().initTable(1);
+  params[0].initKey().setString(kj::StringPtr("role").asBytes());
+  params[0].initValue().setString(kj::StringPtr("web").asBytes());
+  kj::ArrayInputStream scriptStream(kj::StringPtr(
+      "print(params.role)\n"
+      "print(pcall(function() params.role = 'db' end))\n"
+      "print(params.role)\n").asBytes());
+  capnp::MallocMessageBuilder message;
+  main.process(message, "=(load)", scriptStream, logBufStream,
+      paramsMessage.getRoot<mcm::luacat::LuaValue>().asReader());
+
+  auto outArray = logBufStream.getArray();
+  auto outString = kj::heapString(reinterpret_cast<char*>(outArray.begin()), outArray.size());
+  ASSERT_EQ("web\nfalse\t(load):2: attempt to modify a read-only table\nweb\n", outString);
+}
+
+TEST(MainTest, FailedResourceIsOmitted) {
+  FakeProcessContext ctx;
+  DiscardOutputStream discardStdout;
+  DiscardOutputStream discardLog;
+  mcm::luacat::Main main(ctx, kj::str(), discardStdout, discardLog);
+  kj::ArrayInputStream scriptStream(kj::StringPtr(
+      "mcm.resource('a', {}, mcm.file{path='/a'})\n"
+      "assert(not pcall(mcm.resource, 'bad', {}, mcm.file{path={}}))\n"
+      "mcm.resource('b', {'a'}, mcm.noop)\n").asBytes());
+  capnp::MallocMessageBuilder message;
+  main.process(message, "=(load)", scriptStream);
+
+  auto resources = message.getRoot<mcm::Catalog>().getResources();
+  ASSERT_EQ(2, resources.size());
+  EXPECT_EQ(kj::StringPtr("a"), resources[0].getComment());
+  ASSERT_TRUE(resources[0].isFile());
+  EXPECT_EQ(kj::StringPtr("/a"), resources[0].getFile().getPath());
+  EXPECT_EQ(kj::StringPtr("b"), resources[1].getComment());
+  ASSERT_EQ(1, resources[1].getDependencies().size());
+}
+
+TEST(MainTest, CanonicalOutputIgnoresDeclarationOrder) {
+  const char* scripts[] = {
+    "mcm.resource('b', {'c', 'a', 'c'}, mcm.noop)\n"
+    "mcm.resource('a', {}, mcm.file{path='/a'})\n"
+    "mcm.resource('c', {}, mcm.exec{command={bash='true'},\n"
+    "    condition={ifDepsChanged={mcm.hash('b'), mcm.hash('a'), mcm.hash('b')}}})\n",
+
+    "local t = {}\n"
+    "for i = 1, 100 do t[i] = {} end  -- move the resources around in the message\n"
+    "mcm.resource('c', {}, mcm.exec{command={bash='true'},\n"
+    "    condition={ifDepsChanged={mcm.hash('a'), mcm.hash('b')}}})\n"
+    "mcm.resource('a', {}, mcm.file{path='/a'})\n"
+    "mcm.resource('b', {'a', 'c'}, mcm.noop)\n",
+  };
+  kj::Array<kj::byte> outputs[2];
+  for (int i = 0; i < 2; i++) {
+    auto path = writeTempScript(scripts[i]);
+    FakeProcessContext ctx;
+    mcm::luacat::BufferOutputStream out;
+    DiscardOutputStream discardLog;
+    mcm::luacat::Main main(ctx, kj::str(), out, discardLog);
+    ASSERT_TRUE(isValidOption(main.setCanonicalOutput()));
+    ASSERT_TRUE(isValidOption(main.processFile(path)));
+    unlink(path.cStr());
+    outputs[i] = kj::heapArray(out.getArray());
+  }
+  ASSERT_GT(outputs[0].size(), 0);
+  EXPECT_TRUE(outputs[0].asPtr() == outputs[1].asPtr());
+
+  kj::ArrayInputStream stream(outputs[0]);
+  capnp::InputStreamMessageReader reader(stream);
+  auto resources = reader.getRoot<mcm::Catalog>().getResources();
+  ASSERT_EQ(3, resources.size());
+  EXPECT_LT(resources[0].getId(), resources[1].getId());
+  EXPECT_LT(resources[1].getId(), resources[2].getId());
+  for (auto r : resources) {
+    if (r.getComment() == "b") {
+      auto deps = r.getDependencies();
+      ASSERT_EQ(2, deps.size());
+      EXPECT_LT(deps[0], deps[1]);
+    } else if (r.getComment() == "c") {
+      ASSERT_EQ(2, r.getExec().getCondition().getIfDepsChanged().size());
+    }
+  }
+}
@@ -16,9 +16,20 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <initializer_list>
+#include <utility>
 #include "kj/debug.h"
 #include "kj/exception.h"
+#include "kj/mutex.h"
+#include "kj/thread.h"
 #include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
 
 extern "C" {
 #include "lauxlib.h"
@@ -26,8 +37,12 @@ extern "C" {
 }
 
 #include "luacat/convert.h"
+#include "luacat/io.h"
 #include "luacat/lib.h"
+#include "luacat/luaconv.h"
 #include "luacat/path.h"
+#include "luacat/stdlib.h"
+#include "luacat/stream.h"
 
 namespace mcm {
 
@@ -82,10 +97,148 @@ namespace {
     stream.write("\n", 1);
     return 0;
   }
+
+  void writeFile(kj::StringPtr path, kj::ArrayPtr<const kj::byte> data) {
+    int fd;
+    KJ_SYSCALL(fd = open(path.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666), path);
+    kj::FdOutputStream stream{kj::AutoCloseFd(fd)};
+    stream.write(data.begin(), data.size());
+  }
+
+  class CountingOutputStream: public kj::OutputStream {
+    // Counts the bytes written to an output stream.
+
+  public:
+    explicit CountingOutputStream(kj::OutputStream& inner): inner(inner) {}
+
+    void write(const void* buffer, size_t size) override {
+      inner.write(buffer, size);
+      count += size;
+    }
+
+    inline uint64_t getCount() const { return count; }
+
+  private:
+    kj::OutputStream& inner;
+    uint64_t count = 0;
+  };
+
+  class TeeOutputStream: public kj::OutputStream {
+    // Writes to an output stream while keeping a copy.
+
+  public:
+    explicit TeeOutputStream(kj::OutputStream& inner): inner(inner) {}
+
+    void write(const void* buffer, size_t size) override {
+      inner.write(buffer, size);
+      copy.write(buffer, size);
+    }
+
+    void write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+      inner.write(pieces);  // keep the write gathered
+      for (auto piece : pieces) {
+        copy.write(piece.begin(), piece.size());
+      }
+    }
+
+    inline kj::ArrayPtr<const kj::byte> getArray() { return copy.getArray(); }
+
+  private:
+    kj::OutputStream& inner;
+    BufferOutputStream copy;
+  };
+
+  bool parseScaled(kj::StringPtr s, std::initializer_list<std::pair<char, uint64_t>> units, uint64_t& result) {
+    // Parse a decimal number with an optional unit suffix.
+
+    if (s.size() == 0 || s[0] < '0' || s[0] > '9') {
+      return false;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long val = strtoull(s.cStr(), &end, 10);
+    if (errno != 0) {
+      return false;
+    }
+    uint64_t scale = 1;
+    if (*end != '\0') {
+      if (end[1] != '\0') {
+        return false;
+      }
+      bool found = false;
+      for (auto& u : units) {
+        if (*end == u.first) {
+          scale = u.second;
+          found = true;
+        }
+      }
+      if (!found) {
+        return false;
+      }
+    }
+    if (val > UINT64_MAX / scale) {
+      return false;
+    }
+    result = val * scale;
+    return true;
+  }
+
+  kj::String formatProblems(kj::ArrayPtr<const kj::String> problems) {
+    // Describe dependency graph problems, listing only the first few.
+
+    const size_t maxProblems = 20;
+    kj::Vector<kj::String> lines;
+    lines.add(kj::str("invalid dependency graph:"));
+    for (size_t i = 0; i < problems.size() && i < maxProblems; i++) {
+      lines.add(kj::str("  ", problems[i]));
+    }
+    if (problems.size() > maxProblems) {
+      lines.add(kj::str("  ...and ", problems.size() - maxProblems, " more"));
+    }
+    return kj::strArray(lines, "\n");
+  }
+
+  kj::ArrayPtr<const char> scriptStem(kj::StringPtr base) {
+    // Returns the name used for a script's output file.
+    // The returned array is only valid as long as base.
+
+    if (base.endsWith(".lua") && base.size() > 4) {
+      return base.slice(0, base.size() - 4);
+    }
+    return base;
+  }
+
+  bool isValidHostName(kj::ArrayPtr<const kj::byte> name) {
+    if (name.size() == 0) {
+      return false;
+    }
+    for (auto c : name) {
+      if (c == _::pathSep || c == 0) {
+        return false;
+      }
+    }
+    // Reject "." and "..".
+    return name.size() > 2 || name[0] != '.' || name[name.size() - 1] != '.';
+  }
+
+  kj::ArrayPtr<const char> hostName(LuaValue::Entry::Reader host) {
+    // The returned array is not NUL-terminated.
+
+    auto name = host.getKey().getString();
+    return kj::arrayPtr(reinterpret_cast<const char*>(name.begin()), name.size());
+  }
+
+  bool hostNameLess(LuaValue::Entry::Reader a, LuaValue::Entry::Reader b) {
+    auto x = hostName(a);
+    auto y = hostName(b);
+    int cmp = memcmp(x.begin(), y.begin(), kj::min(x.size(), y.size()));
+    return cmp < 0 || (cmp == 0 && x.size() < y.size());
+  }
 }  // namespace
 
 Main::Main(kj::ProcessContext& context, kj::String versionInfo, kj::OutputStream& outStream, kj::OutputStream& logStream):
-    context(context), versionInfo(kj::mv(versionInfo)), outStream(&outStream), logStream(logStream) {
+    context(context), versionInfo(kj::mv(versionInfo)), outStream(&outStream), logStream(logStream),
+    catalogWords(0) {
 }
 
 void Main::setFallbackIncludePath(kj::StringPtr include) {
@@ -131,6 +284,331 @@ kj::MainBuilder::Validity Main::setOutputPath(kj::StringPtr outPath) {
   return true;
 }
 
+kj::MainBuilder::Validity Main::setOutputDir(kj::StringPtr dir) {
+  outDir = kj::heapString(dir);
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setInventory(kj::StringPtr path) {
+  auto message = kj::heap<capnp::MallocMessageBuilder>();
+  auto maybeExc = kj::runCatchingExceptions([&]() {
+    loadParams(path, message->initRoot<LuaValue>());
+  });
+  KJ_IF_MAYBE(e, maybeExc) {
+    return kj::str(path, ": ", e->getDescription());
+  }
+  auto root = message->getRoot<LuaValue>().asReader();
+  if (!root.isTable()) {
+    return kj::str(path, ": inventory must return a table");
+  }
+  for (auto host : root.getTable()) {
+    auto key = host.getKey();
+    if (!key.isString() || !isValidHostName(key.getString())) {
+      return kj::str(path, ": inventory keys must be host names");
+    }
+  }
+  inventory = kj::mv(message);
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setJobs(kj::StringPtr n) {
+  char* end;
+  unsigned long val = strtoul(n.cStr(), &end, 10);
+  if (n.size() == 0 || *end != '\0' || val == 0 || val > 1024) {
+    return kj::str("invalid job count '", n, "'");
+  }
+  jobs = val;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setBytecodeCache(kj::StringPtr dir) {
+  if (dir.size() == 0) {
+    return kj::str("empty bytecode cache directory");
+  }
+  if (mkdir(dir.cStr(), 0777) != 0 && errno != EEXIST) {
+    return kj::str("create ", dir, ": ", strerror(errno));
+  }
+  bytecodeCache = kj::heap<BytecodeCache>(dir, versionInfo);
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setOutputCache(kj::StringPtr dir) {
+  if (dir.size() == 0) {
+    return kj::str("empty output cache directory");
+  }
+  if (mkdir(dir.cStr(), 0777) != 0 && errno != EEXIST) {
+    return kj::str("create ", dir, ": ", strerror(errno));
+  }
+  outputCache = kj::heap<OutputCache>(dir, versionInfo);
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setOutputCacheMaxSize(kj::StringPtr size) {
+  uint64_t val;
+  if (!parseScaled(size, {{'K', 1ull << 10}, {'M', 1ull << 20}, {'G', 1ull << 30}}, val)) {
+    return kj::str("invalid size '", size, "'");
+  }
+  outputCacheMaxSize = val;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setOutputCacheMaxAge(kj::StringPtr age) {
+  uint64_t val;
+  if (!parseScaled(age, {{'s', 1}, {'m', 60}, {'h', 60 * 60}, {'d', 24 * 60 * 60}}, val) ||
+      val > uint64_t(INT64_MAX)) {
+    return kj::str("invalid age '", age, "'");
+  }
+  outputCacheMaxAge = val;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setStdlibFromPath() {
+  stdlibFromPath = true;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setMaxMemory(kj::StringPtr size) {
+  uint64_t val;
+  if (!parseScaled(size, {{'K', 1ull << 10}, {'M', 1ull << 20}, {'G', 1ull << 30}}, val)) {
+    return kj::str("invalid size '", size, "'");
+  }
+  heapLimits.maxBytes = val;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setMaxInstructions(kj::StringPtr n) {
+  uint64_t val;
+  if (!parseScaled(n, {{'K', 1000}, {'M', 1000 * 1000}, {'G', 1000 * 1000 * 1000}}, val)) {
+    return kj::str("invalid count '", n, "'");
+  }
+  heapLimits.maxInstructions = val;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setProfilePath(kj::StringPtr path) {
+  if (path.size() == 0) {
+    return kj::str("empty profile path");
+  }
+  profilePath = kj::heapString(path);
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setStatsPath(kj::StringPtr path) {
+  if (path.size() == 0) {
+    return kj::str("empty stats path");
+  }
+  statsPath = kj::heapString(path);
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setStreamOutput() {
+  streamOutput = true;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setPackedOutput() {
+  packedOutput = true;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setCanonicalOutput() {
+  canonicalOutput = true;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setValidate() {
+  validateGraph = true;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setScheduleOutput() {
+  validateGraph = true;
+  scheduleOutput = true;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setIndexOutput() {
+  validateGraph = true;
+  indexOutput = true;
+  return true;
+}
+
+kj::MainBuilder::Validity Main::setServeAddress(kj::StringPtr path) {
+  serveAddress = kj::heapString(path);
+  return true;
+}
+
+kj::MainBuilder::Validity Main::addSource(kj::StringPtr src) {
+  if (src.size() == 0) {
+    return kj::str("empty source");
+  }
+  sources.add(kj::heapString(src));
+  return true;
+}
+
+kj::MainBuilder::Validity Main::run() {
+  if (serveAddress.size() > 0) {
+    if (sources.size() > 0 || inventory.get() != nullptr || outDir.size() > 0 ||
+        profilePath.size() > 0 || statsPath.size() > 0) {
+      return kj::str("--serve can't be combined with FILE arguments, --inventory, --out-dir, --profile, or --stats");
+    }
+    serve();
+    return true;
+  }
+  if (sources.size() == 0) {
+    return kj::str("missing FILE argument");
+  }
+  directoryCache = kj::heap<DirectoryCache>();
+  if (canonicalOutput && streamOutput) {
+    return kj::str("--canonical can't be combined with --stream");
+  }
+  if ((scheduleOutput || indexOutput) && streamOutput) {
+    return kj::str("--schedule and --index can't be combined with --stream");
+  }
+  if (inventory.get() == nullptr && outDir.size() == 0 && sources.size() == 1) {
+    auto result = processFile(sources[0]);
+    logCacheStats();
+    writeProfile();
+    writeStats();
+    return result;
+  }
+  if (outDir.size() == 0) {
+    return kj::str("--out-dir is required with --inventory or multiple FILE arguments");
+  }
+  if (ownOutStream.get() != nullptr) {
+    return kj::str("-o can't be combined with --out-dir");
+  }
+  if (mkdir(outDir.cStr(), 0777) != 0 && errno != EEXIST) {
+    return kj::str("create ", outDir, ": ", strerror(errno));
+  }
+  processBatch();
+  logCacheStats();
+  writeProfile();
+  writeStats();
+  return true;
+}
+
+void Main::logCacheStats() {
+  if (bytecodeCache.get() != nullptr) {
+    uint64_t hits = bytecodeCache->getHits();
+    uint64_t misses = bytecodeCache->getMisses();
+    KJ_LOG(INFO, "bytecode cache", hits, misses);
+  }
+  if (directoryCache.get() != nullptr) {
+    uint64_t listings = directoryCache->getListings();
+    uint64_t probesSaved = directoryCache->getProbesSaved();
+    KJ_LOG(INFO, "directory cache", listings, probesSaved);
+  }
+  if (outputCache.get() != nullptr) {
+    uint64_t hits = outputCache->getHits();
+    uint64_t misses = outputCache->getMisses();
+    KJ_LOG(INFO, "output cache", hits, misses);
+    if (outputCache->hasStored()) {
+      outputCache->evict(outputCacheMaxSize, outputCacheMaxAge);
+    }
+  }
+}
+
+void Main::writeProfile() {
+  if (profilePath.size() == 0) {
+    return;
+  }
+  BufferOutputStream out;
+  profile.lockShared()->write(out);
+  writeFile(profilePath, out.getArray());
+}
+
+void Main::writeStats() {
+  if (statsPath.size() == 0) {
+    return;
+  }
+  BufferOutputStream out;
+  stats.lockShared()->writeJson(out);
+  writeFile(statsPath, out.getArray());
+}
+
+void Main::processBatch() {
+  struct Job {
+    size_t script;
+    kj::Maybe<LuaValue::Reader> params;
+    kj::String outPath;
+    kj::Maybe<kj::Exception> error;
+  };
+
+  auto chunkNames = KJ_MAP(src, sources) { return kj::str("@", src); };
+  auto bases = KJ_MAP(src, sources) { return baseName(src); };
+  kj::Vector<LuaValue::Entry::Reader> sortedHosts;
+  if (inventory.get() != nullptr) {
+    for (auto host : inventory->getRoot<LuaValue>().asReader().getTable()) {
+      sortedHosts.add(host);
+    }
+    std::sort(sortedHosts.begin(), sortedHosts.end(), hostNameLess);
+  }
+
+  // Build job list, checking for output file collisions.
+  kj::Vector<Job> jobList;
+  for (size_t i = 0; i < sources.size(); i++) {
+    auto stem = scriptStem(bases[i]);
+    if (inventory.get() == nullptr) {
+      jobList.add(Job{i, nullptr, kj::str(joinPath(outDir, stem).flatten(), ".catalog"), nullptr});
+      continue;
+    }
+    for (auto host : sortedHosts) {
+      auto name = sources.size() == 1 ?
+          kj::str(hostName(host)) : kj::str(stem, "-", hostName(host));
+      jobList.add(Job{i, host.getValue(), kj::str(joinPath(outDir, name).flatten(), ".catalog"), nullptr});
+    }
+  }
+  {
+    auto paths = KJ_MAP(job, jobList) { return kj::StringPtr(job.outPath); };
+    std::sort(paths.begin(), paths.end());
+    for (size_t i = 1; i < paths.size(); i++) {
+      if (paths[i] == paths[i-1]) {
+        context.exitError(kj::str("mcm-luacat: multiple catalogs would be written to ", paths[i]));
+      }
+    }
+  }
+
+  auto scripts = KJ_MAP(src, sources) { return mapFile(src); };
+  kj::MutexGuarded<size_t> nextJob(0);
+  kj::MutexGuarded<kj::OutputStream*> log(&logStream);
+  {
+    auto threads = kj::heapArrayBuilder<kj::Own<kj::Thread>>(kj::min(jobs, jobList.size()));
+    while (!threads.isFull()) {
+      threads.add(kj::heap<kj::Thread>([&]() {
+        for (;;) {
+          size_t i;
+          {
+            auto lock = nextJob.lockExclusive();
+            if (*lock >= jobList.size()) {
+              return;
+            }
+            i = (*lock)++;
+          }
+          auto& job = jobList[i];
+          BufferOutputStream jobLog;
+          job.error = kj::runCatchingExceptions([&]() {
+            BufferOutputStream catalog;
+            compile(chunkNames[job.script], scripts[job.script], job.params, jobLog, catalog);
+            writeFile(job.outPath, catalog.getArray());
+          });
+          auto out = jobLog.getArray();
+          if (out.size() > 0) {
+            auto lock = log.lockExclusive();
+            (*lock)->write(out.begin(), out.size());
+          }
+        }
+      }));
+    }
+  }  // join threads
+
+  for (auto& job : jobList) {
+    KJ_IF_MAYBE(e, job.error) {
+      context.error(kj::str(job.outPath, ": ", e->getDescription()));
+    }
+  }
+}
+
 kj::MainBuilder::Validity Main::processFile(kj::StringPtr src) {
   if (src.size() == 0) {
     return kj::str("empty source");
@@ -143,13 +621,7 @@ kj::MainBuilder::Validity Main::processFile(kj::StringPtr src) {
   }
   auto chunkName = kj::str("@", src);
   auto maybeExc = kj::runCatchingExceptions([&]() {
-    int fd;
-    KJ_SYSCALL(fd = open(src.cStr(), O_RDONLY, 0), src);
-    kj::AutoCloseFd afd(fd);
-    kj::FdInputStream stream(kj::mv(afd));
-    capnp::MallocMessageBuilder message;
-    process(message, chunkName, stream);
-    capnp::writeMessage(*outStream, message);
+    compile(chunkName, mapFile(src), nullptr, logStream, *outStream);
   });
   KJ_IF_MAYBE(e, maybeExc) {
     context.error(e->getDescription());
@@ -158,53 +630,242 @@ kj::MainBuilder::Validity Main::processFile(kj::StringPtr src) {
   return true;
 }
 
+void Main::compile(kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> script,
+                   kj::Maybe<LuaValue::Reader> params, kj::OutputStream& log, kj::OutputStream& out) {
+  // Run a script and write its serialized catalog to out, going through
+  // the output cache if one is enabled.
+
+  auto inc = includes.flatten();
+  kj::Maybe<Digest> key;
+  if (outputCache.get() != nullptr && profilePath.size() == 0) {
+    auto k = outputCache->key(chunkName, script, buildIncludePath(chunkName, inc), params,
+                              kj::str(streamOutput ? "stream" : "message",
+                                      packedOutput ? "-packed" : "",
+                                      canonicalOutput ? "-canonical" : "",
+                                      validateGraph ? "-validate" : "",
+                                      scheduleOutput ? "-schedule" : "",
+                                      indexOutput ? "-index" : "",
+                                      stdlibFromPath ? "-stdlib-from-path" : "",
+                                      // A budget can turn a catalog into an error.
+                                      heapLimits.maxBytes != 0 ?
+                                          kj::str("-max-memory=", heapLimits.maxBytes) : kj::String(),
+                                      heapLimits.maxInstructions != 0 ?
+                                          kj::str("-max-instructions=", heapLimits.maxInstructions) :
+                                          kj::String()));
+    KJ_IF_MAYBE(r, outputCache->lookup(k)) {
+      log.write(r->output.begin(), r->output.size());
+      out.write(r->catalog.begin(), r->catalog.size());
+      auto lock = stats.lockExclusive();
+      lock->addCachedScript();
+      lock->addOutputBytes(r->catalog.size());
+      return;
+    }
+    key = k;
+  }
+
+  TeeOutputStream logTee(log);
+  TeeOutputStream outTee(out);
+  kj::OutputStream& scriptLog = key == nullptr ? log : logTee;
+  CountingOutputStream catalogOut(key == nullptr ? out : outTee);
+  kj::Own<CatalogStreamWriter> writer;
+  if (streamOutput) {
+    writer = kj::heap<CatalogStreamWriter>(catalogOut, packedOutput);
+  }
+  kj::Own<Profiler> profiler;  // outlives interp, which may run __gc code when closed
+  if (profilePath.size() > 0) {
+    profiler = kj::heap<Profiler>();
+  }
+  auto start = Timestamp::now();
+  Interpreter interp(heapLimits);
+  interp.getStats().charge(CompileStats::SETUP, start);
+  KJ_DEFER({
+    auto& s = interp.getStats();
+    s.addScript();
+    s.addOutputBytes(catalogOut.getCount());
+    stats.lockExclusive()->merge(s);
+  });
+  if (profiler.get() != nullptr) {
+    profiler->attach(interp.getState(), interp.getLibState());
+  }
+  KJ_DEFER(if (profiler.get() != nullptr) {
+    profile.lockExclusive()->merge(profiler->getProfile());
+  });
+  kj::ArrayInputStream stream(script);
+  if (writer.get() != nullptr) {
+    interp.getLibState().setSink(*writer);
+    capnp::MallocMessageBuilder message(16);  // stays empty
+    process(interp, message, chunkName, stream, scriptLog, params, inc);
+    auto t = Timestamp::now();
+    writer->finish();
+    interp.getStats().charge(CompileStats::SERIALIZE, t);
+  } else {
+    capnp::MallocMessageBuilder message(firstSegmentWords());
+    process(interp, message, chunkName, stream, scriptLog, params, inc);
+    auto t = Timestamp::now();
+    capnp::MessageBuilder* result = &message;
+    kj::Own<capnp::MallocMessageBuilder> canonical;
+    if (canonicalOutput) {
+      // Copying into a segment big enough for the whole catalog lays
+      // it out in preorder, without the gaps left by adopted orphans.
+      canonical = kj::heap<capnp::MallocMessageBuilder>(capnp::computeSerializedSizeInWords(message));
+      canonical->setRoot(message.getRoot<Catalog>().asReader());
+      result = canonical.get();
+    }
+    if (packedOutput) {
+      capnp::writePackedMessage(catalogOut, *result);
+    } else {
+      capnp::writeMessage(catalogOut, *result);
+    }
+    interp.getStats().charge(CompileStats::SERIALIZE, t);
+  }
+  KJ_IF_MAYBE(k, key) {
+    if (interp.getModules().isCacheable()) {
+      outputCache->store(*k, interp.getModules(), outTee.getArray(), logTee.getArray());
+    }
+  }
+}
+
 void Main::process(capnp::MessageBuilder& message, kj::StringPtr chunkName, kj::InputStream& stream) {
-  auto state = newLuaState();
+  process(message, chunkName, stream, logStream, nullptr);
+}
 
-  // Load libraries
-  const luaL_Reg *reg;
-  for (reg = loadedlibs; reg->func; reg++) {
-    luaL_requiref(state, reg->name, reg->func, 1);
-    lua_pop(state, 1);  // remove lib
+void Main::process(capnp::MessageBuilder& message, kj::StringPtr chunkName, kj::InputStream& stream,
+                   kj::OutputStream& log, kj::Maybe<LuaValue::Reader> params) {
+  Interpreter interp(heapLimits);
+  process(interp, message, chunkName, stream, log, params, includes.flatten());
+}
+
+void Main::process(Interpreter& interp, capnp::MessageBuilder& message, kj::StringPtr chunkName,
+                   kj::InputStream& stream, kj::OutputStream& log,
+                   kj::Maybe<LuaValue::Reader> params, kj::StringPtr includes) {
+  auto& stats = interp.getStats();
+  auto t = Timestamp::now();
+  lua_State* state = interp.getState();
+  auto& libState = interp.getLibState();
+  auto& heap = LuaHeap::from(state);
+  libState.setMessage(message);
+  libState.setCanonical(canonicalOutput);
+  if (validateGraph) {
+    interp.getValidator().attach(libState);
   }
-  LibState libState;
-  openlib(state, libState);  // push mcm module
-  lua_setglobal(state, "mcm");  // _G.mcm = module
+  KJ_DEFER(libState.releaseResources());  // don't let orphans outlive message
+  KJ_DEFER({
+    stats.addLib(libState.getStats());
+    stats.addPeakHeapBytes(heap.getPeakBytes());
+  });
 
   // Override print function.
   lua_getglobal(state, "_G");
-  lua_pushlightuserdata(state, &logStream);
+  lua_pushlightuserdata(state, &log);
   lua_pushcclosure(state, printfunc, 1);
   lua_setfield(state, -2, "print");
   lua_pop(state, 1);
 
+  // Inject parameters.
+  KJ_IF_MAYBE(p, params) {
+    pushLua(state, *p);
+    lua_setglobal(state, "params");
+  }
+
   // Set package.path
   {
-    auto inc = buildIncludePath(chunkName);
+    auto inc = buildIncludePath(chunkName, includes);
     lua_getglobal(state, "package");
     pushLua(state, inc);
     lua_setfield(state, -2, "path");
     lua_pop(state, 1);
   }
+  if (bytecodeCache.get() != nullptr || outputCache.get() != nullptr ||
+      directoryCache.get() != nullptr) {
+    kj::Maybe<BytecodeCache&> cache;
+    if (bytecodeCache.get() != nullptr) {
+      cache = *bytecodeCache;
+    }
+    kj::Maybe<DirectoryCache&> dirs;
+    if (directoryCache.get() != nullptr) {
+      dirs = *directoryCache;
+    }
+    installSearcher(state, cache, interp.getModules(), dirs);
+  }
+  if (stdlibFromPath) {
+    addStdlibSearcher(state);
+  } else {
+    preloadStdlib(state);
+  }
 
   // Run script
-  if (luaLoad(state, chunkName, stream) || lua_pcall(state, 0, 0, 0)) {
-    auto errMsg = kj::heapString(luaStringPtr(state, -1));
+  t = stats.charge(CompileStats::SETUP, t);
+  int status = luaLoad(state, chunkName, stream);
+  t = stats.charge(CompileStats::LOAD, t);
+  if (status == LUA_OK) {
+    status = lua_pcall(state, 0, 0, 0);
+    t = stats.charge(CompileStats::EXECUTE, t);
+  }
+  if (status != LUA_OK) {
+    auto errMsg = status == LUA_ERRMEM && heap.refusedAllocation() ?
+        kj::str("memory budget of ", heap.getLimits().maxBytes, " bytes exceeded") :
+        kj::heapString(luaStringPtr(state, -1));
     lua_pop(state, 1);
     throw kj::Exception(kj::Exception::Type::FAILED, __FILE__, __LINE__, kj::mv(errMsg));
   }
+  if (libState.hasReadCatalogs()) {
+    interp.getModules().setUncacheable();  // catalog files aren't tracked
+  }
+  if (validateGraph) {
+    auto problems = interp.getValidator().check();
+    if (problems.size() > 0) {
+      throw kj::Exception(kj::Exception::Type::FAILED, __FILE__, __LINE__,
+                          formatProblems(problems));
+    }
+  }
+  {
+    uint64_t peakBytes = heap.getPeakBytes();
+    KJ_LOG(INFO, "lua heap", chunkName, peakBytes);
+    auto modules = heap.getModules();
+    for (size_t i = 1; i < modules.size(); i++) {
+      KJ_LOG(INFO, "lua heap module", modules[i].name, modules[i].bytes, modules[i].allocs);
+    }
+  }
 
-  // Create catalog
+  // Create catalog (empty if resources were sent to a sink).  The
+  // resources were built in message, so adopting them only moves their
+  // pointers.  The discarded struct shells stay behind as zeroed words.
   auto catalog = message.initRoot<Catalog>();
-  auto resources = libState.getResources();
+  auto resources = libState.releaseResources();
+  if (canonicalOutput) {
+    // Stable, so duplicate IDs keep their declaration order.
+    std::stable_sort(resources.begin(), resources.end(),
+        [](const capnp::Orphan<Resource>& a, const capnp::Orphan<Resource>& b) {
+          return a.getReader().getId() < b.getReader().getId();
+        });
+  }
   auto rlist = catalog.initResources(resources.size());
-  // TODO(soon): sort
   for (size_t i = 0; i < resources.size(); i++) {
-    rlist.setWithCaveats(i, resources[i].get());
+    rlist.adoptWithCaveats(i, kj::mv(resources[i]));
+  }
+  if (scheduleOutput) {
+    buildSchedule(rlist.asReader(), catalog.initSchedule());
+  }
+  if (indexOutput) {
+    buildIndex(rlist.asReader(), catalog.initIndex());
+  }
+  stats.charge(CompileStats::ASSEMBLE, t);
+
+  size_t words = 0;
+  for (auto segment : message.getSegmentsForOutput()) {
+    words += segment.size();
   }
+  capnp::uint prev = catalogWords.load(std::memory_order_relaxed);
+  while (words > prev && !catalogWords.compare_exchange_weak(prev, words, std::memory_order_relaxed)) {}
+}
+
+capnp::uint Main::firstSegmentWords() const {
+  // Leave some room for the next catalog to be a little larger.
+  capnp::uint words = catalogWords.load(std::memory_order_relaxed);
+  return kj::max(words + words / 8, capnp::SUGGESTED_FIRST_SEGMENT_WORDS);
 }
 
-kj::String Main::buildIncludePath(kj::StringPtr chunkName) {
+kj::String Main::buildIncludePath(kj::StringPtr chunkName, kj::StringPtr includes) {
   kj::StringTree tree;
   if (chunkName.startsWith("@")) {
     // Actual file name; add containing directory.
@@ -215,7 +876,7 @@ kj::String Main::buildIncludePath(kj::StringPtr chunkName) {
     if (tree.size() > 0) {
       tree = kj::strTree(kj::mv(tree), ";");
     }
-    tree = kj::strTree(kj::mv(tree), includes.flatten());
+    tree = kj::strTree(kj::mv(tree), includes);
   }
   if (fallbackInclude.size() > 0) {
     if (tree.size() > 0) {
@@ -232,16 +893,121 @@ kj::MainFunc Main::getMain() {
           "<templates>", "Add a package path template in package.searchpath format.")
       .addOptionWithArg({'o'}, KJ_BIND_METHOD(*this, setOutputPath),
           "FILE", "Write output to FILE instead of stdout.")
-      .expectArg("FILE", KJ_BIND_METHOD(*this, processFile))
+      .addOptionWithArg({'d', "out-dir"}, KJ_BIND_METHOD(*this, setOutputDir),
+          "DIR", "Write one catalog per script (or per script and host) into DIR.")
+      .addOptionWithArg({"inventory"}, KJ_BIND_METHOD(*this, setInventory),
+          "FILE", "Run each script once per host listed in the Lua file FILE. "
+          "FILE must return a table mapping host names to parameters, which "
+          "scripts see as the global \"params\".")
+      .addOptionWithArg({'j', "jobs"}, KJ_BIND_METHOD(*this, setJobs),
+          "N", "Process up to N catalogs at once.")
+      .addOption({"stream"}, KJ_BIND_METHOD(*this, setStreamOutput),
+          "Write a streamed catalog, with each resource written as soon as it is declared. "
+          "mcm-exec can start applying a streamed catalog before it has been fully written.")
+      .addOption({"packed"}, KJ_BIND_METHOD(*this, setPackedOutput),
+          "Write catalogs in the packed Cap'n Proto encoding, which is smaller but slower to read. "
+          "mcm-exec, mcm-shellify, and mcm-dot detect the encoding on their own.")
+      .addOption({"canonical"}, KJ_BIND_METHOD(*this, setCanonicalOutput),
+          "Sort resources by ID and dependencies, so that equivalent scripts "
+          "produce byte-identical catalogs.  Can't be combined with --stream.")
+      .addOption({"validate"}, KJ_BIND_METHOD(*this, setValidate),
+          "Fail if a script's resources have duplicate or colliding IDs, depend on "
+          "undeclared resources, misuse ifDepsChanged, or form a dependency cycle.")
+      .addOption({"schedule"}, KJ_BIND_METHOD(*this, setScheduleOutput),
+          "Like --validate, and also store a topological order and level for each "
+          "resource in the catalog.  Can't be combined with --stream.")
+      .addOption({"index"}, KJ_BIND_METHOD(*this, setIndexOutput),
+          "Like --validate, and also store a sorted ID table and the dependency graph in "
+          "compressed sparse row form in the catalog, so that mcm-exec can skip building "
+          "its own.  Can't be combined with --stream.")
+      .addOption({"stdlib-from-path"}, KJ_BIND_METHOD(*this, setStdlibFromPath),
+          "Load the standard library modules (apt, configs, shlib) from package.path "
+          "when found there, instead of the copies built into mcm-luacat.  "
+          "For developing the libraries.")
+      .addOptionWithArg({"max-memory"}, KJ_BIND_METHOD(*this, setMaxMemory),
+          "SIZE", "Fail a script that uses more than SIZE bytes of Lua memory "
+          "(suffixes K, M, G allowed).")
+      .addOptionWithArg({"max-instructions"}, KJ_BIND_METHOD(*this, setMaxInstructions),
+          "N", "Fail a script that runs more than about N Lua VM instructions "
+          "(suffixes K, M, G allowed).")
+      .addOptionWithArg({"profile"}, KJ_BIND_METHOD(*this, setProfilePath),
+          "<path>", "Profile the scripts and write folded stacks and a summary to <path>.")
+      .addOptionWithArg({"stats"}, KJ_BIND_METHOD(*this, setStatsPath),
+          "<path>", "Write phase timings and catalog counters to <path> as JSON.")
+      .addOptionWithArg({"bytecode-cache"}, KJ_BIND_METHOD(*this, setBytecodeCache),
+          "DIR", "Cache compiled Lua modules in DIR.  Run with --verbose to see hit counts.")
+      .addOptionWithArg({"output-cache"}, KJ_BIND_METHOD(*this, setOutputCache),
+          "DIR", "Cache catalogs in DIR and reuse them when a script's inputs haven't changed.")
+      .addOptionWithArg({"output-cache-max-size"}, KJ_BIND_METHOD(*this, setOutputCacheMaxSize),
+          "SIZE", "Evict least recently used entries from the output cache to keep it under "
+          "SIZE bytes (suffixes K, M, G allowed; 0 means no limit).  Default: 1G.")
+      .addOptionWithArg({"output-cache-max-age"}, KJ_BIND_METHOD(*this, setOutputCacheMaxAge),
+          "AGE", "Evict output cache entries that haven't been used in AGE seconds "
+          "(suffixes m, h, d allowed; 0 means no limit).  Default: 30d.")
+      .addOptionWithArg({"serve"}, KJ_BIND_METHOD(*this, setServeAddress),
+          "SOCKET", "Serve compile requests from mcm-luacat-client on the Unix socket SOCKET.")
+      .expectZeroOrMoreArgs("FILE", KJ_BIND_METHOD(*this, addSource))
+      .callAfterParsing(KJ_BIND_METHOD(*this, run))
       .build();
 }
 
-OwnState newLuaState() {
-  // TODO(someday): use lua_newstate and set atpanic
-  lua_State* state = luaL_newstate();
-  KJ_ASSERT_NONNULL(state);
+Interpreter::Interpreter(const HeapLimits& limits): state(newLuaState(limits)) {
+  // Load libraries
+  const luaL_Reg *reg;
+  for (reg = loadedlibs; reg->func; reg++) {
+    luaL_requiref(state, reg->name, reg->func, 1);
+    lua_pop(state, 1);  // remove lib
+  }
+  LuaHeap::from(state).install(state);
+  openlib(state, lib);  // push mcm module
+  lua_setglobal(state, "mcm");  // _G.mcm = module
+}
+
+void loadParams(kj::StringPtr path, LuaValue::Builder builder) {
+  auto state = newLuaState();
+  for (const luaL_Reg* reg = loadedlibs; reg->func; reg++) {
+    luaL_requiref(state, reg->name, reg->func, 1);
+    lua_pop(state, 1);  // remove lib
+  }
+  int fd;
+  KJ_SYSCALL(fd = open(path.cStr(), O_RDONLY, 0), path);
+  kj::FdInputStream stream{kj::AutoCloseFd(fd)};
+  auto chunkName = kj::str("@", path);
+  if (luaLoad(state, chunkName, stream) || lua_pcall(state, 0, 1, 0)) {
+    auto errMsg = kj::heapString(luaStringPtr(state, -1));
+    lua_pop(state, 1);
+    throw kj::Exception(kj::Exception::Type::FAILED, __FILE__, __LINE__, kj::mv(errMsg));
+  }
+  copyValue(state, builder);
+  lua_pop(state, 1);
+}
+
+namespace {
+  int panicfunc(lua_State* state) {
+    // Lua aborts after this returns.
+    const char* msg = lua_tostring(state, -1);
+    KJ_LOG(ERROR, "unprotected error in Lua", msg == nullptr ? "(error object is not a string)" : msg);
+    return 0;
+  }
+}  // namespace
+
+OwnState newLuaState(const HeapLimits& limits) {
+  auto heap = new LuaHeap(limits);  // freed by closeLuaState
+  lua_State* state = lua_newstate(&LuaHeap::alloc, heap);
+  if (state == nullptr) {
+    delete heap;
+    KJ_FAIL_ASSERT("lua_newstate failed");
+  }
+  lua_atpanic(state, panicfunc);
+  luaconv::setStats(state, nullptr);  // the extra space starts uninitialized
   return OwnState(state);
 }
 
+void closeLuaState(lua_State* state) {
+  LuaHeap* heap = &LuaHeap::from(state);
+  lua_close(state);
+  delete heap;
+}
+
 }  // namespace luacat
 }  // namespace mcm
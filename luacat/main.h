@@ -15,21 +15,35 @@
 #ifndef MCM_LUACAT_MAIN_H_
 #define MCM_LUACAT_MAIN_H_
 
+#include <atomic>
 #include "kj/common.h"
 #include "kj/io.h"
 #include "kj/main.h"
+#include "kj/mutex.h"
 #include "kj/string.h"
 #include "kj/string-tree.h"
+#include "kj/vector.h"
 #include "capnp/message.h"
 
 extern "C" {
 #include "lua.h"
 }
 
+#include "luacat/heap.h"
+#include "luacat/lib.h"
+#include "luacat/outcache.h"
+#include "luacat/params.capnp.h"
+#include "luacat/profile.h"
+#include "luacat/searcher.h"
+#include "luacat/stats.h"
+#include "luacat/validate.h"
+
 namespace mcm {
 
 namespace luacat {
 
+class Interpreter;
+
 class Main {
 public:
   Main(kj::ProcessContext& context, kj::String versionInfo, kj::OutputStream& outStream, kj::OutputStream& logStream);
@@ -46,15 +60,122 @@ public:
   kj::MainBuilder::Validity setOutputPath(kj::StringPtr outPath);
   // Open the file at the given path as the new output stream.
 
+  kj::MainBuilder::Validity setOutputDir(kj::StringPtr dir);
+  // Write each catalog into the given directory instead of the output
+  // stream.  Required for processing more than one catalog.
+
+  kj::MainBuilder::Validity setInventory(kj::StringPtr path);
+  // Read a host inventory from the Lua file at the given path.  The
+  // file must return a table that maps host names to parameter tables.
+  // Each FILE argument is run once per host.
+
+  kj::MainBuilder::Validity setJobs(kj::StringPtr n);
+  // Set the number of worker threads used to process catalogs.
+
+  kj::MainBuilder::Validity setStreamOutput();
+  // Write catalogs in the streamed format (see streamMagic in
+  // catalog.capnp) instead of as a single message.
+
+  kj::MainBuilder::Validity setPackedOutput();
+  // Write catalogs in the packed Cap'n Proto encoding.
+
+  kj::MainBuilder::Validity setCanonicalOutput();
+  // Write catalogs with resources sorted by ID and dependency lists
+  // sorted and de-duplicated, so that equivalent scripts produce the
+  // same bytes.
+
+  kj::MainBuilder::Validity setValidate();
+  // Fail a script whose resources don't form a valid dependency graph.
+  // See GraphValidator::check.
+
+  kj::MainBuilder::Validity setScheduleOutput();
+  // Validate catalogs and include a precomputed schedule in them.
+
+  kj::MainBuilder::Validity setIndexOutput();
+  // Validate catalogs and include a precomputed dependency index in them.
+
+  kj::MainBuilder::Validity setStdlibFromPath();
+  // Look for the standard library modules on package.path before using
+  // the copies built into mcm-luacat.
+
+  kj::MainBuilder::Validity setMaxMemory(kj::StringPtr size);
+  // Limit the memory each script's interpreter may use.
+
+  kj::MainBuilder::Validity setMaxInstructions(kj::StringPtr n);
+  // Limit the number of Lua VM instructions each script may run.
+
+  kj::MainBuilder::Validity setProfilePath(kj::StringPtr path);
+  // Profile the scripts and write the result to the given path.  See
+  // Profile::write for the format.
+
+  kj::MainBuilder::Validity setStatsPath(kj::StringPtr path);
+  // Write timings and counters for the run to the given path as JSON.
+  // See CompileStats::writeJson.
+
+  kj::MainBuilder::Validity setBytecodeCache(kj::StringPtr dir);
+  // Cache compiled Lua modules in the given directory, creating it if
+  // needed.
+
+  kj::MainBuilder::Validity setOutputCache(kj::StringPtr dir);
+  // Cache catalogs in the given directory, creating it if needed.  A
+  // script is not run again if none of its inputs have changed.
+
+  kj::MainBuilder::Validity setOutputCacheMaxSize(kj::StringPtr size);
+  // Set the output cache's size limit, in bytes with an optional K, M,
+  // or G suffix.  0 means unlimited.
+
+  kj::MainBuilder::Validity setOutputCacheMaxAge(kj::StringPtr age);
+  // Set how long output cache entries are kept after they were last
+  // used, in seconds with an optional m, h, or d suffix.  0 means
+  // forever.
+
+  kj::MainBuilder::Validity setServeAddress(kj::StringPtr path);
+  // Instead of processing FILE arguments, serve Compiler RPCs on the
+  // Unix socket at the given path.
+
+  kj::MainBuilder::Validity addSource(kj::StringPtr src);
+  // Queue a script to be processed by run().
+
+  kj::MainBuilder::Validity run();
+  // Process all queued scripts.
+
   kj::MainBuilder::Validity processFile(kj::StringPtr src);
 
   void process(capnp::MessageBuilder& out, kj::StringPtr chunkName, kj::InputStream& stream);
   // Run the Lua file from the given stream.
 
+  void process(capnp::MessageBuilder& out, kj::StringPtr chunkName, kj::InputStream& stream,
+               kj::OutputStream& log, kj::Maybe<LuaValue::Reader> params);
+  // Run the Lua file from the given stream, sending print() output to
+  // log instead of the log stream.  If params is given, the script sees
+  // it as the read-only global "params".  Safe to call from multiple
+  // threads at once.
+
+  void process(Interpreter& interp, capnp::MessageBuilder& out, kj::StringPtr chunkName,
+               kj::InputStream& stream, kj::OutputStream& log,
+               kj::Maybe<LuaValue::Reader> params, kj::StringPtr includes);
+  // Run the Lua file from the given stream in an interpreter that has
+  // not run any other script.  includes is used in place of the paths
+  // added with addIncludePath.
+
+  capnp::uint firstSegmentWords() const;
+  // A first segment size for the next catalog message, estimated from
+  // the catalogs processed so far.
+
+  inline const HeapLimits& getHeapLimits() const { return heapLimits; }
+  // Limits for the interpreters that run scripts.
+
   kj::MainFunc getMain();
 
 private:
-  kj::String buildIncludePath(kj::StringPtr chunkName);
+  kj::String buildIncludePath(kj::StringPtr chunkName, kj::StringPtr includes);
+  void compile(kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> script,
+               kj::Maybe<LuaValue::Reader> params, kj::OutputStream& log, kj::OutputStream& out);
+  void processBatch();
+  void logCacheStats();
+  void writeProfile();
+  void writeStats();
+  void serve();
 
   kj::ProcessContext& context;
   kj::String versionInfo;
@@ -64,8 +185,35 @@ private:
 
   kj::StringTree includes;
   kj::String fallbackInclude;
+
+  kj::Vector<kj::String> sources;
+  kj::String outDir;
+  kj::Own<capnp::MallocMessageBuilder> inventory;  // root is a LuaValue table; null if not set
+  unsigned int jobs = 1;
+  kj::String serveAddress;
+  bool streamOutput = false;
+  bool packedOutput = false;
+  bool canonicalOutput = false;
+  bool validateGraph = false;
+  bool scheduleOutput = false;
+  bool indexOutput = false;
+  bool stdlibFromPath = false;
+  HeapLimits heapLimits;
+  kj::String profilePath;
+  kj::MutexGuarded<Profile> profile;  // merged from every script run
+  kj::String statsPath;
+  kj::MutexGuarded<CompileStats> stats;  // merged from every compile
+  kj::Own<BytecodeCache> bytecodeCache;  // null if not enabled
+  kj::Own<DirectoryCache> directoryCache;  // null when serving, since directories may change
+  kj::Own<OutputCache> outputCache;  // null if not enabled
+  uint64_t outputCacheMaxSize = uint64_t(1) << 30;
+  int64_t outputCacheMaxAge = 30 * 24 * 60 * 60;
+  std::atomic<capnp::uint> catalogWords;  // size of the largest catalog so far
 };
 
+void closeLuaState(lua_State* state);
+// Close a state created by newLuaState and free its heap.
+
 class OwnState {
   // A transferrable title to a lua_State.
   // Similar to kj::Own, but kj::Own requires a complete type for its disposers.
@@ -82,7 +230,7 @@ public:
     if (ptr == nullptr) {
       return;
     }
-    lua_close(ptr);
+    closeLuaState(ptr);
     ptr = nullptr;
   }
 
@@ -93,13 +241,13 @@ public:
     ptr = other.ptr;
     other.ptr = nullptr;
     if (ptrCopy != nullptr) {
-      lua_close(ptrCopy);
+      closeLuaState(ptrCopy);
     }
     return *this;
   }
 
   inline OwnState& operator=(decltype(nullptr)) {
-    lua_close(ptr);
+    closeLuaState(ptr);
     ptr = nullptr;
     return *this;
   }
@@ -111,8 +259,37 @@ private:
   lua_State* ptr;
 };
 
-OwnState newLuaState();
-// Create a new Lua interpreter.
+OwnState newLuaState(const HeapLimits& limits = HeapLimits());
+// Create a new Lua interpreter with its own LuaHeap.
+
+class Interpreter {
+  // A Lua interpreter with the standard libraries and the mcm module
+  // loaded.  Setup is separate from Main::process so that interpreters
+  // can be prepared ahead of time, but each one must only run a single
+  // script.
+
+public:
+  explicit Interpreter(const HeapLimits& limits = HeapLimits());
+  KJ_DISALLOW_COPY(Interpreter);
+
+  inline lua_State* getState() { return state; }
+  inline LibState& getLibState() { return lib; }
+  inline ModuleLog& getModules() { return modules; }
+  // Modules searched for by require, if a cache is enabled.
+  inline CompileStats& getStats() { return stats; }
+  inline GraphValidator& getValidator() { return validator; }
+  // Only attached to the LibState if validation is enabled.
+
+private:
+  LibState lib;
+  ModuleLog modules;
+  CompileStats stats;
+  GraphValidator validator;
+  OwnState state;  // declared last so that it's closed first
+};
+
+void loadParams(kj::StringPtr path, LuaValue::Builder builder);
+// Run the Lua file at the given path and store the value it returns.
 
 }  // namespace luacat
 }  // namespace mcm
@@ -0,0 +1,193 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/outcache.h"
+
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "gtest/gtest.h"
+#include "capnp/message.h"
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/string.h"
+
+#include "luacat/path.h"
+
+using mcm::luacat::Digest;
+using mcm::luacat::LuaValue;
+using mcm::luacat::ModuleLog;
+using mcm::luacat::OutputCache;
+using mcm::luacat::joinPath;
+
+namespace {
+  class OutputCacheTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+      const char* tmp = getenv("TEST_TMPDIR");
+      auto tmpl = joinPath(tmp != nullptr ? tmp : "/tmp", "outcache-test.XXXXXX").flatten();
+      ASSERT_NE(nullptr, mkdtemp(tmpl.begin()));
+      dir = kj::mv(tmpl);
+    }
+
+    void TearDown() override {
+      DIR* dp = opendir(dir.cStr());
+      if (dp == nullptr) {
+        return;
+      }
+      while (struct dirent* ent = readdir(dp)) {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+          unlink(joinPath(dir, ent->d_name).flatten().cStr());
+        }
+      }
+      closedir(dp);
+      rmdir(dir.cStr());
+    }
+
+    kj::String writeFile(kj::StringPtr name, kj::StringPtr content) {
+      auto path = joinPath(dir, name).flatten();
+      int fd;
+      KJ_SYSCALL(fd = open(path.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+      kj::FdOutputStream stream{kj::AutoCloseFd(fd)};
+      stream.write(content.begin(), content.size());
+      return path;
+    }
+
+    size_t countFiles(off_t* totalSize = nullptr) {
+      size_t n = 0;
+      off_t total = 0;
+      DIR* dp = opendir(dir.cStr());
+      while (struct dirent* ent = readdir(dp)) {
+        kj::StringPtr name(ent->d_name);
+        if (name.endsWith(".manifest") || name.endsWith(".result")) {
+          struct stat st;
+          KJ_SYSCALL(stat(joinPath(dir, name).flatten().cStr(), &st));
+          total += st.st_size;
+          n++;
+        }
+      }
+      closedir(dp);
+      if (totalSize != nullptr) {
+        *totalSize = total;
+      }
+      return n;
+    }
+
+    kj::String dir;
+  };
+
+  kj::String asString(kj::ArrayPtr<const kj::byte> b) {
+    return kj::heapString(reinterpret_cast<const char*>(b.begin()), b.size());
+  }
+}  // namespace
+
+TEST_F(OutputCacheTest, ParamsKeyIgnoresTableOrder) {
+  OutputCache cache(dir, "v1");
+  auto script = kj::StringPtr("print(1)").asBytes();
+  capnp::MallocMessageBuilder m1, m2;
+  auto t1 = m1.initRoot<LuaValue>().initTable(2);
+  t1[0].initKey().setInteger(1);
+  t1[0].initValue().setString(kj::StringPtr("a").asBytes());
+  t1[1].initKey().setInteger(2);
+  t1[1].initValue().setString(kj::StringPtr("b").asBytes());
+  auto t2 = m2.initRoot<LuaValue>().initTable(2);
+  t2[0].initKey().setInteger(2);
+  t2[0].initValue().setString(kj::StringPtr("b").asBytes());
+  t2[1].initKey().setInteger(1);
+  t2[1].initValue().setString(kj::StringPtr("a").asBytes());
+
+  auto k1 = cache.key("=x", script, "", m1.getRoot<LuaValue>().asReader(), "message");
+  auto k2 = cache.key("=x", script, "", m2.getRoot<LuaValue>().asReader(), "message");
+  auto k3 = cache.key("=x", script, "", nullptr, "message");
+  auto k4 = cache.key("=x", script, "/?.lua", m1.getRoot<LuaValue>().asReader(), "message");
+  EXPECT_EQ(0, memcmp(k1.begin(), k2.begin(), k1.size()));
+  EXPECT_NE(0, memcmp(k1.begin(), k3.begin(), k1.size()));
+  EXPECT_NE(0, memcmp(k1.begin(), k4.begin(), k1.size()));
+  EXPECT_NE(0, memcmp(cache.key("=x", script, "", nullptr, "message").begin(),
+                      OutputCache(dir, "v2").key("=x", script, "", nullptr, "message").begin(), k1.size()));
+  EXPECT_NE(0, memcmp(cache.key("=x", script, "", nullptr, "message").begin(),
+                      cache.key("=x", script, "", nullptr, "stream").begin(), k1.size()));
+}
+
+TEST_F(OutputCacheTest, ModuleChangeMisses) {
+  OutputCache cache(dir, "v1");
+  auto modPath = writeFile("mod.lua", "return 1\n");
+  auto path = joinPath(dir, "?.lua").flatten();
+  ModuleLog modules;
+  modules.add(ModuleLog::Entry{kj::str("mod"), kj::heapString(path), kj::heapString(modPath),
+                               mcm::luacat::digestBytes(kj::StringPtr("return 1\n").asBytes())});
+  modules.add(ModuleLog::Entry{kj::str("other"), kj::heapString(path), kj::str(), {}});
+  auto key = cache.key("=x", kj::StringPtr("script").asBytes(), path, nullptr, "message");
+
+  EXPECT_TRUE(cache.lookup(key) == nullptr);
+  cache.store(key, modules, kj::StringPtr("catalog").asBytes(), kj::StringPtr("output\n").asBytes());
+  KJ_IF_MAYBE(r, cache.lookup(key)) {
+    EXPECT_EQ(kj::StringPtr("catalog"), asString(r->catalog));
+    EXPECT_EQ(kj::StringPtr("output\n"), asString(r->output));
+  } else {
+    ADD_FAILURE() << "lookup after store missed";
+  }
+
+  writeFile("mod.lua", "return 2\n");
+  EXPECT_TRUE(cache.lookup(key) == nullptr);
+  writeFile("mod.lua", "return 1\n");
+  EXPECT_TRUE(cache.lookup(key) != nullptr);
+  writeFile("other.lua", "return 3\n");
+  EXPECT_TRUE(cache.lookup(key) == nullptr);
+  EXPECT_EQ(2, cache.getHits());
+  EXPECT_EQ(3, cache.getMisses());
+}
+
+TEST_F(OutputCacheTest, EvictsBySize) {
+  OutputCache cache(dir, "v1");
+  ModuleLog modules;
+  auto big = kj::heapArray<kj::byte>(1000);
+  memset(big.begin(), 'x', big.size());
+  for (int i = 0; i < 4; i++) {
+    cache.store(cache.key(kj::str("=", i), big, "", nullptr, "message"), modules, big, nullptr);
+  }
+  EXPECT_EQ(8, countFiles());
+  cache.evict(2500, 0);
+  off_t total;
+  size_t n = countFiles(&total);
+  EXPECT_LE(total, 2500);
+  EXPECT_GE(n, 2);
+  cache.evict(0, 0);
+  EXPECT_EQ(n, countFiles());
+}
+
+TEST_F(OutputCacheTest, EvictsByAge) {
+  OutputCache cache(dir, "v1");
+  ModuleLog modules;
+  auto key = cache.key("=x", kj::StringPtr("script").asBytes(), "", nullptr, "message");
+  cache.store(key, modules, kj::StringPtr("catalog").asBytes(), nullptr);
+  cache.evict(0, 3600);
+  EXPECT_EQ(2, countFiles());
+
+  DIR* dp = opendir(dir.cStr());
+  while (struct dirent* ent = readdir(dp)) {
+    if (ent->d_name[0] != '.') {
+      struct timeval old[2] = {{1, 0}, {1, 0}};
+      utimes(joinPath(dir, ent->d_name).flatten().cStr(), old);
+    }
+  }
+  closedir(dp);
+  cache.evict(0, 3600);
+  EXPECT_EQ(0, countFiles());
+  EXPECT_TRUE(cache.lookup(key) == nullptr);
+}
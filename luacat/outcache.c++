@@ -0,0 +1,326 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/outcache.h"
+
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <algorithm>
+#include "kj/debug.h"
+#include "kj/exception.h"
+#include "kj/vector.h"
+#include "openssl/sha.h"
+
+#include "luacat/io.h"
+#include "luacat/path.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  const char manifestMagic[] = "mcm-luacat manifest 1\n";
+  const char resultMagic[] = "mcm-luacat result 1\n";
+  const size_t resultHeaderSize = sizeof(resultMagic) - 1 + 8;
+
+  void hashU64(SHA256_CTX& ctx, uint64_t x) {
+    kj::byte buf[8];
+    for (int i = 0; i < 8; i++) {
+      buf[i] = x >> (i * 8);
+    }
+    SHA256_Update(&ctx, buf, sizeof(buf));
+  }
+
+  void hashString(SHA256_CTX& ctx, kj::ArrayPtr<const char> s) {
+    hashU64(ctx, s.size());
+    SHA256_Update(&ctx, s.begin(), s.size());
+  }
+
+  void hashValue(SHA256_CTX& ctx, LuaValue::Reader value) {
+    // Tables are hashed independently of their entries' order, since
+    // Lua table iteration order isn't stable between runs.
+
+    switch (value.which()) {
+    case LuaValue::NIL:
+      SHA256_Update(&ctx, "n", 1);
+      break;
+    case LuaValue::BOOLEAN:
+      SHA256_Update(&ctx, value.getBoolean() ? "T" : "F", 1);
+      break;
+    case LuaValue::INTEGER:
+      SHA256_Update(&ctx, "i", 1);
+      hashU64(ctx, value.getInteger());
+      break;
+    case LuaValue::NUMBER: {
+      double x = value.getNumber();
+      uint64_t bits;
+      memcpy(&bits, &x, sizeof(bits));
+      SHA256_Update(&ctx, "f", 1);
+      hashU64(ctx, bits);
+      break;
+    }
+    case LuaValue::STRING:
+      SHA256_Update(&ctx, "s", 1);
+      hashString(ctx, value.getString().asChars());
+      break;
+    case LuaValue::TABLE: {
+      auto entries = value.getTable();
+      auto digests = KJ_MAP(e, entries) {
+        SHA256_CTX ectx;
+        SHA256_Init(&ectx);
+        hashValue(ectx, e.getKey());
+        hashValue(ectx, e.getValue());
+        Digest d;
+        SHA256_Final(d.begin(), &ectx);
+        return d;
+      };
+      std::sort(digests.begin(), digests.end(), [](const Digest& a, const Digest& b) {
+        return memcmp(a.begin(), b.begin(), DIGEST_SIZE) < 0;
+      });
+      SHA256_Update(&ctx, "t", 1);
+      hashU64(ctx, digests.size());
+      for (auto& d : digests) {
+        SHA256_Update(&ctx, d.begin(), d.size());
+      }
+      break;
+    }
+    default:
+      KJ_FAIL_REQUIRE("unknown LuaValue type");
+    }
+  }
+
+  Digest resultKey(const Digest& key, kj::ArrayPtr<const ModuleLog::Entry> modules) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, key.begin(), key.size());
+    for (auto& m : modules) {
+      hashString(ctx, m.name);
+      hashString(ctx, m.path);
+      hashString(ctx, m.file);
+      if (m.file.size() > 0) {
+        SHA256_Update(&ctx, m.digest.begin(), m.digest.size());
+      }
+    }
+    Digest d;
+    SHA256_Final(d.begin(), &ctx);
+    return d;
+  }
+
+  kj::Maybe<kj::Array<kj::byte>> tryReadFile(kj::StringPtr path) {
+    if (access(path.cStr(), F_OK) != 0) {
+      return nullptr;
+    }
+    kj::Maybe<kj::Array<kj::byte>> result;
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { result = readFile(path); })) {
+      KJ_LOG(WARNING, "can't read file", path, e->getDescription());
+      return nullptr;
+    }
+    return kj::mv(result);
+  }
+
+  kj::Maybe<kj::Array<ModuleLog::Entry>> parseManifest(kj::ArrayPtr<const kj::byte> data) {
+    auto magic = kj::StringPtr(manifestMagic).asBytes();
+    if (data.size() < magic.size() || memcmp(data.begin(), magic.begin(), magic.size()) != 0) {
+      return nullptr;
+    }
+    data = data.slice(magic.size(), data.size());
+    kj::Vector<kj::String> fields;
+    while (data.size() > 0) {
+      auto end = reinterpret_cast<const kj::byte*>(memchr(data.begin(), 0, data.size()));
+      if (end == nullptr) {
+        return nullptr;
+      }
+      fields.add(kj::heapString(reinterpret_cast<const char*>(data.begin()), end - data.begin()));
+      data = data.slice(end - data.begin() + 1, data.size());
+    }
+    if (fields.size() % 3 != 0) {
+      return nullptr;
+    }
+    auto entries = kj::heapArrayBuilder<ModuleLog::Entry>(fields.size() / 3);
+    for (size_t i = 0; i < fields.size(); i += 3) {
+      entries.add(ModuleLog::Entry{kj::mv(fields[i]), kj::mv(fields[i+1]), kj::mv(fields[i+2]), {}});
+    }
+    return entries.finish();
+  }
+}  // namespace
+
+OutputCache::OutputCache(kj::StringPtr dir, kj::StringPtr version):
+    dir(kj::heapString(dir)), version(kj::heapString(version)), hits(0), misses(0), stored(false) {
+}
+
+Digest OutputCache::key(kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> script,
+                        kj::StringPtr includePath, kj::Maybe<LuaValue::Reader> params,
+                        kj::StringPtr format) {
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  hashString(ctx, version);
+  hashString(ctx, format);
+  hashString(ctx, chunkName);
+  hashString(ctx, script.asChars());
+  hashString(ctx, includePath);
+  KJ_IF_MAYBE(p, params) {
+    SHA256_Update(&ctx, "p", 1);
+    hashValue(ctx, *p);
+  } else {
+    SHA256_Update(&ctx, "-", 1);
+  }
+  Digest d;
+  SHA256_Final(d.begin(), &ctx);
+  return d;
+}
+
+kj::Maybe<OutputCache::Result> OutputCache::lookup(const Digest& key) {
+  auto manifestPath = entryPath(key, ".manifest");
+  kj::Maybe<Result> result = nullptr;
+  KJ_IF_MAYBE(data, tryReadFile(manifestPath)) {
+    KJ_IF_MAYBE(modules, parseManifest(*data)) {
+      bool unchanged = true;
+      for (auto& m : *modules) {
+        auto file = searchPath(m.name, m.path);
+        if (file != m.file) {
+          unchanged = false;
+          break;
+        }
+        if (file.size() == 0) {
+          continue;
+        }
+        KJ_IF_MAYBE(content, tryReadFile(file)) {
+          m.digest = digestBytes(*content);
+        } else {
+          unchanged = false;
+          break;
+        }
+      }
+      if (unchanged) {
+        auto resultPath = entryPath(resultKey(key, *modules), ".result");
+        KJ_IF_MAYBE(r, tryReadFile(resultPath)) {
+          auto magic = kj::StringPtr(resultMagic).asBytes();
+          if (r->size() >= resultHeaderSize && memcmp(r->begin(), magic.begin(), magic.size()) == 0) {
+            uint64_t outputSize = 0;
+            for (int i = 0; i < 8; i++) {
+              outputSize |= uint64_t((*r)[magic.size() + i]) << (i * 8);
+            }
+            if (outputSize <= r->size() - resultHeaderSize) {
+              auto rest = r->slice(resultHeaderSize, r->size());
+              result = Result{
+                kj::heapArray(rest.slice(outputSize, rest.size())),
+                kj::heapArray(rest.slice(0, outputSize)),
+              };
+              // Mark as recently used for eviction.
+              utimes(manifestPath.cStr(), nullptr);
+              utimes(resultPath.cStr(), nullptr);
+            }
+          }
+        }
+      }
+    }
+  }
+  if (result == nullptr) {
+    misses++;
+  } else {
+    hits++;
+  }
+  return kj::mv(result);
+}
+
+void OutputCache::store(const Digest& key, const ModuleLog& modules,
+                        kj::ArrayPtr<const kj::byte> catalog, kj::ArrayPtr<const kj::byte> output) {
+  KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+    kj::Vector<kj::byte> manifest;
+    auto magic = kj::StringPtr(manifestMagic).asBytes();
+    manifest.addAll(magic);
+    for (auto& m : modules.getEntries()) {
+      for (kj::StringPtr s : {kj::StringPtr(m.name), kj::StringPtr(m.path), kj::StringPtr(m.file)}) {
+        manifest.addAll(s.asBytes());
+        manifest.add(0);
+      }
+    }
+
+    kj::byte header[resultHeaderSize];
+    memcpy(header, resultMagic, sizeof(resultMagic) - 1);
+    for (int i = 0; i < 8; i++) {
+      header[sizeof(resultMagic) - 1 + i] = uint64_t(output.size()) >> (i * 8);
+    }
+    kj::ArrayPtr<const kj::byte> pieces[] = {kj::arrayPtr(header, sizeof(header)), output, catalog};
+
+    // Write the result first, so that a manifest never refers to a
+    // missing result unless it has been evicted.
+    replaceFile(entryPath(resultKey(key, modules.getEntries()), ".result"), pieces);
+    replaceFile(entryPath(key, ".manifest"), manifest);
+    stored = true;
+  })) {
+    KJ_LOG(WARNING, "can't write output cache entry", e->getDescription());
+  }
+}
+
+void OutputCache::evict(uint64_t maxSize, int64_t maxAge) {
+  struct CacheFile {
+    kj::String path;
+    uint64_t size;
+    time_t mtime;
+  };
+
+  kj::Vector<CacheFile> files;
+  {
+    DIR* d = opendir(dir.cStr());
+    if (d == nullptr) {
+      KJ_LOG(WARNING, "can't read output cache directory", dir, strerror(errno));
+      return;
+    }
+    KJ_DEFER(closedir(d));
+    while (struct dirent* ent = readdir(d)) {
+      kj::StringPtr name(ent->d_name);
+      if (!name.endsWith(".manifest") && !name.endsWith(".result")) {
+        continue;
+      }
+      auto path = joinPath(dir, name).flatten();
+      struct stat st;
+      if (stat(path.cStr(), &st) != 0) {
+        continue;
+      }
+      files.add(CacheFile{kj::mv(path), uint64_t(st.st_size), st.st_mtime});
+    }
+  }
+  std::sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b) {
+    return a.mtime < b.mtime;
+  });
+
+  uint64_t total = 0;
+  for (auto& f : files) {
+    total += f.size;
+  }
+  time_t cutoff = maxAge > 0 ? time(nullptr) - maxAge : 0;
+  for (auto& f : files) {
+    if (f.mtime >= cutoff && (maxSize == 0 || total <= maxSize)) {
+      break;
+    }
+    if (unlink(f.path.cStr()) != 0 && errno != ENOENT) {
+      KJ_LOG(WARNING, "can't remove output cache entry", f.path, strerror(errno));
+      continue;
+    }
+    total -= f.size;
+  }
+}
+
+kj::String OutputCache::entryPath(const Digest& key, kj::StringPtr ext) {
+  return kj::str(joinPath(dir, hexString(key)).flatten(), ext);
+}
+
+}  // namespace luacat
+}  // namespace mcm
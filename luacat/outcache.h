@@ -0,0 +1,90 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_OUTCACHE_H_
+#define MCM_LUACAT_OUTCACHE_H_
+// Cache of compiled catalogs, keyed by their inputs.
+
+#include <stdint.h>
+#include <atomic>
+#include "kj/array.h"
+#include "kj/common.h"
+#include "kj/string.h"
+
+#include "luacat/params.capnp.h"
+#include "luacat/searcher.h"
+
+namespace mcm {
+
+namespace luacat {
+
+class OutputCache {
+  // An on-disk cache of script results, in the style of ccache's
+  // direct mode.
+  //
+  // A script's inputs that are known before running it (the script
+  // itself, its include path, its parameters, and the luacat version)
+  // form the manifest key.  The manifest records the modules that the
+  // last run searched for.  The result is stored under a key that adds
+  // the contents of those modules, so a lookup only has to repeat the
+  // searches and hash the files that were found.
+  //
+  // Safe to use from multiple threads at once.
+
+public:
+  OutputCache(kj::StringPtr dir, kj::StringPtr version);
+  KJ_DISALLOW_COPY(OutputCache);
+
+  struct Result {
+    kj::Array<kj::byte> catalog;  // serialized message
+    kj::Array<kj::byte> output;   // print() output
+  };
+
+  Digest key(kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> script,
+             kj::StringPtr includePath, kj::Maybe<LuaValue::Reader> params,
+             kj::StringPtr format);
+  // Compute the manifest key for a script.  format names the catalog
+  // serialization, since the cache stores serialized bytes.
+
+  kj::Maybe<Result> lookup(const Digest& key);
+  // Find the result for the manifest key, if the modules it depended on
+  // are unchanged.
+
+  void store(const Digest& key, const ModuleLog& modules,
+             kj::ArrayPtr<const kj::byte> catalog, kj::ArrayPtr<const kj::byte> output);
+  // Record a result.  Failures are logged rather than thrown.
+
+  void evict(uint64_t maxSize, int64_t maxAge);
+  // Remove least recently used entries until the cache is no larger
+  // than maxSize bytes, and entries not used within maxAge seconds.
+  // Either limit may be zero to disable it.
+
+  inline uint64_t getHits() const { return hits; }
+  inline uint64_t getMisses() const { return misses; }
+  inline bool hasStored() const { return stored; }
+
+private:
+  kj::String dir;
+  kj::String version;
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<bool> stored;
+
+  kj::String entryPath(const Digest& key, kj::StringPtr ext);
+};
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_OUTCACHE_H_
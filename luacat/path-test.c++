@@ -14,6 +14,7 @@
 
 #include "luacat/path.h"
 
+#include <unistd.h>
 #include <iostream>
 #include "gtest/gtest.h"
 #include "kj/string.h"
@@ -28,6 +29,9 @@ namespace kj {
   }
 }
 
+using mcm::luacat::absolutePath;
+using mcm::luacat::absoluteSearchPath;
+using mcm::luacat::baseName;
 using mcm::luacat::dirName;
 using mcm::luacat::joinPath;
 using mcm::luacat::splitStr;
@@ -47,6 +51,16 @@ TEST(DirNameTest, ReturnsDirNested2) {
   ASSERT_EQ("foo/bar", dir);
 }
 
+TEST(BaseNameTest, NameReturnsName) {
+  auto base = baseName("foo");
+  ASSERT_EQ("foo", base);
+}
+
+TEST(BaseNameTest, ReturnsLastElement) {
+  auto base = baseName("foo/bar/baz.lua");
+  ASSERT_EQ("baz.lua", base);
+}
+
 TEST(JoinPathTest, OneComponentNop) {
   auto p = joinPath("foo");
   ASSERT_EQ("foo", kj::str(p));
@@ -97,3 +111,24 @@ TEST(SplitStrTest, EmptyDelimsAtEdges) {
   EXPECT_EQ("bar", kj::str(parts[2]));
   EXPECT_EQ("", kj::str(parts[3]));
 }
+
+TEST(AbsolutePathTest, AbsoluteIsUnchanged) {
+  EXPECT_EQ("/foo/bar.lua", absolutePath("/foo/bar.lua"));
+}
+
+TEST(AbsolutePathTest, EmptyIsUnchanged) {
+  EXPECT_EQ("", absolutePath(""));
+}
+
+TEST(AbsolutePathTest, RelativeIsJoinedToWorkingDir) {
+  char cwd[4096];
+  ASSERT_NE(nullptr, getcwd(cwd, sizeof(cwd)));
+  EXPECT_EQ(kj::str(cwd, "/lib/foo.lua"), absolutePath("lib/foo.lua"));
+}
+
+TEST(AbsoluteSearchPathTest, JoinsEachTemplate) {
+  char cwd[4096];
+  ASSERT_NE(nullptr, getcwd(cwd, sizeof(cwd)));
+  EXPECT_EQ(kj::str(cwd, "/?.lua;/usr/share/lua/?.lua;;", cwd, "/lib/?/init.lua"),
+            absoluteSearchPath("?.lua;/usr/share/lua/?.lua;;lib/?/init.lua"));
+}
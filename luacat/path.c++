@@ -14,6 +14,10 @@
 
 #include "luacat/path.h"
 
+#include <errno.h>
+#include <unistd.h>
+#include "kj/debug.h"
+
 namespace {
   template <typename T, typename E>
   size_t count(T iter, E elem) {
@@ -39,6 +43,14 @@ kj::String dirName(kj::StringPtr path) {
   }
 }
 
+kj::String baseName(kj::StringPtr path) {
+  KJ_IF_MAYBE(slashPos, path.findLast(_::pathSep)) {
+    return kj::heapString(path.slice(*slashPos + 1));
+  } else {
+    return kj::heapString(path);
+  }
+}
+
 kj::Array<kj::ArrayPtr<const char>> splitStr(kj::StringPtr s, char delim) {
   auto parts = kj::heapArray<kj::ArrayPtr<const char>>(count(s, delim) + 1);
   size_t n = 0;
@@ -54,5 +66,35 @@ kj::Array<kj::ArrayPtr<const char>> splitStr(kj::StringPtr s, char delim) {
   return parts;
 }
 
+kj::String absolutePath(kj::StringPtr path) {
+  if (path.size() == 0 || path[0] == _::pathSep) {
+    return kj::heapString(path);
+  }
+  for (size_t size = 256;; size *= 2) {
+    auto buf = kj::heapArray<char>(size);
+    if (getcwd(buf.begin(), size) != nullptr) {
+      return joinPath(kj::StringPtr(buf.begin()), path).flatten();
+    }
+    if (errno != ERANGE) {
+      KJ_FAIL_SYSCALL("getcwd", errno);
+    }
+  }
+}
+
+kj::String absoluteSearchPath(kj::StringPtr templates) {
+  kj::StringTree tree;
+  bool first = true;
+  for (auto part : splitStr(templates, ';')) {
+    if (!first) {
+      tree = kj::strTree(kj::mv(tree), ";");
+    }
+    first = false;
+    if (part.size() > 0) {
+      tree = kj::strTree(kj::mv(tree), absolutePath(kj::heapString(part)));
+    }
+  }
+  return tree.flatten();
+}
+
 }  // namespace luacat
 }  // namespace mcm
@@ -27,6 +27,9 @@ namespace luacat {
 
 kj::String dirName(kj::StringPtr path);
 
+kj::String baseName(kj::StringPtr path);
+// Returns the last element of path.
+
 namespace _ {
 #if _WIN32
   const char pathSep = '\\';
@@ -53,6 +56,13 @@ kj::StringTree joinPath(const First& first, Rest&&... rest) {
 kj::Array<kj::ArrayPtr<const char>> splitStr(kj::StringPtr s, char delim);
 // Split a string by a given delimiter.
 
+kj::String absolutePath(kj::StringPtr path);
+// Returns path joined to the working directory, unless it is empty or
+// already absolute.
+
+kj::String absoluteSearchPath(kj::StringPtr templates);
+// Applies absolutePath to each template in a package.path-style list.
+
 }  // namespace luacat
 }  // namespace mcm
 
@@ -0,0 +1,151 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/profile.h"
+
+#include <string.h>
+#include "gtest/gtest.h"
+#include "capnp/message.h"
+#include "kj/vector.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/io.h"
+#include "luacat/main.h"
+
+namespace {
+
+kj::Vector<kj::String> lines(mcm::luacat::BufferOutputStream& out) {
+  kj::Vector<kj::String> result;
+  auto data = out.getArray().asChars();
+  size_t start = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    if (data[i] == '\n') {
+      result.add(kj::heapString(data.slice(start, i)));
+      start = i + 1;
+    }
+  }
+  return result;
+}
+
+bool contains(const kj::Vector<kj::String>& v, kj::StringPtr s) {
+  for (auto& line : v) {
+    if (line == s) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+TEST(ProfileTest, WritesFoldedStacks) {
+  mcm::luacat::Profile::Weights w;
+  w.nanos = 2000000;
+  w.resources = 3;
+  w.bytes = 96;
+  mcm::luacat::Profile p1;
+  p1.add("main.lua:3;lib.lua:10", w);
+  mcm::luacat::Profile p2;
+  w.nanos = 1000000;
+  w.resources = 0;
+  w.bytes = 0;
+  p2.add("main.lua:3;lib.lua:10", w);
+  p2.add("main.lua:5", w);
+  p1.merge(p2);
+
+  mcm::luacat::BufferOutputStream out;
+  p1.write(out);
+  auto result = lines(out);
+  EXPECT_TRUE(contains(result, "time;main.lua:3;lib.lua:10 3000"));
+  EXPECT_TRUE(contains(result, "time;main.lua:5 1000"));
+  EXPECT_TRUE(contains(result, "resources;main.lua:3;lib.lua:10 3"));
+  EXPECT_TRUE(contains(result, "bytes;main.lua:3;lib.lua:10 96"));
+  EXPECT_FALSE(contains(result, "resources;main.lua:5 0"));
+
+  // Summary rows are sorted by inclusive time, then by bytes.
+  ASSERT_GE(result.size(), 5);
+  EXPECT_STREQ("# 4.000 ms sampled, 3 resources, 96 bytes", result[0].cStr());
+  EXPECT_STREQ("#      3.000      3.000          3         96  lib.lua:10", result[2].cStr());
+  EXPECT_STREQ("#      0.000      3.000          0          0  main.lua:3", result[3].cStr());
+  EXPECT_STREQ("#      1.000      1.000          0          0  main.lua:5", result[4].cStr());
+}
+
+TEST(ProfilerTest, ChargesResourcesToCaller) {
+  mcm::luacat::Profiler profiler;
+  capnp::MallocMessageBuilder message;
+  {
+    mcm::luacat::Interpreter interp;
+    interp.getLibState().setMessage(message);
+    lua_State* state = interp.getState();
+    profiler.attach(state, interp.getLibState());
+    const char* script =
+        "local function declare(name)\n"
+        "  mcm.resource(name, {}, mcm.file{path='/' .. name})\n"
+        "end\n"
+        "for i = 1, 5 do declare('f' .. i) end\n"
+        "mcm.resource('x', {}, mcm.noop)\n"
+        "local s = 0\n"
+        "for i = 1, 100000 do s = s + i end\n";
+    ASSERT_EQ(LUA_OK, luaL_loadbuffer(state, script, strlen(script), "=test"));
+    ASSERT_EQ(LUA_OK, lua_pcall(state, 0, 0, 0)) << lua_tostring(state, -1);
+    interp.getLibState().releaseResources();
+  }
+
+  mcm::luacat::BufferOutputStream out;
+  profiler.getProfile().write(out);
+  auto result = lines(out);
+  EXPECT_TRUE(contains(result, "resources;test:4;test:2 5"));
+  EXPECT_TRUE(contains(result, "resources;test:5 1"));
+  bool sawLoop = false;
+  for (auto& line : result) {
+    if (line.startsWith("time;test:7 ")) {
+      sawLoop = true;
+    }
+  }
+  EXPECT_TRUE(sawLoop);
+}
+
+TEST(ProfilerTest, TruncatesDeepStacksAtRoot) {
+  mcm::luacat::Profiler profiler;
+  capnp::MallocMessageBuilder message;
+  {
+    mcm::luacat::Interpreter interp;
+    interp.getLibState().setMessage(message);
+    lua_State* state = interp.getState();
+    profiler.attach(state, interp.getLibState());
+    const char* script =
+        "local function deep(n)\n"
+        "  if n == 0 then return mcm.resource('x', {}, mcm.noop) end\n"
+        "  deep(n - 1)\n"
+        "end\n"
+        "deep(100)\n";
+    ASSERT_EQ(LUA_OK, luaL_loadbuffer(state, script, strlen(script), "=test"));
+    ASSERT_EQ(LUA_OK, lua_pcall(state, 0, 0, 0)) << lua_tostring(state, -1);
+    interp.getLibState().releaseResources();
+  }
+
+  mcm::luacat::BufferOutputStream out;
+  profiler.getProfile().write(out);
+  kj::Vector<kj::String> expected;
+  expected.add(kj::heapString("resources;[truncated]"));
+  for (int i = 0; i < 62; i++) {
+    expected.add(kj::heapString("test:3"));
+  }
+  expected.add(kj::heapString("test:2 1"));
+  auto result = lines(out);
+  EXPECT_TRUE(contains(result, kj::strArray(expected, ";"))) << kj::strArray(result, "\n").cStr();
+}
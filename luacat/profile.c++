@@ -0,0 +1,203 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/profile.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <set>
+#include "kj/array.h"
+#include "kj/debug.h"
+#include "kj/vector.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  const size_t maxDepth = 64;  // frames kept per stack, including the [truncated] root
+
+  uint64_t monotonicNanos() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+  }
+
+  kj::String frameName(lua_State* state, lua_Debug* ar) {
+    lua_getinfo(state, "Sln", ar);
+    if (strcmp(ar->what, "C") == 0) {
+      return ar->name != nullptr ? kj::str("[C] ", ar->name) : kj::str("[C]");
+    }
+    return kj::str(ar->short_src, ":", ar->currentline);
+  }
+
+  kj::StringPtr lastFrame(kj::StringPtr stack) {
+    for (size_t i = stack.size(); i > 0; i--) {
+      if (stack[i-1] == ';') {
+        return stack.slice(i);
+      }
+    }
+    return stack;
+  }
+
+  void writeLine(kj::OutputStream& out, kj::StringPtr line) {
+    out.write(line.begin(), line.size());
+    out.write("\n", 1);
+  }
+}  // namespace
+
+void Profile::add(kj::StringPtr stack, const Weights& w) {
+  auto& entry = stacks[kj::heapString(stack)];
+  entry.nanos += w.nanos;
+  entry.resources += w.resources;
+  entry.bytes += w.bytes;
+}
+
+void Profile::merge(const Profile& other) {
+  for (auto& entry : other.stacks) {
+    add(entry.first, entry.second);
+  }
+}
+
+void Profile::write(kj::OutputStream& out, size_t maxRows) const {
+  struct Row {
+    Weights self;
+    Weights total;
+  };
+  typedef std::pair<const kj::String, Row> Location;
+
+  // Sum the weights of each location, counting a location only once
+  // per stack for the inclusive totals.
+  std::map<kj::String, Row> rows;
+  Weights sum;
+  for (auto& entry : stacks) {
+    auto& w = entry.second;
+    sum.nanos += w.nanos;
+    sum.resources += w.resources;
+    sum.bytes += w.bytes;
+    std::set<kj::String> seen;
+    kj::StringPtr stack = entry.first;
+    size_t start = 0;
+    for (size_t i = 0; i <= stack.size(); i++) {
+      if (i < stack.size() && stack[i] != ';') {
+        continue;
+      }
+      auto loc = kj::heapString(stack.slice(start, i));
+      start = i + 1;
+      auto& row = rows[kj::heapString(loc)];
+      if (seen.insert(kj::mv(loc)).second) {
+        row.total.nanos += w.nanos;
+        row.total.resources += w.resources;
+        row.total.bytes += w.bytes;
+      }
+    }
+    auto& self = rows[kj::heapString(lastFrame(stack))].self;
+    self.nanos += w.nanos;
+    self.resources += w.resources;
+    self.bytes += w.bytes;
+  }
+  kj::Vector<const Location*> sorted(rows.size());
+  for (auto& entry : rows) {
+    sorted.add(&entry);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const Location* a, const Location* b) {
+    if (a->second.total.nanos != b->second.total.nanos) {
+      return a->second.total.nanos > b->second.total.nanos;
+    }
+    if (a->second.self.bytes != b->second.self.bytes) {
+      return a->second.self.bytes > b->second.self.bytes;
+    }
+    return a->first < b->first;
+  });
+
+  char buf[128];
+  snprintf(buf, sizeof(buf), "# %.3f ms sampled, %llu resources, %llu bytes",
+           double(sum.nanos) / 1e6, (unsigned long long)sum.resources,
+           (unsigned long long)sum.bytes);
+  writeLine(out, buf);
+  writeLine(out, "#    self ms   total ms  resources      bytes  location");
+  for (size_t i = 0; i < sorted.size() && i < maxRows; i++) {
+    auto& row = sorted[i]->second;
+    snprintf(buf, sizeof(buf), "# %10.3f %10.3f %10llu %10llu  ",
+             double(row.self.nanos) / 1e6, double(row.total.nanos) / 1e6,
+             (unsigned long long)row.self.resources, (unsigned long long)row.self.bytes);
+    writeLine(out, kj::str(buf, sorted[i]->first));
+  }
+  if (sorted.size() > maxRows) {
+    writeLine(out, kj::str("# (", sorted.size() - maxRows, " more locations)"));
+  }
+
+  for (auto& entry : stacks) {
+    if (entry.second.nanos / 1000 > 0) {
+      writeLine(out, kj::str("time;", entry.first, " ", entry.second.nanos / 1000));
+    }
+  }
+  for (auto& entry : stacks) {
+    if (entry.second.resources > 0) {
+      writeLine(out, kj::str("resources;", entry.first, " ", entry.second.resources));
+    }
+  }
+  for (auto& entry : stacks) {
+    if (entry.second.bytes > 0) {
+      writeLine(out, kj::str("bytes;", entry.first, " ", entry.second.bytes));
+    }
+  }
+}
+
+Profiler::Profiler(): last(monotonicNanos()) {}
+
+void Profiler::attach(lua_State* state, LibState& lib) {
+  LuaHeap::from(state).setSampler(state, *this);
+  lib.addObserver(*this);
+  last = monotonicNanos();
+}
+
+void Profiler::sample(lua_State* state) {
+  charge(state, 0, Profile::Weights());
+}
+
+void Profiler::resourceDeclared(lua_State* state, Resource::Reader resource) {
+  // Level 0 is mcm.resource itself; charge its caller.
+  Profile::Weights w;
+  w.resources = 1;
+  w.bytes = resource.totalSize().wordCount * sizeof(capnp::word);
+  charge(state, 1, w);
+}
+
+void Profiler::charge(lua_State* state, int level, Profile::Weights w) {
+  uint64_t now = monotonicNanos();
+  w.nanos = now - last;
+  last = now;
+
+  kj::Vector<kj::String> frames;
+  lua_Debug ar;
+  for (; frames.size() < maxDepth && lua_getstack(state, level, &ar); level++) {
+    frames.add(frameName(state, &ar));
+  }
+  if (frames.size() == maxDepth && lua_getstack(state, level, &ar)) {
+    // Give deeper stacks their own root, so they don't look like calls
+    // from whatever function happened to be maxDepth frames up.
+    frames.back() = kj::heapString("[truncated]");
+  }
+  if (frames.size() == 0) {
+    return;
+  }
+  std::reverse(frames.begin(), frames.end());
+  profile.add(kj::strArray(frames, ";"), w);
+}
+
+}  // namespace luacat
+}  // namespace mcm
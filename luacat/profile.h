@@ -0,0 +1,91 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_PROFILE_H_
+#define MCM_LUACAT_PROFILE_H_
+// Sampling profiler for catalog scripts.
+
+#include <stdint.h>
+#include <map>
+#include "kj/common.h"
+#include "kj/io.h"
+#include "kj/string.h"
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "catalog.capnp.h"
+#include "luacat/heap.h"
+#include "luacat/lib.h"
+
+namespace mcm {
+
+namespace luacat {
+
+class Profile {
+  // Lua stacks weighted by the time spent in them and by the resources
+  // they declared.  A stack is a list of frames separated by ';',
+  // outermost first, as in the folded format read by flamegraph.pl.
+
+public:
+  struct Weights {
+    uint64_t nanos = 0;
+    uint64_t resources = 0;
+    uint64_t bytes = 0;  // encoded size of the resources
+  };
+
+  void add(kj::StringPtr stack, const Weights& w);
+  void merge(const Profile& other);
+
+  void write(kj::OutputStream& out, size_t maxRows = 50) const;
+  // Write a summary table of the heaviest locations, as '#' comment
+  // lines, followed by the folded stacks.  Each folded stack is rooted
+  // in a frame that names its metric: "time" (in microseconds),
+  // "resources", or "bytes".
+
+  inline bool empty() const { return stacks.empty(); }
+
+private:
+  std::map<kj::String, Weights> stacks;
+};
+
+class Profiler final: public Sampler, public ResourceObserver {
+  // Collects a Profile from a single interpreter.  Time is charged to
+  // the stack seen at each sample, which is taken every thousand or so
+  // VM instructions and at every mcm.resource call.
+
+public:
+  Profiler();
+  KJ_DISALLOW_COPY(Profiler);
+
+  void attach(lua_State* state, LibState& lib);
+  // Start profiling state.  The Profiler must outlive the state.
+
+  inline const Profile& getProfile() const { return profile; }
+
+  void sample(lua_State* state) override;
+  void resourceDeclared(lua_State* state, Resource::Reader resource) override;
+
+private:
+  Profile profile;
+  uint64_t last;  // monotonic clock at the last sample, in nanoseconds
+
+  void charge(lua_State* state, int level, Profile::Weights w);
+};
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_PROFILE_H_
@@ -0,0 +1,213 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/searcher.h"
+
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gtest/gtest.h"
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/string.h"
+
+extern "C" {
+#include "lauxlib.h"
+#include "lualib.h"
+}
+
+#include "luacat/convert.h"
+#include "luacat/main.h"
+#include "luacat/path.h"
+
+using mcm::luacat::BytecodeCache;
+using mcm::luacat::DirectoryCache;
+using mcm::luacat::ModuleLog;
+using mcm::luacat::joinPath;
+
+namespace {
+  class SearcherTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+      const char* tmp = getenv("TEST_TMPDIR");
+      auto tmpl = joinPath(tmp != nullptr ? tmp : "/tmp", "searcher-test.XXXXXX").flatten();
+      ASSERT_NE(nullptr, mkdtemp(tmpl.begin()));
+      dir = kj::mv(tmpl);
+      cacheDir = joinPath(dir, "cache").flatten();
+      KJ_SYSCALL(mkdir(cacheDir.cStr(), 0777));
+    }
+
+    void TearDown() override {
+      for (auto d : {cacheDir.cStr(), dir.cStr()}) {
+        DIR* dp = opendir(d);
+        if (dp == nullptr) {
+          continue;
+        }
+        while (struct dirent* ent = readdir(dp)) {
+          if (ent->d_name[0] != '.' || ent->d_name[1] == 't') {
+            unlink(joinPath(d, ent->d_name).flatten().cStr());
+          }
+        }
+        closedir(dp);
+        rmdir(d);
+      }
+    }
+
+    void writeFile(kj::StringPtr name, kj::StringPtr content) {
+      auto path = joinPath(dir, name).flatten();
+      int fd;
+      KJ_SYSCALL(fd = open(path.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+      kj::FdOutputStream stream{kj::AutoCloseFd(fd)};
+      stream.write(content.begin(), content.size());
+    }
+
+    kj::String run(BytecodeCache& cache, kj::StringPtr script) {
+      ModuleLog log;
+      return run(cache, script, log);
+    }
+
+    kj::String run(BytecodeCache& cache, kj::StringPtr script, ModuleLog& log) {
+      // Run script in a fresh interpreter and return its result or error.
+
+      auto state = mcm::luacat::newLuaState();
+      luaL_openlibs(state);
+      lua_getglobal(state, "package");
+      mcm::luacat::pushLua(state, joinPath(dir, "?.lua").flatten());
+      lua_setfield(state, -2, "path");
+      lua_pop(state, 1);
+      mcm::luacat::installSearcher(state, cache, log);
+      if (luaL_loadstring(state, script.cStr()) || lua_pcall(state, 0, 1, 0)) {
+        return kj::str("error: ", mcm::luacat::luaStringPtr(state, -1));
+      }
+      return kj::heapString(mcm::luacat::luaStringPtr(state, -1));
+    }
+
+    kj::String dir;
+    kj::String cacheDir;
+  };
+}  // namespace
+
+TEST_F(SearcherTest, CachesModules) {
+  writeFile("mod.lua", "return {x = 'hello'}\n");
+  {
+    BytecodeCache cache(cacheDir, "v1");
+    EXPECT_EQ(kj::StringPtr("hello"), run(cache, "return require('mod').x"));
+    EXPECT_EQ(0, cache.getHits());
+    EXPECT_EQ(1, cache.getMisses());
+  }
+  {
+    BytecodeCache cache(cacheDir, "v1");
+    EXPECT_EQ(kj::StringPtr("hello"), run(cache, "return require('mod').x"));
+    EXPECT_EQ(1, cache.getHits());
+    EXPECT_EQ(0, cache.getMisses());
+  }
+  {
+    BytecodeCache cache(cacheDir, "v2");
+    EXPECT_EQ(kj::StringPtr("hello"), run(cache, "return require('mod').x"));
+    EXPECT_EQ(0, cache.getHits());
+    EXPECT_EQ(1, cache.getMisses());
+  }
+}
+
+TEST_F(SearcherTest, SourceChangeMisses) {
+  writeFile("mod.lua", "return 'a'\n");
+  BytecodeCache cache(cacheDir, "v1");
+  EXPECT_EQ(kj::StringPtr("a"), run(cache, "return require('mod')"));
+  writeFile("mod.lua", "return 'b'\n");
+  EXPECT_EQ(kj::StringPtr("b"), run(cache, "return require('mod')"));
+  EXPECT_EQ(0, cache.getHits());
+  EXPECT_EQ(2, cache.getMisses());
+}
+
+TEST_F(SearcherTest, CachedModuleKeepsDebugInfo) {
+  writeFile("mod.lua", "#!/usr/bin/lua\nlocal x = 1\nerror('boom')\n");
+  BytecodeCache cache(cacheDir, "v1");
+  auto path = joinPath(dir, "mod.lua").flatten();
+  auto want = kj::str("error: ", path, ":3: boom");
+  EXPECT_EQ(want, run(cache, "require('mod')"));
+  EXPECT_EQ(want, run(cache, "require('mod')"));
+  EXPECT_EQ(1, cache.getHits());
+}
+
+TEST_F(SearcherTest, MissingModule) {
+  BytecodeCache cache(cacheDir, "v1");
+  auto result = run(cache, "require('nope')");
+  auto want = kj::str("\n\tno file '", joinPath(dir, "nope.lua").flatten(), "'");
+  EXPECT_NE(nullptr, strstr(result.cStr(), want.cStr())) << result.cStr();
+  EXPECT_EQ(0, cache.getMisses());
+}
+
+TEST_F(SearcherTest, RecordsSearches) {
+  writeFile("mod.lua", "return 1\n");
+  BytecodeCache cache(cacheDir, "v1");
+  ModuleLog log;
+  EXPECT_EQ(kj::StringPtr("false"), run(cache, "require('mod'); return tostring(pcall(require, 'nope'))", log));
+
+  auto entries = log.getEntries();
+  ASSERT_EQ(2, entries.size());
+  EXPECT_EQ(kj::StringPtr("mod"), entries[0].name);
+  EXPECT_EQ(joinPath(dir, "?.lua").flatten(), entries[0].path);
+  EXPECT_EQ(joinPath(dir, "mod.lua").flatten(), entries[0].file);
+  auto want = mcm::luacat::digestBytes(kj::StringPtr("return 1\n").asBytes());
+  EXPECT_EQ(0, memcmp(want.begin(), entries[0].digest.begin(), want.size()));
+  EXPECT_EQ(kj::StringPtr("nope"), entries[1].name);
+  EXPECT_EQ(kj::StringPtr(""), entries[1].file);
+  EXPECT_TRUE(log.isCacheable());
+}
+
+TEST_F(SearcherTest, DofileIsUncacheable) {
+  writeFile("mod.lua", "return 'x'\n");
+  BytecodeCache cache(cacheDir, "v1");
+  auto script = kj::str("return dofile('", joinPath(dir, "mod.lua").flatten(), "')");
+  ModuleLog log;
+  EXPECT_EQ(kj::StringPtr("x"), run(cache, script, log));
+  EXPECT_FALSE(log.isCacheable());
+}
+
+TEST_F(SearcherTest, DirectoryCacheSkipsMissingFiles) {
+  writeFile("mod.lua", "return 1\n");
+  auto missingDir = joinPath(dir, "nodir").flatten();
+  auto path = kj::str(joinPath(dir, "?.luac").flatten(), ";",
+                      joinPath(missingDir, "?.lua").flatten(), ";",
+                      joinPath(dir, "?.lua").flatten());
+  DirectoryCache dirs;
+  EXPECT_EQ(joinPath(dir, "mod.lua").flatten(), mcm::luacat::searchPath("mod", path, dirs));
+  EXPECT_EQ(1, dirs.getListings());
+  EXPECT_EQ(2, dirs.getProbesSaved());
+
+  EXPECT_EQ(kj::StringPtr(""), mcm::luacat::searchPath("nope", path, dirs));
+  EXPECT_EQ(1, dirs.getListings());
+  EXPECT_EQ(5, dirs.getProbesSaved());
+}
+
+TEST_F(SearcherTest, DirectoryCacheLoadsModules) {
+  writeFile("mod.lua", "return {x = 'hello'}\n");
+  auto state = mcm::luacat::newLuaState();
+  luaL_openlibs(state);
+  lua_getglobal(state, "package");
+  mcm::luacat::pushLua(state, joinPath(dir, "?.lua").flatten());
+  lua_setfield(state, -2, "path");
+  lua_pop(state, 1);
+  ModuleLog log;
+  DirectoryCache dirs;
+  mcm::luacat::installSearcher(state, nullptr, log, dirs);
+  ASSERT_EQ(LUA_OK, luaL_dostring(state, "return require('mod').x, pcall(require, 'nope')"))
+      << mcm::luacat::luaStringPtr(state, -1).cStr();
+  EXPECT_EQ(kj::StringPtr("hello"), mcm::luacat::luaStringPtr(state, -3));
+  EXPECT_FALSE(lua_toboolean(state, -2));
+  EXPECT_EQ(1, dirs.getListings());
+  EXPECT_EQ(1, dirs.getProbesSaved());
+}
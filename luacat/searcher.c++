@@ -0,0 +1,402 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/searcher.h"
+
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kj/debug.h"
+#include "kj/exception.h"
+#include "kj/io.h"
+#include "kj/vector.h"
+#include "openssl/sha.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/convert.h"
+#include "luacat/io.h"
+#include "luacat/path.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  const char hexDigits[] = "0123456789abcdef";
+
+  int dumpWriter(lua_State* state, const void* p, size_t sz, void* ud) {
+    auto& buf = *reinterpret_cast<kj::Vector<kj::byte>*>(ud);
+    auto bytes = reinterpret_cast<const kj::byte*>(p);
+    buf.addAll(bytes, bytes + sz);
+    return 0;
+  }
+
+  kj::ArrayPtr<const kj::byte> skipPreamble(kj::ArrayPtr<const kj::byte> source) {
+    // Skip a UTF-8 byte order mark and a first line starting with '#',
+    // as luaL_loadfile does.  The newline is kept so that line numbers
+    // stay the same.
+
+    if (source.size() >= 3 && source[0] == 0xef && source[1] == 0xbb && source[2] == 0xbf) {
+      source = source.slice(3, source.size());
+    }
+    if (source.size() > 0 && source[0] == '#') {
+      size_t i = 0;
+      while (i < source.size() && source[i] != '\n') {
+        i++;
+      }
+      source = source.slice(i, source.size());
+    }
+    return source;
+  }
+
+  int loadSource(lua_State* state, kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> source,
+                 BytecodeCache* cache) {
+    auto text = skipPreamble(source);
+    if (text.size() > 0 && text[0] == LUA_SIGNATURE[0]) {
+      // Already precompiled.
+      return luaL_loadbufferx(state, reinterpret_cast<const char*>(text.begin()), text.size(), chunkName.cStr(), "b");
+    }
+    if (cache != nullptr) {
+      return cache->load(state, chunkName, text);
+    }
+    return luaL_loadbufferx(state, reinterpret_cast<const char*>(text.begin()), text.size(), chunkName.cStr(), "t");
+  }
+
+  void pushNotFound(lua_State* state, kj::StringPtr name, kj::StringPtr path) {
+    // Push the same message as package.searchpath.
+
+    luaL_Buffer msg;
+    luaL_buffinit(state, &msg);
+    for (auto tmpl : splitStr(path, ';')) {
+      if (tmpl.size() == 0) {
+        continue;
+      }
+      luaL_addstring(&msg, "\n\tno file '");
+      for (char c : tmpl) {
+        if (c != '?') {
+          luaL_addchar(&msg, c);
+          continue;
+        }
+        for (char nc : name) {
+          luaL_addchar(&msg, nc == '.' ? _::pathSep : nc);
+        }
+      }
+      luaL_addchar(&msg, '\'');
+    }
+    luaL_pushresult(&msg);
+  }
+
+  int searchLua(lua_State* state, kj::StringPtr name, kj::StringPtr path,
+                BytecodeCache* cache, ModuleLog& log, DirectoryCache* dirs) {
+    // Returns the number of results pushed, or -1 if an error message
+    // was pushed.  Doesn't raise Lua errors, so that it can use RAII.
+
+    kj::Maybe<DirectoryCache&> maybeDirs;
+    if (dirs != nullptr) {
+      maybeDirs = *dirs;
+    }
+    ModuleLog::Entry entry{kj::heapString(name), kj::heapString(path), searchPath(name, path, maybeDirs), {}};
+    if (entry.file.size() == 0) {
+      pushNotFound(state, name, path);
+      log.add(kj::mv(entry));
+      return 1;
+    }
+    kj::Array<const kj::byte> source;
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { source = mapFile(entry.file); })) {
+      lua_pushfstring(state, "error loading module '%s' from file '%s':\n\t%s",
+                      name.cStr(), entry.file.cStr(), e->getDescription().cStr());
+      return -1;
+    }
+    entry.digest = digestBytes(source);
+    auto chunkName = kj::str("@", entry.file);
+    pushLua(state, entry.file);
+    log.add(kj::mv(entry));
+    if (loadSource(state, chunkName, source, cache) != LUA_OK) {
+      lua_pushfstring(state, "error loading module '%s' from file '%s':\n\t%s",
+                      name.cStr(), lua_tostring(state, -2), lua_tostring(state, -1));
+      return -1;
+    }
+    lua_insert(state, -2);  // file name is passed as the module's second argument
+    return 2;
+  }
+
+  int searcherLua(lua_State* state) {
+    // Like the package library's searcher for Lua files, but records
+    // the search and may load the file through a BytecodeCache.
+    // Upvalues: package table, BytecodeCache (may be NULL), ModuleLog,
+    // DirectoryCache (may be NULL).
+
+    luaL_checkstring(state, 1);
+    auto cache = reinterpret_cast<BytecodeCache*>(lua_touserdata(state, lua_upvalueindex(2)));
+    auto& log = *reinterpret_cast<ModuleLog*>(lua_touserdata(state, lua_upvalueindex(3)));
+    auto dirs = reinterpret_cast<DirectoryCache*>(lua_touserdata(state, lua_upvalueindex(4)));
+    if (lua_getfield(state, lua_upvalueindex(1), "path") != LUA_TSTRING) {
+      return luaL_error(state, "'package.path' must be a string");
+    }
+    int n = searchLua(state, luaStringPtr(state, 1), luaStringPtr(state, -1), cache, log, dirs);
+    if (n < 0) {
+      return lua_error(state);
+    }
+    return n;
+  }
+
+  int uncacheableCall(lua_State* state) {
+    // Wraps a function that reads files outside of the Lua file searcher.
+    // Upvalues: original function, ModuleLog.
+
+    auto& log = *reinterpret_cast<ModuleLog*>(lua_touserdata(state, lua_upvalueindex(2)));
+    log.setUncacheable();
+    int base = lua_gettop(state);
+    lua_pushvalue(state, lua_upvalueindex(1));
+    lua_insert(state, 1);
+    lua_call(state, base, LUA_MULTRET);
+    return lua_gettop(state);
+  }
+
+  int uncacheableSearcher(lua_State* state) {
+    // Wraps a package searcher that marks the log as uncacheable if it
+    // finds a module.
+    // Upvalues: original searcher, ModuleLog.
+
+    auto& log = *reinterpret_cast<ModuleLog*>(lua_touserdata(state, lua_upvalueindex(2)));
+    int base = lua_gettop(state);
+    lua_pushvalue(state, lua_upvalueindex(1));
+    lua_insert(state, 1);
+    lua_call(state, base, LUA_MULTRET);
+    if (lua_gettop(state) > 0 && lua_type(state, 1) == LUA_TFUNCTION) {
+      log.setUncacheable();
+    }
+    return lua_gettop(state);
+  }
+
+  void wrapUncacheable(lua_State* state, int table, lua_Integer i, const char* field,
+                       lua_CFunction wrapper, ModuleLog& log) {
+    // Replace table[field] (or table[i] if field is null) with a closure
+    // of wrapper around it.
+
+    table = lua_absindex(state, table);
+    int type = field != nullptr ? lua_getfield(state, table, field) : lua_rawgeti(state, table, i);
+    if (type != LUA_TFUNCTION) {
+      lua_pop(state, 1);
+      return;
+    }
+    lua_pushlightuserdata(state, &log);
+    lua_pushcclosure(state, wrapper, 2);
+    if (field != nullptr) {
+      lua_setfield(state, table, field);
+    } else {
+      lua_rawseti(state, table, i);
+    }
+  }
+}  // namespace
+
+BytecodeCache::BytecodeCache(kj::StringPtr dir, kj::StringPtr version):
+    dir(kj::heapString(dir)), version(kj::heapString(version)), hits(0), misses(0) {
+}
+
+int BytecodeCache::load(lua_State* state, kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> source) {
+  auto path = entryPath(chunkName, source);
+  int fd = open(path.cStr(), O_RDONLY, 0);
+  if (fd >= 0) {
+    auto entry = mapFile(kj::AutoCloseFd(fd));
+    if (luaL_loadbufferx(state, reinterpret_cast<const char*>(entry.begin()), entry.size(), chunkName.cStr(), "b") == LUA_OK) {
+      hits++;
+      return LUA_OK;
+    }
+    lua_pop(state, 1);  // ignore bad entry; it gets rewritten below
+  } else if (errno != ENOENT) {
+    KJ_LOG(WARNING, "can't read bytecode cache entry", path, strerror(errno));
+  }
+
+  misses++;
+  int status = luaL_loadbufferx(state, reinterpret_cast<const char*>(source.begin()), source.size(), chunkName.cStr(), "t");
+  if (status != LUA_OK) {
+    return status;
+  }
+  kj::Vector<kj::byte> bytecode;
+  lua_dump(state, dumpWriter, &bytecode, 0);
+  KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { replaceFile(path, bytecode); })) {
+    KJ_LOG(WARNING, "can't write bytecode cache entry", path, e->getDescription());
+  }
+  return LUA_OK;
+}
+
+kj::String BytecodeCache::entryPath(kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> source) {
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  SHA256_Update(&ctx, version.cStr(), version.size() + 1);
+  SHA256_Update(&ctx, chunkName.cStr(), chunkName.size() + 1);
+  SHA256_Update(&ctx, source.begin(), source.size());
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  SHA256_Final(hash, &ctx);
+
+  return kj::str(joinPath(dir, hexString(kj::arrayPtr(hash, sizeof(hash)))).flatten(), ".luac");
+}
+
+Digest digestBytes(kj::ArrayPtr<const kj::byte> data) {
+  Digest d;
+  SHA256(data.begin(), data.size(), d.begin());
+  return d;
+}
+
+kj::String hexString(kj::ArrayPtr<const kj::byte> data) {
+  auto s = kj::heapString(data.size() * 2);
+  for (size_t i = 0; i < data.size(); i++) {
+    s[i*2] = hexDigits[data[i] >> 4];
+    s[i*2+1] = hexDigits[data[i] & 0xf];
+  }
+  return s;
+}
+
+bool DirectoryCache::mightExist(kj::StringPtr path) {
+  kj::String dir;
+  kj::StringPtr base;
+  KJ_IF_MAYBE(i, path.findLast(_::pathSep)) {
+    dir = kj::heapString(path.begin(), *i == 0 ? 1 : *i);
+    base = path.slice(*i + 1);
+  } else {
+    dir = kj::heapString(".");
+    base = path;
+  }
+  if (base.size() == 0) {
+    return true;
+  }
+
+  const Listing* listing = nullptr;
+  {
+    auto lock = dirs.lockShared();
+    auto iter = lock->find(dir);
+    if (iter != lock->end()) {
+      listing = iter->second.get();
+    }
+  }
+  if (listing == nullptr) {
+    // Listings are never removed, so the pointer stays valid after the
+    // lock is released.  Two threads may list the same directory; the
+    // first one to finish wins.
+    auto newListing = list(dir);
+    auto lock = dirs.lockExclusive();
+    auto iter = lock->find(dir);
+    if (iter == lock->end()) {
+      iter = lock->insert(std::make_pair(kj::mv(dir), kj::mv(newListing))).first;
+    }
+    listing = iter->second.get();
+  }
+
+  switch (listing->state) {
+  case Listing::LISTED:
+    if (listing->names.count(kj::heapString(base)) > 0) {
+      return true;
+    }
+    break;
+  case Listing::MISSING:
+    break;
+  case Listing::UNREADABLE:
+    return true;
+  }
+  probesSaved++;
+  return false;
+}
+
+kj::Own<const DirectoryCache::Listing> DirectoryCache::list(kj::StringPtr dir) {
+  auto listing = kj::heap<Listing>();
+  DIR* dp = opendir(dir.cStr());
+  if (dp == nullptr) {
+    // A directory that can't be listed may still allow opening files
+    // in it, so only skip it if it's definitely not there.
+    listing->state = errno == ENOENT || errno == ENOTDIR ? Listing::MISSING : Listing::UNREADABLE;
+    return kj::mv(listing);
+  }
+  KJ_DEFER(closedir(dp));
+  listing->state = Listing::LISTED;
+  while (struct dirent* ent = readdir(dp)) {
+    listing->names.insert(kj::heapString(ent->d_name));
+  }
+  listings++;
+  return kj::mv(listing);
+}
+
+kj::String searchPath(kj::StringPtr name, kj::StringPtr path, kj::Maybe<DirectoryCache&> dirs) {
+  auto fileName = kj::str(name);
+  for (auto& c : fileName) {
+    if (c == '.') {
+      c = _::pathSep;
+    }
+  }
+  for (auto tmpl : splitStr(path, ';')) {
+    if (tmpl.size() == 0) {
+      continue;
+    }
+    kj::Vector<char> candidate(tmpl.size() + fileName.size());
+    for (char c : tmpl) {
+      if (c == '?') {
+        candidate.addAll(fileName);
+      } else {
+        candidate.add(c);
+      }
+    }
+    candidate.add('\0');
+    KJ_IF_MAYBE(d, dirs) {
+      if (!d->mightExist(kj::StringPtr(candidate.begin(), candidate.size() - 1))) {
+        continue;
+      }
+    }
+    int fd = open(candidate.begin(), O_RDONLY, 0);
+    if (fd >= 0) {
+      close(fd);
+      return kj::heapString(candidate.begin(), candidate.size() - 1);
+    }
+  }
+  return kj::String();
+}
+
+void installSearcher(lua_State* state, kj::Maybe<BytecodeCache&> cache, ModuleLog& log,
+                     kj::Maybe<DirectoryCache&> dirs) {
+  lua_getglobal(state, "package");
+  KJ_REQUIRE(lua_type(state, -1) == LUA_TTABLE, "package library not loaded");
+  lua_getfield(state, -1, "searchers");
+  KJ_REQUIRE(lua_type(state, -1) == LUA_TTABLE, "package.searchers is not a table");
+  lua_pushvalue(state, -2);
+  BytecodeCache* cachePtr = nullptr;
+  KJ_IF_MAYBE(c, cache) {
+    cachePtr = c;
+  }
+  lua_pushlightuserdata(state, cachePtr);
+  lua_pushlightuserdata(state, &log);
+  DirectoryCache* dirsPtr = nullptr;
+  KJ_IF_MAYBE(d, dirs) {
+    dirsPtr = d;
+  }
+  lua_pushlightuserdata(state, dirsPtr);
+  lua_pushcclosure(state, searcherLua, 4);
+  lua_rawseti(state, -2, 2);  // searchers[2] is the Lua file searcher
+  wrapUncacheable(state, -1, 3, nullptr, uncacheableSearcher, log);  // C searcher
+  wrapUncacheable(state, -1, 4, nullptr, uncacheableSearcher, log);  // all-in-one C searcher
+  lua_pop(state, 2);
+
+  lua_pushglobaltable(state);
+  wrapUncacheable(state, -1, 0, "loadfile", uncacheableCall, log);
+  wrapUncacheable(state, -1, 0, "dofile", uncacheableCall, log);
+  lua_pop(state, 1);
+}
+
+}  // namespace luacat
+}  // namespace mcm
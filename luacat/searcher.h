@@ -0,0 +1,150 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_SEARCHER_H_
+#define MCM_LUACAT_SEARCHER_H_
+// Replacement for Lua's package searcher for Lua source files.
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include "kj/array.h"
+#include "kj/common.h"
+#include "kj/mutex.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace mcm {
+
+namespace luacat {
+
+class BytecodeCache {
+  // An on-disk cache of compiled Lua modules.  Entries are keyed by a
+  // hash of the luacat version, the module's file name, and its source,
+  // so stale entries are never used; they are just never hit again.
+  // Safe to use from multiple threads at once.
+
+public:
+  BytecodeCache(kj::StringPtr dir, kj::StringPtr version);
+  KJ_DISALLOW_COPY(BytecodeCache);
+
+  int load(lua_State* state, kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> source);
+  // Load the given Lua source as a function, like luaL_loadbufferx in
+  // text mode.  Returns a Lua status code.
+
+  inline uint64_t getHits() const { return hits; }
+  inline uint64_t getMisses() const { return misses; }
+
+private:
+  kj::String dir;
+  kj::String version;
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+
+  kj::String entryPath(kj::StringPtr chunkName, kj::ArrayPtr<const kj::byte> source);
+};
+
+const size_t DIGEST_SIZE = 32;
+typedef kj::FixedArray<kj::byte, DIGEST_SIZE> Digest;
+// A SHA-256 digest.
+
+Digest digestBytes(kj::ArrayPtr<const kj::byte> data);
+
+kj::String hexString(kj::ArrayPtr<const kj::byte> data);
+// Returns data as lowercase hexadecimal.
+
+class ModuleLog {
+  // Records every Lua file search made by require, so that the files a
+  // script depended on can be checked again later.
+
+public:
+  struct Entry {
+    kj::String name;  // module name passed to require
+    kj::String path;  // package.path at the time of the search
+    kj::String file;  // file that was found, or empty if none was
+    Digest digest;    // digest of file's contents, if found
+  };
+
+  inline kj::ArrayPtr<const Entry> getEntries() const { return entries.asPtr(); }
+  inline void add(Entry&& e) { entries.add(kj::mv(e)); }
+
+  inline bool isCacheable() const { return cacheable; }
+  inline void setUncacheable() { cacheable = false; }
+  // A script is uncacheable if it reads files other than through the
+  // Lua file searcher, e.g. with dofile or by loading a C module.
+
+private:
+  kj::Vector<Entry> entries;
+  bool cacheable = true;
+};
+
+class DirectoryCache {
+  // Remembers the names in each directory that a search has looked in,
+  // so that searching a package.path opens only files that exist instead
+  // of trying every template.  Each directory is listed once; changes to
+  // it afterward are not seen, so a cache should last no longer than one
+  // batch of scripts.  Safe to use from multiple threads at once.
+
+public:
+  DirectoryCache(): listings(0), probesSaved(0) {}
+  KJ_DISALLOW_COPY(DirectoryCache);
+
+  bool mightExist(kj::StringPtr path);
+  // Returns false if path's directory doesn't exist or has no entry
+  // with path's base name.
+
+  inline uint64_t getListings() const { return listings; }
+  // Number of directories read.
+  inline uint64_t getProbesSaved() const { return probesSaved; }
+  // Number of times mightExist returned false, each of which saved a
+  // failed open.
+
+private:
+  struct Listing {
+    enum { LISTED, MISSING, UNREADABLE } state;
+    std::set<kj::String> names;  // only filled in if LISTED
+  };
+
+  kj::MutexGuarded<std::map<kj::String, kj::Own<const Listing>>> dirs;
+  std::atomic<uint64_t> listings;
+  std::atomic<uint64_t> probesSaved;
+
+  kj::Own<const Listing> list(kj::StringPtr dir);
+};
+
+kj::String searchPath(kj::StringPtr name, kj::StringPtr path,
+                      kj::Maybe<DirectoryCache&> dirs = nullptr);
+// Returns the first readable file for the module name in the given
+// package.path, as package.searchpath does, or an empty string.
+// Candidates that dirs says don't exist are skipped without opening.
+
+void installSearcher(lua_State* state, kj::Maybe<BytecodeCache&> cache, ModuleLog& log,
+                     kj::Maybe<DirectoryCache&> dirs = nullptr);
+// Replace the Lua file searcher in package.searchers with one that
+// records its searches in log and, if given, loads modules through
+// cache and looks up files through dirs.  Modules are mapped into
+// memory rather than copied.  Other ways of reading files (loadfile,
+// dofile, and the C searchers) mark log as uncacheable when used.  The
+// base and package libraries must be loaded, and log and dirs must
+// outlive state.
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_SEARCHER_H_
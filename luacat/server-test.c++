@@ -0,0 +1,143 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/server.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "kj/async.h"
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/string.h"
+
+#include "luacat/path.h"
+
+namespace {
+  struct DiscardOutputStream : public kj::OutputStream {
+    void write(const void* buffer, size_t size) override {
+    }
+  };
+
+  struct FakeProcessContext : public kj::ProcessContext {
+    kj::StringPtr getProgramName() override {
+      return nullptr;
+    }
+
+    void exit() override {
+      KJ_FAIL_ASSERT("exit");
+    }
+
+    void warning(kj::StringPtr message) override {}
+
+    void error(kj::StringPtr message) override {}
+
+    void exitError(kj::StringPtr message) override {
+      error(message);
+      exit();
+    }
+
+    void exitInfo(kj::StringPtr message) override {
+      exit();
+    }
+
+    void increaseLoggingVerbosity() override {}
+  };
+}  // namespace
+
+TEST(CompilerServerTest, CompilesRepeatedly) {
+  FakeProcessContext ctx;
+  DiscardOutputStream discard;
+  mcm::luacat::Main main(ctx, kj::str(), discard, discard);
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  mcm::luacat::Compiler::Client client = kj::heap<mcm::luacat::CompilerServer>(main, 1);
+
+  for (int i = 0; i < 3; i++) {
+    SCOPED_TRACE(i);
+    auto req = client.compileRequest();
+    req.setScript(kj::StringPtr(
+        "print(params.n)\n"
+        "mcm.resource('x', {}, mcm.noop)\n").asBytes());
+    auto p = req.initParams().initTable(1);
+    p[0].initKey().setString(kj::StringPtr("n").asBytes());
+    p[0].initValue().setInteger(i);
+    auto resp = req.send().wait(waitScope);
+
+    auto output = resp.getOutput();
+    EXPECT_EQ(kj::str(i, "\n"), kj::heapString(reinterpret_cast<const char*>(output.begin()), output.size()));
+    ASSERT_EQ(1, resp.getCatalog().getResources().size());
+    EXPECT_EQ(kj::StringPtr("x"), resp.getCatalog().getResources()[0].getComment());
+  }
+}
+
+TEST(CompilerServerTest, ScriptErrorIsReturned) {
+  FakeProcessContext ctx;
+  DiscardOutputStream discard;
+  mcm::luacat::Main main(ctx, kj::str(), discard, discard);
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  mcm::luacat::Compiler::Client client = kj::heap<mcm::luacat::CompilerServer>(main, 1);
+
+  auto req = client.compileRequest();
+  req.setScript(kj::StringPtr("error('boom')\n").asBytes());
+  EXPECT_ANY_THROW(req.send().wait(waitScope));
+}
+
+TEST(CompilerServerTest, ClientPathsDontDependOnServerDirectory) {
+  const char* tmp = getenv("TEST_TMPDIR");
+  auto dir = mcm::luacat::joinPath(tmp != nullptr ? tmp : "/tmp", "server-test.XXXXXX").flatten();
+  ASSERT_NE(nullptr, mkdtemp(dir.begin()));
+  auto libDir = mcm::luacat::joinPath(dir, "lib").flatten();
+  KJ_SYSCALL(mkdir(libDir.cStr(), 0777));
+  auto modPath = mcm::luacat::joinPath(libDir, "mod.lua").flatten();
+  auto sibPath = mcm::luacat::joinPath(dir, "sib.lua").flatten();
+  for (auto f : {modPath.cStr(), sibPath.cStr()}) {
+    int fd;
+    KJ_SYSCALL(fd = open(f, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    kj::FdOutputStream stream{kj::AutoCloseFd(fd)};
+    auto content = kj::str("return '", mcm::luacat::baseName(f), "'\n");
+    stream.write(content.begin(), content.size());
+  }
+
+  // Resolve paths the way mcm-luacat-client does, from another directory.
+  char cwd[4096];
+  ASSERT_NE(nullptr, getcwd(cwd, sizeof(cwd)));
+  KJ_SYSCALL(chdir(dir.cStr()));
+  auto path = mcm::luacat::absolutePath("site.lua");
+  auto includes = mcm::luacat::absoluteSearchPath("lib/?.lua");
+  KJ_SYSCALL(chdir(cwd));
+
+  FakeProcessContext ctx;
+  DiscardOutputStream discard;
+  mcm::luacat::Main main(ctx, kj::str(), discard, discard);
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  mcm::luacat::Compiler::Client client = kj::heap<mcm::luacat::CompilerServer>(main, 1);
+  auto req = client.compileRequest();
+  req.setScript(kj::StringPtr("print(require('mod'), require('sib'))\n").asBytes());
+  req.setPath(path);
+  req.initIncludePaths(1).set(0, includes);
+  auto resp = req.send().wait(waitScope);
+  auto output = resp.getOutput();
+  EXPECT_EQ(kj::StringPtr("mod.lua\tsib.lua\n"),
+            kj::heapString(reinterpret_cast<const char*>(output.begin()), output.size()));
+
+  unlink(modPath.cStr());
+  unlink(sibPath.cStr());
+  rmdir(libDir.cStr());
+  rmdir(dir.cStr());
+}
@@ -0,0 +1,95 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/server.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include "kj/debug.h"
+#include "kj/string-tree.h"
+#include "capnp/ez-rpc.h"
+
+#include "catalog.capnp.h"
+#include "luacat/io.h"
+
+namespace mcm {
+
+namespace luacat {
+
+CompilerServer::CompilerServer(Main& main, size_t poolSize):
+    main(main), poolSize(poolSize), tasks(*this) {
+  fillPool();
+}
+
+kj::Promise<void> CompilerServer::compile(CompileContext context) {
+  auto params = context.getParams();
+  kj::StringTree includes;
+  for (auto inc : params.getIncludePaths()) {
+    KJ_REQUIRE(kj::StringPtr(inc).findFirst('?') != nullptr,
+        "include path does not include a '?' wildcard", inc);
+    if (includes.size() > 0) {
+      includes = kj::strTree(kj::mv(includes), ";");
+    }
+    includes = kj::strTree(kj::mv(includes), inc);
+  }
+  auto chunkName = params.getPath().size() > 0 ?
+      kj::str("@", params.getPath()) : kj::str("=(compile)");
+  kj::Maybe<LuaValue::Reader> scriptParams;
+  if (params.hasParams()) {
+    scriptParams = params.getParams();
+  }
+
+  kj::Own<Interpreter> interp;
+  if (pool.size() > 0) {
+    interp = kj::mv(pool.back());
+    pool.removeLast();
+  } else {
+    interp = kj::heap<Interpreter>(main.getHeapLimits());
+  }
+  tasks.add(kj::evalLater([this]() { fillPool(); }));
+  capnp::MallocMessageBuilder message(main.firstSegmentWords());
+  BufferOutputStream log;
+  kj::ArrayInputStream stream(params.getScript());
+  main.process(*interp, message, chunkName, stream, log, scriptParams, includes.flatten());
+  interp = nullptr;
+
+  auto results = context.getResults();
+  results.setCatalog(message.getRoot<Catalog>().asReader());
+  results.setOutput(log.getArray());
+  return kj::READY_NOW;
+}
+
+void CompilerServer::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+void CompilerServer::fillPool() {
+  while (pool.size() < poolSize) {
+    pool.add(kj::heap<Interpreter>(main.getHeapLimits()));
+  }
+}
+
+void Main::serve() {
+  if (unlink(serveAddress.cStr()) != 0 && errno != ENOENT) {
+    KJ_FAIL_SYSCALL("unlink", errno, serveAddress);
+  }
+  capnp::EzRpcServer server(kj::heap<CompilerServer>(*this), kj::str("unix:", serveAddress));
+  auto& waitScope = server.getWaitScope();
+  server.getPort().wait(waitScope);  // wait until the socket is bound
+  KJ_LOG(INFO, "listening", serveAddress);
+  kj::NEVER_DONE.wait(waitScope);
+}
+
+}  // namespace luacat
+}  // namespace mcm
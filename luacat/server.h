@@ -0,0 +1,57 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_SERVER_H_
+#define MCM_LUACAT_SERVER_H_
+// Compile server for mcm-luacat --serve.
+
+#include "kj/async.h"
+#include "kj/common.h"
+#include "kj/memory.h"
+#include "kj/vector.h"
+
+#include "luacat/compiler.capnp.h"
+#include "luacat/main.h"
+
+namespace mcm {
+
+namespace luacat {
+
+class CompilerServer final: public Compiler::Server, private kj::TaskSet::ErrorHandler {
+  // Runs catalog scripts on behalf of RPC clients.  Keeps a few
+  // interpreters set up ahead of time so that requests don't pay for
+  // loading the standard libraries.  Must be used from a thread with a
+  // KJ event loop.
+
+public:
+  explicit CompilerServer(Main& main, size_t poolSize = 2);
+  KJ_DISALLOW_COPY(CompilerServer);
+
+protected:
+  kj::Promise<void> compile(CompileContext context) override;
+
+private:
+  void taskFailed(kj::Exception&& exception) override;
+  void fillPool();
+
+  Main& main;
+  size_t poolSize;
+  kj::Vector<kj::Own<Interpreter>> pool;
+  kj::TaskSet tasks;
+};
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_SERVER_H_
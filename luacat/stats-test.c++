@@ -0,0 +1,86 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/stats.h"
+
+#include <string.h>
+#include "gtest/gtest.h"
+#include "capnp/message.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/io.h"
+#include "luacat/main.h"
+
+TEST(LibStatsTest, CountsDeclaredResources) {
+  capnp::MallocMessageBuilder message;
+  mcm::luacat::Interpreter interp;
+  interp.getLibState().setMessage(message);
+  lua_State* state = interp.getState();
+  ASSERT_EQ(LUA_OK, luaL_dostring(state,
+      "mcm.resource('a', {}, mcm.file{path='/a', plain={content='hello'}})\n"
+      "assert(not pcall(mcm.resource, 'bad', {'a'}, mcm.file{path={}}))\n"
+      "mcm.resource('b', {'a', mcm.hash('c')}, mcm.noop)\n"
+      "mcm.resource(mcm.hash('c'), {'a', 'b'}, mcm.exec{command={argv={'/bin/true'}}})\n"))
+      << lua_tostring(state, -1);
+  interp.getLibState().releaseResources();
+
+  auto& stats = interp.getLibState().getStats();
+  EXPECT_EQ(1, stats.noops);
+  EXPECT_EQ(1, stats.files);
+  EXPECT_EQ(1, stats.execs);
+  EXPECT_EQ(4, stats.dependencies);
+  // Comments "a", "b", and "c", path "/a", and argv "/bin/true".
+  EXPECT_EQ(3 + 2 + 9, stats.convert.textBytes);
+  EXPECT_EQ(5, stats.convert.dataBytes);
+  // Resource names aren't cached, so "a" and "b" are hashed once as
+  // names and once as dependencies.  "bad" and "c" are hashed once.
+  EXPECT_EQ(6, stats.hashes);
+}
+
+TEST(CompileStatsTest, MergeAndWriteJson) {
+  mcm::luacat::CompileStats a;
+  a.addScript();
+  a.addPeakHeapBytes(1000);
+  a.addOutputBytes(64);
+  mcm::luacat::LibStats lib;
+  lib.files = 2;
+  lib.dependencies = 3;
+  a.addLib(lib);
+  auto t = mcm::luacat::Timestamp::now();
+  a.charge(mcm::luacat::CompileStats::EXECUTE, t);
+
+  mcm::luacat::CompileStats b;
+  b.addCachedScript();
+  b.addPeakHeapBytes(500);
+  b.addOutputBytes(32);
+  b.addLib(lib);
+  b.merge(a);
+  EXPECT_EQ(4, b.getLib().files);
+  EXPECT_EQ(6, b.getLib().dependencies);
+  EXPECT_GE(b.getPhase(mcm::luacat::CompileStats::EXECUTE).wallNanos,
+            a.getPhase(mcm::luacat::CompileStats::EXECUTE).wallNanos);
+
+  mcm::luacat::BufferOutputStream out;
+  b.writeJson(out);
+  auto json = kj::heapString(out.getArray().asChars());
+  EXPECT_NE(nullptr, strstr(json.cStr(), "\"scripts\": 1,")) << json.cStr();
+  EXPECT_NE(nullptr, strstr(json.cStr(), "\"cachedScripts\": 1,"));
+  EXPECT_NE(nullptr, strstr(json.cStr(), "\"resources\": {\"noop\": 0, \"file\": 4, \"exec\": 0}"));
+  EXPECT_NE(nullptr, strstr(json.cStr(), "\"serialize\": {\"wallNanos\": 0, \"cpuNanos\": 0}"));
+  EXPECT_NE(nullptr, strstr(json.cStr(), "\"peakHeapBytes\": 1000,"));
+  EXPECT_NE(nullptr, strstr(json.cStr(), "\"outputBytes\": 96\n"));
+}
@@ -0,0 +1,104 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/stats.h"
+
+#include <time.h>
+#include "kj/debug.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  const char* const phaseNames[CompileStats::phaseCount] = {
+    "setup",
+    "load",
+    "execute",
+    "assemble",
+    "serialize",
+  };
+
+  uint64_t clockNanos(clockid_t clock) {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(clock, &ts));
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+  }
+}  // namespace
+
+Timestamp Timestamp::now() {
+  return Timestamp{clockNanos(CLOCK_MONOTONIC), clockNanos(CLOCK_THREAD_CPUTIME_ID)};
+}
+
+Timestamp CompileStats::charge(Phase phase, const Timestamp& since) {
+  auto now = Timestamp::now();
+  phases[phase].wallNanos += now.wallNanos - since.wallNanos;
+  phases[phase].cpuNanos += now.cpuNanos - since.cpuNanos;
+  return now;
+}
+
+void CompileStats::addLib(const LibStats& other) {
+  lib.noops += other.noops;
+  lib.files += other.files;
+  lib.execs += other.execs;
+  lib.dependencies += other.dependencies;
+  lib.hashes += other.hashes;
+  lib.convert.textBytes += other.convert.textBytes;
+  lib.convert.dataBytes += other.convert.dataBytes;
+}
+
+void CompileStats::addPeakHeapBytes(uint64_t bytes) {
+  peakHeapBytes = kj::max(peakHeapBytes, bytes);
+}
+
+void CompileStats::merge(const CompileStats& other) {
+  for (int i = 0; i < phaseCount; i++) {
+    phases[i].wallNanos += other.phases[i].wallNanos;
+    phases[i].cpuNanos += other.phases[i].cpuNanos;
+  }
+  addLib(other.lib);
+  scripts += other.scripts;
+  cachedScripts += other.cachedScripts;
+  addPeakHeapBytes(other.peakHeapBytes);
+  outputBytes += other.outputBytes;
+}
+
+void CompileStats::writeJson(kj::OutputStream& out) const {
+  kj::Vector<kj::String> phaseFields;
+  for (int i = 0; i < phaseCount; i++) {
+    phaseFields.add(kj::str(
+        "\"", phaseNames[i], "\": {\"wallNanos\": ", phases[i].wallNanos,
+        ", \"cpuNanos\": ", phases[i].cpuNanos, "}"));
+  }
+  auto text = kj::str(
+      "{\n"
+      "  \"scripts\": ", scripts, ",\n"
+      "  \"cachedScripts\": ", cachedScripts, ",\n"
+      "  \"phases\": {\n    ", kj::strArray(phaseFields, ",\n    "), "\n  },\n"
+      "  \"resources\": {\"noop\": ", lib.noops, ", \"file\": ", lib.files,
+      ", \"exec\": ", lib.execs, "},\n"
+      "  \"dependencies\": ", lib.dependencies, ",\n"
+      "  \"textBytes\": ", lib.convert.textBytes, ",\n"
+      "  \"dataBytes\": ", lib.convert.dataBytes, ",\n"
+      "  \"hashes\": ", lib.hashes, ",\n"
+      "  \"peakHeapBytes\": ", peakHeapBytes, ",\n"
+      "  \"outputBytes\": ", outputBytes, "\n"
+      "}\n");
+  out.write(text.begin(), text.size());
+}
+
+}  // namespace luacat
+}  // namespace mcm
@@ -0,0 +1,85 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_STATS_H_
+#define MCM_LUACAT_STATS_H_
+// Timings and counters for compiling catalogs.
+
+#include <stdint.h>
+#include "kj/common.h"
+#include "kj/io.h"
+
+#include "luacat/lib.h"
+
+namespace mcm {
+
+namespace luacat {
+
+struct Timestamp {
+  uint64_t wallNanos;  // monotonic clock
+  uint64_t cpuNanos;  // calling thread's CPU time
+
+  static Timestamp now();
+};
+
+class CompileStats {
+  // Where the time went while compiling one or more catalogs, and what
+  // came out.  Cheap enough to collect for every script.
+
+public:
+  enum Phase {
+    SETUP,  // creating the interpreter and its globals
+    LOAD,  // compiling the script
+    EXECUTE,  // running the script; includes writing resources when streaming
+    ASSEMBLE,  // building the catalog from the declared resources
+    SERIALIZE,  // encoding the catalog
+  };
+  static const int phaseCount = SERIALIZE + 1;
+
+  struct PhaseTime {
+    uint64_t wallNanos = 0;
+    uint64_t cpuNanos = 0;
+  };
+
+  Timestamp charge(Phase phase, const Timestamp& since);
+  // Add the time from since until now to phase and return now.
+
+  void addLib(const LibStats& lib);
+  void addPeakHeapBytes(uint64_t bytes);
+  inline void addScript() { scripts++; }
+  inline void addCachedScript() { cachedScripts++; }
+  inline void addOutputBytes(uint64_t n) { outputBytes += n; }
+
+  void merge(const CompileStats& other);
+
+  inline const PhaseTime& getPhase(Phase phase) const { return phases[phase]; }
+  inline const LibStats& getLib() const { return lib; }
+
+  void writeJson(kj::OutputStream& out) const;
+  // Write the stats as a JSON object.  Heap size is the largest of any
+  // script; everything else is summed.
+
+private:
+  PhaseTime phases[phaseCount];
+  LibStats lib;
+  uint64_t scripts = 0;
+  uint64_t cachedScripts = 0;  // found in the output cache, so not run
+  uint64_t peakHeapBytes = 0;
+  uint64_t outputBytes = 0;
+};
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_STATS_H_
@@ -0,0 +1,97 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/stdlib.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gtest/gtest.h"
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/string.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/convert.h"
+#include "luacat/main.h"
+#include "luacat/path.h"
+
+namespace {
+
+kj::String run(lua_State* state, const char* script) {
+  if (luaL_loadstring(state, script) || lua_pcall(state, 0, 1, 0)) {
+    return kj::str("error: ", mcm::luacat::luaStringPtr(state, -1));
+  }
+  auto result = kj::heapString(mcm::luacat::luaStringPtr(state, -1));
+  lua_pop(state, 1);
+  return result;
+}
+
+}  // namespace
+
+TEST(StdlibTest, EmbedsEveryModule) {
+  auto modules = mcm::luacat::getStdlibModules();
+  ASSERT_EQ(3, modules.size());
+  EXPECT_STREQ("apt", modules[0].name);
+  EXPECT_STREQ("configs", modules[1].name);
+  EXPECT_STREQ("shlib", modules[2].name);
+  for (auto& m : modules) {
+    ASSERT_GT(m.size, 0);
+    EXPECT_EQ(LUA_SIGNATURE[0], m.bytecode[0]);
+  }
+}
+
+TEST(StdlibTest, Preload) {
+  mcm::luacat::Interpreter interp;
+  lua_State* state = interp.getState();
+  mcm::luacat::preloadStdlib(state);
+  EXPECT_EQ(kj::StringPtr("'a b'"), run(state, "return require('shlib').quote('a b')"));
+  EXPECT_EQ(kj::StringPtr("function"), run(state, "return type(require('configs').line)"));
+  auto err = run(state, "return require('configs').line('x', {}, {})");
+  EXPECT_TRUE(err.startsWith("error: luacat/lib/configs.lua:")) << err.cStr();
+}
+
+TEST(StdlibTest, SearcherPrefersPath) {
+  const char* tmp = getenv("TEST_TMPDIR");
+  auto dir = mcm::luacat::joinPath(tmp != nullptr ? tmp : "/tmp", "stdlib-test.XXXXXX").flatten();
+  ASSERT_NE(nullptr, mkdtemp(dir.begin()));
+  auto shlibPath = mcm::luacat::joinPath(dir, "shlib.lua").flatten();
+  KJ_DEFER({
+    unlink(shlibPath.cStr());
+    rmdir(dir.cStr());
+  });
+  {
+    int fd;
+    KJ_SYSCALL(fd = open(shlibPath.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    kj::FdOutputStream stream{kj::AutoCloseFd(fd)};
+    kj::StringPtr content = "return {quote = function(s) return 'disk' end}\n";
+    stream.write(content.begin(), content.size());
+  }
+
+  mcm::luacat::Interpreter interp;
+  lua_State* state = interp.getState();
+  lua_getglobal(state, "package");
+  mcm::luacat::pushLua(state, mcm::luacat::joinPath(dir, "?.lua").flatten());
+  lua_setfield(state, -2, "path");
+  lua_pop(state, 1);
+  mcm::luacat::addStdlibSearcher(state);
+  EXPECT_EQ(kj::StringPtr("disk"), run(state, "return require('shlib').quote('a b')"));
+  EXPECT_EQ(kj::StringPtr("function"), run(state, "return type(require('configs').line)"));
+  auto result = run(state, "return select(2, pcall(require, 'nope'))");
+  EXPECT_NE(nullptr, strstr(result.cStr(), "no embedded module 'nope'")) << result.cStr();
+}
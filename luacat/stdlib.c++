@@ -0,0 +1,87 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/stdlib.h"
+
+#include <string.h>
+#include "kj/debug.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  int loadEmbedded(lua_State* state) {
+    // A package loader that runs an embedded module's bytecode with the
+    // arguments require passes to loaders.
+    // Upvalues: EmbeddedModule.
+
+    auto& module = *reinterpret_cast<const EmbeddedModule*>(lua_touserdata(state, lua_upvalueindex(1)));
+    if (luaL_loadbufferx(state, reinterpret_cast<const char*>(module.bytecode), module.size,
+                         module.name, "b") != LUA_OK) {
+      return luaL_error(state, "error loading embedded module '%s':\n\t%s",
+                        module.name, lua_tostring(state, -1));
+    }
+    lua_insert(state, 1);
+    lua_call(state, lua_gettop(state) - 1, 1);
+    return 1;
+  }
+
+  void pushLoader(lua_State* state, const EmbeddedModule& module) {
+    lua_pushlightuserdata(state, const_cast<EmbeddedModule*>(&module));
+    lua_pushcclosure(state, loadEmbedded, 1);
+  }
+
+  int searcherEmbedded(lua_State* state) {
+    const char* name = luaL_checkstring(state, 1);
+    for (auto& module : getStdlibModules()) {
+      if (strcmp(module.name, name) == 0) {
+        pushLoader(state, module);
+        lua_pushliteral(state, ":embedded:");
+        return 2;
+      }
+    }
+    lua_pushfstring(state, "\n\tno embedded module '%s'", name);
+    return 1;
+  }
+}  // namespace
+
+void preloadStdlib(lua_State* state) {
+  lua_getglobal(state, "package");
+  KJ_REQUIRE(lua_type(state, -1) == LUA_TTABLE, "package library not loaded");
+  lua_getfield(state, -1, "preload");
+  KJ_REQUIRE(lua_type(state, -1) == LUA_TTABLE, "package.preload is not a table");
+  for (auto& module : getStdlibModules()) {
+    pushLoader(state, module);
+    lua_setfield(state, -2, module.name);
+  }
+  lua_pop(state, 2);
+}
+
+void addStdlibSearcher(lua_State* state) {
+  lua_getglobal(state, "package");
+  KJ_REQUIRE(lua_type(state, -1) == LUA_TTABLE, "package library not loaded");
+  lua_getfield(state, -1, "searchers");
+  KJ_REQUIRE(lua_type(state, -1) == LUA_TTABLE, "package.searchers is not a table");
+  lua_pushcfunction(state, searcherEmbedded);
+  lua_rawseti(state, -2, luaL_len(state, -2) + 1);
+  lua_pop(state, 2);
+}
+
+}  // namespace luacat
+}  // namespace mcm
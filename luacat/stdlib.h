@@ -0,0 +1,59 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_STDLIB_H_
+#define MCM_LUACAT_STDLIB_H_
+// The standard library modules (luacat/lib) built into mcm-luacat.
+
+#include <stddef.h>
+#include "kj/array.h"
+#include "kj/common.h"
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace mcm {
+
+namespace luacat {
+
+struct EmbeddedModule {
+  const char* name;       // module name passed to require
+  const kj::byte* bytecode;
+  size_t size;
+};
+
+extern const EmbeddedModule stdlibModules[];
+extern const size_t stdlibModuleCount;
+// Defined in stdlib_modules.c++, which embedlua generates from the
+// files in luacat/lib at build time.
+
+inline kj::ArrayPtr<const EmbeddedModule> getStdlibModules() {
+  return kj::arrayPtr(stdlibModules, stdlibModuleCount);
+}
+
+void preloadStdlib(lua_State* state);
+// Register each standard library module in package.preload, so that
+// require loads it from the embedded bytecode without searching
+// package.path.  The package library must be loaded.
+
+void addStdlibSearcher(lua_State* state);
+// Append a searcher for the standard library modules to
+// package.searchers instead of preloading them, so that copies found on
+// package.path take precedence.  Used while developing the libraries.
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_STDLIB_H_
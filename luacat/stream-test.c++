@@ -0,0 +1,95 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/stream.h"
+
+#include <string.h>
+#include "gtest/gtest.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+#include "kj/io.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "catalog.capnp.h"
+#include "luacat/convert.h"
+#include "luacat/io.h"
+#include "luacat/main.h"
+
+TEST(CatalogStreamWriterTest, WritesResourcesAsDeclared) {
+  mcm::luacat::BufferOutputStream out;
+  mcm::luacat::CatalogStreamWriter writer(out);
+  mcm::luacat::Interpreter interp;
+  interp.getLibState().setSink(writer);
+  auto magic = mcm::STREAM_MAGIC.get();
+  ASSERT_EQ(magic.size(), out.getArray().size());
+
+  lua_State* state = interp.getState();
+  ASSERT_EQ(LUA_OK, luaL_dostring(state, "mcm.resource('a', {}, mcm.noop)"));
+  size_t afterFirst = out.getArray().size();
+  EXPECT_GT(afterFirst, magic.size());
+  ASSERT_EQ(LUA_OK, luaL_dostring(state,
+      "assert(not pcall(mcm.resource, 'bad', {}, mcm.file{path={}}))\n"
+      "mcm.resource('b', {'a'}, mcm.file{path='/b'})"));
+  writer.finish();
+
+  auto data = out.getArray();
+  ASSERT_EQ(0, memcmp(data.begin(), magic.begin(), magic.size()));
+  kj::ArrayInputStream stream(data.slice(magic.size(), data.size()));
+  kj::Vector<kj::String> comments;
+  for (;;) {
+    capnp::InputStreamMessageReader reader(stream);
+    auto entry = reader.getRoot<mcm::StreamEntry>();
+    if (entry.isEnd()) {
+      EXPECT_EQ(2, entry.getEnd());
+      break;
+    }
+    ASSERT_TRUE(entry.isResource());
+    comments.add(kj::heapString(entry.getResource().getComment()));
+  }
+  EXPECT_EQ(0, stream.tryGetReadBuffer().size());
+  ASSERT_EQ(2, comments.size());
+  EXPECT_STREQ("a", comments[0].cStr());
+  EXPECT_STREQ("b", comments[1].cStr());
+}
+
+TEST(CatalogStreamWriterTest, Packed) {
+  mcm::luacat::BufferOutputStream out;
+  mcm::luacat::CatalogStreamWriter writer(out, true);
+  mcm::luacat::Interpreter interp;
+  interp.getLibState().setSink(writer);
+  lua_State* state = interp.getState();
+  ASSERT_EQ(LUA_OK, luaL_dostring(state, "mcm.resource('a', {}, mcm.file{path='/a'})"));
+  writer.finish();
+
+  auto magic = mcm::STREAM_MAGIC.get();
+  auto data = out.getArray();
+  ASSERT_EQ(0, memcmp(data.begin(), magic.begin(), magic.size()));
+  kj::ArrayInputStream stream(data.slice(magic.size(), data.size()));
+  {
+    capnp::PackedMessageReader reader(stream);
+    auto entry = reader.getRoot<mcm::StreamEntry>();
+    ASSERT_TRUE(entry.isResource());
+    EXPECT_STREQ("/a", entry.getResource().getFile().getPath().cStr());
+  }
+  {
+    capnp::PackedMessageReader reader(stream);
+    auto entry = reader.getRoot<mcm::StreamEntry>();
+    ASSERT_TRUE(entry.isEnd());
+    EXPECT_EQ(1, entry.getEnd());
+  }
+  EXPECT_EQ(0, stream.tryGetReadBuffer().size());
+}
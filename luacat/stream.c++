@@ -0,0 +1,70 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/stream.h"
+
+#include "kj/debug.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+
+namespace mcm {
+
+namespace luacat {
+
+CatalogStreamWriter::CatalogStreamWriter(kj::OutputStream& out, bool packed):
+    out(out), packed(packed) {
+  auto magic = STREAM_MAGIC.get();
+  out.write(magic.begin(), magic.size());
+}
+
+Resource::Builder CatalogStreamWriter::newResource() {
+  KJ_REQUIRE(!finished, "resource added after end of stream");
+  message = kj::heap<capnp::MallocMessageBuilder>();
+  return message->initRoot<StreamEntry>().initResource();
+}
+
+void CatalogStreamWriter::finishResource() {
+  KJ_REQUIRE(message.get() != nullptr, "finishResource without newResource");
+  write(*message);
+  message = nullptr;
+  count++;
+}
+
+void CatalogStreamWriter::addResource(Resource::Reader resource) {
+  KJ_REQUIRE(!finished, "resource added after end of stream");
+  message = nullptr;
+  capnp::MallocMessageBuilder entry(resource.totalSize().wordCount + 8);
+  entry.initRoot<StreamEntry>().setResource(resource);
+  write(entry);
+  count++;
+}
+
+void CatalogStreamWriter::finish() {
+  KJ_REQUIRE(!finished, "stream already finished");
+  capnp::MallocMessageBuilder trailer(16);
+  trailer.initRoot<StreamEntry>().setEnd(count);
+  write(trailer);
+  finished = true;
+}
+
+void CatalogStreamWriter::write(capnp::MessageBuilder& entry) {
+  if (packed) {
+    capnp::writePackedMessage(out, entry);
+  } else {
+    capnp::writeMessage(out, entry);
+  }
+}
+
+}  // namespace luacat
+}  // namespace mcm
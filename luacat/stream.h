@@ -0,0 +1,66 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_STREAM_H_
+#define MCM_LUACAT_STREAM_H_
+// Streamed catalog output.
+
+#include <stdint.h>
+#include "kj/common.h"
+#include "kj/io.h"
+#include "kj/memory.h"
+#include "capnp/message.h"
+
+#include "catalog.capnp.h"
+#include "luacat/lib.h"
+
+namespace mcm {
+
+namespace luacat {
+
+class CatalogStreamWriter final : public ResourceSink {
+  // Writes each resource to an output stream as a StreamEntry message
+  // as soon as it is finished.  See streamMagic in catalog.capnp.
+
+public:
+  explicit CatalogStreamWriter(kj::OutputStream& out, bool packed = false);
+  // Writes the stream magic to out.  If packed is true, the entries
+  // after the magic use the packed encoding.
+
+  KJ_DISALLOW_COPY(CatalogStreamWriter);
+
+  Resource::Builder newResource() override;
+  void finishResource() override;
+  void addResource(Resource::Reader resource) override;
+
+  void finish();
+  // Write the end entry.  No resources may be added afterward.
+
+  inline uint64_t getCount() const { return count; }
+  // Number of resources written so far.
+
+private:
+  kj::OutputStream& out;
+  bool packed;
+  kj::Own<capnp::MallocMessageBuilder> message;  // resource being built, if any
+  uint64_t count = 0;
+  bool finished = false;
+
+  void write(capnp::MessageBuilder& entry);
+};
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_STREAM_H_
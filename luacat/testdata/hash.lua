@@ -0,0 +1,4 @@
+local id = mcm.hash("xyzzy!")
+print(id == mcm.hash("xyzzy!"), id == mcm.hash("xyzzy"))
+mcm.resource(id, {}, mcm.noop)
+mcm.resource("apt-get update", {"xyzzy!", id, mcm.hash(42)}, mcm.noop)
@@ -0,0 +1,19 @@
+-- The same resources as depschanged.lua, declared with one call.
+mcm.resources{
+  {"xyzzy!", {}, mcm.file{
+    path = "/etc/motd",
+    plain = {},
+  }},
+  {"apt-get update", {"xyzzy!"}, mcm.exec{
+    condition = {ifDepsChanged = {0xd96f419065c49db1}},
+    command = {
+      argv = {"/usr/bin/apt-get", "update"},
+    },
+  }},
+}
+
+-- Entries before a bad one stay declared.
+print(pcall(mcm.resources, {
+  {"ok", {}, mcm.noop},
+  {"bad", {}, {}},
+}))
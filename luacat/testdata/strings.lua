@@ -0,0 +1,8 @@
+print(mcm.shquote(""), mcm.shquote("abc/def.txt"), mcm.shquote("abc def"), mcm.shquote("'abc'"), mcm.shquote("abc\\"))
+print((pcall(mcm.shquote, 42)), (pcall(mcm.escapeRegex, 42)))
+print(mcm.escapeRegex(""), mcm.escapeRegex("abc"), mcm.escapeRegex("abc/def"), mcm.escapeRegex("a.b[]*^$\\"))
+local b = mcm.buffer("x", 1)
+b:add("y"):add("z", "!")
+print(tostring(b), #b, b:tostring() == "x1yz!")
+b:clear()
+print(#b, (pcall(b.add, b, {})))
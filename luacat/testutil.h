@@ -0,0 +1,52 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_TESTUTIL_H_
+#define MCM_LUACAT_TESTUTIL_H_
+// Helpers shared by the luacat tests.
+
+#include <stdlib.h>
+#include "capnp/message.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+#include "kj/debug.h"
+#include "kj/io.h"
+
+#include "luacat/path.h"
+
+namespace mcm {
+
+namespace luacat {
+
+inline kj::String writeTempCatalog(capnp::MessageBuilder& message, bool packed = false) {
+  // Writes message to a new file under $TEST_TMPDIR and returns its
+  // path.  The caller should unlink it.
+
+  const char* tmp = getenv("TEST_TMPDIR");
+  auto path = joinPath(tmp != nullptr ? tmp : "/tmp", "luacat-test.XXXXXX").flatten();
+  int fd;
+  KJ_SYSCALL(fd = mkstemp(path.begin()));
+  kj::AutoCloseFd closer(fd);
+  if (packed) {
+    capnp::writePackedMessageToFd(fd, message);
+  } else {
+    capnp::writeMessageToFd(fd, message);
+  }
+  return path;
+}
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_TESTUTIL_H_
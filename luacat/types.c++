@@ -14,6 +14,8 @@
 
 #include "luacat/types.h"
 
+#include <string.h>
+#include <new>
 #include "lua.hpp"
 
 namespace mcm {
@@ -21,8 +23,29 @@ namespace mcm {
 namespace luacat {
 
 namespace {
-  const char* resourceTypeKey = "mcm resourcetype";
-  const char* idKey = "mcm id";
+  // The addresses of these are the registry keys for the metatables.
+  // Light userdata keys avoid hashing a string on every type check.
+  char resourceTypeKey;
+  char idKey;
+
+  void pushMetatable(lua_State* state, const void* key, const char* name,
+                     lua_CFunction eq = nullptr) {
+    // Pushes the metatable for key, creating it if needed.
+
+    if (lua_rawgetp(state, LUA_REGISTRYINDEX, key) != LUA_TNIL) {
+      return;
+    }
+    lua_pop(state, 1);
+    lua_createtable(state, 0, 2);
+    lua_pushstring(state, name);
+    lua_setfield(state, -2, "__name");
+    if (eq != nullptr) {
+      lua_pushcfunction(state, eq);
+      lua_setfield(state, -2, "__eq");
+    }
+    lua_pushvalue(state, -1);
+    lua_rawsetp(state, LUA_REGISTRYINDEX, key);
+  }
 
   template<typename T>
   T& newUserData(lua_State* state) {
@@ -32,61 +55,62 @@ namespace {
   }
 
   template<typename T>
-  kj::Maybe<T&> testUserData(lua_State* state, int index, const char* tname) {
+  kj::Maybe<T&> testUserData(lua_State* state, int index, const void* key) {
     void* p = lua_touserdata(state, index);
-    if (p == nullptr) {  // value is a userdata?
+    if (p == nullptr || !lua_getmetatable(state, index)) {
       return nullptr;  // value is not a userdata with a metatable
     }
-    if (lua_getmetatable(state, index)) {  // does it have a metatable?
-      if (luaL_getmetatable(state, tname) == LUA_TNIL) {  // get correct metatable
-        p = nullptr;  // metatable not set up yet; can't have the metatable
-      } else if (!lua_rawequal(state, -1, -2)) {  // not the same?
-        p = nullptr;  // value is a userdata with wrong metatable
-      }
-      lua_pop(state, 2);  // remove both metatables
+    lua_rawgetp(state, LUA_REGISTRYINDEX, key);
+    if (!lua_rawequal(state, -1, -2)) {
+      p = nullptr;  // value is a userdata with wrong metatable
     }
+    lua_pop(state, 2);  // remove both metatables
     return reinterpret_cast<T*>(p);
   }
+
+  int idEq(lua_State* state);
 }  // namespace
 
 void pushResourceType(lua_State* state, uint64_t rt) {
   auto& p = newUserData<uint64_t>(state);
   p = rt;
-  luaL_newmetatable(state, resourceTypeKey);
+  pushMetatable(state, &resourceTypeKey, "mcm resourcetype");
   lua_setmetatable(state, -2);
 }
 
 kj::Maybe<uint64_t> getResourceType(lua_State* state, int index) {
-  return testUserData<uint64_t>(state, index, resourceTypeKey);
+  return testUserData<uint64_t>(state, index, &resourceTypeKey);
 }
 
-namespace {
-  struct IdHolder {
-    kj::Own<const Id> id;
-  };
-
-  int destroyIdHolder(lua_State* state) {
-    auto& holder = KJ_ASSERT_NONNULL(testUserData<IdHolder>(state, 1, idKey));
-    holder.id = nullptr;
-    return 0;
-  }
-}  // namespace
-
-void pushId(lua_State* state, kj::Own<const Id> id) {
-  auto& p = newUserData<IdHolder>(state);
-  p.id = kj::mv(id);
-  if (luaL_newmetatable(state, idKey)) {
-    lua_pushcfunction(state, destroyIdHolder);
-    lua_setfield(state, -2, "__gc");
-  }
+void pushId(lua_State* state, uint64_t value, kj::StringPtr comment) {
+  void* p = lua_newuserdata(state, sizeof(Id) + comment.size() + 1);
+  auto id = new (p) Id(value, comment.size());
+  char* c = reinterpret_cast<char*>(id + 1);
+  memcpy(c, comment.begin(), comment.size());
+  c[comment.size()] = '\0';
+  pushMetatable(state, &idKey, "mcm id", idEq);
   lua_setmetatable(state, -2);
 }
 
 kj::Maybe<const Id&> getId(lua_State* state, int index) {
-  return testUserData<IdHolder>(state, index, idKey).map([] (IdHolder& holder) -> const Id& {
-    return *holder.id;
-  });
+  return testUserData<const Id>(state, index, &idKey);
 }
 
+namespace {
+  int idEq(lua_State* state) {
+    // Ids from mcm.hash are cached, but ones read from a catalog view
+    // are not, so compare by value.
+
+    KJ_IF_MAYBE(a, getId(state, 1)) {
+      KJ_IF_MAYBE(b, getId(state, 2)) {
+        lua_pushboolean(state, a->getValue() == b->getValue());
+        return 1;
+      }
+    }
+    lua_pushboolean(state, false);
+    return 1;
+  }
+}  // namespace
+
 }  // namespace luacat
 }  // namespace mcm
@@ -33,23 +33,38 @@ namespace mcm {
 namespace luacat {
 
 class Id {
+  // A resource ID created by mcm.hash.  Ids live inside Lua userdata
+  // (see pushId) and are collected along with it.
+
 public:
-  inline Id(uint64_t v, kj::StringPtr c) : value(v), comment(kj::heapString(c)) {}
   KJ_DISALLOW_COPY(Id);
 
   inline uint64_t getValue() const { return value; }
-  inline kj::StringPtr getComment() const { return comment; }
+  inline kj::StringPtr getComment() const {
+    return kj::StringPtr(reinterpret_cast<const char*>(this + 1), commentSize);
+  }
 
 private:
+  inline Id(uint64_t v, size_t n) : value(v), commentSize(n) {}
+
   uint64_t value;
-  kj::String comment;
+  size_t commentSize;
+  // Followed by commentSize bytes of comment and a NUL.
+
+  friend void pushId(lua_State* state, uint64_t value, kj::StringPtr comment);
 };
 
 void pushResourceType(lua_State* state, uint64_t rt);
 kj::Maybe<uint64_t> getResourceType(lua_State* state, int index);
 
-void pushId(lua_State* state, kj::Own<const Id> id);
+void pushId(lua_State* state, uint64_t value, kj::StringPtr comment);
+// Push a new Id onto the Lua stack.  The Id and its comment are stored
+// in a single userdata without a finalizer.  Ids compare equal with ==
+// when their values are equal.
+
 kj::Maybe<const Id&> getId(lua_State* state, int index);
+// Returns the Id at the given index, if it is one.  The reference is
+// valid while the value is reachable from Lua.
 
 }  // namespace luacat
 }  // namespace mcm
@@ -0,0 +1,180 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/validate.h"
+
+#include <string.h>
+#include "gtest/gtest.h"
+#include "capnp/message.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/main.h"
+
+namespace {
+
+kj::Array<kj::String> runAndCheck(const char* script) {
+  capnp::MallocMessageBuilder message;
+  mcm::luacat::Interpreter interp;
+  auto& lib = interp.getLibState();
+  lib.setMessage(message);
+  interp.getValidator().attach(lib);
+  lua_State* state = interp.getState();
+  KJ_DEFER(lib.releaseResources());
+  if (luaL_loadbuffer(state, script, strlen(script), "=test") != LUA_OK ||
+      lua_pcall(state, 0, 0, 0) != LUA_OK) {
+    ADD_FAILURE() << lua_tostring(state, -1);
+    return nullptr;
+  }
+  return interp.getValidator().check();
+}
+
+}  // namespace
+
+TEST(GraphValidatorTest, AcceptsValidGraph) {
+  auto problems = runAndCheck(
+      "mcm.resource('a', {}, mcm.noop)\n"
+      "mcm.resource('b', {'a'}, mcm.noop)\n"
+      "mcm.resource('c', {'a', 'b'}, mcm.exec{\n"
+      "  command={argv={'/bin/true'}},\n"
+      "  condition={ifDepsChanged={mcm.hash('b')}},\n"
+      "})\n");
+  EXPECT_EQ(0, problems.size());
+  for (auto& p : problems) {
+    ADD_FAILURE() << p.cStr();
+  }
+}
+
+TEST(GraphValidatorTest, ReportsProblems) {
+  auto problems = runAndCheck(
+      "mcm.resource('a', {'missing'}, mcm.noop)\n"
+      "mcm.resource('a', {}, mcm.noop)\n"
+      "mcm.resource('b', {'a'}, mcm.exec{\n"
+      "  command={argv={'/bin/true'}},\n"
+      "  condition={ifDepsChanged={mcm.hash('c')}},\n"
+      "})\n"
+      "mcm.resource('c', {'d'}, mcm.noop)\n"
+      "mcm.resource('d', {'e'}, mcm.noop)\n"
+      "mcm.resource('e', {'c'}, mcm.noop)\n"
+      "mcm.resource('f', {'f'}, mcm.noop)\n");
+  ASSERT_EQ(5, problems.size());
+  EXPECT_STREQ("test:2: resource \"a\" already declared at test:1", problems[0].cStr());
+  EXPECT_STREQ("test:1: resource \"a\" depends on \"missing\", which is not declared", problems[1].cStr());
+  EXPECT_STREQ("test:3: resource \"b\" lists \"c\" in ifDepsChanged but does not depend on it",
+               problems[2].cStr());
+  EXPECT_STREQ("test:7: dependency cycle: \"c\" (test:7) -> \"d\" (test:8) -> \"e\" (test:9) -> \"c\"",
+               problems[3].cStr());
+  EXPECT_STREQ("test:10: dependency cycle: \"f\" (test:10) -> \"f\"", problems[4].cStr());
+}
+
+TEST(GraphValidatorTest, ReportsCollisions) {
+  mcm::luacat::Interpreter interp;
+  auto& validator = interp.getValidator();
+  validator.idHashed(interp.getState(), 42, "foo");
+  validator.idHashed(interp.getState(), 42, "foo");
+  validator.idHashed(interp.getState(), 42, "bar");
+  auto problems = validator.check();
+  ASSERT_EQ(1, problems.size());
+  EXPECT_STREQ("?: \"bar\" and \"foo\" hash to the same ID 2a", problems[0].cStr());
+}
+
+TEST(BuildScheduleTest, OrdersByLevel) {
+  capnp::MallocMessageBuilder message;
+  auto catalog = message.initRoot<mcm::Catalog>();
+  auto resources = catalog.initResources(4);
+  resources[0].setId(1);
+  resources[0].initDependencies(2).set(0, 2);
+  resources[0].getDependencies().set(1, 4);
+  resources[1].setId(2);
+  resources[1].initDependencies(1).set(0, 3);
+  resources[2].setId(3);
+  resources[3].setId(4);
+  mcm::luacat::buildSchedule(resources.asReader(), catalog.initSchedule());
+
+  auto schedule = catalog.asReader().getSchedule();
+  auto levels = schedule.getLevels();
+  ASSERT_EQ(4, levels.size());
+  EXPECT_EQ(2, levels[0]);
+  EXPECT_EQ(1, levels[1]);
+  EXPECT_EQ(0, levels[2]);
+  EXPECT_EQ(0, levels[3]);
+  auto order = schedule.getOrder();
+  ASSERT_EQ(4, order.size());
+  EXPECT_EQ(2, order[0]);
+  EXPECT_EQ(3, order[1]);
+  EXPECT_EQ(1, order[2]);
+  EXPECT_EQ(0, order[3]);
+}
+
+TEST(BuildScheduleTest, RejectsCycles) {
+  capnp::MallocMessageBuilder message;
+  auto catalog = message.initRoot<mcm::Catalog>();
+  auto resources = catalog.initResources(2);
+  resources[0].setId(1);
+  resources[0].initDependencies(1).set(0, 2);
+  resources[1].setId(2);
+  resources[1].initDependencies(1).set(0, 1);
+  EXPECT_ANY_THROW(mcm::luacat::buildSchedule(resources.asReader(), catalog.initSchedule()));
+}
+
+TEST(BuildIndexTest, SortsIdsAndStoresBothDirections) {
+  capnp::MallocMessageBuilder message;
+  auto catalog = message.initRoot<mcm::Catalog>();
+  auto resources = catalog.initResources(3);
+  resources[0].setId(30);
+  resources[0].initDependencies(2).set(0, 10);
+  resources[0].getDependencies().set(1, 20);
+  resources[1].setId(10);
+  resources[2].setId(20);
+  resources[2].initDependencies(1).set(0, 10);
+  mcm::luacat::buildIndex(resources.asReader(), catalog.initIndex());
+
+  auto index = catalog.asReader().getIndex();
+  auto ids = index.getIds();
+  auto positions = index.getPositions();
+  ASSERT_EQ(3, ids.size());
+  ASSERT_EQ(3, positions.size());
+  EXPECT_EQ(10, ids[0]);
+  EXPECT_EQ(1, positions[0]);
+  EXPECT_EQ(20, ids[1]);
+  EXPECT_EQ(2, positions[1]);
+  EXPECT_EQ(30, ids[2]);
+  EXPECT_EQ(0, positions[2]);
+
+  auto depOffsets = index.getDependencyOffsets();
+  auto depTargets = index.getDependencyTargets();
+  ASSERT_EQ(4, depOffsets.size());
+  EXPECT_EQ(0, depOffsets[0]);
+  EXPECT_EQ(2, depOffsets[1]);
+  EXPECT_EQ(2, depOffsets[2]);
+  EXPECT_EQ(3, depOffsets[3]);
+  ASSERT_EQ(3, depTargets.size());
+  EXPECT_EQ(1, depTargets[0]);
+  EXPECT_EQ(2, depTargets[1]);
+  EXPECT_EQ(1, depTargets[2]);
+
+  auto revOffsets = index.getDependentOffsets();
+  auto revTargets = index.getDependentTargets();
+  ASSERT_EQ(4, revOffsets.size());
+  EXPECT_EQ(0, revOffsets[0]);
+  EXPECT_EQ(0, revOffsets[1]);
+  EXPECT_EQ(2, revOffsets[2]);
+  EXPECT_EQ(3, revOffsets[3]);
+  ASSERT_EQ(3, revTargets.size());
+  EXPECT_EQ(0, revTargets[0]);
+  EXPECT_EQ(2, revTargets[1]);
+  EXPECT_EQ(0, revTargets[2]);
+}
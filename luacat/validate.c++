@@ -0,0 +1,399 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/validate.h"
+
+#include <algorithm>
+#include "kj/debug.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  const uint32_t unvisited = UINT32_MAX;
+
+  kj::String callerLocation(lua_State* state) {
+    // Returns "chunk:line" for the innermost Lua function calling into C.
+
+    lua_Debug ar;
+    for (int level = 1; lua_getstack(state, level, &ar); level++) {
+      lua_getinfo(state, "Sl", &ar);
+      if (ar.currentline > 0) {
+        return kj::str(ar.short_src, ":", ar.currentline);
+      }
+    }
+    return kj::str("?");
+  }
+
+  kj::String quote(kj::StringPtr comment) {
+    return kj::str("\"", comment, "\"");
+  }
+
+  kj::Array<uint64_t> copyIds(capnp::List<uint64_t>::Reader list) {
+    return KJ_MAP(id, list) { return id; };
+  }
+
+  struct Graph {
+    // Edges from each resource to its dependencies, as indices into the
+    // resource list.  edges[offsets[i]..offsets[i+1]) belong to resource i.
+
+    kj::Array<uint32_t> offsets;
+    kj::Array<uint32_t> edges;
+
+    inline kj::ArrayPtr<const uint32_t> from(uint32_t i) const {
+      return edges.slice(offsets[i], offsets[i+1]);
+    }
+  };
+
+  Graph dependencyGraph(capnp::List<Resource>::Reader resources) {
+    // Returns the edges from each resource to its dependencies, which
+    // must all be in resources.
+
+    uint32_t n = resources.size();
+    std::unordered_map<uint64_t, uint32_t> index;
+    for (uint32_t i = 0; i < n; i++) {
+      index.emplace(resources[i].getId(), i);
+    }
+    Graph graph;
+    graph.offsets = kj::heapArray<uint32_t>(n + 1);
+    kj::Vector<uint32_t> edges;
+    for (uint32_t i = 0; i < n; i++) {
+      graph.offsets[i] = edges.size();
+      for (auto dep : resources[i].getDependencies()) {
+        auto iter = index.find(dep);
+        KJ_REQUIRE(iter != index.end(), "dependency not in catalog", resources[i].getComment(), dep);
+        edges.add(iter->second);
+      }
+    }
+    graph.offsets[n] = edges.size();
+    graph.edges = edges.releaseAsArray();
+    return graph;
+  }
+
+  Graph reverse(const Graph& graph) {
+    // Returns graph with its edges reversed.  Each node's edges come out
+    // in ascending order.
+
+    uint32_t n = graph.offsets.size() - 1;
+    Graph result;
+    result.offsets = kj::heapArray<uint32_t>(n + 1);
+    std::fill(result.offsets.begin(), result.offsets.end(), 0);
+    for (auto to : graph.edges) {
+      result.offsets[to + 1]++;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      result.offsets[i+1] += result.offsets[i];
+    }
+    result.edges = kj::heapArray<uint32_t>(graph.edges.size());
+    auto fill = kj::heapArray<uint32_t>(result.offsets.slice(0, n));
+    for (uint32_t i = 0; i < n; i++) {
+      for (auto to : graph.from(i)) {
+        result.edges[fill[to]++] = i;
+      }
+    }
+    return result;
+  }
+
+  void copyList(kj::ArrayPtr<const uint32_t> from, capnp::List<uint32_t>::Builder to) {
+    for (size_t i = 0; i < from.size(); i++) {
+      to.set(i, from[i]);
+    }
+  }
+}  // namespace
+
+void GraphValidator::attach(LibState& lib) {
+  lib.addObserver(*this);
+}
+
+void GraphValidator::resourceDeclared(lua_State* state, Resource::Reader resource) {
+  kj::Maybe<kj::Array<uint64_t>> ifDepsChanged;
+  if (resource.isExec()) {
+    auto cond = resource.getExec().getCondition();
+    if (cond.isIfDepsChanged()) {
+      ifDepsChanged = copyIds(cond.getIfDepsChanged());
+    }
+  }
+  declarations.add(Declaration{
+    resource.getId(),
+    kj::heapString(resource.getComment()),
+    callerLocation(state),
+    copyIds(resource.getDependencies()),
+    kj::mv(ifDepsChanged),
+  });
+}
+
+void GraphValidator::idHashed(lua_State* state, uint64_t id, kj::StringPtr s) {
+  auto iter = names.find(id);
+  if (iter == names.end()) {
+    names.emplace(id, kj::heapString(s));
+    return;
+  }
+  if (iter->second != s) {
+    collisions.add(kj::str(callerLocation(state), ": ", quote(s), " and ",
+                           quote(iter->second), " hash to the same ID ", kj::hex(id)));
+  }
+}
+
+kj::String GraphValidator::describe(uint64_t id) const {
+  auto iter = names.find(id);
+  if (iter == names.end()) {
+    return kj::str("ID ", kj::hex(id));
+  }
+  return quote(iter->second);
+}
+
+kj::Array<kj::String> GraphValidator::check() const {
+  kj::Vector<kj::String> problems;
+  for (auto& c : collisions) {
+    problems.add(kj::heapString(c));
+  }
+
+  // Resolve IDs to declarations.  Dependencies on a duplicated ID go to
+  // its first declaration.
+  std::unordered_map<uint64_t, uint32_t> index;
+  for (uint32_t i = 0; i < declarations.size(); i++) {
+    auto& decl = declarations[i];
+    if (decl.id == 0) {
+      problems.add(kj::str(decl.location, ": resource ", quote(decl.comment), " has ID 0"));
+      continue;
+    }
+    auto inserted = index.emplace(decl.id, i);
+    if (!inserted.second) {
+      auto& first = declarations[inserted.first->second];
+      if (first.comment == decl.comment) {
+        problems.add(kj::str(decl.location, ": resource ", quote(decl.comment),
+                             " already declared at ", first.location));
+      } else {
+        problems.add(kj::str(decl.location, ": resource ", quote(decl.comment),
+                             " has the same ID as ", quote(first.comment),
+                             " (declared at ", first.location, ")"));
+      }
+    }
+  }
+
+  Graph graph;
+  graph.offsets = kj::heapArray<uint32_t>(declarations.size() + 1);
+  kj::Vector<uint32_t> edges;
+  for (uint32_t i = 0; i < declarations.size(); i++) {
+    auto& decl = declarations[i];
+    graph.offsets[i] = edges.size();
+    for (auto dep : decl.dependencies) {
+      auto iter = index.find(dep);
+      if (iter == index.end()) {
+        problems.add(kj::str(decl.location, ": resource ", quote(decl.comment),
+                             " depends on ", describe(dep), ", which is not declared"));
+        continue;
+      }
+      edges.add(iter->second);
+    }
+    KJ_IF_MAYBE(list, decl.ifDepsChanged) {
+      if (list->size() == 0) {
+        problems.add(kj::str(decl.location, ": resource ", quote(decl.comment),
+                             " has an empty ifDepsChanged list"));
+      }
+      for (auto id : *list) {
+        if (std::find(decl.dependencies.begin(), decl.dependencies.end(), id) ==
+            decl.dependencies.end()) {
+          problems.add(kj::str(decl.location, ": resource ", quote(decl.comment),
+                               " lists ", describe(id), " in ifDepsChanged but does not depend on it"));
+        }
+      }
+    }
+  }
+  graph.offsets[declarations.size()] = edges.size();
+  graph.edges = edges.releaseAsArray();
+
+  // Find cycles with Tarjan's strongly connected components algorithm.
+  // The depth-first search keeps its own stack, since dependency chains
+  // can be far longer than the C stack allows.
+  uint32_t n = declarations.size();
+  auto order = kj::heapArray<uint32_t>(n);
+  auto lowLink = kj::heapArray<uint32_t>(n);
+  auto onStack = kj::heapArray<bool>(n);
+  std::fill(order.begin(), order.end(), unvisited);
+  std::fill(onStack.begin(), onStack.end(), false);
+  struct Frame {
+    uint32_t node;
+    uint32_t nextEdge;
+  };
+  kj::Vector<Frame> calls;
+  kj::Vector<uint32_t> stack;
+  uint32_t counter = 0;
+  auto visit = [&](uint32_t v) {
+    order[v] = lowLink[v] = counter++;
+    stack.add(v);
+    onStack[v] = true;
+    calls.add(Frame{v, graph.offsets[v]});
+  };
+  for (uint32_t root = 0; root < n; root++) {
+    if (order[root] != unvisited) {
+      continue;
+    }
+    visit(root);
+    while (calls.size() > 0) {
+      auto& frame = calls.back();
+      uint32_t v = frame.node;
+      if (frame.nextEdge < graph.offsets[v+1]) {
+        uint32_t w = graph.edges[frame.nextEdge++];
+        if (order[w] == unvisited) {
+          visit(w);  // invalidates frame
+        } else if (onStack[w]) {
+          lowLink[v] = kj::min(lowLink[v], order[w]);
+        }
+        continue;
+      }
+      calls.removeLast();
+      if (calls.size() > 0) {
+        uint32_t parent = calls.back().node;
+        lowLink[parent] = kj::min(lowLink[parent], lowLink[v]);
+      }
+      if (lowLink[v] != order[v]) {
+        continue;
+      }
+
+      // v is the root of a component.  Pop it and report one cycle
+      // through its earliest declaration.
+      kj::Vector<uint32_t> members;
+      uint32_t w;
+      do {
+        w = stack.back();
+        stack.removeLast();
+        onStack[w] = false;
+        members.add(w);
+      } while (w != v);
+      uint32_t start = *std::min_element(members.begin(), members.end());
+      auto self = graph.from(start);
+      if (members.size() == 1 && std::find(self.begin(), self.end(), start) == self.end()) {
+        continue;
+      }
+      // Breadth-first search within the component for the shortest path
+      // back to start.
+      std::sort(members.begin(), members.end());
+      std::unordered_map<uint32_t, uint32_t> parents;
+      kj::Vector<uint32_t> queue;
+      queue.add(start);
+      uint32_t last = start;
+      for (size_t head = 0; head < queue.size(); head++) {
+        uint32_t u = queue[head];
+        bool closed = false;
+        for (auto x : graph.from(u)) {
+          if (x == start) {
+            last = u;
+            closed = true;
+            break;
+          }
+          if (std::binary_search(members.begin(), members.end(), x) &&
+              parents.find(x) == parents.end()) {
+            parents.emplace(x, u);
+            queue.add(x);
+          }
+        }
+        if (closed) {
+          break;
+        }
+      }
+      kj::Vector<uint32_t> path;
+      for (uint32_t u = last; u != start; u = parents.find(u)->second) {
+        path.add(u);
+      }
+      path.add(start);
+      kj::Vector<kj::String> steps;
+      for (size_t i = path.size(); i > 0; i--) {
+        auto& decl = declarations[path[i-1]];
+        steps.add(kj::str(quote(decl.comment), " (", decl.location, ")"));
+      }
+      steps.add(quote(declarations[start].comment));
+      problems.add(kj::str(declarations[start].location, ": dependency cycle: ",
+                           kj::strArray(steps, " -> ")));
+    }
+  }
+
+  return problems.releaseAsArray();
+}
+
+void buildSchedule(capnp::List<Resource>::Reader resources, Catalog::Schedule::Builder schedule) {
+  // Kahn's algorithm: a resource is scheduled once all of its
+  // dependencies are, one level above the highest of them.
+
+  uint32_t n = resources.size();
+  auto forward = dependencyGraph(resources);
+  auto backward = reverse(forward);
+  auto pending = kj::heapArray<uint32_t>(n);
+  auto levels = schedule.initLevels(n);
+  kj::Vector<uint32_t> ready;
+  for (uint32_t i = 0; i < n; i++) {
+    pending[i] = forward.from(i).size();
+    levels.set(i, 0);
+    if (pending[i] == 0) {
+      ready.add(i);
+    }
+  }
+  uint32_t maxLevel = 0;
+  for (size_t head = 0; head < ready.size(); head++) {
+    uint32_t i = ready[head];
+    uint32_t next = levels[i] + 1;
+    for (auto j : backward.from(i)) {
+      if (levels[j] < next) {
+        levels.set(j, next);
+        maxLevel = kj::max(maxLevel, next);
+      }
+      if (--pending[j] == 0) {
+        ready.add(j);
+      }
+    }
+  }
+  KJ_REQUIRE(ready.size() == n, "dependency cycle in catalog");
+
+  // Counting sort by level, which keeps indices ascending within a level.
+  auto starts = kj::heapArray<uint32_t>(maxLevel + 2);
+  std::fill(starts.begin(), starts.end(), 0);
+  for (uint32_t i = 0; i < n; i++) {
+    starts[levels[i] + 1]++;
+  }
+  for (uint32_t l = 0; l <= maxLevel; l++) {
+    starts[l+1] += starts[l];
+  }
+  auto order = schedule.initOrder(n);
+  for (uint32_t i = 0; i < n; i++) {
+    order.set(starts[levels[i]]++, i);
+  }
+}
+
+void buildIndex(capnp::List<Resource>::Reader resources, Catalog::Index::Builder index) {
+  uint32_t n = resources.size();
+  auto byId = kj::heapArray<uint32_t>(n);
+  for (uint32_t i = 0; i < n; i++) {
+    byId[i] = i;
+  }
+  std::sort(byId.begin(), byId.end(), [&](uint32_t a, uint32_t b) {
+    return resources[a].getId() < resources[b].getId();
+  });
+  auto ids = index.initIds(n);
+  auto positions = index.initPositions(n);
+  for (uint32_t i = 0; i < n; i++) {
+    ids.set(i, resources[byId[i]].getId());
+    positions.set(i, byId[i]);
+  }
+
+  auto forward = dependencyGraph(resources);
+  copyList(forward.offsets, index.initDependencyOffsets(forward.offsets.size()));
+  copyList(forward.edges, index.initDependencyTargets(forward.edges.size()));
+  auto backward = reverse(forward);
+  copyList(backward.offsets, index.initDependentOffsets(backward.offsets.size()));
+  copyList(backward.edges, index.initDependentTargets(backward.edges.size()));
+}
+
+}  // namespace luacat
+}  // namespace mcm
@@ -0,0 +1,87 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_VALIDATE_H_
+#define MCM_LUACAT_VALIDATE_H_
+// Checking, scheduling, and indexing a catalog's dependency graph.
+
+#include <stdint.h>
+#include <unordered_map>
+#include "kj/array.h"
+#include "kj/common.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "catalog.capnp.h"
+#include "luacat/lib.h"
+
+namespace mcm {
+
+namespace luacat {
+
+class GraphValidator final: public ResourceObserver {
+  // Records the resources a script declares, along with where it
+  // declared them, so that mistakes in the dependency graph can be
+  // reported against the script instead of surfacing when the catalog
+  // is applied.
+
+public:
+  GraphValidator() {}
+  KJ_DISALLOW_COPY(GraphValidator);
+
+  void attach(LibState& lib);
+  // Start watching lib.  Must be called before the script runs, so
+  // that every hashed string is seen.
+
+  kj::Array<kj::String> check() const;
+  // Returns a message for each problem in the resources declared so
+  // far: strings that hash to the same ID, resources without an ID or
+  // sharing an ID, dependencies on undeclared resources, bad
+  // ifDepsChanged lists, and dependency cycles.  Each message starts
+  // with the location of the offending declaration.
+
+  void resourceDeclared(lua_State* state, Resource::Reader resource) override;
+  void idHashed(lua_State* state, uint64_t id, kj::StringPtr s) override;
+
+private:
+  struct Declaration {
+    uint64_t id;
+    kj::String comment;
+    kj::String location;
+    kj::Array<uint64_t> dependencies;
+    kj::Maybe<kj::Array<uint64_t>> ifDepsChanged;
+  };
+
+  kj::String describe(uint64_t id) const;
+
+  kj::Vector<Declaration> declarations;
+  std::unordered_map<uint64_t, kj::String> names;  // every string hashed, by ID
+  kj::Vector<kj::String> collisions;
+};
+
+void buildSchedule(capnp::List<Resource>::Reader resources, Catalog::Schedule::Builder schedule);
+// Fill in schedule for resources.  Every dependency must be declared
+// and the graph must be acyclic, which GraphValidator::check ensures.
+
+void buildIndex(capnp::List<Resource>::Reader resources, Catalog::Index::Builder index);
+// Fill in index for resources.  Every dependency must be declared.
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_VALIDATE_H_
@@ -0,0 +1,169 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/view.h"
+
+#include <algorithm>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "capnp/message.h"
+
+extern "C" {
+#include "lauxlib.h"
+}
+
+#include "luacat/idhash.h"
+#include "luacat/main.h"
+#include "luacat/testutil.h"
+
+namespace {
+
+kj::String buildCatalog(bool withIndex, bool staleIndex = false) {
+  capnp::MallocMessageBuilder message;
+  auto catalog = message.initRoot<mcm::Catalog>();
+  auto resources = catalog.initResources(3);
+  resources[0].setId(mcm::luacat::idHash("conf"));
+  resources[0].setComment("conf");
+  auto file = resources[0].initFile();
+  file.setPath("/etc/foo.conf");
+  file.initPlain().setContent(kj::StringPtr("a=1\n").asBytes());
+  file.getPlain().initMode().setBits(0644);
+  resources[1].setId(mcm::luacat::idHash("restart"));
+  resources[1].setComment("restart");
+  resources[1].initDependencies(1).set(0, mcm::luacat::idHash("conf"));
+  auto exec = resources[1].initExec();
+  auto argv = exec.initCommand().initArgv(2);
+  argv.set(0, "/bin/systemctl");
+  argv.set(1, "restart");
+  exec.getCondition().initIfDepsChanged(1).set(0, mcm::luacat::idHash("conf"));
+  resources[2].setId(mcm::luacat::idHash("marker"));
+  resources[2].setComment("marker");
+  resources[2].setNoop();
+  if (withIndex) {
+    uint64_t ids[3];
+    uint32_t positions[3] = {0, 1, 2};
+    for (int i = 0; i < 3; i++) {
+      ids[i] = resources[i].getId();
+    }
+    std::sort(positions, positions + 3, [&](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+    auto index = catalog.initIndex();
+    auto outIds = index.initIds(3);
+    auto outPositions = index.initPositions(3);
+    for (int i = 0; i < 3; i++) {
+      outIds.set(i, ids[positions[i]]);
+      outPositions.set(i, positions[staleIndex ? 2 - i : i]);
+    }
+  }
+  return mcm::luacat::writeTempCatalog(message);
+}
+
+kj::Maybe<kj::String> runScript(kj::StringPtr script, kj::StringPtr expectComment = nullptr) {
+  // Returns the error message if the script fails.  If expectComment is
+  // given, the script must declare one resource with that comment.
+
+  capnp::MallocMessageBuilder message;
+  mcm::luacat::Interpreter interp;
+  auto& lib = interp.getLibState();
+  lib.setMessage(message);
+  lua_State* state = interp.getState();
+  if (luaL_loadbuffer(state, script.begin(), script.size(), "=test") != LUA_OK ||
+      lua_pcall(state, 0, 0, 0) != LUA_OK) {
+    lib.releaseResources();
+    return kj::heapString(lua_tostring(state, -1));
+  }
+  auto resources = lib.releaseResources();
+  if (expectComment != nullptr) {
+    if (resources.size() != 1) {
+      return kj::str("declared ", resources.size(), " resources");
+    }
+    auto comment = resources[0].getReader().getComment();
+    if (comment != expectComment) {
+      return kj::str("declared resource with comment \"", comment, "\"");
+    }
+  }
+  return nullptr;
+}
+
+const char* const viewScript =
+    "local cat = mcm.load(path)\n"
+    "assert(#cat.resources == 3)\n"
+    "local conf = cat.resources[1]\n"
+    "assert(conf.comment == 'conf')\n"
+    "assert(conf.id == mcm.hash('conf'))\n"
+    "assert(conf.exec == nil and conf.noop == nil)\n"
+    "assert(conf.file.path == '/etc/foo.conf')\n"
+    "assert(conf.file.plain.content == 'a=1\\n')\n"
+    "assert(conf.file.plain.mode.bits == 420)\n"
+    "assert(conf.file.plain.mode.user == nil)\n"
+    "assert(conf.file.directory == nil)\n"
+    "assert(#conf.dependencies == 0)\n"
+    "assert(conf.bogus == nil)\n"
+    "local restart = cat:get('restart')\n"
+    "assert(restart.exec.command.argv[2] == 'restart')\n"
+    "assert(restart.exec.command.argv[3] == nil)\n"
+    "assert(restart.dependencies[1] == conf.id)\n"
+    "assert(restart.exec.condition.ifDepsChanged[1] == mcm.hash('conf'))\n"
+    "assert(cat:get(mcm.hash('marker')).noop == true)\n"
+    "assert(cat:get('missing') == nil)\n"
+    "local keys = {}\n"
+    "for k, v in pairs(restart) do keys[#keys+1] = k end\n"
+    "assert(table.concat(keys, ',') == 'id,comment,dependencies,exec', table.concat(keys, ','))\n"
+    "local n = 0\n"
+    "for i, r in ipairs(cat.resources) do n = n + 1 end\n"
+    "assert(n == 3)\n"
+    "assert(not pcall(function() conf.comment = 'x' end))\n"
+    "mcm.resource(conf.id, {restart.id}, mcm.file{path=conf.file.path})\n";
+
+}  // namespace
+
+TEST(CatalogViewTest, ReadsFields) {
+  for (bool withIndex : {false, true}) {
+    auto path = buildCatalog(withIndex);
+    KJ_DEFER(unlink(path.cStr()));
+    auto script = kj::str("local path = '", path, "'\n", viewScript);
+    KJ_IF_MAYBE(err, runScript(script, "conf")) {
+      ADD_FAILURE() << "withIndex=" << withIndex << ": " << err->cStr();
+    }
+  }
+}
+
+TEST(CatalogViewTest, IgnoresStaleIndex) {
+  auto path = buildCatalog(true, true);
+  KJ_DEFER(unlink(path.cStr()));
+  auto script = kj::str("local path = '", path, "'\n", viewScript);
+  KJ_IF_MAYBE(err, runScript(script, "conf")) {
+    ADD_FAILURE() << err->cStr();
+  }
+}
+
+TEST(CatalogViewTest, OutlivesCatalogVariable) {
+  auto path = buildCatalog(false);
+  KJ_DEFER(unlink(path.cStr()));
+  auto script = kj::str(
+      "local r = mcm.load('", path, "').resources[2].exec.command\n"
+      "collectgarbage()\n"
+      "collectgarbage()\n"
+      "assert(r.argv[1] == '/bin/systemctl')\n");
+  KJ_IF_MAYBE(err, runScript(script)) {
+    ADD_FAILURE() << err->cStr();
+  }
+}
+
+TEST(CatalogViewTest, MissingFile) {
+  KJ_IF_MAYBE(err, runScript("mcm.load('/nonexistent/base.catalog')")) {
+    EXPECT_TRUE(kj::StringPtr(*err).startsWith("test:1: ")) << err->cStr();
+  } else {
+    ADD_FAILURE() << "mcm.load did not fail";
+  }
+}
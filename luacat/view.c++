@@ -0,0 +1,456 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "luacat/view.h"
+
+#include <algorithm>
+#include <new>
+#include "kj/debug.h"
+#include "kj/exception.h"
+#include "capnp/dynamic.h"
+#include "capnp/schema.h"
+#include "lua.hpp"
+
+#include "catalog.capnp.h"
+#include "luacat/convert.h"
+#include "luacat/idhash.h"
+#include "luacat/types.h"
+
+namespace mcm {
+
+namespace luacat {
+
+namespace {
+  // The addresses of these are the registry keys for the metatables.
+  char catalogViewKey;
+  char structViewKey;
+  char listViewKey;
+
+  struct Entry {
+    uint64_t id;
+    uint32_t pos;
+
+    inline bool operator<(const Entry& other) const { return id < other.id; }
+  };
+
+  struct CatalogView {
+    capnp::DynamicStruct::Reader root;
+    kj::Own<CatalogFile> file;
+    bool sorted = false;
+    kj::Array<Entry> sortedIds;  // built by the first get() if the catalog has no index
+  };
+
+  struct StructView {
+    // The user value is the CatalogView that owns the memory.
+    capnp::DynamicStruct::Reader reader;
+  };
+
+  struct ListView {
+    // The user value is the CatalogView that owns the memory.
+    capnp::DynamicList::Reader reader;
+  };
+
+  template <typename Func>
+  int protect(lua_State* state, Func&& func) {
+    // Call func, converting a kj::Exception into a Lua error.  Catalogs
+    // are only checked as they are read, so any access can fail.
+
+    int n = 0;
+    bool failed = false;
+    {
+      KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() { n = func(); })) {
+        pushLua(state, *e);
+        failed = true;
+      }
+    }
+    if (failed) {
+      return lua_error(state);  // after the exception's destructor has run
+    }
+    return n;
+  }
+
+  void pushStruct(lua_State* state, capnp::DynamicStruct::Reader reader, int owner);
+  void pushList(lua_State* state, capnp::DynamicList::Reader reader, int owner);
+
+  void pushValue(lua_State* state, capnp::schema::Type::Which type,
+                 capnp::DynamicValue::Reader value, int owner, kj::StringPtr comment = "") {
+    // Push a field or list element.  UInt64s are resource IDs, so they
+    // are pushed as Ids with the given comment.
+
+    switch (type) {
+    case capnp::schema::Type::VOID:
+      lua_pushboolean(state, true);
+      break;
+    case capnp::schema::Type::BOOL:
+      lua_pushboolean(state, value.as<bool>());
+      break;
+    case capnp::schema::Type::INT8:
+    case capnp::schema::Type::INT16:
+    case capnp::schema::Type::INT32:
+    case capnp::schema::Type::INT64:
+      lua_pushinteger(state, value.as<int64_t>());
+      break;
+    case capnp::schema::Type::UINT8:
+    case capnp::schema::Type::UINT16:
+    case capnp::schema::Type::UINT32:
+      lua_pushinteger(state, value.as<uint32_t>());
+      break;
+    case capnp::schema::Type::UINT64:
+      pushId(state, value.as<uint64_t>(), comment);
+      break;
+    case capnp::schema::Type::FLOAT32:
+    case capnp::schema::Type::FLOAT64:
+      lua_pushnumber(state, value.as<double>());
+      break;
+    case capnp::schema::Type::TEXT:
+      pushLua(state, value.as<capnp::Text>());
+      break;
+    case capnp::schema::Type::DATA:
+      {
+        auto data = value.as<capnp::Data>();
+        lua_pushlstring(state, reinterpret_cast<const char*>(data.begin()), data.size());
+      }
+      break;
+    case capnp::schema::Type::ENUM:
+      {
+        auto e = value.as<capnp::DynamicEnum>();
+        KJ_IF_MAYBE(enumerant, e.getEnumerant()) {
+          pushLua(state, enumerant->getProto().getName());
+        } else {
+          lua_pushinteger(state, e.getRaw());
+        }
+      }
+      break;
+    case capnp::schema::Type::STRUCT:
+      pushStruct(state, value.as<capnp::DynamicStruct>(), owner);
+      break;
+    case capnp::schema::Type::LIST:
+      pushList(state, value.as<capnp::DynamicList>(), owner);
+      break;
+    default:
+      KJ_FAIL_REQUIRE("can't map type to Lua", static_cast<int>(type));
+    }
+  }
+
+  void pushField(lua_State* state, capnp::DynamicStruct::Reader reader,
+                 capnp::StructSchema::Field field, int owner) {
+    // Push a struct's field, or nil if it is a union member other than
+    // the one set, or a Text, Data, or struct field that isn't set.
+    // Lists that aren't set are empty, as in Cap'n Proto.
+
+    auto proto = field.getProto();
+    if (proto.getDiscriminantValue() != capnp::schema::Field::NO_DISCRIMINANT) {
+      KJ_IF_MAYBE(active, reader.which()) {
+        if (*active != field) {
+          lua_pushnil(state);
+          return;
+        }
+      } else {
+        lua_pushnil(state);
+        return;
+      }
+    }
+    if (proto.isGroup()) {
+      pushStruct(state, reader.get(field).as<capnp::DynamicStruct>(), owner);
+      return;
+    }
+    auto type = field.getType().which();
+    switch (type) {
+    case capnp::schema::Type::TEXT:
+    case capnp::schema::Type::DATA:
+    case capnp::schema::Type::STRUCT:
+      if (!reader.has(field)) {
+        lua_pushnil(state);
+        return;
+      }
+      break;
+    default:
+      break;
+    }
+    kj::StringPtr comment = "";
+    if (type == capnp::schema::Type::UINT64 &&
+        reader.getSchema().getProto().getId() == capnp::typeId<Resource>()) {
+      // A resource's own ID keeps its name, so mcm.resource(r.id, ...)
+      // declares it with the same comment.
+      comment = reader.as<Resource>().getComment();
+    }
+    pushValue(state, type, reader.get(field), owner, comment);
+  }
+
+  template <typename T>
+  T& newView(lua_State* state, const void* key, int owner) {
+    // Push a userdata for a view, with owner as its user value.
+
+    owner = lua_absindex(state, owner);
+    auto p = reinterpret_cast<T*>(lua_newuserdata(state, sizeof(T)));
+    kj::ctor(*p);
+    lua_rawgetp(state, LUA_REGISTRYINDEX, key);
+    lua_setmetatable(state, -2);
+    lua_pushvalue(state, owner);
+    lua_setuservalue(state, -2);
+    return *p;
+  }
+
+  void pushStruct(lua_State* state, capnp::DynamicStruct::Reader reader, int owner) {
+    newView<StructView>(state, &structViewKey, owner).reader = reader;
+  }
+
+  void pushList(lua_State* state, capnp::DynamicList::Reader reader, int owner) {
+    newView<ListView>(state, &listViewKey, owner).reader = reader;
+  }
+
+  capnp::DynamicStruct::Reader pushStructOwner(lua_State* state, int index) {
+    // Returns the struct read by the catalog or struct view at index,
+    // and pushes the catalog view that owns it.  Only called from
+    // metamethods, so the value is known to be one of the two.
+
+    void* p = lua_touserdata(state, index);
+    lua_getuservalue(state, index);
+    if (lua_isnil(state, -1)) {
+      lua_pop(state, 1);
+      lua_pushvalue(state, index);
+      return reinterpret_cast<CatalogView*>(p)->root;
+    }
+    return reinterpret_cast<StructView*>(p)->reader;
+  }
+
+  int structIndex(lua_State* state) {
+    return protect(state, [&]() {
+      auto reader = pushStructOwner(state, 1);
+      int owner = lua_gettop(state);
+      if (lua_type(state, 2) != LUA_TSTRING) {
+        lua_pushnil(state);
+        return 1;
+      }
+      KJ_IF_MAYBE(field, reader.getSchema().findFieldByName(luaStringPtr(state, 2))) {
+        pushField(state, reader, *field, owner);
+      } else {
+        lua_pushnil(state);
+      }
+      return 1;
+    });
+  }
+
+  int structNext(lua_State* state) {
+    // The iterator for pairs: fields in declaration order, skipping the
+    // ones that read as nil.
+
+    return protect(state, [&]() {
+      auto reader = pushStructOwner(state, 1);
+      int owner = lua_gettop(state);
+      auto fields = reader.getSchema().getFields();
+      capnp::uint i = 0;
+      if (lua_type(state, 2) == LUA_TSTRING) {
+        auto field = KJ_REQUIRE_NONNULL(reader.getSchema().findFieldByName(luaStringPtr(state, 2)),
+                                        "invalid key to 'next'");
+        i = field.getIndex() + 1;
+      }
+      for (; i < fields.size(); i++) {
+        pushLua(state, fields[i].getProto().getName());
+        pushField(state, reader, fields[i], owner);
+        if (!lua_isnil(state, -1)) {
+          return 2;
+        }
+        lua_pop(state, 2);
+      }
+      lua_pushnil(state);
+      return 1;
+    });
+  }
+
+  int structPairs(lua_State* state) {
+    lua_pushcfunction(state, structNext);
+    lua_pushvalue(state, 1);
+    lua_pushnil(state);
+    return 3;
+  }
+
+  int listIndex(lua_State* state) {
+    return protect(state, [&]() {
+      auto& view = *reinterpret_cast<ListView*>(lua_touserdata(state, 1));
+      lua_getuservalue(state, 1);
+      int owner = lua_gettop(state);
+      int isint = 0;
+      lua_Integer i = lua_tointegerx(state, 2, &isint);
+      if (!isint || i < 1 || i > view.reader.size()) {
+        lua_pushnil(state);
+        return 1;
+      }
+      pushValue(state, view.reader.getSchema().whichElementType(), view.reader[i - 1], owner);
+      return 1;
+    });
+  }
+
+  int listLen(lua_State* state) {
+    auto& view = *reinterpret_cast<ListView*>(lua_touserdata(state, 1));
+    lua_pushinteger(state, view.reader.size());
+    return 1;
+  }
+
+  int listNext(lua_State* state) {
+    auto& view = *reinterpret_cast<ListView*>(lua_touserdata(state, 1));
+    lua_Integer i = luaL_optinteger(state, 2, 0) + 1;
+    if (i > view.reader.size()) {
+      lua_pushnil(state);
+      return 1;
+    }
+    lua_pushinteger(state, i);
+    lua_replace(state, 2);
+    lua_settop(state, 2);
+    lua_pushvalue(state, 2);
+    lua_gettable(state, 1);
+    return 2;
+  }
+
+  int listPairs(lua_State* state) {
+    lua_pushcfunction(state, listNext);
+    lua_pushvalue(state, 1);
+    lua_pushnil(state);
+    return 3;
+  }
+
+  int readOnlyNewIndex(lua_State* state) {
+    return luaL_error(state, "attempt to modify a catalog view");
+  }
+
+  kj::Maybe<uint32_t> findResource(CatalogView& view, uint64_t id) {
+    // Binary search the catalog's index, or a sorted copy of its IDs if
+    // it doesn't have one or it points at the wrong resource.
+
+    auto catalog = view.root.as<Catalog>();
+    auto resources = catalog.getResources();
+    if (catalog.hasIndex() && catalog.getIndex().getIds().size() == resources.size() &&
+        catalog.getIndex().getPositions().size() == resources.size()) {
+      auto ids = catalog.getIndex().getIds();
+      uint32_t lo = 0, hi = ids.size();
+      while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < id) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      if (lo == ids.size() || ids[lo] != id) {
+        return nullptr;
+      }
+      auto pos = catalog.getIndex().getPositions()[lo];
+      if (pos < resources.size() && resources[pos].getId() == id) {
+        return pos;
+      }
+    }
+
+    if (!view.sorted) {
+      view.sortedIds = kj::heapArray<Entry>(resources.size());
+      for (uint32_t i = 0; i < resources.size(); i++) {
+        view.sortedIds[i] = Entry{resources[i].getId(), i};
+      }
+      std::stable_sort(view.sortedIds.begin(), view.sortedIds.end());
+      view.sorted = true;
+    }
+    auto iter = std::lower_bound(view.sortedIds.begin(), view.sortedIds.end(), Entry{id, 0});
+    if (iter == view.sortedIds.end() || iter->id != id) {
+      return nullptr;
+    }
+    return iter->pos;
+  }
+
+  int catalogGet(lua_State* state) {
+    // view:get(id) returns the resource with the given ID (an Id or a
+    // string to hash), or nil.
+
+    auto& view = *reinterpret_cast<CatalogView*>(luaL_checkudata(state, 1, "mcm catalog"));
+    uint64_t id;
+    KJ_IF_MAYBE(i, getId(state, 2)) {
+      id = i->getValue();
+    } else {
+      luaL_argcheck(state, lua_isstring(state, 2), 2, "expect mcm.hash or string");
+      id = idHash(luaStringPtr(state, 2));
+    }
+    return protect(state, [&]() {
+      KJ_IF_MAYBE(pos, findResource(view, id)) {
+        pushStruct(state, view.root.as<Catalog>().getResources()[*pos], 1);
+      } else {
+        lua_pushnil(state);
+      }
+      return 1;
+    });
+  }
+
+  int catalogIndex(lua_State* state) {
+    if (lua_type(state, 2) == LUA_TSTRING && luaStringPtr(state, 2) == "get") {
+      lua_pushcfunction(state, catalogGet);
+      return 1;
+    }
+    return structIndex(state);
+  }
+
+  int catalogGc(lua_State* state) {
+    auto& view = *reinterpret_cast<CatalogView*>(lua_touserdata(state, 1));
+    kj::dtor(view);
+    return 0;
+  }
+
+  void newMetatable(lua_State* state, const void* key, const char* name, const luaL_Reg* funcs) {
+    if (lua_rawgetp(state, LUA_REGISTRYINDEX, key) != LUA_TNIL) {
+      lua_pop(state, 1);
+      return;
+    }
+    lua_pop(state, 1);
+    luaL_newmetatable(state, name);
+    luaL_setfuncs(state, funcs, 0);
+    lua_pushliteral(state, "catalog view");
+    lua_setfield(state, -2, "__metatable");
+    lua_rawsetp(state, LUA_REGISTRYINDEX, key);
+  }
+
+  const luaL_Reg catalogMeta[] = {
+    {"__index", catalogIndex},
+    {"__newindex", readOnlyNewIndex},
+    {"__pairs", structPairs},
+    {"__gc", catalogGc},
+    {NULL, NULL},
+  };
+
+  const luaL_Reg structMeta[] = {
+    {"__index", structIndex},
+    {"__newindex", readOnlyNewIndex},
+    {"__pairs", structPairs},
+    {NULL, NULL},
+  };
+
+  const luaL_Reg listMeta[] = {
+    {"__index", listIndex},
+    {"__newindex", readOnlyNewIndex},
+    {"__len", listLen},
+    {"__pairs", listPairs},
+    {NULL, NULL},
+  };
+}  // namespace
+
+void pushCatalogView(lua_State* state, kj::Own<CatalogFile> file) {
+  newMetatable(state, &catalogViewKey, "mcm catalog", catalogMeta);
+  newMetatable(state, &structViewKey, "mcm struct", structMeta);
+  newMetatable(state, &listViewKey, "mcm list", listMeta);
+
+  auto p = reinterpret_cast<CatalogView*>(lua_newuserdata(state, sizeof(CatalogView)));
+  kj::ctor(*p);
+  p->root = capnp::toDynamic(file->getCatalog());
+  p->file = kj::mv(file);
+  lua_rawgetp(state, LUA_REGISTRYINDEX, &catalogViewKey);
+  lua_setmetatable(state, -2);
+}
+
+}  // namespace luacat
+}  // namespace mcm
@@ -0,0 +1,41 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_LUACAT_VIEW_H_
+#define MCM_LUACAT_VIEW_H_
+// Read-only Lua views of catalog files (mcm.load).
+
+#include "kj/memory.h"
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "luacat/link.h"
+
+namespace mcm {
+
+namespace luacat {
+
+void pushCatalogView(lua_State* state, kj::Own<CatalogFile> file);
+// Push a userdata that reads file's catalog in place.  Indexing it (or
+// any struct or list reached from it) converts only the field asked
+// for, using the schema in the same way that copyStruct does in
+// reverse.  The view's get method finds a resource by ID.  file is
+// kept until the view and everything reached from it are collected.
+
+}  // namespace luacat
+}  // namespace mcm
+
+#endif  // MCM_LUACAT_VIEW_H_
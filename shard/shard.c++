@@ -0,0 +1,198 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "capnp/message.h"
+#include "capnp/serialize.h"
+#include "capnp/serialize-packed.h"
+#include "kj/debug.h"
+#include "kj/io.h"
+#include "kj/main.h"
+#include "kj/string.h"
+#include "kj/vector.h"
+
+#include "catalog.capnp.h"
+#include "luacat/link.h"
+#include "shard/split.h"
+
+namespace mcm {
+
+namespace shard {
+
+namespace {
+
+kj::String jsonString(kj::StringPtr s) {
+  kj::Vector<char> buf(s.size() + 2);
+  buf.add('"');
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      buf.add('\\');
+      buf.add(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      const char digits[] = "0123456789abcdef";
+      buf.addAll(kj::StringPtr("\\u00"));
+      buf.add(digits[c >> 4]);
+      buf.add(digits[c & 0xf]);
+    } else {
+      buf.add(c);
+    }
+  }
+  buf.add('"');
+  buf.add('\0');
+  return kj::String(buf.releaseAsArray());
+}
+
+kj::String baseName(kj::StringPtr path) {
+  // The file name without its directory or a .catalog extension, for
+  // naming shards.
+
+  KJ_IF_MAYBE(slash, path.findLast('/')) {
+    path = path.slice(*slash + 1);
+  }
+  if (path.endsWith(".catalog")) {
+    return kj::heapString(path.slice(0, path.size() - strlen(".catalog")));
+  }
+  return kj::heapString(path);
+}
+
+class ShardMain {
+public:
+  ShardMain(kj::ProcessContext& context, kj::OutputStream& outStream):
+      context(context), outStream(&outStream) {}
+  KJ_DISALLOW_COPY(ShardMain);
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "mcm-shard",
+          "Splits CATALOG into catalogs that don't depend on each other, so that "
+          "they can be applied in parallel.  Each weakly connected component of the "
+          "dependency graph becomes its own catalog, unless -n is given.  Writes a "
+          "JSON manifest of the shards to stdout.")
+        .addOptionWithArg({'d'}, KJ_BIND_METHOD(*this, setOutputDir),
+            "DIR", "Write shards to DIR/NAME-K.catalog, where NAME is CATALOG's "
+            "file name without the .catalog extension.  Defaults to the current "
+            "directory.")
+        .addOptionWithArg({'n'}, KJ_BIND_METHOD(*this, setShardCount),
+            "N", "Write exactly N shards, dividing the components among them so "
+            "that each has about the same number of resources and bytes.")
+        .addOptionWithArg({'m', "manifest"}, KJ_BIND_METHOD(*this, setManifestPath),
+            "FILE", "Write the manifest to FILE instead of stdout.")
+        .addOption({"packed"}, KJ_BIND_METHOD(*this, setPackedOutput),
+            "Write shards in the packed encoding.")
+        .expectArg("CATALOG", KJ_BIND_METHOD(*this, setCatalogPath))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::OutputStream* outStream;
+  kj::Own<kj::OutputStream> ownOutStream;
+  kj::String outputDir = kj::heapString(".");
+  uint32_t shardCount = 0;
+  bool packedOutput = false;
+  kj::String catalogPath;
+
+  kj::MainBuilder::Validity setOutputDir(kj::StringPtr dir) {
+    outputDir = kj::heapString(dir);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setShardCount(kj::StringPtr arg) {
+    char* end;
+    errno = 0;
+    unsigned long n = strtoul(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0' || errno != 0 || n == 0 || n > 100000) {
+      return "must be a number between 1 and 100000";
+    }
+    shardCount = n;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setManifestPath(kj::StringPtr path) {
+    int fd = open(path.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      return kj::str("open ", path, ": ", strerror(errno));
+    }
+    ownOutStream = kj::heap<kj::FdOutputStream>(kj::AutoCloseFd(fd));
+    outStream = ownOutStream.get();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPackedOutput() {
+    packedOutput = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setCatalogPath(kj::StringPtr path) {
+    catalogPath = kj::heapString(path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+      luacat::CatalogFile file(catalogPath);
+      auto catalog = file.getCatalog();
+      Split split(catalog, shardCount);
+      auto name = baseName(catalogPath);
+
+      auto shards = split.getShards();
+      kj::Vector<kj::String> entries(shards.size());
+      for (uint32_t s = 0; s < shards.size(); s++) {
+        auto path = kj::str(outputDir, "/", name, "-", s, ".catalog");
+        capnp::MallocMessageBuilder message(shards[s].bytes / sizeof(capnp::word) + 16);
+        split.write(s, message.initRoot<Catalog>());
+        int fd;
+        KJ_SYSCALL(fd = open(path.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666), path);
+        kj::AutoCloseFd closer(fd);
+        if (packedOutput) {
+          capnp::writePackedMessageToFd(fd, message);
+        } else {
+          capnp::writeMessageToFd(fd, message);
+        }
+        entries.add(kj::str(
+            "{\"path\": ", jsonString(path),
+            ", \"resources\": ", shards[s].resources.size(),
+            ", \"components\": ", shards[s].components,
+            ", \"bytes\": ", shards[s].bytes, "}"));
+      }
+
+      auto text = kj::str(
+          "{\n"
+          "  \"catalog\": ", jsonString(catalogPath), ",\n"
+          "  \"resources\": ", catalog.getResources().size(), ",\n"
+          "  \"components\": ", split.getComponentCount(), ",\n"
+          "  \"shards\": [\n    ", kj::strArray(entries, ",\n    "), "\n  ]\n"
+          "}\n");
+      outStream->write(text.begin(), text.size());
+    })) {
+      context.exitError(kj::str("mcm-shard: ", e->getDescription()));
+    }
+    return true;
+  }
+};
+
+}  // namespace
+}  // namespace shard
+}  // namespace mcm
+
+int main(int argc, char* argv[]) {
+  kj::TopLevelProcessContext context(argv[0]);
+  kj::FdOutputStream out(STDOUT_FILENO);
+  mcm::shard::ShardMain mainObject(context, out);
+  return kj::runMainAndExit(context, mainObject.getMain(), argc, argv);
+}
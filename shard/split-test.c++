@@ -0,0 +1,195 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shard/split.h"
+
+#include "gtest/gtest.h"
+#include "capnp/message.h"
+
+namespace {
+
+void addResource(mcm::Resource::Builder r, uint64_t id, std::initializer_list<uint64_t> deps) {
+  r.setId(id);
+  auto list = r.initDependencies(deps.size());
+  size_t i = 0;
+  for (uint64_t d : deps) {
+    list.set(i++, d);
+  }
+}
+
+kj::Array<uint64_t> shardIds(const mcm::shard::Split& split, uint32_t s) {
+  capnp::MallocMessageBuilder message;
+  auto out = message.initRoot<mcm::Catalog>();
+  split.write(s, out);
+  auto resources = out.asReader().getResources();
+  auto ids = kj::heapArray<uint64_t>(resources.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    ids[i] = resources[i].getId();
+  }
+  return ids;
+}
+
+void expectIds(kj::ArrayPtr<const uint64_t> got, std::initializer_list<uint64_t> want) {
+  ASSERT_EQ(want.size(), got.size());
+  size_t i = 0;
+  for (uint64_t id : want) {
+    EXPECT_EQ(id, got[i]) << "at " << i;
+    i++;
+  }
+}
+
+}  // namespace
+
+TEST(SplitTest, OneShardPerComponent) {
+  capnp::MallocMessageBuilder message;
+  auto resources = message.initRoot<mcm::Catalog>().initResources(6);
+  addResource(resources[0], 1, {});
+  addResource(resources[1], 10, {});
+  addResource(resources[2], 2, {1});
+  addResource(resources[3], 20, {99});  // undeclared dependency
+  addResource(resources[4], 3, {});
+  addResource(resources[5], 11, {10, 20});
+
+  mcm::shard::Split split(message.getRoot<mcm::Catalog>().asReader());
+  EXPECT_EQ(3, split.getComponentCount());
+  ASSERT_EQ(3, split.getShards().size());
+  expectIds(shardIds(split, 0), {1, 2});
+  expectIds(shardIds(split, 1), {10, 20, 11});
+  expectIds(shardIds(split, 2), {3});
+  EXPECT_EQ(1, split.getShards()[2].components);
+}
+
+TEST(SplitTest, BalancesShards) {
+  capnp::MallocMessageBuilder message;
+  auto resources = message.initRoot<mcm::Catalog>().initResources(7);
+  addResource(resources[0], 1, {});
+  addResource(resources[1], 2, {1});
+  addResource(resources[2], 3, {2});
+  addResource(resources[3], 4, {});
+  addResource(resources[4], 5, {});
+  addResource(resources[5], 6, {});
+  addResource(resources[6], 7, {4});
+
+  mcm::shard::Split split(message.getRoot<mcm::Catalog>().asReader(), 3);
+  EXPECT_EQ(4, split.getComponentCount());
+  auto shards = split.getShards();
+  ASSERT_EQ(3, shards.size());
+  EXPECT_EQ(3, shards[0].resources.size());
+  EXPECT_EQ(2, shards[1].resources.size());
+  EXPECT_EQ(2, shards[2].resources.size());
+  expectIds(shardIds(split, 0), {1, 2, 3});
+  expectIds(shardIds(split, 1), {4, 7});
+  expectIds(shardIds(split, 2), {5, 6});
+  EXPECT_EQ(2, shards[2].components);
+
+  mcm::shard::Split many(message.getRoot<mcm::Catalog>().asReader(), 6);
+  EXPECT_EQ(6, many.getShards().size());
+  EXPECT_EQ(0, many.getShards()[5].resources.size());
+}
+
+TEST(SplitTest, KeepsDuplicateIdsTogether) {
+  capnp::MallocMessageBuilder message;
+  auto resources = message.initRoot<mcm::Catalog>().initResources(3);
+  addResource(resources[0], 1, {});
+  addResource(resources[1], 2, {});
+  addResource(resources[2], 1, {});
+
+  mcm::shard::Split split(message.getRoot<mcm::Catalog>().asReader());
+  ASSERT_EQ(2, split.getShards().size());
+  expectIds(shardIds(split, 0), {1, 1});
+  expectIds(shardIds(split, 1), {2});
+}
+
+TEST(SplitTest, SplitsScheduleAndIndex) {
+  capnp::MallocMessageBuilder message;
+  auto catalog = message.initRoot<mcm::Catalog>();
+  auto resources = catalog.initResources(4);
+  addResource(resources[0], 40, {30});
+  addResource(resources[1], 20, {});
+  addResource(resources[2], 30, {});
+  addResource(resources[3], 10, {20});
+
+  auto schedule = catalog.initSchedule();
+  auto order = schedule.initOrder(4);
+  order.set(0, 1);
+  order.set(1, 2);
+  order.set(2, 0);
+  order.set(3, 3);
+  auto levels = schedule.initLevels(4);
+  levels.set(0, 1);
+  levels.set(1, 0);
+  levels.set(2, 0);
+  levels.set(3, 1);
+
+  auto index = catalog.initIndex();
+  auto ids = index.initIds(4);
+  auto positions = index.initPositions(4);
+  const uint64_t sortedIds[] = {10, 20, 30, 40};
+  const uint32_t sortedPositions[] = {3, 1, 2, 0};
+  for (int i = 0; i < 4; i++) {
+    ids.set(i, sortedIds[i]);
+    positions.set(i, sortedPositions[i]);
+  }
+  auto depOffsets = index.initDependencyOffsets(5);
+  const uint32_t depOffsetValues[] = {0, 1, 1, 1, 2};
+  for (int i = 0; i < 5; i++) {
+    depOffsets.set(i, depOffsetValues[i]);
+  }
+  auto depTargets = index.initDependencyTargets(2);
+  depTargets.set(0, 2);
+  depTargets.set(1, 1);
+  auto revOffsets = index.initDependentOffsets(5);
+  const uint32_t revOffsetValues[] = {0, 0, 1, 2, 2};
+  for (int i = 0; i < 5; i++) {
+    revOffsets.set(i, revOffsetValues[i]);
+  }
+  auto revTargets = index.initDependentTargets(2);
+  revTargets.set(0, 3);
+  revTargets.set(1, 0);
+
+  mcm::shard::Split split(catalog.asReader());
+  ASSERT_EQ(2, split.getShards().size());
+
+  // Shard 0 holds 40 and 30; shard 1 holds 20 and 10.
+  capnp::MallocMessageBuilder outMessage;
+  auto out = outMessage.initRoot<mcm::Catalog>();
+  split.write(1, out);
+  auto shard = out.asReader();
+  ASSERT_EQ(2, shard.getResources().size());
+  EXPECT_EQ(20, shard.getResources()[0].getId());
+  EXPECT_EQ(10, shard.getResources()[1].getId());
+
+  ASSERT_TRUE(shard.hasSchedule());
+  ASSERT_EQ(2, shard.getSchedule().getOrder().size());
+  EXPECT_EQ(0, shard.getSchedule().getOrder()[0]);
+  EXPECT_EQ(1, shard.getSchedule().getOrder()[1]);
+  EXPECT_EQ(0, shard.getSchedule().getLevels()[0]);
+  EXPECT_EQ(1, shard.getSchedule().getLevels()[1]);
+
+  ASSERT_TRUE(shard.hasIndex());
+  auto outIndex = shard.getIndex();
+  ASSERT_EQ(2, outIndex.getIds().size());
+  EXPECT_EQ(10, outIndex.getIds()[0]);
+  EXPECT_EQ(1, outIndex.getPositions()[0]);
+  EXPECT_EQ(20, outIndex.getIds()[1]);
+  EXPECT_EQ(0, outIndex.getPositions()[1]);
+  ASSERT_EQ(3, outIndex.getDependencyOffsets().size());
+  EXPECT_EQ(0, outIndex.getDependencyOffsets()[1]);
+  EXPECT_EQ(1, outIndex.getDependencyOffsets()[2]);
+  ASSERT_EQ(1, outIndex.getDependencyTargets().size());
+  EXPECT_EQ(0, outIndex.getDependencyTargets()[0]);
+  ASSERT_EQ(1, outIndex.getDependentTargets().size());
+  EXPECT_EQ(1, outIndex.getDependentTargets()[0]);
+  EXPECT_EQ(1, outIndex.getDependentOffsets()[1]);
+}
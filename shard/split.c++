@@ -0,0 +1,330 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shard/split.h"
+
+#include <algorithm>
+#include <queue>
+#include <utility>
+#include <vector>
+#include "capnp/common.h"
+#include "kj/debug.h"
+#include "kj/vector.h"
+
+namespace mcm {
+
+namespace shard {
+
+namespace {
+  class DisjointSets {
+    // Union-find over resource indices, with path halving and union by
+    // size.
+
+  public:
+    explicit DisjointSets(uint32_t n): parent(kj::heapArray<uint32_t>(n)), size(kj::heapArray<uint32_t>(n)) {
+      for (uint32_t i = 0; i < n; i++) {
+        parent[i] = i;
+        size[i] = 1;
+      }
+    }
+
+    uint32_t find(uint32_t x) {
+      while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+      }
+      return x;
+    }
+
+    void unite(uint32_t a, uint32_t b) {
+      a = find(a);
+      b = find(b);
+      if (a == b) {
+        return;
+      }
+      if (size[a] < size[b]) {
+        std::swap(a, b);
+      }
+      parent[b] = a;
+      size[a] += size[b];
+    }
+
+  private:
+    kj::Array<uint32_t> parent;
+    kj::Array<uint32_t> size;
+  };
+
+  struct Entry {
+    uint64_t id;
+    uint32_t pos;
+
+    inline bool operator<(const Entry& other) const { return id < other.id; }
+  };
+
+  bool usableIndex(Catalog::Reader catalog) {
+    if (!catalog.hasIndex()) {
+      return false;
+    }
+    auto n = catalog.getResources().size();
+    auto index = catalog.getIndex();
+    return index.getIds().size() == n && index.getPositions().size() == n &&
+        index.getDependencyOffsets().size() == n + 1 && index.getDependentOffsets().size() == n + 1;
+  }
+
+  bool usableSchedule(Catalog::Reader catalog) {
+    if (!catalog.hasSchedule()) {
+      return false;
+    }
+    auto n = catalog.getResources().size();
+    auto schedule = catalog.getSchedule();
+    return schedule.getOrder().size() == n && schedule.getLevels().size() == n;
+  }
+
+  void uniteDependencies(Catalog::Reader catalog, DisjointSets& sets) {
+    auto resources = catalog.getResources();
+    uint32_t n = resources.size();
+    if (usableIndex(catalog)) {
+      // The index already resolves each dependency to a position.
+      auto offsets = catalog.getIndex().getDependencyOffsets();
+      auto targets = catalog.getIndex().getDependencyTargets();
+      for (uint32_t i = 0; i < n; i++) {
+        KJ_REQUIRE(offsets[i] <= offsets[i+1] && offsets[i+1] <= targets.size(),
+                   "catalog index out of range");
+        for (uint32_t j = offsets[i]; j < offsets[i+1]; j++) {
+          KJ_REQUIRE(targets[j] < n, "catalog index out of range", targets[j]);
+          sets.unite(i, targets[j]);
+        }
+      }
+      return;
+    }
+
+    auto entries = kj::heapArray<Entry>(n);
+    for (uint32_t i = 0; i < n; i++) {
+      entries[i] = Entry{resources[i].getId(), i};
+    }
+    std::sort(entries.begin(), entries.end());
+    for (uint32_t i = 1; i < n; i++) {
+      if (entries[i-1].id == entries[i].id) {
+        sets.unite(entries[i-1].pos, entries[i].pos);
+      }
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      for (auto dep : resources[i].getDependencies()) {
+        auto iter = std::lower_bound(entries.begin(), entries.end(), Entry{dep, 0});
+        if (iter != entries.end() && iter->id == dep) {
+          sets.unite(i, iter->pos);
+        }
+      }
+    }
+  }
+
+  void bucket(capnp::List<uint32_t>::Reader positions, kj::ArrayPtr<const uint32_t> shardOf,
+              kj::ArrayPtr<kj::Array<uint32_t>> buckets) {
+    // Append each position to the bucket of its shard, keeping order.
+    // Each bucket must already have the size of its shard.
+
+    auto fill = kj::heapArray<uint32_t>(buckets.size());
+    std::fill(fill.begin(), fill.end(), 0);
+    for (auto p : positions) {
+      KJ_REQUIRE(p < shardOf.size(), "catalog position out of range", p);
+      auto s = shardOf[p];
+      KJ_REQUIRE(fill[s] < buckets[s].size(), "catalog positions repeat", p);
+      buckets[s][fill[s]++] = p;
+    }
+  }
+}  // namespace
+
+Split::Split(Catalog::Reader catalog, uint32_t shardCount): catalog(catalog) {
+  auto resources = catalog.getResources();
+  uint32_t n = resources.size();
+
+  DisjointSets sets(n);
+  uniteDependencies(catalog, sets);
+
+  // Number components by their first resource.
+  auto component = kj::heapArray<uint32_t>(n);
+  auto rootComponent = kj::heapArray<uint32_t>(n);
+  std::fill(rootComponent.begin(), rootComponent.end(), UINT32_MAX);
+  kj::Vector<uint32_t> componentSizes;
+  kj::Vector<uint64_t> componentBytes;
+  for (uint32_t i = 0; i < n; i++) {
+    auto root = sets.find(i);
+    if (rootComponent[root] == UINT32_MAX) {
+      rootComponent[root] = componentSizes.size();
+      componentSizes.add(0);
+      componentBytes.add(0);
+    }
+    auto c = rootComponent[root];
+    component[i] = c;
+    componentSizes[c]++;
+    componentBytes[c] += resources[i].totalSize().wordCount * sizeof(capnp::word);
+  }
+  componentCount = componentSizes.size();
+
+  // Assign components to shards.
+  auto componentShard = kj::heapArray<uint32_t>(componentCount);
+  if (shardCount == 0) {
+    shardCount = componentCount;
+    for (uint32_t c = 0; c < componentCount; c++) {
+      componentShard[c] = c;
+    }
+  } else {
+    // Largest first, each to the lightest shard so far.  A component's
+    // weight is its share of the resources plus its share of the bytes.
+    uint64_t totalBytes = 0;
+    for (auto b : componentBytes) {
+      totalBytes += b;
+    }
+    auto weight = kj::heapArray<double>(componentCount);
+    auto byWeight = kj::heapArray<uint32_t>(componentCount);
+    for (uint32_t c = 0; c < componentCount; c++) {
+      weight[c] = double(componentSizes[c]) / n;
+      if (totalBytes > 0) {
+        weight[c] += double(componentBytes[c]) / totalBytes;
+      }
+      byWeight[c] = c;
+    }
+    std::stable_sort(byWeight.begin(), byWeight.end(),
+                     [&](uint32_t a, uint32_t b) { return weight[a] > weight[b]; });
+    typedef std::pair<double, uint32_t> Load;
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+    for (uint32_t s = 0; s < shardCount; s++) {
+      loads.push(Load(0, s));
+    }
+    for (auto c : byWeight) {
+      auto lightest = loads.top();
+      loads.pop();
+      componentShard[c] = lightest.second;
+      loads.push(Load(lightest.first + weight[c], lightest.second));
+    }
+  }
+
+  shards = kj::heapArray<Shard>(shardCount);
+  auto shardSizes = kj::heapArray<uint32_t>(shardCount);
+  std::fill(shardSizes.begin(), shardSizes.end(), 0);
+  for (uint32_t c = 0; c < componentCount; c++) {
+    auto& shard = shards[componentShard[c]];
+    shard.components++;
+    shard.bytes += componentBytes[c];
+    shardSizes[componentShard[c]] += componentSizes[c];
+  }
+  auto shardOf = kj::heapArray<uint32_t>(n);
+  for (uint32_t i = 0; i < n; i++) {
+    shardOf[i] = componentShard[component[i]];
+  }
+
+  localPositions = kj::heapArray<uint32_t>(n);
+  auto fill = kj::heapArray<uint32_t>(shardCount);
+  std::fill(fill.begin(), fill.end(), 0);
+  for (uint32_t s = 0; s < shardCount; s++) {
+    shards[s].resources = kj::heapArray<uint32_t>(shardSizes[s]);
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    auto s = shardOf[i];
+    localPositions[i] = fill[s];
+    shards[s].resources[fill[s]++] = i;
+  }
+
+  hasSchedule = usableSchedule(catalog);
+  if (hasSchedule) {
+    orders = kj::heapArray<kj::Array<uint32_t>>(shardCount);
+    for (uint32_t s = 0; s < shardCount; s++) {
+      orders[s] = kj::heapArray<uint32_t>(shardSizes[s]);
+    }
+    bucket(catalog.getSchedule().getOrder(), shardOf, orders);
+  }
+  hasIndex = usableIndex(catalog);
+  if (hasIndex) {
+    idOrders = kj::heapArray<kj::Array<uint32_t>>(shardCount);
+    for (uint32_t s = 0; s < shardCount; s++) {
+      idOrders[s] = kj::heapArray<uint32_t>(shardSizes[s]);
+    }
+    bucket(catalog.getIndex().getPositions(), shardOf, idOrders);
+  }
+}
+
+namespace {
+  template <typename InitOffsets, typename InitTargets>
+  void copyEdges(kj::ArrayPtr<const uint32_t> members, kj::ArrayPtr<const uint32_t> localPositions,
+                 capnp::List<uint32_t>::Reader offsets, capnp::List<uint32_t>::Reader targets,
+                 InitOffsets initOffsets, InitTargets initTargets) {
+    // Copy the CSR edges of members, renumbering the targets within the
+    // shard.  Edges never leave a shard, since shards are unions of
+    // components.
+
+    uint32_t total = 0;
+    for (auto i : members) {
+      KJ_REQUIRE(offsets[i] <= offsets[i+1] && offsets[i+1] <= targets.size(),
+                 "catalog index out of range");
+      total += offsets[i+1] - offsets[i];
+    }
+    auto outOffsets = initOffsets(members.size() + 1);
+    auto outTargets = initTargets(total);
+    uint32_t k = 0;
+    for (uint32_t m = 0; m < members.size(); m++) {
+      outOffsets.set(m, k);
+      auto i = members[m];
+      for (uint32_t j = offsets[i]; j < offsets[i+1]; j++) {
+        KJ_REQUIRE(targets[j] < localPositions.size(), "catalog index out of range", targets[j]);
+        outTargets.set(k++, localPositions[targets[j]]);
+      }
+    }
+    outOffsets.set(members.size(), k);
+  }
+}  // namespace
+
+void Split::write(uint32_t s, Catalog::Builder out) const {
+  KJ_REQUIRE(s < shards.size(), "shard out of range", s);
+  auto& members = shards[s].resources;
+  uint32_t n = members.size();
+  auto src = catalog.getResources();
+  auto dst = out.initResources(n);
+  for (uint32_t i = 0; i < n; i++) {
+    dst.setWithCaveats(i, src[members[i]]);
+  }
+
+  if (hasSchedule) {
+    auto levels = catalog.getSchedule().getLevels();
+    auto schedule = out.initSchedule();
+    auto outOrder = schedule.initOrder(n);
+    for (uint32_t k = 0; k < n; k++) {
+      outOrder.set(k, localPositions[orders[s][k]]);
+    }
+    auto outLevels = schedule.initLevels(n);
+    for (uint32_t i = 0; i < n; i++) {
+      outLevels.set(i, levels[members[i]]);
+    }
+  }
+
+  if (hasIndex) {
+    auto index = catalog.getIndex();
+    auto outIndex = out.initIndex();
+    auto outIds = outIndex.initIds(n);
+    auto outPositions = outIndex.initPositions(n);
+    for (uint32_t k = 0; k < n; k++) {
+      auto p = idOrders[s][k];
+      outIds.set(k, src[p].getId());
+      outPositions.set(k, localPositions[p]);
+    }
+    copyEdges(members, localPositions, index.getDependencyOffsets(), index.getDependencyTargets(),
+              [&](capnp::uint size) { return outIndex.initDependencyOffsets(size); },
+              [&](capnp::uint size) { return outIndex.initDependencyTargets(size); });
+    copyEdges(members, localPositions, index.getDependentOffsets(), index.getDependentTargets(),
+              [&](capnp::uint size) { return outIndex.initDependentOffsets(size); },
+              [&](capnp::uint size) { return outIndex.initDependentTargets(size); });
+  }
+}
+
+}  // namespace shard
+}  // namespace mcm
@@ -0,0 +1,74 @@
+// Copyright 2017 The Minimal Configuration Manager Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MCM_SHARD_SPLIT_H_
+#define MCM_SHARD_SPLIT_H_
+// Splitting a catalog into catalogs that can be applied independently.
+
+#include <stdint.h>
+#include "kj/array.h"
+#include "kj/common.h"
+
+#include "catalog.capnp.h"
+
+namespace mcm {
+
+namespace shard {
+
+struct Shard {
+  kj::Array<uint32_t> resources;  // indices into the catalog's resources, ascending
+  uint32_t components = 0;        // weakly connected components in the shard
+  uint64_t bytes = 0;             // encoded size of the resources
+};
+
+class Split {
+  // A partition of a catalog's resources such that no resource depends
+  // on a resource in another shard.  Resources with the same ID are
+  // always in the same shard.
+
+public:
+  Split(Catalog::Reader catalog, uint32_t shardCount = 0);
+  // Find the weakly connected components of catalog's dependency graph.
+  // If shardCount is zero, each component becomes its own shard, in the
+  // order of their first resources.  Otherwise the components are
+  // divided among exactly shardCount shards (some of which may be
+  // empty), balancing the number of resources and bytes in each.
+  // Dependencies on IDs that aren't in the catalog are ignored.
+
+  KJ_DISALLOW_COPY(Split);
+
+  inline uint32_t getComponentCount() const { return componentCount; }
+  inline kj::ArrayPtr<const Shard> getShards() const { return shards; }
+
+  void write(uint32_t shard, Catalog::Builder out) const;
+  // Copy a shard's resources to out, keeping their order.  If the
+  // catalog has a schedule or index, the shard gets the matching part
+  // of it.
+
+private:
+  Catalog::Reader catalog;
+  uint32_t componentCount = 0;
+  kj::Array<Shard> shards;
+  kj::Array<uint32_t> localPositions;  // each resource's index within its shard
+
+  bool hasSchedule = false;
+  bool hasIndex = false;
+  kj::Array<kj::Array<uint32_t>> orders;    // per shard, schedule order as catalog indices
+  kj::Array<kj::Array<uint32_t>> idOrders;  // per shard, index positions as catalog indices
+};
+
+}  // namespace shard
+}  // namespace mcm
+
+#endif  // MCM_SHARD_SPLIT_H_
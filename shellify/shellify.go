@@ -17,13 +17,12 @@ package main
 import (
 	"flag"
 	"fmt"
-	"io"
 	"os"
 
 	"github.com/zombiezen/mcm/catalog"
+	"github.com/zombiezen/mcm/internal/catio"
 	"github.com/zombiezen/mcm/internal/version"
 	"github.com/zombiezen/mcm/shellify/shlib"
-	"github.com/zombiezen/mcm/third_party/golang/capnproto"
 )
 
 func init() {
@@ -45,7 +44,7 @@ func main() {
 
 	c, err := readCatalogArg()
 	if err != nil {
-		fmt.Fprintln(os.Stderr, "mcm-shellify: read catalog:", err)
+		fmt.Fprintln(os.Stderr, "mcm-shellify:", err)
 		os.Exit(1)
 	}
 	if err = shlib.WriteScript(os.Stdout, c); err != nil {
@@ -57,7 +56,7 @@ func main() {
 func readCatalogArg() (catalog.Catalog, error) {
 	switch flag.NArg() {
 	case 0:
-		return readCatalog(os.Stdin)
+		return catio.ReadCatalog(os.Stdin)
 	case 1:
 		// TODO(someday): read segments lazily
 		f, err := os.Open(flag.Arg(0))
@@ -65,18 +64,10 @@ func readCatalogArg() (catalog.Catalog, error) {
 			return catalog.Catalog{}, err
 		}
 		defer f.Close()
-		return readCatalog(f)
+		return catio.ReadCatalog(f)
 	default:
 		usage()
 		os.Exit(2)
 		panic("unreachable")
 	}
 }
-
-func readCatalog(r io.Reader) (catalog.Catalog, error) {
-	msg, err := capnp.NewDecoder(r).Decode()
-	if err != nil {
-		return catalog.Catalog{}, err
-	}
-	return catalog.ReadRootCatalog(msg)
-}
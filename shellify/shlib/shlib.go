@@ -41,7 +41,7 @@ func WriteScript(w io.Writer, c catalog.Catalog) error {
 		g.p(script("# Empty catalog"))
 		return g.ew.err
 	}
-	graph, err := depgraph.New(res)
+	graph, err := depgraph.NewFromCatalog(c)
 	if err != nil {
 		return err
 	}
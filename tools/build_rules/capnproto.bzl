@@ -233,6 +233,67 @@ def capnp_cc_library(
   )
 
 
+def _capnp_genluaconv_impl(ctx):
+  schema = ctx.file.src
+  basename = ctx.attr.src.capnp_basename
+  srcout = ctx.outputs.out
+  hdrout = ctx.outputs.hdr
+  plugin = ctx.executable._capnpc_tool
+
+  args = ["../" * (ctx.genfiles_dir.path.count("/") + 1) + plugin.path]
+  stem = ctx.genfiles_dir.path + "/" + basename[:-len(".capnp")]
+  tmpsrc = stem + ".luaconv.c++"
+  tmphdr = stem + ".luaconv.h"
+  cmd = "(cd %s && %s) < %s" % (ctx.genfiles_dir.path, " ".join(args), schema.path)
+  if tmpsrc != srcout.path:
+    cmd += " && mv %s %s" % (tmpsrc, srcout.path)
+  if tmphdr != hdrout.path:
+    cmd += " && mv %s %s" % (tmphdr, hdrout.path)
+  ctx.action(
+      inputs = [schema, plugin],
+      outputs = [srcout, hdrout],
+      mnemonic = "CapnpGenLuaconv",
+      command = cmd)
+  return struct()
+
+
+_capnp_genluaconv = rule(_capnp_genluaconv_impl,
+    attrs = {
+        "src": attr.label(providers=["capnp_basename"], allow_single_file=True, mandatory=True),
+        "hdr": attr.output(mandatory=True),
+        "out": attr.output(mandatory=True),
+        "_capnpc_tool": attr.label(
+            default = Label("//luacat:capnpc-luaconv"),
+            cfg = "host",
+            executable = True),
+    },
+    output_to_genfiles = True)
+
+
+def capnp_luaconv_srcs(
+    name,
+    lib,
+    basename,
+    testonly = False,
+    visibility = None):
+  """Generates mcm-luacat converters for the structs in a schema.
+
+  The outputs are basename + ".luaconv.h" and basename + ".luaconv.c++".
+  They depend on //luacat:luacat, so they are meant to be listed in the
+  srcs of a library or test that already depends on it.
+  """
+  if basename.endswith(".capnp"):
+    fail("\"%s\" should not include the .capnp extension" % (basename), "basename")
+  _capnp_genluaconv(
+      name = name,
+      src = lib,
+      hdr = basename + ".luaconv.h",
+      out = basename + ".luaconv.c++",
+      testonly = testonly,
+      visibility = visibility,
+  )
+
+
 def _capnp_eval_impl(ctx):
   src = ctx.file.src
   symbol = ctx.attr.symbol